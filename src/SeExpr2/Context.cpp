@@ -14,11 +14,17 @@
 * You may obtain a copy of the License at
 * http://www.apache.org/licenses/LICENSE-2.0
 */
+#include <atomic>
+
 #include "Context.h"
 
 using namespace SeExpr2;
 
-Context::Context(const Context* parent) : _parent(parent) {}
+namespace {
+std::atomic<uint64_t> lastContextId(0);
+}
+
+Context::Context(const Context* parent) : _parent(parent), _id(++lastContextId) {}
 
 void Context::setParameter(const std::string& parameterName, const std::string& value) {
     _parameters[parameterName] = value;
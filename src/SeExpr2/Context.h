@@ -18,6 +18,7 @@
 
 #include <map>
 #include <string>
+#include <stdint.h>
 
 namespace SeExpr2 {
 
@@ -52,6 +53,9 @@ class Context {
     /// The global default context of the seexpr
     static Context& global();
 
+    /// Number identifying this context, never reused (unlike its address) once it is destroyed
+    uint64_t id() const { return _id; }
+
   private:
     /// Private constructor and un-implemented default/copy/assignment
     /// (it is required that we derive from the global context via createChildContext)
@@ -61,6 +65,7 @@ class Context {
     Context(const Context* parent);
     /// The parent scope
     const Context* _parent;
+    const uint64_t _id;
 
     // TODO: Use std::map until C++11 is ubiq.
     typedef std::map<std::string, std::string> ParameterMap;
@@ -65,6 +65,9 @@ class Curve {
     //! Adds a point to the curve
     void addPoint(double position, const T& val, InterpType type);
 
+    //! Memory held by the curve and its control points
+    size_t sizeInBytes() const { return sizeof(*this) + _cvData.capacity() * sizeof(CV); }
+
     //! Prepares points for evaluation (sorts and computes boundaries, clamps extrema)
     void preparePoints();
 
@@ -21,20 +21,29 @@
 
 #ifdef SEEXPR_ENABLE_LLVM
 #include <llvm/Support/Compiler.h>
+#include <functional>
+#include <mutex>
+#include "ExprLLVMObjectCache.h"
 #endif
 
 extern "C" void SeExpr2LLVMEvalFPVarRef(SeExpr2::ExprVarRef *seVR, double *result);
 extern "C" void SeExpr2LLVMEvalStrVarRef(SeExpr2::ExprVarRef *seVR, double *result);
+extern "C" char *SeExpr2LLVMConcatStrings(SeExpr2::ExprStringArena *strings, const char *a, const char *b);
+extern "C" int SeExpr2LLVMStringsEqual(const char *a, const char *b);
+extern "C" double SeExpr2LLVMHalfToDouble(uint16_t half);
+extern "C" uint16_t SeExpr2LLVMDoubleToHalf(double value);
 extern "C" void SeExpr2LLVMEvalCustomFunction(int *opDataArg,
                                               double *fpArg,
                                               char **strArg,
-                                              void **funcdata,
+                                              void *funcdata,
                                               const SeExpr2::ExprFuncNode *node);
 
 namespace SeExpr2 {
 #ifdef SEEXPR_ENABLE_LLVM
 
 LLVM_VALUE promoteToDim(LLVM_VALUE val, unsigned dim, llvm::IRBuilder<> &Builder);
+//! Bind the declarations that generated code uses to call ExprFuncStandard functions to their addresses
+void mapStandardFunctions(llvm::ExecutionEngine &engine, llvm::Module &module, const ExprNode *node);
 
 class LLVMEvaluator {
     // TODO: this seems needlessly complex, let's fix it
@@ -44,7 +53,8 @@ class LLVMEvaluator {
     class LLVMEvaluationContext {
       private:
         typedef void (*FunctionPtr)(T *, char **, uint32_t);
-        typedef void (*FunctionPtrMultiple)(char **, uint32_t, uint32_t, uint32_t);
+        typedef void (*FunctionPtrMultiple)(
+            char **, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
         FunctionPtr functionPtr;
         FunctionPtrMultiple functionPtrMultiple;
         T *resultData;
@@ -65,19 +75,66 @@ class LLVMEvaluator {
             functionPtr = nullptr;
             resultData = nullptr;
         }
+        /// Evaluate into the evaluator's own result buffer (not safe to call from several threads at once)
         const T *operator()(VarBlock *varBlock) {
             assert(functionPtr && resultData);
             functionPtr(resultData, varBlock ? varBlock->data() : nullptr, varBlock ? varBlock->indirectIndex : 0);
             return resultData;
         }
-        void operator()(VarBlock *varBlock, size_t outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) {
+        /// Evaluate into caller owned storage. Reentrant unless the expression concatenates strings: the compiled
+        /// code only uses its stack and the varBlock, but concatenations write into an arena of their parse node.
+        void operator()(T *result, VarBlock *varBlock) const {
+            assert(functionPtr);
+            functionPtr(result, varBlock ? varBlock->data() : nullptr, varBlock ? varBlock->indirectIndex : 0);
+        }
+        void operator()(VarBlock *varBlock,
+                        size_t outputVarBlockOffset,
+                        size_t rangeStart,
+                        size_t rangeEnd,
+                        const VarBinding &output) {
             assert(functionPtr && resultData);
-            functionPtrMultiple(varBlock ? varBlock->data() : nullptr, outputVarBlockOffset, rangeStart, rangeEnd);
+            // soa outputs step through the data pointers, the others through the components of one point
+            size_t elementSize = VarBinding::elementSize(output.elementType);
+            functionPtrMultiple(varBlock ? varBlock->data() : nullptr,
+                                outputVarBlockOffset,
+                                rangeStart,
+                                rangeEnd,
+                                output.elementType,
+                                output.byteStride,
+                                output.soa ? 0 : elementSize,
+                                output.soa ? 1 : 0);
         }
     };
     std::unique_ptr<LLVMEvaluationContext<double>> _llvmEvalFP;
     std::unique_ptr<LLVMEvaluationContext<char *>> _llvmEvalStr;
 
+    /// Section memory manager that adds the size of every code and data section the JIT allocates to a counter
+    class CountingMemoryManager : public llvm::SectionMemoryManager {
+      public:
+        explicit CountingMemoryManager(size_t &bytes) : _bytes(bytes) {}
+        uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment, unsigned sectionID,
+                                     llvm::StringRef sectionName) override {
+            _bytes += size;
+            return SectionMemoryManager::allocateCodeSection(size, alignment, sectionID, sectionName);
+        }
+        uint8_t *allocateDataSection(uintptr_t size, unsigned alignment, unsigned sectionID,
+                                     llvm::StringRef sectionName, bool isReadOnly) override {
+            _bytes += size;
+            return SectionMemoryManager::allocateDataSection(size, alignment, sectionID, sectionName, isReadOnly);
+        }
+
+      private:
+        size_t &_bytes;
+    };
+
+    /// Bytes of machine code and data sections, and estimated bytes of the module's IR, which the engine keeps
+    size_t _codeBytes = 0, _moduleBytes = 0;
+    /// True if the loop vectorizer widened the evalMultiple loop
+    bool _loopVectorized = false;
+    /// Process addresses the compiled code reads through globals, so that it can be cached across processes
+    std::vector<const void *> _addresses;
+
+    /// The context the module is compiled into, which must outlive the engine owning the module
     std::unique_ptr<llvm::LLVMContext> _llvmContext;
     std::unique_ptr<llvm::ExecutionEngine> TheExecutionEngine;
 
@@ -86,51 +143,73 @@ class LLVMEvaluator {
 
     const char *evalStr(VarBlock *varBlock) { return *(*_llvmEvalStr)(varBlock); }
     const double *evalFP(VarBlock *varBlock) { return (*_llvmEvalFP)(varBlock); }
-
-    void evalMultiple(VarBlock *varBlock, uint32_t outputVarBlockOffset, uint32_t rangeStart, uint32_t rangeEnd) {
-        return (*_llvmEvalFP)(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+    void evalStr(char **result, VarBlock *varBlock) const { (*_llvmEvalStr)(result, varBlock); }
+    void evalFP(double *result, VarBlock *varBlock) const { (*_llvmEvalFP)(result, varBlock); }
+
+    void evalMultiple(VarBlock *varBlock,
+                      uint32_t outputVarBlockOffset,
+                      uint32_t rangeStart,
+                      uint32_t rangeEnd,
+                      const VarBinding &output) {
+        return (*_llvmEvalFP)(varBlock, outputVarBlockOffset, rangeStart, rangeEnd, output);
     }
 
     void debugPrint() {
         // TheModule->dump();
     }
 
+    /// Memory held by the JIT compiled code and data
+    size_t codeSizeInBytes() const { return _codeBytes; }
+    /// Estimated memory held by the compiled module's IR
+    size_t moduleSizeInBytes() const { return _moduleBytes; }
+    /// True if the evalMultiple loop evaluates several points per iteration
+    bool loopVectorized() const { return _loopVectorized; }
+
+    /// Compile parseTree, whose custom function nodes must already have their data (see
+    /// ExprFuncSimple::buildInterpreter), which the generated code only reads. The loop function stores its results
+    /// in the layout of the output binding it is given
     bool prepLLVM(ExprNode *parseTree, ExprType desiredReturnType) {
         using namespace llvm;
-        InitializeNativeTarget();
-        InitializeNativeTargetAsmPrinter();
-        InitializeNativeTargetAsmParser();
-
-        std::string uniqueName = getUniqueName();
+        // target registration is not thread safe, and expressions may be prepared in parallel (see prepareAsync)
+        static std::once_flag targetInitialized;
+        std::call_once(targetInitialized, []() {
+            InitializeNativeTarget();
+            InitializeNativeTargetAsmPrinter();
+            InitializeNativeTargetAsmParser();
+        });
+
+        // cached object code is looked up by symbol name, so use names that do not depend on this evaluator
+        ExprLLVMObjectCache *objectCache = ExprLLVMObjectCache::instance();
+        std::string uniqueName = objectCache ? std::string("_seexpr") : getUniqueName();
 
-        // create Module
         _llvmContext.reset(new LLVMContext());
+        LLVMContext &llvmContext = *_llvmContext;
 
-        std::unique_ptr<Module> TheModule(new Module(uniqueName + "_module", *_llvmContext));
+        // create Module
+        std::unique_ptr<Module> TheModule(new Module(uniqueName + "_module", llvmContext));
 
         // create all needed types
-        Type        *i8PtrTy        = Type::getInt8PtrTy(*_llvmContext);        // char *
+        Type        *i8PtrTy        = Type::getInt8PtrTy(llvmContext);        // char *
         PointerType *i8PtrPtrTy     = PointerType::getUnqual(i8PtrTy);          // char **
         PointerType *i8PtrPtrPtrTy  = PointerType::getUnqual(i8PtrPtrTy);       // char ***
-        Type        *i32Ty          = Type::getInt32Ty(*_llvmContext);          // int
-        Type        *i32PtrTy       = Type::getInt32PtrTy(*_llvmContext);       // int *
-        Type        *i64Ty          = Type::getInt64Ty(*_llvmContext);          // int64 *
-        Type        *doublePtrTy    = Type::getDoublePtrTy(*_llvmContext);      // double *
+        Type        *i32Ty          = Type::getInt32Ty(llvmContext);          // int
+        Type        *i32PtrTy       = Type::getInt32PtrTy(llvmContext);       // int *
+        Type        *i64Ty          = Type::getInt64Ty(llvmContext);          // int64 *
+        Type        *doublePtrTy    = Type::getDoublePtrTy(llvmContext);      // double *
         PointerType *doublePtrPtrTy = PointerType::getUnqual(doublePtrTy);      // double **
-        Type        *voidTy         = Type::getVoidTy(*_llvmContext);           // void
+        Type        *voidTy         = Type::getVoidTy(llvmContext);           // void
 
         // create bindings to helper functions for variables and fucntions
         Function *SeExpr2LLVMEvalCustomFunctionFunc = nullptr;
         Function *SeExpr2LLVMEvalFPVarRefFunc = nullptr;
         Function *SeExpr2LLVMEvalStrVarRefFunc = nullptr;
-        Function *SeExpr2LLVMEvalstrlenFunc = nullptr;
-        Function *SeExpr2LLVMEvalmallocFunc = nullptr;
-        Function *SeExpr2LLVMEvalfreeFunc = nullptr;
-        Function *SeExpr2LLVMEvalmemsetFunc = nullptr;
-        Function *SeExpr2LLVMEvalstrcatFunc = nullptr;
+        Function *SeExpr2LLVMConcatStringsFunc = nullptr;
+        Function *SeExpr2LLVMStringsEqualFunc = nullptr;
+        Function *SeExpr2LLVMHalfToDoubleFunc = nullptr;
+        Function *SeExpr2LLVMDoubleToHalfFunc = nullptr;
         {
             {
-                FunctionType *FT = FunctionType::get(voidTy, {i32PtrTy, doublePtrTy, i8PtrPtrTy, i8PtrPtrTy, i64Ty}, false);
+                FunctionType *FT = FunctionType::get(voidTy, {i32PtrTy, doublePtrTy, i8PtrPtrTy, i8PtrTy, i64Ty}, false);
                 SeExpr2LLVMEvalCustomFunctionFunc = Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalCustomFunction", TheModule.get());
             }
             {
@@ -142,24 +221,18 @@ class LLVMEvaluator {
                 SeExpr2LLVMEvalStrVarRefFunc = Function::Create(FT, GlobalValue::ExternalLinkage, "SeExpr2LLVMEvalStrVarRef", TheModule.get());
             }
             {
-                FunctionType *FT = FunctionType::get(i32Ty, { i8PtrTy }, false);
-                SeExpr2LLVMEvalstrlenFunc = Function::Create(FT, Function::ExternalLinkage, "strlen", TheModule.get());
-            }
-            {
-                FunctionType *FT = FunctionType::get(i8PtrTy, { i32Ty }, false);
-                SeExpr2LLVMEvalmallocFunc = Function::Create(FT, Function::ExternalLinkage, "malloc", TheModule.get());
-            }
-            {
-                FunctionType *FT = FunctionType::get(voidTy, { i8PtrTy }, false);
-                SeExpr2LLVMEvalfreeFunc = Function::Create(FT, Function::ExternalLinkage, "free", TheModule.get());
+                FunctionType *FT = FunctionType::get(i8PtrTy, {i8PtrTy, i8PtrTy, i8PtrTy}, false);
+                SeExpr2LLVMConcatStringsFunc = Function::Create(FT, Function::ExternalLinkage, "SeExpr2LLVMConcatStrings", TheModule.get());
             }
             {
-                FunctionType *FT = FunctionType::get(voidTy, { i8PtrTy, i32Ty, i32Ty }, false);
-                SeExpr2LLVMEvalmemsetFunc = Function::Create(FT, Function::ExternalLinkage, "memset", TheModule.get());
+                FunctionType *FT = FunctionType::get(i32Ty, {i8PtrTy, i8PtrTy}, false);
+                SeExpr2LLVMStringsEqualFunc = Function::Create(FT, Function::ExternalLinkage, "SeExpr2LLVMStringsEqual", TheModule.get());
             }
             {
-                FunctionType *FT = FunctionType::get(i8PtrTy, { i8PtrTy, i8PtrTy }, false);
-                SeExpr2LLVMEvalstrcatFunc = Function::Create(FT, Function::ExternalLinkage, "strcat", TheModule.get());
+                Type *i16Ty = Type::getInt16Ty(llvmContext);
+                Type *doubleTy = Type::getDoubleTy(llvmContext);
+                SeExpr2LLVMHalfToDoubleFunc = Function::Create(FunctionType::get(doubleTy, {i16Ty}, false), Function::ExternalLinkage, "SeExpr2LLVMHalfToDouble", TheModule.get());
+                SeExpr2LLVMDoubleToHalfFunc = Function::Create(FunctionType::get(i16Ty, {doubleTy}, false), Function::ExternalLinkage, "SeExpr2LLVMDoubleToHalf", TheModule.get());
             }
         }
 
@@ -174,6 +247,8 @@ class LLVMEvaluator {
         Function *F = Function::Create(FT, Function::ExternalLinkage, uniqueName + "_func", TheModule.get());
 #if (LLVM_VERSION_MAJOR < 5)
         F->addAttribute(llvm::AttributeSet::FunctionIndex, llvm::Attribute::AlwaysInline);
+#else
+        F->addFnAttr(llvm::Attribute::AlwaysInline);
 #endif
         {
             // label the function with names
@@ -185,8 +260,8 @@ class LLVMEvaluator {
         unsigned int dimDesired = (unsigned)desiredReturnType.dim();
         unsigned int dimGenerated = parseTree->type().dim();
         {
-            BasicBlock *BB = BasicBlock::Create(*_llvmContext, "entry", F);
-            IRBuilder<> Builder(BB);
+            BasicBlock *BB = BasicBlock::Create(llvmContext, "entry", F);
+            LLVMCodegenBuilder Builder(BB);
 
             // codegen
             Value *lastVal = parseTree->codegen(Builder);
@@ -198,7 +273,7 @@ class LLVMEvaluator {
                     Value *newLastVal = promoteToDim(lastVal, dimDesired, Builder);
                     assert(newLastVal->getType()->getVectorNumElements() >= dimDesired);
                     for (unsigned i = 0; i < dimDesired; ++i) {
-                        Value *idx = ConstantInt::get(Type::getInt64Ty(*_llvmContext), i);
+                        Value *idx = ConstantInt::get(Type::getInt64Ty(llvmContext), i);
                         Value *val = Builder.CreateExtractElement(newLastVal, idx);
                         Value *ptr = Builder.CreateInBoundsGEP(firstArg, idx);
                         Builder.CreateStore(val, ptr);
@@ -216,14 +291,16 @@ class LLVMEvaluator {
             }
 
             Builder.CreateRetVoid();
+            _addresses = Builder.addresses;
         }
 
         // write a new function
-        FunctionType *FTLOOP = FunctionType::get(voidTy, {i8PtrTy, i32Ty, i32Ty, i32Ty}, false);
+        FunctionType *FTLOOP = FunctionType::get(voidTy, {i8PtrTy, i32Ty, i32Ty, i32Ty, i32Ty, i32Ty, i32Ty, i32Ty}, false);
         Function *FLOOP = Function::Create(FTLOOP, Function::ExternalLinkage, uniqueName + "_loopfunc", TheModule.get());
         {
             // label the function with names
-            const char *names[] = {"dataBlock", "outputVarBlockOffset", "rangeStart", "rangeEnd"};
+            const char *names[] = {"dataBlock", "outputVarBlockOffset", "rangeStart", "rangeEnd",
+                                   "outputElementType", "outputByteStride", "outputComponentStride", "outputPointerStride"};
             int idx = 0;
             for (auto &arg : FLOOP->args()) {
                 arg.setName(names[idx++]);
@@ -235,11 +312,7 @@ class LLVMEvaluator {
             Value *oneValue = ConstantInt::get(i32Ty, 1);
 
             // Basic blocks
-            BasicBlock *entryBlock = BasicBlock::Create(*_llvmContext, "entry", FLOOP);
-            BasicBlock *loopCmpBlock = BasicBlock::Create(*_llvmContext, "loopCmp", FLOOP);
-            BasicBlock *loopRepeatBlock = BasicBlock::Create(*_llvmContext, "loopRepeat", FLOOP);
-            BasicBlock *loopIncBlock = BasicBlock::Create(*_llvmContext, "loopInc", FLOOP);
-            BasicBlock *loopEndBlock = BasicBlock::Create(*_llvmContext, "loopEnd", FLOOP);
+            BasicBlock *entryBlock = BasicBlock::Create(llvmContext, "entry", FLOOP);
             IRBuilder<> Builder(entryBlock);
             Builder.SetInsertPoint(entryBlock);
 
@@ -248,44 +321,142 @@ class LLVMEvaluator {
             Value *varBlockCharPtrPtrArg = &*argIterator;       ++argIterator;
             Value *outputVarBlockOffsetArg = &*argIterator;     ++argIterator;
             Value *rangeStartArg = &*argIterator;                ++argIterator;
-            Value *rangeEndArg = &*argIterator;                    ++argIterator;
+            Value *rangeEndArg = &*argIterator;                  ++argIterator;
+            Value *outputElementTypeArg = &*argIterator;         ++argIterator;
+            Value *outputByteStrideArg = &*argIterator;          ++argIterator;
+            Value *outputComponentStrideArg = &*argIterator;     ++argIterator;
+            Value *outputPointerStrideArg = &*argIterator;       ++argIterator;
 
             // Allocate Variables
-            Value *rangeStartVar = Builder.CreateAlloca(Type::getInt32Ty(*_llvmContext), oneValue, "rangeStartVar");
-            Value *rangeEndVar = Builder.CreateAlloca(Type::getInt32Ty(*_llvmContext), oneValue, "rangeEndVar");
-            Value *indexVar = Builder.CreateAlloca(Type::getInt32Ty(*_llvmContext), oneValue, "indexVar");
-            Value *outputVarBlockOffsetVar = Builder.CreateAlloca(Type::getInt32Ty(*_llvmContext), oneValue, "outputVarBlockOffsetVar");
-            Value *varBlockDoublePtrPtrVar = Builder.CreateAlloca(doublePtrPtrTy, oneValue, "varBlockDoublePtrPtrVar");
-            Value *varBlockTPtrPtrVar = Builder.CreateAlloca(desireFP == true ? doublePtrPtrTy : i8PtrPtrPtrTy, oneValue, "varBlockTPtrPtrVar");
-
-            // Copy variables from args
-            Builder.CreateStore(Builder.CreatePointerCast(varBlockCharPtrPtrArg, doublePtrPtrTy, "varBlockAsDoublePtrPtr"), varBlockDoublePtrPtrVar);
-            Builder.CreateStore(Builder.CreatePointerCast(varBlockCharPtrPtrArg, desireFP ? doublePtrPtrTy : i8PtrPtrPtrTy, "varBlockAsTPtrPtr"), varBlockTPtrPtrVar);
-            Builder.CreateStore(rangeStartArg, rangeStartVar);
-            Builder.CreateStore(rangeEndArg, rangeEndVar);
-            Builder.CreateStore(outputVarBlockOffsetArg, outputVarBlockOffsetVar);
-
-            // Set output pointer
-            Value *outputBasePtrPtr = Builder.CreateGEP(nullptr, Builder.CreateLoad(varBlockTPtrPtrVar), outputVarBlockOffsetArg, "outputBasePtrPtr");
-            Value *outputBasePtr = Builder.CreateLoad(outputBasePtrPtr, "outputBasePtr");
-            Builder.CreateStore(Builder.CreateLoad(rangeStartVar), indexVar);
-
-            Builder.CreateBr(loopCmpBlock);
-            Builder.SetInsertPoint(loopCmpBlock);
-            Value *cond = Builder.CreateICmpULT(Builder.CreateLoad(indexVar), Builder.CreateLoad(rangeEndVar));
-            Builder.CreateCondBr(cond, loopRepeatBlock, loopEndBlock);
-
-            Builder.SetInsertPoint(loopRepeatBlock);
-            Value *myOutputPtr = Builder.CreateGEP(nullptr, outputBasePtr, Builder.CreateMul(dimValue, Builder.CreateLoad(indexVar)));
-            Builder.CreateCall(F, {myOutputPtr, Builder.CreateLoad(varBlockDoublePtrPtrVar), Builder.CreateLoad(indexVar)});
-
-            Builder.CreateBr(loopIncBlock);
-
-            Builder.SetInsertPoint(loopIncBlock);
-            Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(indexVar), oneValue), indexVar);
-            Builder.CreateBr(loopCmpBlock);
-
-            Builder.SetInsertPoint(loopEndBlock);
+            Value *varBlockDoublePtrPtr = Builder.CreatePointerCast(varBlockCharPtrPtrArg, doublePtrPtrTy, "varBlockAsDoublePtrPtr");
+            // FP results of a chunk of points are computed into a double scratch and then stored in the output
+            // binding's layout, so the expression itself is generated once whatever the output element type
+            const unsigned pointsPerChunk = 64;
+            Value *chunkSizeValue = ConstantInt::get(i32Ty, pointsPerChunk);
+            Value *resultChunk = desireFP ? Builder.CreateAlloca(Type::getDoubleTy(llvmContext), ConstantInt::get(i32Ty, pointsPerChunk * dimDesired), "resultChunk") : nullptr;
+
+            // Set output pointers (one per component for soa outputs)
+            std::vector<Value *> outputComponentPtrs;
+            Value *outputBasePtr = nullptr;
+            if (desireFP) {
+                Value *varBlockI8PtrPtr = Builder.CreatePointerCast(varBlockCharPtrPtrArg, i8PtrPtrTy);
+                for (unsigned i = 0; i < dimDesired; ++i) {
+                    Value *pointerIndex = Builder.CreateAdd(outputVarBlockOffsetArg, Builder.CreateMul(outputPointerStrideArg, ConstantInt::get(i32Ty, i)));
+                    Value *componentPtr = Builder.CreateLoad(Builder.CreateGEP(nullptr, varBlockI8PtrPtr, pointerIndex));
+                    Value *componentOffset = Builder.CreateMul(outputComponentStrideArg, ConstantInt::get(i32Ty, i));
+                    outputComponentPtrs.push_back(Builder.CreateGEP(nullptr, componentPtr, Builder.CreateZExt(componentOffset, i64Ty)));
+                }
+            } else {
+                Value *varBlockTPtrPtr = Builder.CreatePointerCast(varBlockCharPtrPtrArg, i8PtrPtrPtrTy, "varBlockAsTPtrPtr");
+                Value *outputBasePtrPtr = Builder.CreateGEP(nullptr, varBlockTPtrPtr, outputVarBlockOffsetArg, "outputBasePtrPtr");
+                outputBasePtr = Builder.CreateLoad(outputBasePtrPtr, "outputBasePtr");
+            }
+
+            // Loop hints for the loop vectorizer, on the loop that evaluates the points. F is always inlined into
+            // it, so vectorizing the loop evaluates the expression for several points at once in SoA vector lanes,
+            // with branches turned into masks and a scalar loop for the points left over. Width 1 keeps one point
+            // per iteration. The seexpr.loop.points entry tells this loop from the others after optimizing.
+            int vectorWidth = Expression::llvmVectorWidth;
+            auto loopHints = [&]() {
+                Type *i1Ty = Type::getInt1Ty(llvmContext);
+                auto self = MDNode::getTemporary(llvmContext, None);
+                std::vector<Metadata *> hints = {self.get()};
+                hints.push_back(MDNode::get(llvmContext, {MDString::get(llvmContext, "seexpr.loop.points")}));
+                hints.push_back(MDNode::get(llvmContext,
+                                            {MDString::get(llvmContext, "llvm.loop.vectorize.enable"),
+                                             ConstantAsMetadata::get(ConstantInt::get(i1Ty, vectorWidth != 1))}));
+                if (vectorWidth > 1)
+                    hints.push_back(MDNode::get(llvmContext,
+                                                {MDString::get(llvmContext, "llvm.loop.vectorize.width"),
+                                                 ConstantAsMetadata::get(ConstantInt::get(i32Ty, vectorWidth))}));
+                MDNode *loopID = MDNode::getDistinct(llvmContext, hints);
+                loopID->replaceOperandWith(0, loopID);
+                return loopID;
+            };
+
+            // Emit a loop over [start,end) in steps of step at the insert point that runs body for every index,
+            // and leave the insert point after it. Loops evaluating points carry the vectorizer hints.
+            auto createLoop = [&](Value *start, Value *end, Value *step, bool evaluatesPoints,
+                                  const std::function<void(Value *)> &body) {
+                IRBuilder<> entryBuilder(entryBlock, entryBlock->begin());
+                Value *indexVar = entryBuilder.CreateAlloca(i32Ty, oneValue, "indexVar");
+                BasicBlock *loopCmpBlock = BasicBlock::Create(llvmContext, "loopCmp", FLOOP);
+                BasicBlock *loopRepeatBlock = BasicBlock::Create(llvmContext, "loopRepeat", FLOOP);
+                BasicBlock *loopDoneBlock = BasicBlock::Create(llvmContext, "loopDone", FLOOP);
+                Builder.CreateStore(start, indexVar);
+                Builder.CreateBr(loopCmpBlock);
+                Builder.SetInsertPoint(loopCmpBlock);
+                Value *cond = Builder.CreateICmpULT(Builder.CreateLoad(indexVar), end);
+                Builder.CreateCondBr(cond, loopRepeatBlock, loopDoneBlock);
+
+                Builder.SetInsertPoint(loopRepeatBlock);
+                Value *index = Builder.CreateLoad(indexVar);
+                body(index);
+                Builder.CreateStore(Builder.CreateAdd(index, step), indexVar);
+                BranchInst *backEdge = Builder.CreateBr(loopCmpBlock);
+                if (evaluatesPoints) backEdge->setMetadata(LLVMContext::MD_loop, loopHints());
+                Builder.SetInsertPoint(loopDoneBlock);
+            };
+
+            if (desireFP) {
+                createLoop(rangeStartArg, rangeEndArg, chunkSizeValue, false, [&](Value *chunkStart) {
+                    Value *remaining = Builder.CreateSub(rangeEndArg, chunkStart);
+                    Value *chunkEnd = Builder.CreateAdd(
+                        chunkStart,
+                        Builder.CreateSelect(Builder.CreateICmpULT(remaining, chunkSizeValue), remaining, chunkSizeValue));
+                    // the result of point index is at resultChunk[(index-chunkStart)*dim]
+                    auto resultAddress = [&](Value *index, unsigned component) -> Value * {
+                        Value *offset = Builder.CreateAdd(Builder.CreateMul(Builder.CreateSub(index, chunkStart), dimValue),
+                                                          ConstantInt::get(i32Ty, component));
+                        return Builder.CreateInBoundsGEP(resultChunk, Builder.CreateZExt(offset, i64Ty));
+                    };
+                    createLoop(chunkStart, chunkEnd, oneValue, true, [&](Value *index) {
+                        Builder.CreateCall(F, {resultAddress(index, 0), varBlockDoublePtrPtr, index});
+                    });
+
+                    // convert to the output element type (see VarBinding::ElementType), with one small store loop
+                    // per type so the switch stays out of the loops
+                    Type *halfBitsTy = Type::getInt16Ty(llvmContext);
+                    std::pair<VarBinding::ElementType, Type *> storeTypes[] = {
+                        {VarBinding::Double, Type::getDoubleTy(llvmContext)},
+                        {VarBinding::Float, Type::getFloatTy(llvmContext)},
+                        {VarBinding::Int32, i32Ty},
+                        {VarBinding::Half, halfBitsTy}};
+                    BasicBlock *storeDoubleBlock = BasicBlock::Create(llvmContext, "storeDouble", FLOOP);
+                    BasicBlock *storedBlock = BasicBlock::Create(llvmContext, "stored", FLOOP);
+                    SwitchInst *storeSwitch = Builder.CreateSwitch(outputElementTypeArg, storeDoubleBlock, 3);
+                    for (auto &storeType : storeTypes) {
+                        BasicBlock *storeBlock = storeType.first == VarBinding::Double
+                                                     ? storeDoubleBlock
+                                                     : BasicBlock::Create(llvmContext, "store", FLOOP);
+                        if (storeBlock != storeDoubleBlock)
+                            storeSwitch->addCase(ConstantInt::get(IntegerType::get(llvmContext, 32), storeType.first), storeBlock);
+                        Builder.SetInsertPoint(storeBlock);
+                        createLoop(chunkStart, chunkEnd, oneValue, false, [&](Value *index) {
+                            Value *pointOffset = Builder.CreateMul(Builder.CreateZExt(index, i64Ty), Builder.CreateZExt(outputByteStrideArg, i64Ty));
+                            for (unsigned i = 0; i < dimDesired; ++i) {
+                                Value *val = Builder.CreateLoad(resultAddress(index, i));
+                                if (storeType.first == VarBinding::Float)
+                                    val = Builder.CreateFPTrunc(val, storeType.second);
+                                else if (storeType.first == VarBinding::Int32)
+                                    val = Builder.CreateFPToSI(val, storeType.second);
+                                else if (storeType.first == VarBinding::Half)
+                                    val = Builder.CreateCall(SeExpr2LLVMDoubleToHalfFunc, {val});
+                                Value *address = Builder.CreateGEP(nullptr, outputComponentPtrs[i], pointOffset);
+                                Builder.CreateStore(val, Builder.CreatePointerCast(address, PointerType::getUnqual(storeType.second)));
+                            }
+                        });
+                        Builder.CreateBr(storedBlock);
+                    }
+                    Builder.SetInsertPoint(storedBlock);
+                });
+            } else {
+                createLoop(rangeStartArg, rangeEndArg, oneValue, true, [&](Value *index) {
+                    Value *myOutputPtr = Builder.CreateGEP(nullptr, outputBasePtr, Builder.CreateMul(dimValue, index));
+                    Builder.CreateCall(F, {myOutputPtr, varBlockDoublePtrPtr, index});
+                });
+            }
+
             Builder.CreateRetVoid();
         }
 
@@ -299,12 +470,21 @@ class LLVMEvaluator {
         //     std::cerr << "Logic error in code generation of LLVM alert developers" << std::endl;
         //     TheModule->dump();
         // }
+        bool cachedObject = false;
+        if (objectCache) {
+            objectCache->setKey(*TheModule);
+            cachedObject = objectCache->hasObject(*TheModule);
+        }
+
         Module *altModule = TheModule.get();
         std::string ErrStr;
         TheExecutionEngine.reset(EngineBuilder(std::move(TheModule))
                                      .setErrorStr(&ErrStr)
+                                     .setMCJITMemoryManager(std::unique_ptr<SectionMemoryManager>(
+                                         new CountingMemoryManager(_codeBytes)))
                                  //     .setUseMCJIT(true)
                                      .setOptLevel(CodeGenOpt::Aggressive)
+                                     .setMCPU(llvm::sys::getHostCPUName())
                                      .create());
 
         altModule->setDataLayout(TheExecutionEngine->getDataLayout());
@@ -313,11 +493,16 @@ class LLVMEvaluator {
         TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalFPVarRefFunc, (void *)SeExpr2LLVMEvalFPVarRef);
         TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalStrVarRefFunc, (void *)SeExpr2LLVMEvalStrVarRef);
         TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalCustomFunctionFunc, (void *)SeExpr2LLVMEvalCustomFunction);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalstrlenFunc, (void *)strlen);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalstrcatFunc, (void *)strcat);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalmemsetFunc, (void *)memset);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalmallocFunc, (void *)malloc);
-        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMEvalfreeFunc, (void *)free);
+        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMConcatStringsFunc, (void *)SeExpr2LLVMConcatStrings);
+        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMStringsEqualFunc, (void *)SeExpr2LLVMStringsEqual);
+        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMHalfToDoubleFunc, (void *)SeExpr2LLVMHalfToDouble);
+        TheExecutionEngine->addGlobalMapping(SeExpr2LLVMDoubleToHalfFunc, (void *)SeExpr2LLVMDoubleToHalf);
+        mapStandardFunctions(*TheExecutionEngine, *altModule, parseTree);
+        // the globals holding process addresses (see LLVMCodegenBuilder::CreateAddress) resolve to _addresses
+        for (size_t i = 0; i < _addresses.size(); i++)
+            TheExecutionEngine->addGlobalMapping(altModule->getNamedGlobal(LLVMCodegenBuilder::addressName(i)),
+                                                 &_addresses[i]);
+        if (objectCache) TheExecutionEngine->setObjectCache(objectCache);
 
         // [verify]
         std::string errorStr;
@@ -327,22 +512,46 @@ class LLVMEvaluator {
             return false;
         }
 
-        // Setup optimization
-        llvm::PassManagerBuilder builder;
-        std::unique_ptr<llvm::legacy::PassManager> pm(new llvm::legacy::PassManager);
-        std::unique_ptr<llvm::legacy::FunctionPassManager> fpm(new llvm::legacy::FunctionPassManager(altModule));
-        builder.OptLevel = 3;
+        // Setup optimization (not needed when MCJIT will load the object code from the cache)
+        if (!cachedObject) {
+            llvm::PassManagerBuilder builder;
+            std::unique_ptr<llvm::legacy::PassManager> pm(new llvm::legacy::PassManager);
+            std::unique_ptr<llvm::legacy::FunctionPassManager> fpm(
+                new llvm::legacy::FunctionPassManager(altModule));
+            builder.OptLevel = 3;
 #if (LLVM_VERSION_MAJOR >= 4)
-        builder.Inliner = llvm::createAlwaysInlinerLegacyPass();
+            builder.Inliner = llvm::createAlwaysInlinerLegacyPass();
 #else
-        builder.Inliner = llvm::createAlwaysInlinerPass();
+            builder.Inliner = llvm::createAlwaysInlinerPass();
 #endif
-        builder.populateModulePassManager(*pm);
-        // fpm->add(new llvm::DataLayoutPass());
-        builder.populateFunctionPassManager(*fpm);
-        fpm->run(*F);
-        fpm->run(*FLOOP);
-        pm->run(*altModule);
+            // the vectorizers need the target's costs, e.g. to pick the vector width of the evalMultiple loop
+            builder.LoopVectorize = Expression::llvmVectorWidth != 1;
+            builder.SLPVectorize = true;
+            if (TargetMachine *targetMachine = TheExecutionEngine->getTargetMachine()) {
+                pm->add(createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+                fpm->add(createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+            }
+            builder.populateModulePassManager(*pm);
+            // fpm->add(new llvm::DataLayoutPass());
+            builder.populateFunctionPassManager(*fpm);
+            fpm->run(*F);
+            fpm->run(*FLOOP);
+            pm->run(*altModule);
+
+            // the loop vectorizer marks the loops it widened (the store loops may be widened too, so only the
+            // loop evaluating the points counts)
+            for (BasicBlock &block : *FLOOP) {
+                MDNode *loopID = block.getTerminator() ? block.getTerminator()->getMetadata(LLVMContext::MD_loop) : nullptr;
+                bool evaluatesPoints = false, vectorized = false;
+                for (unsigned i = 1; loopID && i < loopID->getNumOperands(); i++) {
+                    MDNode *hint = dyn_cast<MDNode>(loopID->getOperand(i));
+                    MDString *name = hint && hint->getNumOperands() ? dyn_cast<MDString>(hint->getOperand(0)) : nullptr;
+                    if (name && name->getString() == "seexpr.loop.points") evaluatesPoints = true;
+                    if (name && name->getString() == "llvm.loop.isvectorized") vectorized = true;
+                }
+                if (evaluatesPoints && vectorized) _loopVectorized = true;
+            }
+        }
 
         // Create the JIT.  This takes ownership of the module.
 
@@ -352,6 +561,15 @@ class LLVMEvaluator {
         }
 
         TheExecutionEngine->finalizeObject();
+        _moduleBytes = sizeof(Module);
+        for (const Function &function : *altModule) {
+            _moduleBytes += sizeof(Function);
+            for (const BasicBlock &block : function) {
+                _moduleBytes += sizeof(BasicBlock);
+                for (const Instruction &instruction : block)
+                    _moduleBytes += sizeof(Instruction) + instruction.getNumOperands() * sizeof(Use);
+            }
+        }
         void *fp = TheExecutionEngine->getPointerToFunction(F);
         void *fpLoop = TheExecutionEngine->getPointerToFunction(FLOOP);
         if (desireFP) {
@@ -380,7 +598,8 @@ class LLVMEvaluator {
 #else  // no LLVM support
 class LLVMEvaluator {
   public:
-    void unsupported() { throw std::runtime_error("LLVM is not enabled in build"); }
+    LLVMEvaluator() {}
+    void unsupported() const { throw std::runtime_error("LLVM is not enabled in build"); }
     const char *evalStr(VarBlock *varBlock) {
         unsupported();
         return "";
@@ -389,14 +608,23 @@ class LLVMEvaluator {
         unsupported();
         return 0;
     }
+    void evalStr(char **result, VarBlock *varBlock) const { unsupported(); }
+    void evalFP(double *result, VarBlock *varBlock) const { unsupported(); }
     bool prepLLVM(ExprNode *parseTree, ExprType desiredReturnType) {
         unsupported();
         return false;
     }
-    void evalMultiple(VarBlock *varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) {
+    void evalMultiple(VarBlock *varBlock,
+                      int outputVarBlockOffset,
+                      size_t rangeStart,
+                      size_t rangeEnd,
+                      const VarBinding &output) {
         unsupported();
     }
     void debugPrint() {}
+    size_t codeSizeInBytes() const { return 0; }
+    size_t moduleSizeInBytes() const { return 0; }
+    bool loopVectorized() const { return false; }
 };
 #endif
 
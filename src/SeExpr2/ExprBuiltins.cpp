@@ -746,6 +746,71 @@ static const char* ccellnoise_docstring =
     "cellnoise generates a field of constant colored cubes based on the integer location.\n"
     "This is the same as the prman cellnoise function.";
 
+// Batch kernels for the noise functions above (see ExprFuncStandard::FuncBatch)
+namespace {
+//! Runs FBMBatch over a block when octaves, lacunarity and gain are the same for all lanes
+template <int d_out, bool turbulence>
+bool fbmBatch(int n, const double* const* args, double* out, int width) {
+    double params[3] = {6, 2, 0.5};  // octaves, lacunarity, gain
+    for (int i = 1; i < n; i++) {
+        const double* arg = args[i];
+        for (int l = 1; l < width; l++)
+            if (arg[l] != arg[0]) return false;
+        params[i - 1] = arg[0];
+    }
+    int octaves = n > 1 ? int(clamp(params[0], 1, 8)) : 6;
+    FBMBatch<3, d_out, turbulence>(width, args[0], out, octaves, params[1], params[2]);
+    return true;
+}
+
+//! out=.5*out+.5 for d components
+void halfShift(double* out, int d, int width) {
+    for (int i = 0; i < d * width; i++) out[i] = .5 * out[i] + .5;
+}
+}
+
+bool turbulence_batch(int n, const double* const* args, double* out, int width) {
+    if (!fbmBatch<1, true>(n, args, out, width)) return false;
+    halfShift(out, 1, width);
+    return true;
+}
+
+bool vturbulence_batch(int n, const double* const* args, double* out, int width) {
+    return fbmBatch<3, true>(n, args, out, width);
+}
+
+bool cturbulence_batch(int n, const double* const* args, double* out, int width) {
+    if (!fbmBatch<3, true>(n, args, out, width)) return false;
+    halfShift(out, 3, width);
+    return true;
+}
+
+bool fbm_batch(int n, const double* const* args, double* out, int width) {
+    if (!fbmBatch<1, false>(n, args, out, width)) return false;
+    halfShift(out, 1, width);
+    return true;
+}
+
+bool vfbm_batch(int n, const double* const* args, double* out, int width) {
+    return fbmBatch<3, false>(n, args, out, width);
+}
+
+bool cfbm_batch(int n, const double* const* args, double* out, int width) {
+    if (!fbmBatch<3, false>(n, args, out, width)) return false;
+    halfShift(out, 3, width);
+    return true;
+}
+
+bool cellnoise_batch(int n, const double* const* args, double* out, int width) {
+    CellNoiseBatch<3, 1>(width, args[0], out);
+    return true;
+}
+
+bool ccellnoise_batch(int n, const double* const* args, double* out, int width) {
+    CellNoiseBatch<3, 3>(width, args[0], out);
+    return true;
+}
+
 double pnoise(const Vec3d& p, const Vec3d& period) {
     double result;
     double args[3] = {p[0], p[1], p[2]};
@@ -1027,11 +1092,14 @@ class CachedVoronoiFunc : public ExprFuncSimple {
     }
 
     virtual ExprFuncNode::Data* evalConstant(const ExprFuncNode* node, ArgHandle args) const {
-        return new VoronoiPointData();
+        return new ExprFuncNode::Data(true);
     }
 
+    // the neighbor cache is updated on every call, so each thread gets its own
+    virtual ExprFuncNode::Data* evalScratch(const ExprFuncNode::Data* data) const { return new VoronoiPointData(); }
+
     virtual void eval(ArgHandle args) {
-        VoronoiPointData* data = static_cast<VoronoiPointData*>(args.data);
+        VoronoiPointData* data = static_cast<VoronoiPointData*>(scratch(args));
         int nargs = args.nargs();
         Vec3d* sevArgs = (Vec3d*)alloca(sizeof(Vec3d) * nargs);
 
@@ -1290,6 +1358,7 @@ template <class T>
 struct CurveData : public ExprFuncNode::Data {
     Curve<T> curve;
     virtual ~CurveData() {}
+    virtual size_t sizeInBytes() const { return sizeof(*this) - sizeof(curve) + curve.sizeInBytes(); }
 };
 
 class CurveFuncX : public ExprFuncSimple {
@@ -1406,6 +1475,7 @@ class GetVar : public ExprFuncSimple {
         Data(func fIn, int dim) : f(fIn), dim(dim) {}
         func f;
         int dim;
+        virtual size_t sizeInBytes() const { return sizeof(*this); }
     };
 
     virtual ExprType prep(ExprFuncNode* node, bool wantScalar, ExprVarEnvBuilder& envBuilder) const {
@@ -1463,6 +1533,9 @@ class PrintFuncX : public ExprFuncSimple {
     struct Data : public ExprFuncNode::Data {
         std::vector<std::pair<int, int> > ranges;
         std::string format;
+        virtual size_t sizeInBytes() const {
+            return sizeof(*this) + ranges.capacity() * sizeof(ranges[0]) + format.capacity();
+        }
     };
 
   public:
@@ -1719,8 +1792,8 @@ static const char* testfunc_docstring="fdsA";
 void defineBuiltins(ExprFunc::Define define, ExprFunc::Define3 define3) {
 // functions from math.h (global namespace)
 //#define FUNC(func)	  define(#func, ExprFunc(::func))
-#define FUNCADOC(name, func) define3(name, ExprFunc(::func), func##_docstring)
-#define FUNCDOC(func) define3(#func, ExprFunc(::func), func##_docstring)
+#define FUNCADOC(name, func) define3(name, ExprFunc(::func).pure(), func##_docstring)
+#define FUNCDOC(func) define3(#func, ExprFunc(::func).pure(), func##_docstring)
     FUNCADOC("abs", fabs);
     FUNCDOC(acos);
     FUNCDOC(asin);
@@ -1752,8 +1825,11 @@ void defineBuiltins(ExprFunc::Define define, ExprFunc::Define3 define3) {
 #undef FUNCDOC
 //#define FUNC(func)	      define(#func, ExprFunc(SeExpr2::func))
 //#define FUNCN(func, min, max) define(#func, ExprFunc(SeExpr2::func, min, max))
-#define FUNCDOC(func) define3(#func, ExprFunc(SeExpr2::func), func##_docstring)
-#define FUNCNDOC(func, min, max) define3(#func, ExprFunc(SeExpr2::func, min, max), func##_docstring)
+#define FUNCDOC(func) define3(#func, ExprFunc(SeExpr2::func).pure(), func##_docstring)
+#define FUNCNDOC(func, min, max) define3(#func, ExprFunc(SeExpr2::func, min, max).pure(), func##_docstring)
+#define FUNCBDOC(func) define3(#func, ExprFunc(SeExpr2::func).pure().batch(SeExpr2::func##_batch), func##_docstring)
+#define FUNCNBDOC(func, min, max) \
+    define3(#func, ExprFunc(SeExpr2::func, min, max).pure().batch(SeExpr2::func##_batch), func##_docstring)
 
     // trig
     FUNCDOC(deg);
@@ -1801,14 +1877,14 @@ void defineBuiltins(ExprFunc::Define define, ExprFunc::Define3 define3) {
     FUNCNDOC(snoise4, 2, 2);
     FUNCNDOC(vnoise4, 2, 2);
     FUNCNDOC(cnoise4, 2, 2);
-    FUNCNDOC(turbulence, 1, 4);
-    FUNCNDOC(vturbulence, 1, 4);
-    FUNCNDOC(cturbulence, 1, 4);
-    FUNCNDOC(fbm, 1, 4);
-    FUNCNDOC(vfbm, 1, 4);
-    FUNCNDOC(cfbm, 1, 4);
-    FUNCDOC(cellnoise);
-    FUNCDOC(ccellnoise);
+    FUNCNBDOC(turbulence, 1, 4);
+    FUNCNBDOC(vturbulence, 1, 4);
+    FUNCNBDOC(cturbulence, 1, 4);
+    FUNCNBDOC(fbm, 1, 4);
+    FUNCNBDOC(vfbm, 1, 4);
+    FUNCNBDOC(cfbm, 1, 4);
+    FUNCBDOC(cellnoise);
+    FUNCBDOC(ccellnoise);
     FUNCDOC(pnoise);
     FUNCNDOC(fbm4, 2, 5);
     FUNCNDOC(vfbm4, 2, 5);
@@ -1834,7 +1910,9 @@ void defineBuiltins(ExprFunc::Define define, ExprFunc::Define3 define3) {
     FUNCNDOC(swatch, 3, -1);
     FUNCNDOC(spline, 5, -1);
 
-    // FuncX interface
+    // FuncX interface (not marked pure)
+#undef FUNCNDOC
+#define FUNCNDOC(func, min, max) define3(#func, ExprFunc(SeExpr2::func, min, max), func##_docstring)
     // noise
     FUNCNDOC(voronoi, 1, 7);
     FUNCNDOC(cvoronoi, 1, 7);
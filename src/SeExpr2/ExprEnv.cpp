@@ -78,6 +78,30 @@ void ExprVarEnv::add(const std::string& name, std::unique_ptr<ExprLocalVar> var)
         _map.insert(std::make_pair(name, std::move(var)));
 }
 
+namespace {
+size_t localVarSize(const ExprLocalVar* var) {
+    return dynamic_cast<const ExprLocalVarPhi*>(var) ? sizeof(ExprLocalVarPhi) : sizeof(ExprLocalVar);
+}
+}
+
+size_t ExprVarEnv::sizeInBytes() const {
+    // map nodes hold the entry and about three pointers of balancing data
+    const size_t mapNodeOverhead = 4 * sizeof(void*);
+    size_t size = sizeof(*this);
+    for (VarDictType::const_iterator it = _map.begin(); it != _map.end(); ++it)
+        size += sizeof(*it) + mapNodeOverhead + it->first.capacity() + localVarSize(it->second.get());
+    for (FuncDictType::const_iterator it = _functions.begin(); it != _functions.end(); ++it)
+        size += sizeof(*it) + mapNodeOverhead + it->first.capacity();
+    size += shadowedVariables.capacity() * sizeof(shadowedVariables[0]);
+    for (size_t i = 0; i < shadowedVariables.size(); i++) size += localVarSize(shadowedVariables[i].get());
+    size += _mergedVariables.capacity() * sizeof(_mergedVariables[0]);
+    for (size_t i = 0; i < _mergedVariables.size(); i++) {
+        size += _mergedVariables[i].capacity() * sizeof(_mergedVariables[i][0]);
+        for (size_t j = 0; j < _mergedVariables[i].size(); j++) size += _mergedVariables[i][j].first.capacity();
+    }
+    return size;
+}
+
 size_t ExprVarEnv::mergeBranches(const ExprType& type, ExprVarEnv& env1, ExprVarEnv& env2) {
     typedef std::map<std::pair<ExprLocalVar*, ExprLocalVar*>, std::string> MakeMap;
     MakeMap phisToMake;
@@ -138,6 +138,8 @@ class ExprVarEnv {
     size_t mergeBranches(const ExprType& type, ExprVarEnv& env1, ExprVarEnv& env2);
     // Code generate merges.
     LLVM_VALUE codegenMerges(LLVM_BUILDER builder, int mergeIndex) LLVM_BODY;
+    //! Estimated memory held by the scope and its variables
+    size_t sizeInBytes() const;
     // Query merges
     std::vector<std::pair<std::string, ExprLocalVarPhi*>>& merge(size_t index) { return _mergedVariables[index]; }
 };
@@ -166,6 +168,12 @@ class ExprVarEnvBuilder {
         all.emplace_back(std::move(newEnv));
         return all.back().get();
     }
+    //! Estimated memory held by all scopes
+    size_t sizeInBytes() const {
+        size_t size = sizeof(*this) + all.capacity() * sizeof(all[0]);
+        for (size_t i = 0; i < all.size(); i++) size += all[i]->sizeInBytes();
+        return size;
+    }
 
   private:
     //! All owned symbol tables
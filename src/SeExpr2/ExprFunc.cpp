@@ -16,6 +16,8 @@
 */
 #include <string>
 #include <map>
+#include <memory>
+#include <atomic>
 #include <stdlib.h>
 #include <iostream>
 #ifndef SEEXPR_WIN32
@@ -34,37 +36,41 @@ namespace {
 // FuncTable - table of pre-defined functions
 class FuncTable {
   public:
-    void define(const char* name, SeExpr2::ExprFunc f, const char* docString = 0) {
+    // returns the entry replaced by the definition, if any
+    std::shared_ptr<const void> define(const char* name, SeExpr2::ExprFunc f, const char* docString = 0) {
+        std::shared_ptr<FuncMapItem>& item = funcmap[name];
+        std::shared_ptr<const void> replaced = item;
         if (docString)
-            funcmap[name] = FuncMapItem(std::string(docString), f);
+            item = std::make_shared<FuncMapItem>(std::string(docString), f);
         else
-            funcmap[name] = FuncMapItem(name, f);
+            item = std::make_shared<FuncMapItem>(name, f);
+        return replaced;
     }
 
-    const SeExpr2::ExprFunc* lookup(const std::string& name) {
-        FuncMap::iterator iter;
-        if ((iter = funcmap.find(name)) != funcmap.end()) return &iter->second.second;
+    const SeExpr2::ExprFunc* lookup(const std::string& name) const {
+        FuncMap::const_iterator iter;
+        if ((iter = funcmap.find(name)) != funcmap.end()) return &iter->second->second;
         return 0;
     }
     void initBuiltins();
 
-    void getFunctionNames(std::vector<std::string>& names) {
-        for (FuncMap::iterator i = funcmap.begin(); i != funcmap.end(); ++i) names.push_back(i->first);
+    void getFunctionNames(std::vector<std::string>& names) const {
+        for (FuncMap::const_iterator i = funcmap.begin(); i != funcmap.end(); ++i) names.push_back(i->first);
     }
 
-    std::string getDocString(const char* functionName) {
-        FuncMap::iterator i = funcmap.find(functionName);
+    std::string getDocString(const char* functionName) const {
+        FuncMap::const_iterator i = funcmap.find(functionName);
         if (i == funcmap.end())
             return "";
         else
-            return i->second.first;
+            return i->second->first;
     }
 
     size_t sizeInBytes() const {
         size_t totalSize = 0;
         for (FuncMap::const_iterator it = funcmap.begin(); it != funcmap.end(); ++it) {
             totalSize += it->first.size() + sizeof(FuncMapItem);
-            const SeExpr2::ExprFunc& function = it->second.second;
+            const SeExpr2::ExprFunc& function = it->second->second;
             if (const SeExpr2::ExprFuncX* funcx = function.funcx()) {
                 totalSize += funcx->sizeInBytes();
             }
@@ -77,7 +83,7 @@ class FuncTable {
         size_t totalSize = 0;
         for (FuncMap::const_iterator it = funcmap.begin(); it != funcmap.end(); ++it) {
             totalSize += it->first.size() + sizeof(FuncMapItem);
-            const SeExpr2::ExprFunc& function = it->second.second;
+            const SeExpr2::ExprFunc& function = it->second->second;
             if (const SeExpr2::ExprFuncX* funcx = function.funcx()) {
                 funcx->statistics(statisticsDump);
             }
@@ -86,12 +92,22 @@ class FuncTable {
     }
 
   private:
+    // items are shared between successive tables so a function keeps its address while others are defined
     typedef std::pair<std::string, SeExpr2::ExprFunc> FuncMapItem;
-    typedef std::map<std::string, FuncMapItem> FuncMap;
+    typedef std::map<std::string, std::shared_ptr<FuncMapItem> > FuncMap;
     FuncMap funcmap;
 };
 
-FuncTable* Functions = 0;
+/* The registry is published as immutable snapshots: readers load the current table without locking,
+   while writers (serialized by a mutex) fill a private copy and then publish it in one atomic store.
+   Superseded tables are retired, and freed by a later publish once no reader is walking a table. Entries
+   replaced by a redefinition are kept until cleanup(), so every pointer returned by lookup stays valid. */
+std::atomic<const FuncTable*> Functions(nullptr);
+std::vector<const FuncTable*> RetiredFunctions;
+std::vector<std::shared_ptr<const void> > ReplacedFunctions;
+std::atomic<int> activeReaders(0);
+FuncTable* PendingFunctions = 0;  // table being filled by the writer holding the mutex
+std::atomic<unsigned int> registryGeneration(0);
 }
 
 // ExprType ExprFuncX::prep(ExprFuncNode* node, bool scalarWanted, ExprVarEnv & env) const
@@ -109,6 +125,44 @@ std::vector<void*> ExprFunc::dynlib;
 
 static SeExprInternal2::Mutex mutex;
 
+namespace {
+// Start modifying a copy of the current table. Requires the mutex and an initialized registry.
+void beginUpdate() {
+    PendingFunctions = new FuncTable(*Functions.load(std::memory_order_relaxed));
+}
+
+// Atomically replace the current table with the pending one. Requires the mutex.
+void publishUpdate() {
+    const FuncTable* old = Functions.exchange(PendingFunctions);
+    PendingFunctions = 0;
+    if (old) RetiredFunctions.push_back(old);
+    registryGeneration++;
+    // readers count themselves before loading the table, so once none are counted none can reach a retired table
+    if (activeReaders.load() == 0) {
+        for (size_t i = 0; i < RetiredFunctions.size(); i++) delete RetiredFunctions[i];
+        RetiredFunctions.clear();
+    }
+}
+
+// The current table, created on first use, held for the lifetime of the reader
+class TableReader {
+  public:
+    TableReader() {
+        activeReaders++;
+        _table = Functions.load();
+        if (!_table) {
+            ExprFunc::init();
+            _table = Functions.load();
+        }
+    }
+    ~TableReader() { activeReaders--; }
+    const FuncTable* operator->() const { return _table; }
+
+  private:
+    const FuncTable* _table;
+};
+}
+
 void ExprFunc::init() {
     SeExprInternal2::AutoMutex locker(mutex);
     initInternal();
@@ -116,8 +170,11 @@ void ExprFunc::init() {
 
 void ExprFunc::cleanup() {
     SeExprInternal2::AutoMutex locker(mutex);
-    delete Functions;
-    Functions = nullptr;
+    delete Functions.exchange(nullptr);
+    for (size_t i = 0; i < RetiredFunctions.size(); i++) delete RetiredFunctions[i];
+    RetiredFunctions.clear();
+    ReplacedFunctions.clear();
+    registryGeneration++;
 #ifdef SEEXPR_WIN32
 #else
     for(size_t i=0; i<dynlib.size(); i++){
@@ -128,77 +185,64 @@ void ExprFunc::cleanup() {
 }
 
 const ExprFunc* ExprFunc::lookup(const std::string& name) {
-    mutex.lock();
-    if (!Functions) initInternal();
-    const ExprFunc* ret = Functions->lookup(name);
-    mutex.unlock();
-    return ret;
+    return TableReader()->lookup(name);
 }
 
 inline static void defineInternal(const char* name, ExprFunc f) {
-    // THIS FUNCTION IS NOT THREAD SAFE, it assumes you have a mutex from callee
+    // THIS FUNCTION IS NOT THREAD SAFE, it assumes you have a mutex from callee and a pending table
     // ALSO YOU MUST BE VERY CAREFUL NOT TO CALL ANYTHING THAT TRIES TO REACQUIRE MUTEX!
-    Functions->define(name, f);
+    std::shared_ptr<const void> replaced = PendingFunctions->define(name, f);
+    if (replaced) ReplacedFunctions.push_back(replaced);
 }
 
 inline static void defineInternal3(const char* name, ExprFunc f, const char* docString) {
-    // THIS FUNCTION IS NOT THREAD SAFE, it assumes you have a mutex from callee
+    // THIS FUNCTION IS NOT THREAD SAFE, it assumes you have a mutex from callee and a pending table
     // ALSO YOU MUST BE VERY CAREFUL NOT TO CALL ANYTHING THAT TRIES TO REACQUIRE MUTEX!
-    Functions->define(name, f, docString);
+    std::shared_ptr<const void> replaced = PendingFunctions->define(name, f, docString);
+    if (replaced) ReplacedFunctions.push_back(replaced);
 }
 
 void ExprFunc::initInternal() {
     // THIS FUNCTION IS NOT THREAD SAFE, it assumes you have a mutex from callee
     // ALSO YOU MUST BE VERY CAREFUL NOT TO CALL ANYTHING THAT TRIES TO REACQUIRE MUTEX!
-
-    // TODO: make thread safe
-    if (Functions) return;
-    Functions = new FuncTable;
+    if (Functions.load(std::memory_order_acquire)) return;
+    PendingFunctions = new FuncTable;
     SeExpr2::defineBuiltins(defineInternal, defineInternal3);
     const char* path = getenv("SE_EXPR_PLUGINS");
-    if (path) loadPlugins(path);
+    if (path) loadPluginsInternal(path);
+    publishUpdate();
 }
 
 void ExprFunc::define(const char* name, ExprFunc f) {
-    mutex.lock();
-    if (!Functions) initInternal();
+    SeExprInternal2::AutoMutex locker(mutex);
+    initInternal();
+    beginUpdate();
     defineInternal(name, f);
-    mutex.unlock();
+    publishUpdate();
 }
 
 void ExprFunc::define(const char* name, ExprFunc f, const char* docString) {
-    mutex.lock();
-    if (!Functions) initInternal();
+    SeExprInternal2::AutoMutex locker(mutex);
+    initInternal();
+    beginUpdate();
     defineInternal3(name, f, docString);
-    mutex.unlock();
+    publishUpdate();
 }
 
-void ExprFunc::getFunctionNames(std::vector<std::string>& names) {
-    mutex.lock();
-    if (!Functions) initInternal();
-    Functions->getFunctionNames(names);
-    mutex.unlock();
-}
+void ExprFunc::getFunctionNames(std::vector<std::string>& names) { TableReader()->getFunctionNames(names); }
 
-std::string ExprFunc::getDocString(const char* functionName) {
-    mutex.lock();
-    if (!Functions) initInternal();
-    std::string ret = Functions->getDocString(functionName);
-    mutex.unlock();
-    return ret;
-}
+std::string ExprFunc::getDocString(const char* functionName) { return TableReader()->getDocString(functionName); }
 
-size_t ExprFunc::sizeInBytes() {
-    SeExprInternal2::AutoMutex locker(mutex);
-    if (!Functions) initInternal();
-    return Functions->sizeInBytes();
+uint64_t ExprFunc::nextId() {
+    static std::atomic<uint64_t> id(0);
+    return ++id;
 }
 
-SeExpr2::Statistics ExprFunc::statistics() {
-    SeExprInternal2::AutoMutex locker(mutex);
-    if (!Functions) initInternal();
-    return Functions->statistics();
-}
+unsigned int ExprFunc::generation() { return registryGeneration.load(std::memory_order_acquire); }
+
+size_t ExprFunc::sizeInBytes() { return TableReader()->sizeInBytes(); }
+
+SeExpr2::Statistics ExprFunc::statistics() { return TableReader()->statistics(); }
 
 #ifndef SEEXPR_WIN32
 
@@ -215,6 +259,22 @@ static int MatchPluginName(const struct dirent* dir)
 #endif
 
 void ExprFunc::loadPlugins(const char* path) {
+    SeExprInternal2::AutoMutex locker(mutex);
+    initInternal();
+    beginUpdate();
+    loadPluginsInternal(path);
+    publishUpdate();
+}
+
+void ExprFunc::loadPlugin(const char* path) {
+    SeExprInternal2::AutoMutex locker(mutex);
+    initInternal();
+    beginUpdate();
+    loadPluginInternal(path);
+    publishUpdate();
+}
+
+void ExprFunc::loadPluginsInternal(const char* path) {
 #ifdef SEEXPR_WIN32
 
 #else
@@ -225,7 +285,7 @@ void ExprFunc::loadPlugins(const char* path) {
     while (entry) {
         // if entry ends with ".so", load directly
         if ((!strcmp(entry + strlen(entry) - 3, ".so")))
-            loadPlugin(entry);
+            loadPluginInternal(entry);
         else {
             // assume it's a dir - search it for plugins
             struct dirent** matches = 0;
@@ -234,7 +294,7 @@ void ExprFunc::loadPlugins(const char* path) {
                 std::string fullpath = entry;
                 fullpath += "/";
                 fullpath += matches[i]->d_name;
-                loadPlugin(fullpath.c_str());
+                loadPluginInternal(fullpath.c_str());
             }
             if (matches)
                 free(matches);
@@ -249,7 +309,7 @@ void ExprFunc::loadPlugins(const char* path) {
 #endif
 }
 
-void ExprFunc::loadPlugin(const char* path) {
+void ExprFunc::loadPluginInternal(const char* path) {
 #ifdef SEEXPR_WIN32
     std::cerr << "SeExpr: warning Plugins are not supported on windows currently" << std::endl;
 #else
@@ -43,12 +43,16 @@ namespace SeExpr2 {
 */
 class ExprFunc {
     static void initInternal();  // call to define built-in funcs and load standard plugins
+    static void loadPluginsInternal(const char* path);  // these expect the lock and a pending table
+    static void loadPluginInternal(const char* path);
+
   public:
     //! call to define built-in funcs and load standard plugins
     /** In addition to initializing all builtins, this loads all plugins given in a
         a colon delimited SE_EXPR_PLUGINS environment variable **/
     static void init();
     //! cleanup all functions
+    /** Must not run concurrently with other uses of the registry; pointers from lookup() become invalid **/
     static void cleanup();
     //! load all plugins in a given path
     static void loadPlugins(const char* path);
@@ -65,6 +69,10 @@ class ExprFunc {
     typedef void (*Define3)(const char* name, ExprFunc f, const char* docString);
 
     //! Lookup a builtin function by name
+    /** Lookups (like getFunctionNames, getDocString, sizeInBytes and statistics) read an immutable snapshot
+        of the registry without locking. define() and loadPlugin() publish a new snapshot atomically; the
+        returned pointer stays valid until cleanup() even if the name is redefined later. Superseded snapshots
+        are freed by the next define() that finds no lookup in progress. **/
     static const ExprFunc* lookup(const std::string& name);
 
     //! Get a list of registered builtin and DSO generated functions
@@ -73,6 +81,9 @@ class ExprFunc {
     //! Get doc string for a specific function
     static std::string getDocString(const char* functionName);
 
+    //! Counter bumped whenever the function table changes (define, plugin loading or cleanup). Lock free.
+    static unsigned int generation();
+
     //! Get the total size estimate of all plugins
     static size_t sizeInBytes();
 
@@ -123,13 +134,33 @@ class ExprFunc {
     int maxArgs() const { return _maxargs; }
     //! return pointer to the funcx
     const ExprFuncX* funcx() const { return _func ? _func : &_standardFunc; }
+    //! Number identifying this function, never reused (unlike its address) once it is destroyed
+    uint64_t id() const { return _id; }
+
+    //! Mark the function as pure (see ExprFuncX::isPure). The flag belongs to this ExprFunc, so other ExprFuncs
+    //! sharing its ExprFuncX are not affected.
+    ExprFunc& pure(bool isPure = true) {
+        _pure = isPure;
+        return *this;
+    }
+    //! True if marked pure, here or by the ExprFuncX itself
+    bool isPure() const { return _pure || funcx()->isPure(); }
+
+    //! Attach a kernel evaluating a whole interpreter batch of a vector argumented function at once
+    ExprFunc& batch(ExprFuncStandard::FuncBatch* f) {
+        _standardFunc.setBatchFunc(f);
+        return *this;
+    }
 
   private:
     ExprFuncStandard _standardFunc;
     ExprFuncX* _func;
     int _minargs;
     int _maxargs;
+    bool _pure = false;
+    uint64_t _id = nextId();
     static std::vector<void*> dynlib;
+    static uint64_t nextId();
 };
 }
 
@@ -142,6 +142,160 @@ int FuncNVVOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
     return 1;
 }
 
+// Batched variants of the ops above. Registers are laid out SoA (see Interpreter::batchWidth), so each
+// lane gathers its arguments and calls the function pointer once; dispatch is paid once per block.
+namespace {
+const int W = Interpreter::batchWidth;
+
+inline Vec3d laneVec(const double* fp, int reg, int l) {
+    const double* base = fp + reg * W + l;
+    return Vec3d(base[0], base[W], base[2 * W]);
+}
+
+inline void setLaneVec(double* fp, int reg, int l, const Vec3d& v) {
+    double* base = fp + reg * W + l;
+    for (int k = 0; k < 3; k++) base[k * W] = v[k];
+}
+}
+
+int Func0BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func0* func = (ExprFuncStandard::Func0*)(c[opData[0]]);
+    for (int l = 0; l < W; l++) fp[opData[1] * W + l] = func();
+    return 1;
+}
+int Func1BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func1* func = (ExprFuncStandard::Func1*)(c[opData[0]]);
+    const double* in = fp + opData[1] * W;
+    double* out = fp + opData[2] * W;
+    for (int l = 0; l < W; l++) out[l] = func(in[l]);
+    return 1;
+}
+int Func2BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func2* func = (ExprFuncStandard::Func2*)(c[opData[0]]);
+    const double* in1 = fp + opData[1] * W;
+    const double* in2 = fp + opData[2] * W;
+    double* out = fp + opData[3] * W;
+    for (int l = 0; l < W; l++) out[l] = func(in1[l], in2[l]);
+    return 1;
+}
+int Func3BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func3* func = (ExprFuncStandard::Func3*)(c[opData[0]]);
+    const double* in1 = fp + opData[1] * W;
+    const double* in2 = fp + opData[2] * W;
+    const double* in3 = fp + opData[3] * W;
+    double* out = fp + opData[4] * W;
+    for (int l = 0; l < W; l++) out[l] = func(in1[l], in2[l], in3[l]);
+    return 1;
+}
+int Func4BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func4* func = (ExprFuncStandard::Func4*)(c[opData[0]]);
+    const double* in1 = fp + opData[1] * W;
+    const double* in2 = fp + opData[2] * W;
+    const double* in3 = fp + opData[3] * W;
+    const double* in4 = fp + opData[4] * W;
+    double* out = fp + opData[5] * W;
+    for (int l = 0; l < W; l++) out[l] = func(in1[l], in2[l], in3[l], in4[l]);
+    return 1;
+}
+int Func5BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func5* func = (ExprFuncStandard::Func5*)(c[opData[0]]);
+    const double* in1 = fp + opData[1] * W;
+    const double* in2 = fp + opData[2] * W;
+    const double* in3 = fp + opData[3] * W;
+    const double* in4 = fp + opData[4] * W;
+    const double* in5 = fp + opData[5] * W;
+    double* out = fp + opData[6] * W;
+    for (int l = 0; l < W; l++) out[l] = func(in1[l], in2[l], in3[l], in4[l], in5[l]);
+    return 1;
+}
+int Func6BatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func6* func = (ExprFuncStandard::Func6*)(c[opData[0]]);
+    const double* in1 = fp + opData[1] * W;
+    const double* in2 = fp + opData[2] * W;
+    const double* in3 = fp + opData[3] * W;
+    const double* in4 = fp + opData[4] * W;
+    const double* in5 = fp + opData[5] * W;
+    const double* in6 = fp + opData[6] * W;
+    double* out = fp + opData[7] * W;
+    for (int l = 0; l < W; l++) out[l] = func(in1[l], in2[l], in3[l], in4[l], in5[l], in6[l]);
+    return 1;
+}
+int FuncNBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Funcn* func = (ExprFuncStandard::Funcn*)(c[opData[0]]);
+    int n = opData[1];
+    double* vals = static_cast<double*>(alloca(n * sizeof(double)));
+    double* out = fp + opData[n + 2] * W;
+    for (int l = 0; l < W; l++) {
+        for (int k = 0; k < n; k++) vals[k] = fp[opData[k + 2] * W + l];
+        out[l] = func(n, vals);
+    }
+    return 1;
+}
+int Func1VBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func1v* func = (ExprFuncStandard::Func1v*)(c[opData[0]]);
+    double* out = fp + opData[2] * W;
+    for (int l = 0; l < W; l++) out[l] = func(laneVec(fp, opData[1], l));
+    return 1;
+}
+int Func2VBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func2v* func = (ExprFuncStandard::Func2v*)(c[opData[0]]);
+    double* out = fp + opData[3] * W;
+    for (int l = 0; l < W; l++) out[l] = func(laneVec(fp, opData[1], l), laneVec(fp, opData[2], l));
+    return 1;
+}
+int Func1VVBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func1vv* func = (ExprFuncStandard::Func1vv*)(c[opData[0]]);
+    for (int l = 0; l < W; l++) setLaneVec(fp, opData[2], l, func(laneVec(fp, opData[1], l)));
+    return 1;
+}
+int Func2VVBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Func2vv* func = (ExprFuncStandard::Func2vv*)(c[opData[0]]);
+    for (int l = 0; l < W; l++)
+        setLaneVec(fp, opData[3], l, func(laneVec(fp, opData[1], l), laneVec(fp, opData[2], l)));
+    return 1;
+}
+int FuncNVBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Funcnv* func = (ExprFuncStandard::Funcnv*)(c[opData[0]]);
+    int n = opData[1];
+    Vec3d* vals = static_cast<Vec3d*>(alloca(n * sizeof(Vec3d)));
+    double* out = fp + opData[n + 2] * W;
+    for (int l = 0; l < W; l++) {
+        for (int k = 0; k < n; k++) new (vals + k) Vec3d(laneVec(fp, opData[k + 2], l));  // placement new!
+        out[l] = func(n, vals);
+    }
+    return 1;
+}
+int FuncNVVBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::Funcnvv* func = (ExprFuncStandard::Funcnvv*)(c[opData[0]]);
+    int n = opData[1];
+    Vec3d* vals = static_cast<Vec3d*>(alloca(n * sizeof(Vec3d)));
+    for (int l = 0; l < W; l++) {
+        for (int k = 0; k < n; k++) new (vals + k) Vec3d(laneVec(fp, opData[k + 2], l));  // placement new!
+        setLaneVec(fp, opData[n + 2], l, func(n, vals));
+    }
+    return 1;
+}
+
+// Batched ops for functions with a batch kernel, whose pointer follows the result operand. When the kernel
+// declines the block, the per lane op is used instead.
+template <int nargs, Interpreter::OpF fallback>
+int FuncVKernelBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    ExprFuncStandard::FuncBatch* kernel = (ExprFuncStandard::FuncBatch*)(c[opData[nargs + 2]]);
+    const double* args[nargs];
+    for (int k = 0; k < nargs; k++) args[k] = fp + opData[k + 1] * W;
+    if (kernel(nargs, args, fp + opData[nargs + 1] * W, W)) return 1;
+    return fallback(opData, fp, c, callStack);
+}
+template <Interpreter::OpF fallback>
+int FuncNVKernelBatchOp(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+    int n = opData[1];
+    ExprFuncStandard::FuncBatch* kernel = (ExprFuncStandard::FuncBatch*)(c[opData[n + 3]]);
+    const double** args = static_cast<const double**>(alloca(n * sizeof(const double*)));
+    for (int k = 0; k < n; k++) args[k] = fp + opData[k + 2] * W;
+    if (kernel(n, args, fp + opData[n + 2] * W, W)) return 1;
+    return fallback(opData, fp, c, callStack);
+}
+
 int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* interpreter) const {
     std::vector<int> argOps;
     for (int c = 0; c < node->numChildren(); c++) {
@@ -153,67 +307,106 @@ int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* in
     int funcPtrLoc = interpreter->allocPtr();
     interpreter->s[funcPtrLoc] = (char*)_func;
 
-    Interpreter::OpF op = 0;
+    Interpreter::OpF op = 0, batchOp = 0;
     switch (_funcType) {
         case FUNC0:
             op = Func0Op;
+            batchOp = Func0BatchOp;
             break;
         case FUNC1:
             op = Func1Op;
+            batchOp = Func1BatchOp;
             break;
         case FUNC2:
             op = Func2Op;
+            batchOp = Func2BatchOp;
             break;
         case FUNC3:
             op = Func3Op;
+            batchOp = Func3BatchOp;
             break;
         case FUNC4:
             op = Func4Op;
+            batchOp = Func4BatchOp;
             break;
         case FUNC5:
             op = Func5Op;
+            batchOp = Func5BatchOp;
             break;
         case FUNC6:
             op = Func6Op;
+            batchOp = Func6BatchOp;
             break;
         case FUNCN:
             op = FuncNOp;
+            batchOp = FuncNBatchOp;
             break;
         case FUNC1V:
             op = Func1VOp;
+            batchOp = Func1VBatchOp;
             break;
         case FUNC2V:
             op = Func2VOp;
+            batchOp = Func2VBatchOp;
             break;
         case FUNCNV:
             op = FuncNVOp;
+            batchOp = FuncNVBatchOp;
             break;
         case FUNC1VV:
             op = Func1VVOp;
+            batchOp = Func1VVBatchOp;
             break;
         case FUNC2VV:
             op = Func2VVOp;
+            batchOp = Func2VVBatchOp;
             break;
         case FUNCNVV:
             op = FuncNVVOp;
+            batchOp = FuncNVVBatchOp;
             break;
         default:
             assert(false);
     }
+    int batchFuncPtrLoc = -1;
+    if (_batchFunc && _funcType >= VEC) {
+        batchFuncPtrLoc = interpreter->allocPtr();
+        interpreter->s[batchFuncPtrLoc] = (char*)_batchFunc;
+        switch (_funcType) {
+            case FUNC1V:
+                batchOp = FuncVKernelBatchOp<1, Func1VBatchOp>;
+                break;
+            case FUNC2V:
+                batchOp = FuncVKernelBatchOp<2, Func2VBatchOp>;
+                break;
+            case FUNCNV:
+                batchOp = FuncNVKernelBatchOp<FuncNVBatchOp>;
+                break;
+            case FUNC1VV:
+                batchOp = FuncVKernelBatchOp<1, Func1VVBatchOp>;
+                break;
+            case FUNC2VV:
+                batchOp = FuncVKernelBatchOp<2, Func2VVBatchOp>;
+                break;
+            default:
+                batchOp = FuncNVKernelBatchOp<FuncNVVBatchOp>;
+                break;
+        }
+    }
 
     if (_funcType < VEC) {
         retOp = interpreter->allocFP(node->type().dim());
         for (int k = 0; k < node->type().dim(); k++) {
-            interpreter->addOp(op);
-            interpreter->addOperand(funcPtrLoc);
-            if (_funcType == FUNCN) interpreter->addOperand(static_cast<int>(argOps.size()));
+            interpreter->addOp(op, batchOp);
+            interpreter->addOperand(funcPtrLoc, Interpreter::ReadPtr);
+            if (_funcType == FUNCN) interpreter->addOperand(static_cast<int>(argOps.size()), Interpreter::Immediate);
             for (size_t c = 0; c < argOps.size(); c++) {
                 if (node->child(c)->type().isFP(1))
-                    interpreter->addOperand(argOps[c]);
+                    interpreter->addOperand(argOps[c], Interpreter::ReadFP);
                 else
-                    interpreter->addOperand(argOps[c] + k);
+                    interpreter->addOperand(argOps[c] + k, Interpreter::ReadFP);
             }
-            interpreter->addOperand(retOp + k);
+            interpreter->addOperand(retOp + k, Interpreter::WriteFP);
             interpreter->endOp();
         }
     } else {
@@ -221,21 +414,23 @@ int ExprFuncStandard::buildInterpreter(const ExprFuncNode* node, Interpreter* in
         for (size_t c = 0; c < argOps.size(); c++)
             if (node->child(c)->type().dim() == 1) {
                 int promotedArgOp = interpreter->allocFP(3);
-                interpreter->addOp(Promote<3>::f);
-                interpreter->addOperand(argOps[c]);
-                interpreter->addOperand(promotedArgOp);
+                interpreter->addOp(Promote<3>::f, PromoteBatch<3>::f);
+                interpreter->addOperand(argOps[c], Interpreter::ReadFP);
+                interpreter->addOperand(promotedArgOp, Interpreter::WriteFP);
                 interpreter->endOp();
                 argOps[c] = promotedArgOp;
             }
         retOp = interpreter->allocFP(_funcType >= VECVEC ? 3 : 1);
 
-        interpreter->addOp(op);
-        interpreter->addOperand(funcPtrLoc);
-        if (_funcType == FUNCNV || _funcType == FUNCNVV) interpreter->addOperand(static_cast<int>(argOps.size()));
+        interpreter->addOp(op, batchOp);
+        interpreter->addOperand(funcPtrLoc, Interpreter::ReadPtr);
+        if (_funcType == FUNCNV || _funcType == FUNCNVV)
+            interpreter->addOperand(static_cast<int>(argOps.size()), Interpreter::Immediate);
         for (size_t c = 0; c < argOps.size(); c++) {
-            interpreter->addOperand(argOps[c]);
+            interpreter->addOperand(argOps[c], Interpreter::ReadFP);
         }
-        interpreter->addOperand(retOp);
+        interpreter->addOperand(retOp, Interpreter::WriteFP);
+        if (batchFuncPtrLoc >= 0) interpreter->addOperand(batchFuncPtrLoc, Interpreter::ReadPtr);
         interpreter->endOp();
     }
     if (Expression::debugging) {
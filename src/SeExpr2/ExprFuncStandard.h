@@ -61,6 +61,10 @@ class ExprFuncStandard : public ExprFuncX {
     typedef double Funcn(int n, double* params);
     typedef double Funcnv(int n, const Vec3d* params);
     typedef Vec3d Funcnvv(int n, const Vec3d* params);
+    //! Optional kernel for vector argumented functions evaluating a whole interpreter batch at once. args[i] and out
+    //! are structure of arrays with component k of lane l at [k*width+l]. Returning false makes the interpreter
+    //! evaluate the lanes one at a time with the regular function instead.
+    typedef bool FuncBatch(int n, const double* const* args, double* out, int width);
 
 #if 0
     Func0* func0() const { return (Func0*)_func; }
@@ -80,7 +84,7 @@ class ExprFuncStandard : public ExprFuncX {
 #endif
 
     //! No argument function
-    ExprFuncStandard(FuncType funcType, void* f) : ExprFuncX(true), _funcType(funcType), _func(f) {}
+    ExprFuncStandard(FuncType funcType, void* f) : ExprFuncX(true), _funcType(funcType), _func(f), _batchFunc(0) {}
 #if 0
     //! User defined function with prototype double f(double)
     ExprFunc(Func1* f)
@@ -137,16 +141,19 @@ class ExprFuncStandard : public ExprFuncX {
 #endif
 
   public:
-    ExprFuncStandard() : ExprFuncX(true) {}
+    ExprFuncStandard() : ExprFuncX(true), _batchFunc(0) {}
 
     virtual ExprType prep(ExprFuncNode* node, bool scalarWanted, ExprVarEnvBuilder& envBuilder) const;
     virtual int buildInterpreter(const ExprFuncNode* node, Interpreter* interpreter) const;
     void* getFuncPointer() const { return _func; }
     FuncType getFuncType() const { return _funcType; }
+    //! Set the batch kernel (see FuncBatch), only used for vector argumented functions
+    void setBatchFunc(FuncBatch* f) { _batchFunc = f; }
 
   private:
     FuncType _funcType;
     void* _func;  // blind func style
+    FuncBatch* _batchFunc;
 };
 }
 
@@ -19,8 +19,45 @@
 #include "Interpreter.h"
 #include "ExprNode.h"
 #include <cstdio>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
 
 namespace SeExpr2 {
+namespace {
+/// Scratch of one thread, by the serial of the data it goes with
+struct ScratchTable {
+    struct Entry {
+        std::weak_ptr<const void> alive;  ///< expires when the data (and so the node) is destroyed
+        std::unique_ptr<ExprFuncNode::Data> scratch;
+    };
+    std::unordered_map<uint64_t, Entry> entries;
+    /// Size after the last sweep for the entries of destroyed data
+    size_t sweptSize = 0;
+
+    void removeExpired() {
+        for (auto it = entries.begin(); it != entries.end();)
+            it = it->second.alive.expired() ? entries.erase(it) : std::next(it);
+        sweptSize = entries.size();
+    }
+};
+}
+
+ExprFuncNode::Data *ExprFuncSimple::scratch(const ArgHandle &args) const {
+    static thread_local ScratchTable table;
+    assert(args.data && "functions using scratch must return data from evalConstant");
+    auto it = table.entries.find(args.data->_serial);
+    if (it != table.entries.end()) return it->second.scratch.get();
+
+    // sweeping only once the table has doubled keeps the cost of inserting constant on average
+    if (table.entries.size() >= 2 * table.sweptSize + 16) table.removeExpired();
+    ExprFuncNode::Data *data = evalScratch(args.data);
+    ScratchTable::Entry &entry = table.entries[args.data->_serial];
+    entry.alive = args.data->_alive;
+    entry.scratch.reset(data);
+    return data;
+}
+
 int ExprFuncSimple::EvalOp(int *opData, double *fp, char **c, std::vector<int> &callStack) {
     ExprFuncSimple *simple = reinterpret_cast<ExprFuncSimple *>(c[opData[0]]);
     //    ExprFuncNode::Data* simpleData=reinterpret_cast<ExprFuncNode::Data*>(c[opData[1]]);
@@ -38,10 +75,11 @@ int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *inte
         std::cerr<<"we are "<<node->promote(c)<<" "<<c<<std::endl;
 #endif
         if (node->promote(c) != 0) {
-            interpreter->addOp(getTemplatizedOp<Promote>(node->promote(c)));
+            interpreter->addOp(getTemplatizedOp<Promote>(node->promote(c)),
+                               getTemplatizedOp<PromoteBatch>(node->promote(c)));
             int promotedOperand = interpreter->allocFP(node->promote(c));
-            interpreter->addOperand(operand);
-            interpreter->addOperand(promotedOperand);
+            interpreter->addOperand(operand, Interpreter::ReadFP);
+            interpreter->addOperand(promotedOperand, Interpreter::WriteFP);
             operand = promotedOperand;
             interpreter->endOp();
         }
@@ -61,12 +99,13 @@ int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *inte
     int ptrLoc = interpreter->allocPtr();
     int ptrDataLoc = interpreter->allocPtr();
     interpreter->s[ptrLoc] = (char *)this;
-    interpreter->addOperand(ptrLoc);
-    interpreter->addOperand(ptrDataLoc);
-    interpreter->addOperand(outoperand);
-    interpreter->addOperand(nargsData);
+    interpreter->addOperand(ptrLoc, Interpreter::ReadPtr);
+    interpreter->addOperand(ptrDataLoc, Interpreter::ReadPtr);
+    interpreter->addOperand(outoperand, node->type().isFP() ? Interpreter::WriteFP : Interpreter::WritePtr);
+    interpreter->addOperand(nargsData, Interpreter::ReadFP);
     for (size_t c = 0; c < operands.size(); c++) {
-        interpreter->addOperand(operands[c]);
+        interpreter->addOperand(operands[c],
+                                node->child(c)->type().isString() ? Interpreter::ReadPtr : Interpreter::ReadFP);
     }
     interpreter->endOp(false);  // do not eval because the function may not be evaluatable!
 
@@ -74,9 +113,13 @@ int ExprFuncSimple::buildInterpreter(const ExprFuncNode *node, Interpreter *inte
     int pc = interpreter->nextPC() - 1;
     int *opCurr = (&interpreter->opData[0]) + interpreter->ops[pc].second;
 
-    ArgHandle args(opCurr, &interpreter->d[0], &interpreter->s[0], interpreter->callStack);
-    ExprFuncNode::Data* data = evalConstant(node, args);
-    node->setData(data);
+    // programs built again from the same tree (e.g. for the LLVM backend) share the data built the first time
+    ExprFuncNode::Data* data = node->getData();
+    if (!data) {
+        ArgHandle args(opCurr, &interpreter->d[0], &interpreter->s[0], interpreter->callStack);
+        data = evalConstant(node, args);
+        node->setData(data);
+    }
     interpreter->s[ptrDataLoc] = reinterpret_cast<char *>(data);
 
     return outoperand;
@@ -107,10 +150,11 @@ extern "C" {
 // opdata[2] points to return value
 // opdata[3] points to number of args
 // opdata[4] points to beginning of arguments in
+// funcdata is the node's data, created at prep time, so this is reentrant and does no allocation.
 void SeExpr2LLVMEvalCustomFunction(int *opDataArg,
                                    double *fpArg,
                                    char **strArg,
-                                   void **funcdata,
+                                   void *funcdata,
                                    const SeExpr2::ExprFuncNode *node) {
     const SeExpr2::ExprFunc *func = node->func();
     SeExpr2::ExprFuncX *funcX = const_cast<SeExpr2::ExprFuncX *>(func->funcx());
@@ -118,15 +162,8 @@ void SeExpr2LLVMEvalCustomFunction(int *opDataArg,
 
     strArg[0] = reinterpret_cast<char *>(funcSimple);
 
-    std::vector<int> callStack;
-    SeExpr2::ExprFuncSimple::ArgHandle handle(opDataArg, fpArg, strArg, callStack);
-    if (!*funcdata) {
-        handle.data = funcSimple->evalConstant(node, handle);
-        *funcdata = reinterpret_cast<void *>(handle.data);
-        node->setData(handle.data);
-    } else {
-        handle.data = reinterpret_cast<SeExpr2::ExprFuncNode::Data *>(*funcdata);
-    }
+    SeExpr2::ExprFuncSimple::ArgHandle handle(opDataArg, fpArg, strArg);
+    handle.data = reinterpret_cast<SeExpr2::ExprFuncNode::Data *>(funcdata);
 
     funcSimple->eval(handle);
     // for (int i = 0; i < retSize; ++i) result[i] = fp[1 + i];
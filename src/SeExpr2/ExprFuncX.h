@@ -40,7 +40,7 @@ class ExprFuncX {
     //! in an expression then bool Expression::isThreadSafe() will return false
     //! and the controlling software should not attempt to run multiple threads
     //! of an expression.
-    ExprFuncX(const bool threadSafe) : _threadSafe(threadSafe) {}
+    ExprFuncX(const bool threadSafe) : _threadSafe(threadSafe), _pure(false) {}
 
     /** prep the expression by doing all type checking argument checking, etc. */
     virtual ExprType prep(ExprFuncNode* node, bool scalarWanted, ExprVarEnvBuilder& env) const = 0;
@@ -55,6 +55,12 @@ class ExprFuncX {
 
     bool isThreadSafe() const { return _threadSafe; }
 
+    //! A pure function has no side effects and its result only depends on its arguments, so calls
+    //! with constant arguments may be folded at prep time and calls with uniform arguments may be
+    //! evaluated once per evalMultiple range. Functions are not pure unless marked so.
+    bool isPure() const { return _pure; }
+    void setPure(bool pure) { _pure = pure; }
+
     /// Return memory usage of a funcX in bytes.
     virtual size_t sizeInBytes() const { return 0; }
 
@@ -67,6 +73,7 @@ class ExprFuncX {
 
   private:
     bool _threadSafe;
+    bool _pure;
 };
 
 class ExprFuncSimple : public ExprFuncX {
@@ -75,7 +82,10 @@ class ExprFuncSimple : public ExprFuncX {
 
     class ArgHandle {
       public:
-        ArgHandle(int* opData, double* fp, char** c, std::vector<int>& callStack)
+        ArgHandle(int* opData, double* fp, char** c, std::vector<int>& callStack) : ArgHandle(opData, fp, c) {}
+
+        /// Construct without a call stack (the call stack is unused by simple functions)
+        ArgHandle(int* opData, double* fp, char** c)
             : outFp(fp[opData[2]]), outStr(c[opData[2]]), data(reinterpret_cast<ExprFuncNode::Data*>(c[opData[1]])),
               // TODO: put the value in opData rather than fp
               _nargs((int)fp[opData[3]]),  // TODO: would be good not to have to convert to int!
@@ -112,6 +122,16 @@ class ExprFuncSimple : public ExprFuncX {
     virtual ExprFuncNode::Data* evalConstant(const ExprFuncNode* node, ArgHandle args) const = 0;
     virtual void eval(ArgHandle args) = 0;
 
+    /// Create the mutable per-thread state (e.g. a cache updated by eval()) that goes with the shared data returned
+    /// by evalConstant, which eval() must then treat as read only. Functions with scratch must return non-null data
+    /// from evalConstant.
+    virtual ExprFuncNode::Data* evalScratch(const ExprFuncNode::Data* data) const { return nullptr; }
+
+  protected:
+    /// The calling thread's scratch for the node being evaluated, created by evalScratch on first use and kept
+    /// until the node's data is destroyed (then freed by a later call on the same thread).
+    ExprFuncNode::Data* scratch(const ArgHandle& args) const;
+
   private:
     static int EvalOp(int* opData, double* fp, char** c, std::vector<int>& callStack);
 };
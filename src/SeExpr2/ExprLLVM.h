@@ -19,6 +19,9 @@
 #include "ExprConfig.h"
 
 #ifdef SEEXPR_ENABLE_LLVM
+#include <map>
+#include <string>
+#include <vector>
 #include <llvm/IR/IRBuilder.h>
 namespace llvm {
 class Value;
@@ -29,6 +32,29 @@ class Function;
 typedef llvm::Value* LLVM_VALUE;
 typedef llvm::IRBuilder<>& LLVM_BUILDER;
 #define LLVM_BODY const
+
+namespace SeExpr2 {
+class ExprNode;
+
+/// The builder every codegen of a parse tree starts from. It also keeps the state of that code generation, since
+/// shared programs (see ExprProgramCache) let several compiles of one parse tree run at once.
+class LLVMCodegenBuilder : public llvm::IRBuilder<> {
+  public:
+    explicit LLVMCodegenBuilder(llvm::BasicBlock* block) : llvm::IRBuilder<>(block) {}
+
+    /// Value computed by each ExprSharedNode generated so far, read by its ExprReuseNodes
+    std::map<const ExprNode*, llvm::Value*> sharedValues;
+
+    /// Load address (custom function data, an ExprVarRef, ...) as a char*. The IR reads it from the external
+    /// global addressName(i), where i is its index in addresses, rather than embedding it, so that the IR (and
+    /// the object cache key) is the same in every process. The engine maps the globals when it loads the code.
+    llvm::Value* CreateAddress(const void* address);
+    static std::string addressName(size_t index);
+
+    /// Every address passed to CreateAddress, in the order of their globals
+    std::vector<const void*> addresses;
+};
+}
 #else
 typedef double LLVM_VALUE;
 typedef double LLVM_BUILDER;
@@ -23,6 +23,7 @@
 #include "ExprFunc.h"
 #include "VarBlock.h"
 #include "StringUtils.h"
+#include <algorithm>
 #include <array>
 using namespace llvm;
 using namespace SeExpr2;
@@ -36,6 +37,12 @@ Function *llvm_getFunction(LLVM_BUILDER Builder) { return Builder.GetInsertBlock
 
 Module *llvm_getModule(LLVM_BUILDER Builder) { return llvm_getFunction(Builder)->getParent(); }
 
+//! Load address through a global the engine resolves (see LLVMCodegenBuilder::CreateAddress)
+LLVM_VALUE createAddress(LLVM_BUILDER Builder, const void *address) {
+    // parse trees are only generated from an LLVMCodegenBuilder (see LLVMEvaluator::prepLLVM)
+    return static_cast<LLVMCodegenBuilder &>(Builder).CreateAddress(address);
+}
+
 //! Turn LLVM type into a std::string, convenience to work around needing to use raw_string_ostream everywhere
 std::string llvmTypeString(llvm::Type *type) {
     std::string myString;
@@ -392,6 +399,9 @@ LLVM_VALUE callPrintf(const ExprFuncNode *seFunc, LLVM_BUILDER Builder, Function
     return ConstantFP::get(Type::getDoubleTy(llvmContext), 0.0);
 }
 
+//! Name of the external declaration used to call the ExprFuncStandard of funcNode
+std::string standardFunctionSymbol(const ExprFuncNode *funcNode) { return std::string("SeExpr2Std_") + funcNode->name(); }
+
 // TODO: not good. need better implementation.
 LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder) {
     LLVMContext &llvmContext = Builder.getContext();
@@ -486,9 +496,9 @@ LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder
     // get the module from the builder
     Module* module = llvm_getModule(Builder);
 
-    // TODO: thread safety?
-    // TODO: This leaks!
-    GlobalVariable *dataGV = new GlobalVariable(*module, int8PtrTy, false, GlobalValue::InternalLinkage, ConstantPointerNull::get(int8PtrTy));
+    // the per-node data was built by LLVMEvaluator::prepLLVM before codegen and is never written by the generated
+    // code, which reads its address (and the node's) from globals resolved at load time
+    LLVM_VALUE dataPtr = createAddress(Builder, funcNode->getData());
 
     // call the function
     Builder.CreateCall(
@@ -497,8 +507,8 @@ LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder
             opDataArg,
             fpArg,
             strArg,
-            dataGV,
-            ConstantInt::get(int64Ty, (uint64_t)funcNode)
+            dataPtr,
+            Builder.CreatePtrToInt(createAddress(Builder, funcNode), int64Ty)
         }
     );
 
@@ -524,11 +534,45 @@ LLVM_VALUE callCustomFunction(const ExprFuncNode *funcNode, LLVM_BUILDER Builder
 }
 }
 
+namespace SeExpr2 {
+std::string LLVMCodegenBuilder::addressName(size_t index) { return "_seexpr_address" + std::to_string(index); }
+
+Value *LLVMCodegenBuilder::CreateAddress(const void *address) {
+    Module *module = GetInsertBlock()->getModule();
+    Type *int8PtrTy = getInt8PtrTy();
+    size_t index = std::find(addresses.begin(), addresses.end(), address) - addresses.begin();
+    if (index == addresses.size()) {
+        addresses.push_back(address);
+        new GlobalVariable(*module, int8PtrTy, true, GlobalValue::ExternalLinkage, nullptr, addressName(index));
+    }
+    return CreateLoad(int8PtrTy, module->getNamedGlobal(addressName(index)));
+}
+}
+
 extern "C" void SeExpr2LLVMEvalFPVarRef(ExprVarRef *seVR, double *result) { seVR->eval(result); }
 extern "C" void SeExpr2LLVMEvalStrVarRef(ExprVarRef *seVR, char **result) { seVR->eval((const char **)result); }
+extern "C" char *SeExpr2LLVMConcatStrings(ExprStringArena *strings, const char *a, const char *b) {
+    strings->reset();
+    return strings->concatenate(a, b);
+}
+extern "C" int SeExpr2LLVMStringsEqual(const char *a, const char *b) { return a == b || strcmp(a, b) == 0; }
+extern "C" double SeExpr2LLVMHalfToDouble(uint16_t half) { return halfToFloat(half); }
+extern "C" uint16_t SeExpr2LLVMDoubleToHalf(double value) { return floatToHalf(static_cast<float>(value)); }
 
 namespace SeExpr2 {
 
+void mapStandardFunctions(llvm::ExecutionEngine &engine, llvm::Module &module, const ExprNode *node) {
+    if (const ExprFuncNode *funcNode = dynamic_cast<const ExprFuncNode *>(node)) {
+        const ExprFuncStandard *standfunc =
+            funcNode->func() ? dynamic_cast<const ExprFuncStandard *>(funcNode->func()->funcx()) : nullptr;
+        if (standfunc) {
+            if (Function *decl = module.getFunction(standardFunctionSymbol(funcNode)))
+                engine.addGlobalMapping(decl, standfunc->getFuncPointer());
+        }
+    }
+    for (int c = 0; c < node->numChildren(); c++) mapStandardFunctions(engine, module, node->child(c));
+}
+
 LLVM_VALUE promoteToDim(LLVM_VALUE val, unsigned dim, LLVM_BUILDER Builder) {
     Type *srcTy = val->getType();
     if (srcTy->isVectorTy() || dim <= 1) return val;
@@ -600,42 +644,10 @@ LLVM_VALUE ExprBinaryOpNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
             }
         }
     } else {
-        // precompute a few things
-        LLVMContext &context    = Builder.getContext();
-        Module      *module     = llvm_getModule(Builder);
-        PointerType *i8PtrPtrTy = PointerType::getUnqual(Type::getInt8PtrTy(context));
-        Type        *i32Ty      = Type::getInt32Ty(context);
-        Function    *strlen     = module->getFunction("strlen");
-        Function    *malloc     = module->getFunction("malloc");
-        Function    *free       = module->getFunction("free");
-        Function    *memset     = module->getFunction("memset");
-        Function    *strcat     = module->getFunction("strcat");
-
-        // do magic (see the pseudo C code on the comments at the end
-        // of each LLVM instruction)
-
-        // compute the length of the operand strings
-        LLVM_VALUE len1 = Builder.CreateCall(strlen, { op1 });              // len1 = strlen(op1);
-        LLVM_VALUE len2 = Builder.CreateCall(strlen, { op2 });              // len2 = strlen(op2);
-        LLVM_VALUE len = Builder.CreateAdd(len1, len2);                     // len = len1 + len2;
-
-        // allocate and clear memory
-        LLVM_VALUE alloc = Builder.CreateCall(malloc, { len });             // alloc = malloc(len1 + len2);
-        LLVM_VALUE zero = ConstantInt::get(i32Ty, 0);                       // zero = 0;
-        Builder.CreateCall(memset, { alloc, zero, len });                   // memset(alloc, zero, len);
-
-        // concatenate operand strings into output string
-        Builder.CreateCall(strcat, { alloc, op1 });                         // strcat(alloc, op1);
-        LLVM_VALUE newAlloc = Builder.CreateGEP(nullptr, alloc, len1);      // newAlloc = alloc + len1
-        Builder.CreateCall(strcat, { newAlloc, op2 });                      // strcat(alloc, op2);
-
-        // store the address in the node's _out member so that it will be
-        // cleaned up when the expression is destroyed.
-        APInt outAddr = APInt(64, (uint64_t)&_out);
-        LLVM_VALUE out = Constant::getIntegerValue(i8PtrPtrTy, outAddr);    // out = &_out;
-        Builder.CreateCall(free, { Builder.CreateLoad(out) });              // free(*out);
-        Builder.CreateStore(alloc, out);                                    // *out = alloc
-        return alloc;
+        // concatenate into the node's arena, which keeps the result until the next evaluation
+        LLVM_VALUE strings = createAddress(Builder, &_strings);
+        Function *concatFun = llvm_getModule(Builder)->getFunction("SeExpr2LLVMConcatStrings");
+        return Builder.CreateCall(concatFun, {strings, op1, op2});
     }
 
     assert(false && "unexpected op");
@@ -662,6 +674,15 @@ LLVM_VALUE ExprLocalVar::codegen(LLVM_BUILDER Builder, const std::string &varNam
 }
 
 LLVM_VALUE ExprCompareEqNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+    if (child(0)->type().isString()) {
+        LLVM_VALUE str1 = child(0)->codegen(Builder);
+        LLVM_VALUE str2 = child(1)->codegen(Builder);
+        Function *equalFun = llvm_getModule(Builder)->getFunction("SeExpr2LLVMStringsEqual");
+        LLVM_VALUE equal = Builder.CreateICmpNE(Builder.CreateCall(equalFun, {str1, str2}), Builder.getInt32(0));
+        if (_op == '!') equal = Builder.CreateNot(equal);
+        return Builder.CreateUIToFP(equal, Type::getDoubleTy(Builder.getContext()));
+    }
+
     LLVM_VALUE op1 = getFirstElement(child(0)->codegen(Builder), Builder);
     LLVM_VALUE op2 = getFirstElement(child(1)->codegen(Builder), Builder);
 
@@ -842,9 +863,11 @@ LLVM_VALUE ExprFuncNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     // get function pointer
     ExprFuncStandard::FuncType seFuncType = standfunc->getFuncType();
     FunctionType *llvmFuncType = getSeExprFuncStandardLLVMType(seFuncType, llvmContext);
-    void *fp = standfunc->getFuncPointer();
-    ConstantInt *funcAddr = ConstantInt::get(Type::getInt64Ty(llvmContext), (uint64_t)fp);
-    LLVM_VALUE addrVal = Builder.CreateIntToPtr(funcAddr, PointerType::getUnqual(llvmFuncType));
+    // call through a named declaration bound by mapStandardFunctions, so the generated code holds no process
+    // specific addresses and can be reused from the object cache
+    std::string symbol = standardFunctionSymbol(this);
+    LLVM_VALUE addrVal = M->getFunction(symbol);
+    if (!addrVal) addrVal = Function::Create(llvmFuncType, GlobalValue::ExternalLinkage, symbol, M);
 
     // Collect distribution positions
     std::vector<LLVM_VALUE> args = codegenFuncCallArgs(Builder, this);
@@ -1015,6 +1038,21 @@ LLVM_VALUE ExprStrNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     return Builder.CreateGlobalStringPtr(unescapeString(_str));
 }
 
+LLVM_VALUE ExprUniformNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+    return child(0)->codegen(Builder);
+}
+
+LLVM_VALUE ExprSharedNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+    // parse trees are only generated from an LLVMCodegenBuilder (see LLVMEvaluator::prepLLVM)
+    return static_cast<LLVMCodegenBuilder&>(Builder).sharedValues[this] = child(0)->codegen(Builder);
+}
+
+LLVM_VALUE ExprReuseNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
+    std::map<const ExprNode*, Value*>& sharedValues = static_cast<LLVMCodegenBuilder&>(Builder).sharedValues;
+    assert(sharedValues.count(_shared) && "Reused a value before computing it");
+    return sharedValues[_shared];
+}
+
 LLVM_VALUE ExprSubscriptNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
     LLVM_VALUE op1 = child(0)->codegen(Builder);
     LLVM_VALUE op2 = child(1)->codegen(Builder);
@@ -1056,7 +1094,6 @@ struct VarCodeGeneration {
         LLVMContext &llvmContext = Builder.getContext();
 
         // a few types
-        Type *int64Ty           = Type::getInt64Ty(llvmContext);    // int64_t
         Type *doubleTy          = Type::getDoubleTy(llvmContext);   // double
         PointerType *int8PtrTy  = Type::getInt8PtrTy(llvmContext);  // char *
 
@@ -1070,7 +1107,7 @@ struct VarCodeGeneration {
         // get our eval var function, and call it with a pointer to our var ref and a ref to the return value
         Function *evalVarFunc = llvm_getModule(Builder)->getFunction(isDouble == true ? "SeExpr2LLVMEvalFPVarRef" : "SeExpr2LLVMEvalStrVarRef");
         Builder.CreateCall(evalVarFunc, {
-           Builder.CreateIntToPtr(ConstantInt::get(int64Ty, (uint64_t)varRef), int8PtrTy),
+           createAddress(Builder, varRef),
            returnValue
         });
 
@@ -1089,46 +1126,63 @@ struct VarCodeGeneration {
         return ret;
     }
 
-    static LLVM_VALUE codegen(VarBlockCreator::Ref *varRef, const std::string &varName, LLVM_BUILDER Builder) {
+    static LLVM_VALUE codegen(VarBlockCreator::Ref *varRef,
+                              const std::string &varName,
+                              bool floatIO,
+                              LLVM_BUILDER Builder) {
         LLVMContext &llvmContext = Builder.getContext();
+        Type *doubleTy = Type::getDoubleTy(llvmContext);
+        Type *int8PtrTy = Type::getInt8PtrTy(llvmContext);
+        Type *int64Ty = Type::getInt64Ty(llvmContext);
+
+        int dim = varRef->type().dim();
+        VarBinding binding = varRef->binding().resolved(floatIO, dim);
+        Type *elementTy = doubleTy;
+        if (binding.elementType == VarBinding::Float)
+            elementTy = Type::getFloatTy(llvmContext);
+        else if (binding.elementType == VarBinding::Int32)
+            elementTy = Type::getInt32Ty(llvmContext);
+        else if (binding.elementType == VarBinding::Half)
+            elementTy = Type::getInt16Ty(llvmContext);
+        uint64_t elementSize = VarBinding::elementSize(binding.elementType);
 
         int variableOffset = varRef->offset();
-        int variableStride = varRef->stride();
         Function *function = llvm_getFunction(Builder);
         auto argIterator = function->arg_begin();
         argIterator++;  // skip first arg
         llvm::Argument *variableBlock = &*(argIterator++);
         llvm::Argument *indirectIndex = &*(argIterator++);
 
-        int dim = varRef->type().dim();
-
-        Type *ptrToPtrTy = variableBlock->getType();
+        Type *ptrToPtrTy = PointerType::getUnqual(int8PtrTy);
         Value *variableBlockAsPtrPtr = Builder.CreatePointerCast(variableBlock, ptrToPtrTy);
-        Value *variableOffsetIndex = ConstantInt::get(Type::getInt32Ty(llvmContext), variableOffset);
-        Value *variableBlockIndirectPtrPtr = Builder.CreateInBoundsGEP(variableBlockAsPtrPtr, variableOffsetIndex);
-        Value *baseMemory = Builder.CreateLoad(variableBlockIndirectPtrPtr);
-        Value *variableStrideValue = ConstantInt::get(Type::getInt32Ty(llvmContext), variableStride);
-        if (dim == 1) {
-            /// If we are uniform always assume indirectIndex is 0 (there's only one value)
-            Value *variablePointer =
-                varRef->type().isLifetimeUniform() ? baseMemory : Builder.CreateInBoundsGEP(baseMemory, indirectIndex);
-            return Builder.CreateLoad(variablePointer);
-        } else {
-            std::vector<Value *> loadedValues(dim);
-            for (int component = 0; component < dim; component++) {
-                Value *componentIndex = ConstantInt::get(Type::getInt32Ty(llvmContext), component);
-                /// If we are uniform always assume indirectIndex is 0 (there's only one value)
-                Value *variablePointer =
-                    varRef->type().isLifetimeUniform()
-                        ? Builder.CreateInBoundsGEP(Type::getDoubleTy(llvmContext), baseMemory, componentIndex)
-                        : Builder.CreateInBoundsGEP(
-                              Type::getDoubleTy(llvmContext),
-                              baseMemory,
-                              Builder.CreateAdd(Builder.CreateMul(indirectIndex, variableStrideValue), componentIndex));
-                loadedValues[component] = Builder.CreateLoad(variablePointer, varName);
-            }
-            return createVecVal(Builder, loadedValues, varName);
+        /// If we are uniform always assume indirectIndex is 0 (there's only one value)
+        Value *pointOffset = varRef->type().isLifetimeUniform()
+                                 ? ConstantInt::get(int64Ty, 0)
+                                 : Builder.CreateMul(Builder.CreateZExt(indirectIndex, int64Ty),
+                                                     ConstantInt::get(int64Ty, binding.byteStride));
+
+        std::vector<Value *> loadedValues(dim);
+        for (int component = 0; component < dim; component++) {
+            // soa bindings have one data pointer per component, otherwise components follow each other
+            int pointerIndex = variableOffset + (binding.soa ? component : 0);
+            uint64_t componentOffset = binding.soa ? 0 : component * elementSize;
+            Value *pointerIndexValue = ConstantInt::get(Type::getInt32Ty(llvmContext), pointerIndex);
+            LoadInst *baseMemory = Builder.CreateLoad(Builder.CreateInBoundsGEP(variableBlockAsPtrPtr, pointerIndexValue));
+            // the data pointers do not change during evaluation, which lets the evalMultiple loop hoist this load
+            baseMemory->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(llvmContext, None));
+            Value *address = Builder.CreateInBoundsGEP(
+                baseMemory, Builder.CreateAdd(pointOffset, ConstantInt::get(int64Ty, componentOffset)));
+            Value *loaded =
+                Builder.CreateLoad(Builder.CreatePointerCast(address, PointerType::getUnqual(elementTy)), varName);
+            if (binding.elementType == VarBinding::Float)
+                loaded = Builder.CreateFPExt(loaded, doubleTy);
+            else if (binding.elementType == VarBinding::Int32)
+                loaded = Builder.CreateSIToFP(loaded, doubleTy);
+            else if (binding.elementType == VarBinding::Half)
+                loaded = Builder.CreateCall(llvm_getModule(Builder)->getFunction("SeExpr2LLVMHalfToDouble"), {loaded});
+            loadedValues[component] = loaded;
         }
+        return dim == 1 ? loadedValues[0] : createVecVal(Builder, loadedValues, varName);
     }
 };
 
@@ -1142,7 +1196,8 @@ LLVM_VALUE ExprVarNode::codegen(LLVM_BUILDER Builder) LLVM_BODY {
         // if (LLVM_VALUE valPtr = resolveLocalVar(varName.c_str(), Builder))
         //     return Builder.CreateLoad(valPtr);
         if (VarBlockCreator::Ref *varBlockRef = dynamic_cast<VarBlockCreator::Ref *>(_var))
-            return VarCodeGeneration::codegen(varBlockRef, varName, Builder);
+            return VarCodeGeneration::codegen(
+                varBlockRef, varName, _expr && _expr->ioPrecision() == Expression::FloatIO, Builder);
         else
             return VarCodeGeneration::codegen(_var, varName, Builder);
     } else if (_localVar) {
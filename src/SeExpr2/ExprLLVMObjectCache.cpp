@@ -0,0 +1,112 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#include "ExprLLVMObjectCache.h"
+
+#ifdef SEEXPR_ENABLE_LLVM
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace SeExpr2 {
+
+ExprLLVMObjectCache* ExprLLVMObjectCache::forDirectory(const std::string& directory) {
+    // compiles in flight may still use a cache, so caches are never deleted
+    static std::mutex mutex;
+    static std::map<std::string, ExprLLVMObjectCache*> caches;
+    if (directory.empty()) return nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    ExprLLVMObjectCache*& cache = caches[directory];
+    if (!cache && !llvm::sys::fs::create_directories(directory)) cache = new ExprLLVMObjectCache(directory);
+    return cache;
+}
+
+std::atomic<ExprLLVMObjectCache*>& ExprLLVMObjectCache::current() {
+    static std::atomic<ExprLLVMObjectCache*> cache([]() {
+        const char* directory = getenv("SE_EXPR_OBJECT_CACHE");
+        return forDirectory(directory ? directory : "");
+    }());
+    return cache;
+}
+
+ExprLLVMObjectCache* ExprLLVMObjectCache::instance() { return current().load(); }
+
+bool ExprLLVMObjectCache::setDirectory(const std::string& directory) {
+    ExprLLVMObjectCache* cache = forDirectory(directory);
+    if (!cache && !directory.empty()) return false;
+    current().store(cache);
+    return true;
+}
+
+void ExprLLVMObjectCache::setKey(llvm::Module& module) const {
+    // the identifier is part of the printed IR, so clear it before hashing
+    module.setModuleIdentifier("");
+    std::string ir;
+    llvm::raw_string_ostream irStream(ir);
+    module.print(irStream, nullptr);
+    irStream.flush();
+
+    llvm::MD5 hash;
+    hash.update(ir);
+    hash.update(module.getTargetTriple());
+    hash.update(llvm::sys::getHostCPUName());
+    hash.update(LLVM_VERSION_STRING);
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    llvm::SmallString<32> digest;
+    llvm::MD5::stringifyResult(result, digest);
+    module.setModuleIdentifier(digest.str());
+}
+
+std::string ExprLLVMObjectCache::path(const llvm::Module& module) const {
+    return _directory + "/" + module.getModuleIdentifier() + ".o";
+}
+
+bool ExprLLVMObjectCache::hasObject(const llvm::Module& module) const {
+    return llvm::sys::fs::exists(path(module));
+}
+
+void ExprLLVMObjectCache::notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) {
+    // write to a unique temporary and rename so concurrent jobs never see a partial object
+    int fd;
+    llvm::SmallString<256> tempPath;
+    if (llvm::sys::fs::createUniqueFile(path(*module) + "-%%%%%%.tmp", fd, tempPath)) return;
+    {
+        llvm::raw_fd_ostream out(fd, true);
+        out << object.getBuffer();
+    }
+    if (llvm::sys::fs::rename(tempPath, path(*module)))
+        llvm::sys::fs::remove(tempPath);
+    else
+        _stores++;
+}
+
+std::unique_ptr<llvm::MemoryBuffer> ExprLLVMObjectCache::getObject(const llvm::Module* module) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > buffer = llvm::MemoryBuffer::getFile(path(*module));
+    if (!buffer) return nullptr;
+    _hits++;
+    return std::move(*buffer);
+}
+}
+#endif
@@ -0,0 +1,69 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#ifndef ExprLLVMObjectCache_h
+#define ExprLLVMObjectCache_h
+
+#include "ExprConfig.h"
+
+#ifdef SEEXPR_ENABLE_LLVM
+#include <atomic>
+#include <string>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+
+namespace SeExpr2 {
+
+/// On-disk cache of the object code MCJIT generates for expressions. Enabled by pointing the environment
+/// variable SE_EXPR_OBJECT_CACHE at a writable directory, or by setDirectory(). Objects are keyed by a hash of the
+/// unoptimized IR, the target triple and host CPU, and the LLVM version. The IR refers to process specific
+/// addresses (external ExprVarRefs, custom functions) through globals the engine resolves when loading the
+/// object, so those expressions hit too.
+class ExprLLVMObjectCache : public llvm::ObjectCache {
+  public:
+    /// The process-wide cache, or null if it is disabled
+    static ExprLLVMObjectCache* instance();
+    /// Cache the objects of later compiles in directory instead of SE_EXPR_OBJECT_CACHE, or disable the cache if
+    /// directory is empty. Returns false if the directory could not be created. Caches used before stay valid.
+    static bool setDirectory(const std::string& directory);
+
+    /// Number of objects loaded from the directory instead of being compiled
+    size_t hits() const { return _hits; }
+    /// Number of compiled objects stored in the directory
+    size_t stores() const { return _stores; }
+
+    /// Name the module after the hash of its (unoptimized) IR. Call before optimizing and handing it to MCJIT.
+    void setKey(llvm::Module& module) const;
+    /// True if an object is stored for the module's key, in which case optimizing the IR can be skipped
+    bool hasObject(const llvm::Module& module) const;
+
+    void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override;
+
+  private:
+    explicit ExprLLVMObjectCache(const std::string& directory) : _directory(directory), _hits(0), _stores(0) {}
+    /// The cache of directory, made on first use and then kept for the life of the process
+    static ExprLLVMObjectCache* forDirectory(const std::string& directory);
+    /// The cache instance() returns, initially the one of SE_EXPR_OBJECT_CACHE
+    static std::atomic<ExprLLVMObjectCache*>& current();
+    std::string path(const llvm::Module& module) const;
+
+    std::string _directory;
+    std::atomic<size_t> _hits, _stores;
+};
+}
+#endif
+
+#endif
@@ -15,15 +15,20 @@
  http://www.apache.org/licenses/LICENSE-2.0
 */
 #include "ExprMultiExpr.h"
+#include "ExprThreadPool.h"
+#include "ExprNode.h"
+#include "Interpreter.h"
 #include <algorithm>
 #include <set>
 
 namespace SeExpr2 {
 class GlobalVal : public ExprVarRef {
   public:
-    GlobalVal(const std::string &varName, const SeExpr2::ExprType &et) : ExprVarRef(et), varName(varName) {}
-    std::set<DExpression *> users;
+    GlobalVal(const std::string &varName, const SeExpr2::ExprType &et)
+        : ExprVarRef(et), varName(varName), loopVariable(false) {}
+    std::vector<DExpression *> users;
     std::string varName;
+    bool loopVariable;
 };
 
 struct GlobalFP : public GlobalVal {
@@ -51,37 +56,26 @@ struct GlobalStr : public GlobalVal {
 
 namespace {
 
-std::set<SeExpr2::DExpression *> getAffectedExpr(SeExpr2::GlobalVal *gv) {
-    std::set<SeExpr2::DExpression *> ret;
-
-    std::set<SeExpr2::DExpression *> workList = gv->users;
-    while (workList.size()) {
-        SeExpr2::DExpression *de = *workList.begin();
-        workList.erase(de);
-        ret.insert(de);
-        workList.insert(de->val->users.begin(), de->val->users.end());
-    }
-
-    return ret;
+template <class T>
+void insertUnique(std::vector<T> &list, T value) {
+    if (std::find(list.begin(), list.end(), value) == list.end()) list.push_back(value);
 }
 
-std::set<SeExpr2::DExpression *> getTransitiveOperandExpr(SeExpr2::DExpression *expr) {
-    std::set<SeExpr2::DExpression *> ret;
-
-    std::set<SeExpr2::DExpression *> workList;
-    workList.insert(expr);
-    while (workList.size()) {
-        SeExpr2::DExpression *de = *workList.begin();
-        workList.erase(de);
-        ret.insert(de);
-        workList.insert(de->operandExprs.begin(), de->operandExprs.end());
+bool levelOrder(const SeExpr2::DExpression *a, const SeExpr2::DExpression *b) { return a->level < b->level; }
+
+/// Set the loop variant flag of every expression depending on gv (the ones already set have theirs set too)
+void markLoopVariant(SeExpr2::GlobalVal *gv) {
+    std::vector<SeExpr2::GlobalVal *> workList(1, gv);
+    while (!workList.empty()) {
+        SeExpr2::GlobalVal *val = workList.back();
+        workList.pop_back();
+        for (SeExpr2::DExpression *user : val->users)
+            if (!user->loopVariant) {
+                user->loopVariant = true;
+                workList.push_back(user->val);
+            }
     }
-
-    return ret;
 }
-
-std::set<SeExpr2::DExpression *> tmpOperandExprs;
-std::set<SeExpr2::GlobalVal *> tmpOperandVars;
 }
 
 namespace SeExpr2 {
@@ -91,7 +85,7 @@ DExpression::DExpression(const std::string &varName,
                          const std::string &e,
                          const ExprType &type,
                          EvaluationStrategy be)
-    : Expression(e, type, be), context(context) {
+    : Expression(e, type, be), context(context), level(0), dirty(true), loopVariant(false), _markId(0) {
     if (type.isFP())
         val = new GlobalFP(varName, type.dim());
     else if (type.isString())
@@ -99,37 +93,61 @@ DExpression::DExpression(const std::string &varName,
     else
         assert(false);
 
-    operandExprs = context.AllExprs;
-    operandVars = context.AllExternalVars;
+    // resolves the operands, which must already be in the context
     prepIfNeeded();
-    operandExprs = tmpOperandExprs;
-    operandVars = tmpOperandVars;
+    for (DExpression *operand : operandExprs) {
+        level = std::max(level, operand->level + 1);
+        loopVariant |= operand->loopVariant;
+    }
+    for (GlobalVal *operand : operandVars) loopVariant |= operand->loopVariable;
 }
 
+DExpression::~DExpression() { delete val; }
+
 const std::string &DExpression::name() const { return val->varName; }
 
 ExprVarRef *DExpression::resolveVar(const std::string &name) const {
-    // first time resolve var from all exprs & vars
-    // then resolve var from used exprs & vars
-    for (std::set<DExpression *>::iterator I = operandExprs.begin(), E = operandExprs.end(); I != E; ++I)
-        if ((*I)->name() == name) {
-            tmpOperandExprs.insert(*I);
-            (*I)->val->users.insert(const_cast<DExpression *>(this));
-            return (*I)->val;
-        }
+    DExpression *self = const_cast<DExpression *>(this);
+    std::map<std::string, DExpression *>::const_iterator expr = context._exprsByName.find(name);
+    if (expr != context._exprsByName.end()) {
+        insertUnique(operandExprs, expr->second);
+        insertUnique(expr->second->val->users, self);
+        return expr->second->val;
+    }
 
-    for (std::set<GlobalVal *>::iterator I = operandVars.begin(), E = operandVars.end(); I != E; ++I)
-        if ((*I)->varName == name) {
-            tmpOperandVars.insert(*I);
-            (*I)->users.insert(const_cast<DExpression *>(this));
-            return *I;
-        }
+    std::map<std::string, GlobalVal *>::const_iterator var = context._varsByName.find(name);
+    if (var != context._varsByName.end()) {
+        insertUnique(operandVars, var->second);
+        insertUnique(var->second->users, self);
+        return var->second;
+    }
 
     addError(name + " fail resolveVar", 0, 0);
     return 0;
 }
 
+int DExpression::buildInterpreter(Interpreter *interpreter) const {
+    // local function bodies would have to come before the start of the whole program
+    if (!isValid() || _parseTree->numChildren() != 1) return -1;
+
+    int loc = _parseTree->child(0)->buildInterpreter(interpreter);
+    if (_desiredReturnType.isFP()) {
+        int dimWanted = _desiredReturnType.dim();
+        if (dimWanted > _parseTree->type().dim()) {
+            interpreter->addOp(getTemplatizedOp<Promote>(dimWanted), getTemplatizedOp<PromoteBatch>(dimWanted));
+            int promoted = interpreter->allocFP(dimWanted);
+            interpreter->addOperand(loc, Interpreter::ReadFP);
+            interpreter->addOperand(promoted, Interpreter::WriteFP);
+            interpreter->endOp();
+            loc = promoted;
+        }
+    }
+    interpreter->varRefToLoc[val] = loc;
+    return loc;
+}
+
 void DExpression::eval() {
+    dirty = false;
     if (_desiredReturnType.isFP()) {
         const double *ret = evalFP();
         GlobalFP *fpVal = dynamic_cast<GlobalFP *>(val);
@@ -142,12 +160,65 @@ void DExpression::eval() {
     strVal->val = evalStr();
 }
 
+struct Expressions::FusedProgram {
+    Interpreter interpreter;
+    InterpreterScratch scratch;
+    int returnSlot;
+};
+
 Expressions::~Expressions() {
+    clearFused();
     for (std::set<DExpression *>::iterator I = AllExprs.begin(), E = AllExprs.end(); I != E; ++I) delete *I;
 
     for (std::set<GlobalVal *>::iterator I = AllExternalVars.begin(), E = AllExternalVars.end(); I != E; ++I) delete *I;
 }
 
+void Expressions::markDirty(GlobalVal *gv) {
+    // fused programs leave the intermediate expressions dirty while their users are clean, so every dependent
+    // expression is visited rather than stopping at dirty ones
+    unsigned markId = ++_markId;
+    std::vector<GlobalVal *> workList(1, gv);
+    while (!workList.empty()) {
+        GlobalVal *val = workList.back();
+        workList.pop_back();
+        for (DExpression *user : val->users)
+            if (user->_markId != markId) {
+                user->_markId = markId;
+                user->dirty = true;
+                workList.push_back(user->val);
+            }
+    }
+}
+
+void Expressions::evalLevels(const std::vector<DExpression *> &exprs) {
+    std::vector<DExpression *> dirty;
+    for (size_t begin = 0, end; begin < exprs.size(); begin = end) {
+        dirty.clear();
+        for (end = begin; end < exprs.size() && exprs[end]->level == exprs[begin]->level; end++)
+            if (exprs[end]->dirty) dirty.push_back(exprs[end]);
+
+        // a level only runs in parallel if none of its expressions calls thread unsafe functions
+        bool parallel = dirty.size() >= std::max<size_t>(parallelLevelSize, 2);
+        for (size_t i = 0; parallel && i < dirty.size(); i++) parallel = dirty[i]->isThreadSafe();
+        if (!parallel) {
+            for (DExpression *expr : dirty) expr->eval();
+        } else {
+            ExprThreadPool::instance().parallelFor(0, dirty.size(), 1, 0, [&](int, size_t first, size_t last) {
+                for (size_t i = first; i < last; i++) dirty[i]->eval();
+            });
+        }
+    }
+}
+
+void Expressions::evalLoopInvariant() {
+    std::vector<DExpression *> exprs;
+    for (const std::vector<DExpression *> &level : _levels)
+        for (DExpression *expr : level)
+            if (expr->dirty && !expr->loopVariant) exprs.push_back(expr);
+    evalLevels(exprs);
+    _invariantDirty = false;
+}
+
 VariableHandle Expressions::addExternalVariable(const std::string &variableName, ExprType seTy) {
     std::pair<std::set<GlobalVal *>::iterator, bool> ret;
 
@@ -158,23 +229,25 @@ VariableHandle Expressions::addExternalVariable(const std::string &variableName,
     else
         assert(false);
 
+    _varsByName.insert(std::make_pair(variableName, *ret.first));
     return ret.first;
 }
 
 ExprHandle Expressions::addExpression(const std::string &varName, ExprType seTy, const std::string &expr) {
-    std::pair<std::set<DExpression *>::iterator, bool> ret;
-    ret = AllExprs.insert(new DExpression(varName, *this, expr, seTy));
-    return ret.first;
+    DExpression *de = new DExpression(varName, *this, expr, seTy);
+    if (_levels.size() <= static_cast<size_t>(de->level)) _levels.resize(de->level + 1);
+    _levels[de->level].push_back(de);
+    _exprsByName.insert(std::make_pair(varName, de));
+    _invariantDirty = true;
+    return AllExprs.insert(de).first;
 }
 
 VariableSetHandle Expressions::getLoopVarSetHandle(VariableHandle vh) {
     GlobalVal *thisvar = *vh;
-    unsigned initSize = static_cast<unsigned>(thisvar->users.size());
-    if (!initSize) return AllExternalVars.end();
+    if (thisvar->users.empty()) return AllExternalVars.end();
 
-    std::set<DExpression *> ret = getAffectedExpr(thisvar);
-    exprToEval.insert(ret.begin(), ret.end());
-    // std::cout << "exprToEval size is " << exprToEval.size() << std::endl;
+    thisvar->loopVariable = true;
+    markLoopVariant(thisvar);
     return vh;
 }
 
@@ -186,6 +259,7 @@ void Expressions::setLoopVariable(VariableSetHandle handle, double *values, unsi
 
     assert(dim == thisvar->val.size());
     for (unsigned i = 0; i < dim; ++i) thisvar->val[i] = values[i];
+    markDirty(thisvar);
 }
 
 void Expressions::setLoopVariable(VariableSetHandle handle, const char *values) {
@@ -194,6 +268,7 @@ void Expressions::setLoopVariable(VariableSetHandle handle, const char *values)
     GlobalStr *thisvar = dynamic_cast<GlobalStr *>(*handle);
     assert(thisvar && "set value to variable with incompatible types.");
     thisvar->val = values;
+    markDirty(thisvar);
 }
 
 void Expressions::setVariable(VariableHandle handle, double *values, unsigned dim) {
@@ -203,9 +278,9 @@ void Expressions::setVariable(VariableHandle handle, double *values, unsigned di
     assert(dim == thisvar->val.size());
     for (unsigned i = 0; i < dim; ++i) thisvar->val[i] = values[i];
 
-    // eval loop invariant now.
-    std::set<DExpression *> ret = getAffectedExpr(thisvar);
-    for (std::set<DExpression *>::iterator I = ret.begin(), E = ret.end(); I != E; ++I) (*I)->eval();
+    // loop invariant expressions are recomputed by the next evaluation
+    markDirty(thisvar);
+    _invariantDirty = true;
 }
 
 void Expressions::setVariable(VariableHandle handle, const char *values) {
@@ -213,9 +288,9 @@ void Expressions::setVariable(VariableHandle handle, const char *values) {
     assert(thisvar && "set value to variable with incompatible types.");
     thisvar->val = values;
 
-    // eval loop invariant now.
-    std::set<DExpression *> ret = getAffectedExpr(thisvar);
-    for (std::set<DExpression *>::iterator I = ret.begin(), E = ret.end(); I != E; ++I) (*I)->eval();
+    // loop invariant expressions are recomputed by the next evaluation
+    markDirty(thisvar);
+    _invariantDirty = true;
 }
 
 bool Expressions::isValid() const {
@@ -226,44 +301,87 @@ bool Expressions::isValid() const {
 }
 
 ExprEvalHandle Expressions::getExprEvalHandle(ExprHandle eh) {
-    // std::cout << "exprToEval size is " << exprToEval.size() << std::endl;
-
-    DExpression *de = *eh;
-    std::set<DExpression *> all = getTransitiveOperandExpr(de);
-    // std::cout << "all size is " << all.size() << std::endl;
-
-    std::vector<DExpression *>::iterator it;
-
-    std::vector<DExpression *> ret1(all.size());
-    it = std::set_intersection(all.begin(), all.end(), exprToEval.begin(), exprToEval.end(), ret1.begin());
-    ret1.resize(it - ret1.begin());
+    // collect the loop variant expressions eh depends on, the loop invariant ones are kept up to date separately
+    std::vector<DExpression *> ret(1, *eh);
+    if (!(*eh)->loopVariant) ret.clear();
+    for (size_t i = 0; i < ret.size(); i++)
+        for (DExpression *operand : ret[i]->operandExprs)
+            if (operand->loopVariant) insertUnique(ret, operand);
+    std::stable_sort(ret.begin(), ret.end(), levelOrder);
+    ExprEvalHandle eeh = std::make_pair(eh, ret);
+    if (fuseHandles) fuse(eeh);
+    return eeh;
+}
 
-    std::vector<DExpression *> ret2(ret1.size());
-    it = std::set_difference(ret1.begin(), ret1.end(), exprEvaled.begin(), exprEvaled.end(), ret2.begin());
-    ret2.resize(it - ret2.begin());
+bool Expressions::fuse(const ExprEvalHandle &eeh) {
+    DExpression *de = *eeh.first;
+    if (eeh.second.empty() || _fused.count(de)) return !eeh.second.empty();
+
+    // expressions compiled by the JIT keep running their own code
+    for (DExpression *expr : eeh.second)
+        if (expr->evaluationStrategy() != Expression::UseInterpreter) return false;
+
+    FusedProgram *program = new FusedProgram;
+    Interpreter &interpreter = program->interpreter;
+    program->returnSlot = -1;
+    for (DExpression *expr : eeh.second) {
+        program->returnSlot = expr->buildInterpreter(&interpreter);
+        if (program->returnSlot < 0) {
+            delete program;
+            return false;
+        }
+    }
+    bool isFP = de->_desiredReturnType.isFP();
+    interpreter.fuseOps(program->returnSlot, isFP);
+    program->returnSlot = interpreter.compactRegisters(program->returnSlot, isFP);
+    interpreter.assemble();
+    _fused[de] = program;
+    return true;
+}
 
-    exprEvaled.insert(ret2.begin(), ret2.end());
+void Expressions::evalHandle(const ExprEvalHandle &eeh) {
+    if (_invariantDirty) evalLoopInvariant();
+
+    DExpression *de = *eeh.first;
+    std::map<DExpression *, FusedProgram *>::iterator fused = _fused.find(de);
+    if (fused == _fused.end()) {
+        evalLevels(eeh.second);
+    } else if (de->dirty) {
+        FusedProgram *program = fused->second;
+        program->interpreter.eval(nullptr, program->scratch);
+        if (GlobalFP *fpVal = dynamic_cast<GlobalFP *>(de->val)) {
+            const double *ret = program->scratch.d.data() + program->returnSlot;
+            fpVal->val.assign(ret, ret + fpVal->val.size());
+        } else {
+            dynamic_cast<GlobalStr *>(de->val)->val = program->scratch.s[program->returnSlot];
+        }
+        de->dirty = false;
+    }
+}
 
-    // std::cout << "ret2 size is " << ret2.size() << std::endl;
-    return std::make_pair(eh, ret2);
+void Expressions::clearFused() {
+    for (std::map<DExpression *, FusedProgram *>::iterator I = _fused.begin(), E = _fused.end(); I != E; ++I)
+        delete I->second;
+    _fused.clear();
 }
 
 const std::vector<double> &Expressions::evalFP(ExprEvalHandle eeh) {
-    // std::cout << "eeh.second.size() is " << eeh.second.size() << std::endl;
-    for (std::vector<DExpression *>::iterator I = eeh.second.begin(), E = eeh.second.end(); I != E; ++I) (*I)->eval();
+    evalHandle(eeh);
 
     GlobalFP *thisvar = dynamic_cast<GlobalFP *>((*eeh.first)->val);
-
-    //    std::cout << thisvar->val[0] << ","
-    //            << thisvar->val[1] << ","
-    //            << thisvar->val[2] << std::endl;
     return thisvar->val;
 }
 
 const char *Expressions::evalStr(ExprEvalHandle eeh) {
-    for (std::vector<DExpression *>::iterator I = eeh.second.begin(), E = eeh.second.end(); I != E; ++I) (*I)->eval();
+    evalHandle(eeh);
 
     GlobalStr *thisvar = dynamic_cast<GlobalStr *>((*eeh.first)->val);
     return thisvar->val;
 }
+
+void Expressions::resetEval() {
+    for (const std::vector<DExpression *> &level : _levels)
+        for (DExpression *expr : level) expr->dirty = true;
+    _invariantDirty = true;
+}
 }
@@ -14,6 +14,9 @@
  You may obtain a copy of the License at
  http://www.apache.org/licenses/LICENSE-2.0
 */
+#include <map>
+#include <set>
+#include <vector>
 #include "Expression.h"
 
 namespace SeExpr2 {
@@ -21,13 +24,16 @@ namespace SeExpr2 {
 class DExpression;
 class GlobalVal;
 class Expressions;
+class Interpreter;
 
 typedef std::set<GlobalVal*>::iterator VariableHandle;
 typedef std::set<GlobalVal*>::iterator VariableSetHandle;
 typedef std::set<DExpression*>::iterator ExprHandle;
 typedef std::pair<ExprHandle, std::vector<DExpression*> > ExprEvalHandle;
 
+/// One expression of an Expressions graph, whose result is a variable other expressions of the graph can use
 class DExpression : public Expression {
+    friend class Expressions;
     Expressions& context;
 
   public:
@@ -36,26 +42,72 @@ class DExpression : public Expression {
                 const std::string& e,
                 const ExprType& type = ExprType().FP(3),
                 EvaluationStrategy be = defaultEvaluationStrategy);
+    ~DExpression();
 
-    mutable std::set<DExpression*> operandExprs;
-    mutable std::set<GlobalVal*> operandVars;
+    /// Expressions and external variables this expression uses, filled in while it is prepped
+    mutable std::vector<DExpression*> operandExprs;
+    mutable std::vector<GlobalVal*> operandVars;
 
     GlobalVal* val;
     const std::string& name() const;
     ExprVarRef* resolveVar(const std::string& name) const;
     void eval();
+
+    /// Position in the graph's topological order: 0 without operand expressions, else one more than the deepest
+    /// operand. Expressions of the same level don't depend on each other.
+    int level;
+    /// True if the result is out of date with the variables and expressions it uses
+    bool dirty;
+    /// True if the expression depends on a loop variable (see Expressions::getLoopVarSetHandle)
+    bool loopVariant;
+
+  private:
+    /// Append the code computing this expression to a program that already computes its operand expressions
+    /// (bound in interpreter->varRefToLoc), bind the result and return its register, or -1 if the expression
+    /// is invalid or defines local functions
+    int buildInterpreter(Interpreter* interpreter) const;
+
+    /// Last Expressions::markDirty traversal that visited this expression
+    unsigned _markId;
 };
 
+/// A dependency graph of named expressions that use each other and external variables. The graph is leveled
+/// topologically as expressions are added. Setting a variable marks the expressions that depend on it dirty, and
+/// the next evalFP or evalStr recomputes only dirty expressions, one level at a time, with the expressions of a
+/// large level evaluated in parallel on the ExprThreadPool unless one of them is not thread safe.
 class Expressions {
-    std::set<DExpression*> exprToEval;
-    std::set<DExpression*> exprEvaled;
+    friend class DExpression;
+
+    /// Expressions of each level, in the order they were added
+    std::vector<std::vector<DExpression*> > _levels;
+    /// Name lookup for resolving variables of new expressions, which may only use ones added before them
+    std::map<std::string, DExpression*> _exprsByName;
+    std::map<std::string, GlobalVal*> _varsByName;
+    /// True if some loop invariant expression may be dirty
+    bool _invariantDirty;
+    unsigned _markId;
+
+    /// One program computing the loop variant part of a handle (see fuse())
+    struct FusedProgram;
+    std::map<DExpression*, FusedProgram*> _fused;
+
+    void markDirty(GlobalVal* gv);
+    void evalLevels(const std::vector<DExpression*>& exprs);
+    void evalLoopInvariant();
+    void evalHandle(const ExprEvalHandle& eeh);
+    void clearFused();
 
   public:
     std::set<DExpression*> AllExprs;
     std::set<GlobalVal*> AllExternalVars;
 
+    /// Levels with at least this many dirty expressions are evaluated in parallel
+    size_t parallelLevelSize;
+    /// If true, getExprEvalHandle fuses the expressions of every handle into one program (see fuse())
+    bool fuseHandles;
+
     // Expressions(int numberOfEvals=1);
-    Expressions() {}
+    Expressions() : _invariantDirty(false), _markId(0), parallelLevelSize(16), fuseHandles(false) {}
     ~Expressions();
 
     VariableHandle addExternalVariable(const std::string& variableName, ExprType seTy);
@@ -74,17 +126,29 @@ class Expressions {
     void getErrors(std::vector<std::string>& errors) const;
     // bool isVariableUsed(VariableHandle variableHandle) const;
 
+    /// The handle holds the expression and, in topological order, the loop variant expressions it depends on
+    /// (itself included), which are the ones evalFP and evalStr may have to recompute.
     ExprEvalHandle getExprEvalHandle(ExprHandle eh);
     const std::vector<double>& evalFP(ExprEvalHandle eeh);
     const char* evalStr(ExprEvalHandle eeh);
 
-    void resetEval() {
-        exprToEval.clear();
-        exprEvaled.clear();
-    }
+    /// Compile the loop variant expressions of eeh into a single interpreter program that keeps intermediate
+    /// results in registers and only writes the value of the handle's expression, which evalFP and evalStr then
+    /// run whenever that value is dirty. Loop invariant operands are still read from their hoisted values.
+    /// Returns false, leaving the handle evaluated expression by expression, if there is nothing to fuse (the
+    /// handle's expression is loop invariant) or one of the expressions is invalid, defines local functions or
+    /// is not evaluated with the interpreter (UseLLVM and UseTiered expressions keep their JIT compiled code).
+    bool fuse(const ExprEvalHandle& eeh);
+
+    /// Mark every expression dirty, so that all are recomputed when next needed
+    void resetEval();
 
     void reset() {
-        resetEval();
+        clearFused();
+        _levels.clear();
+        _exprsByName.clear();
+        _varsByName.clear();
+        _invariantDirty = false;
         AllExprs.clear();
         AllExternalVars.clear();
     }
@@ -19,6 +19,7 @@
 #include <math.h>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
 #endif
 #include "Vec.h"
 #include "ExprType.h"
@@ -530,6 +531,23 @@ ExprType ExprStrNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     return _type;
 }
 
+uint64_t ExprFuncNode::Data::nextSerial() {
+    static std::atomic<uint64_t> serial(0);
+    return ++serial;
+}
+
+ExprType ExprUniformNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
+    setType(child(0)->prep(wantScalar, envBuilder));
+    return _type;
+}
+
+ExprType ExprSharedNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
+    setType(child(0)->prep(wantScalar, envBuilder));
+    return _type;
+}
+
+ExprType ExprReuseNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) { return _type; }
+
 ExprType ExprFuncNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
     bool error = false;
 
@@ -556,6 +574,7 @@ ExprType ExprFuncNode::prep(bool wantScalar, ExprVarEnvBuilder& envBuilder) {
             const ExprFuncX* funcx = _func->funcx();
             ExprType type = funcx->prep(this, wantScalar, envBuilder);
             setTypeWithChildLife(type);
+            if (!funcx->isThreadSafe()) _expr->setThreadUnsafe(_name);
         } else {                                // didn't match num args or function not found
             ExprNode::prep(false, envBuilder);  // prep arguments anyways to catch as many errors as possible!
             setTypeWithChildLife(ExprType().Error());
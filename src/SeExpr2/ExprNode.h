@@ -19,6 +19,7 @@
 #define ExprNode_h
 
 #include <cstdlib>
+#include <memory>
 
 // TODO: get rid of makedepends everywhere
 #ifndef MAKEDEPEND
@@ -32,6 +33,7 @@
 #include "Expression.h"
 #include "ExprType.h"
 #include "ExprEnv.h"
+#include "ExprStringTable.h"
 #include "Vec.h"
 #include "Interpreter.h"
 
@@ -95,6 +97,9 @@ class ExprNode {
 
     virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
 
+    /// Estimated memory held by this node, not counting its children or its ExprFuncNode::Data
+    virtual size_t sizeInBytes() const { return nodeSizeInBytes(sizeof(ExprNode)); }
+
     /// True if node has a vector result.
     bool isVec() const { return _isVec; }
 
@@ -133,6 +138,15 @@ class ExprNode {
         }
     }
 
+    /// Replace child i with newChild and return the old child, which the caller now owns
+    ExprNode* replaceChild(size_t i, ExprNode* newChild) {
+        assert(i < _children.size());
+        ExprNode* oldChild = _children[i];
+        _children[i] = newChild;
+        newChild->_parent = this;
+        return oldChild;
+    }
+
     /// Add a child to the child list (for parser use only)
     void addChild(ExprNode* child);
 
@@ -168,6 +182,9 @@ class ExprNode {
     inline void addError(const std::string& error) const { _expr->addError(error, _startPos, _endPos); }
 
   protected: /*protected functions*/
+    /// Memory held by a node object of objectSize bytes and its child list
+    size_t nodeSizeInBytes(size_t objectSize) const { return objectSize + _children.capacity() * sizeof(ExprNode*); }
+
     //! Set type of parameter
     inline void setType(const ExprType& t) {
         _type = t;
@@ -293,6 +310,11 @@ class ExprPrototypeNode : public ExprNode {
     /// Return op for interpreter
     int interpreterOps(int c) const { return _interpreterOps.at(c); }
 
+    virtual size_t sizeInBytes() const {
+        return nodeSizeInBytes(sizeof(*this)) + _name.capacity() + _argTypes.capacity() * sizeof(ExprType) +
+               _interpreterOps.capacity() * sizeof(int);
+    }
+
   private:
     std::string _name;
     bool _retTypeSet;
@@ -369,6 +391,7 @@ class ExprAssignNode : public ExprNode {
         return _assignedType;
     };
     const ExprLocalVar* localVar() const { return _localVar; }
+    virtual size_t sizeInBytes() const { return nodeSizeInBytes(sizeof(*this)) + _name.capacity(); }
 
   private:
     std::string _name;
@@ -450,15 +473,16 @@ class ExprCompareNode : public ExprNode {
 /// Node that implements an binary operator
 class ExprBinaryOpNode : public ExprNode {
   public:
-    ExprBinaryOpNode(const Expression* expr, ExprNode* a, ExprNode* b, char op) : ExprNode(expr, a, b), _op(op), _out(0) {}
-    virtual ~ExprBinaryOpNode() { free(_out); }
+    ExprBinaryOpNode(const Expression* expr, ExprNode* a, ExprNode* b, char op) : ExprNode(expr, a, b), _op(op) {}
 
     virtual ExprType prep(bool wantScalar, ExprVarEnvBuilder& envBuilder);
     virtual int buildInterpreter(Interpreter* interpreter) const;
     virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
+    virtual size_t sizeInBytes() const { return nodeSizeInBytes(sizeof(*this)) + _strings.sizeInBytes(); }
 
     char _op;
-    char* _out;
+    /// Holds the result of a string concatenation in LLVM generated code, which has no per-evaluation arena
+    mutable ExprStringArena _strings;
 };
 
 /// Node that references a variable
@@ -475,6 +499,7 @@ class ExprVarNode : public ExprNode {
     const char* name() const { return _name.c_str(); }
     const ExprLocalVar* localVar() const { return _localVar; }
     const ExprVarRef* var() const { return _var; }
+    virtual size_t sizeInBytes() const { return nodeSizeInBytes(sizeof(*this)) + _name.capacity(); }
 
   private:
     std::string _name;
@@ -508,11 +533,61 @@ class ExprStrNode : public ExprNode {
     virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
     const char* str() const { return _str.c_str(); }
     void str(const char* newstr) { _str = newstr; }
+    virtual size_t sizeInBytes() const { return nodeSizeInBytes(sizeof(*this)) + _str.capacity(); }
 
   private:
     std::string _str;
 };
 
+/// Node inserted after prep around a uniform subtree (see hoistUniforms). The interpreter evaluates the
+/// subtree once per evaluation, or once per range in evalMultiple, and reuses the result afterwards.
+class ExprUniformNode : public ExprNode {
+  public:
+    ExprUniformNode(const Expression* expr, ExprNode* subtree) : ExprNode(expr, subtree) {
+        setType(subtree->type());
+        _isVec = subtree->isVec();
+        setPosition(subtree->startPos(), subtree->endPos());
+    }
+
+    virtual ExprType prep(bool wantScalar, ExprVarEnvBuilder& envBuilder);
+    virtual int buildInterpreter(Interpreter* interpreter) const;
+    virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
+};
+
+/// Node inserted after prep around a subtree whose value ExprReuseNodes elsewhere in the tree read instead of
+/// computing it again (see eliminateCommonSubexpressions). It is always evaluated before them.
+class ExprSharedNode : public ExprNode {
+  public:
+    ExprSharedNode(const Expression* expr, ExprNode* subtree)
+        : ExprNode(expr, subtree) {
+        setType(subtree->type());
+        _isVec = subtree->isVec();
+        setPosition(subtree->startPos(), subtree->endPos());
+    }
+
+    virtual ExprType prep(bool wantScalar, ExprVarEnvBuilder& envBuilder);
+    virtual int buildInterpreter(Interpreter* interpreter) const;
+    virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
+};
+
+/// Node that replaced a subtree computing the same value as an ExprSharedNode evaluated before it
+class ExprReuseNode : public ExprNode {
+  public:
+    ExprReuseNode(const Expression* expr, const ExprSharedNode* shared) : ExprNode(expr), _shared(shared) {
+        setType(shared->type());
+        _isVec = shared->isVec();
+    }
+
+    virtual ExprType prep(bool wantScalar, ExprVarEnvBuilder& envBuilder);
+    virtual int buildInterpreter(Interpreter* interpreter) const;
+    virtual LLVM_VALUE codegen(LLVM_BUILDER) LLVM_BODY;
+
+    const ExprSharedNode* shared() const { return _shared; }
+
+  private:
+    const ExprSharedNode* _shared;
+};
+
 /// Node that calls a function
 class ExprFuncNode : public ExprNode {
   public:
@@ -532,6 +607,9 @@ class ExprFuncNode : public ExprNode {
 
     const char* name() const { return _name.c_str(); }
     bool checkArg(int argIndex, ExprType type, ExprVarEnvBuilder& envBuilder);
+    virtual size_t sizeInBytes() const {
+        return nodeSizeInBytes(sizeof(*this)) + _name.capacity() + _promote.capacity() * sizeof(int);
+    }
 
 #if 0
     virtual void eval(Vec3d& result) const;
@@ -568,9 +646,18 @@ class ExprFuncNode : public ExprNode {
 
     //! base class for custom instance data
     struct Data {
-        Data(bool cleanup = false) : _cleanup(cleanup) {}
+        Data(bool cleanup = false) : _cleanup(cleanup), _serial(nextSerial()), _alive(std::make_shared<char>()) {}
         virtual ~Data() {}
         bool _cleanup;
+        //! Unique for the life of the process (unlike the address), used to key per-thread scratch
+        const uint64_t _serial;
+        //! Released with the data, so per-thread scratch can tell (through a weak_ptr) that the data is gone
+        const std::shared_ptr<const void> _alive;
+        //! Estimated memory held by the data, to be overridden by data holding more than a Data
+        virtual size_t sizeInBytes() const { return sizeof(Data); }
+
+      private:
+        static uint64_t nextSerial();
     };
 
     //! associate blind data with this node (subsequently owned by this object)
@@ -579,9 +666,12 @@ class ExprFuncNode : public ExprNode {
         associated with a specific evaluation point of a function.
         Examples would be tokenized values,
         sorted lists for binary searches in curve evaluation, etc. This should be done
-        in ExprFuncX::prep().
+        in ExprFuncX::prep(). Data the node owned (see Data::_cleanup) is deleted when replaced.
     */
-    void setData(Data* data) const { _data = data; }
+    void setData(Data* data) const {
+        if (_data != nullptr && _data != data && _data->_cleanup == true) delete _data;
+        _data = data;
+    }
 
     //! get associated blind data (returns 0 if none)
     /***
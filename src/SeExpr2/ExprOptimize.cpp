@@ -0,0 +1,278 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#include "ExprOptimize.h"
+#include "ExprNode.h"
+#include "ExprFunc.h"
+#include "Interpreter.h"
+#include <functional>
+#include <typeinfo>
+#include <unordered_map>
+
+namespace SeExpr2 {
+
+namespace {
+
+/// True if node computes the same value every time it is evaluated within one evaluation context.
+/// External variables are only accepted when allowVars is set; local variables never are.
+bool isInvariant(const ExprNode* node, bool allowVars) {
+    if (dynamic_cast<const ExprNumNode*>(node) || dynamic_cast<const ExprStrNode*>(node)) return true;
+
+    if (const ExprVarNode* var = dynamic_cast<const ExprVarNode*>(node)) return allowVars && var->var() != 0;
+
+    if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(node)) {
+        if (!func->func() || !func->func()->isPure()) return false;
+    } else if (!dynamic_cast<const ExprVecNode*>(node) && !dynamic_cast<const ExprUnaryOpNode*>(node) &&
+               !dynamic_cast<const ExprCondNode*>(node) && !dynamic_cast<const ExprSubscriptNode*>(node) &&
+               !dynamic_cast<const ExprCompareNode*>(node) && !dynamic_cast<const ExprCompareEqNode*>(node) &&
+               !dynamic_cast<const ExprUniformNode*>(node) &&
+               !(dynamic_cast<const ExprBinaryOpNode*>(node) && node->type().isFP())) {
+        return false;
+    }
+
+    for (int c = 0; c < node->numChildren(); c++)
+        if (!isInvariant(node->child(c), allowVars)) return false;
+    return true;
+}
+
+/// Local function bodies are prepped per call site and refer to their parameters, so leave them alone
+bool isFunctionDefinition(const ExprNode* node) {
+    return dynamic_cast<const ExprLocalFunctionNode*>(node) || dynamic_cast<const ExprPrototypeNode*>(node);
+}
+
+bool isLiteral(const ExprNode* node) {
+    if (dynamic_cast<const ExprNumNode*>(node)) return true;
+    if (!dynamic_cast<const ExprVecNode*>(node)) return false;
+    for (int c = 0; c < node->numChildren(); c++)
+        if (!dynamic_cast<const ExprNumNode*>(node->child(c))) return false;
+    return true;
+}
+
+/// Evaluate a constant subtree with a throwaway interpreter and build the literal that replaces it
+ExprNode* evaluateToLiteral(const ExprNode* node, ExprVarEnvBuilder& envBuilder) {
+    Interpreter interpreter;
+    interpreter.setPCStart(0);
+    int loc = node->buildInterpreter(&interpreter);
+    InterpreterScratch scratch;
+    interpreter.eval(0, scratch);
+
+    const Expression* expr = node->expr();
+    int dim = node->type().dim();
+    ExprNode* literal = 0;
+    if (dim == 1) {
+        literal = new ExprNumNode(expr, scratch.d[loc]);
+    } else {
+        literal = new ExprVecNode(expr);
+        for (int k = 0; k < dim; k++) {
+            ExprNode* component = new ExprNumNode(expr, scratch.d[loc + k]);
+            component->setPosition(node->startPos(), node->endPos());
+            literal->addChild(component);
+        }
+    }
+    literal->setPosition(node->startPos(), node->endPos());
+    literal->prep(false, envBuilder);
+    return literal;
+}
+
+/// The subtree whose value node stands for, looking through the nodes added by common subexpression elimination
+const ExprNode* resolveShared(const ExprNode* node) {
+    if (const ExprReuseNode* reuse = dynamic_cast<const ExprReuseNode*>(node)) node = reuse->shared();
+    if (dynamic_cast<const ExprSharedNode*>(node)) node = node->child(0);
+    return node;
+}
+
+/// True if node computes a value from its children alone (no assignments, local function calls or side effects)
+bool isPureNode(const ExprNode* node) {
+    if (dynamic_cast<const ExprNumNode*>(node) || dynamic_cast<const ExprStrNode*>(node) ||
+        dynamic_cast<const ExprVarNode*>(node) || dynamic_cast<const ExprVecNode*>(node) ||
+        dynamic_cast<const ExprUnaryOpNode*>(node) || dynamic_cast<const ExprCondNode*>(node) ||
+        dynamic_cast<const ExprSubscriptNode*>(node) || dynamic_cast<const ExprCompareNode*>(node) ||
+        dynamic_cast<const ExprCompareEqNode*>(node) || dynamic_cast<const ExprUniformNode*>(node) ||
+        dynamic_cast<const ExprSharedNode*>(node) || dynamic_cast<const ExprReuseNode*>(node))
+        return true;
+    if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(node))
+        return func->func() && func->func()->isPure();
+    return dynamic_cast<const ExprBinaryOpNode*>(node) && node->type().isFP();
+}
+
+bool isPureTree(const ExprNode* node) {
+    if (!isPureNode(node)) return false;
+    for (int c = 0; c < node->numChildren(); c++)
+        if (!isPureTree(node->child(c))) return false;
+    return true;
+}
+
+/// Operator, value, variable or function that distinguishes node from others of its kind
+size_t nodeAttributeHash(const ExprNode* node) {
+    if (const ExprNumNode* num = dynamic_cast<const ExprNumNode*>(node)) return std::hash<double>()(num->value());
+    if (const ExprStrNode* str = dynamic_cast<const ExprStrNode*>(node)) return std::hash<std::string>()(str->str());
+    if (const ExprVarNode* var = dynamic_cast<const ExprVarNode*>(node))
+        return std::hash<const void*>()(var->localVar()) ^ std::hash<const void*>()(var->var());
+    if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(node)) return std::hash<const void*>()(func->func());
+    if (const ExprUnaryOpNode* op = dynamic_cast<const ExprUnaryOpNode*>(node)) return op->_op;
+    if (const ExprBinaryOpNode* op = dynamic_cast<const ExprBinaryOpNode*>(node)) return op->_op;
+    if (const ExprCompareNode* op = dynamic_cast<const ExprCompareNode*>(node)) return op->_op;
+    if (const ExprCompareEqNode* op = dynamic_cast<const ExprCompareEqNode*>(node)) return op->_op;
+    return 0;
+}
+
+size_t structuralHash(const ExprNode* node) {
+    node = resolveShared(node);
+    size_t hash = typeid(*node).hash_code() * 31 + nodeAttributeHash(node);
+    hash = hash * 31 + node->type().dim();
+    for (int c = 0; c < node->numChildren(); c++) hash = hash * 31 + structuralHash(node->child(c));
+    return hash;
+}
+
+bool sameAttributes(const ExprNode* a, const ExprNode* b) {
+    if (const ExprNumNode* num = dynamic_cast<const ExprNumNode*>(a))
+        return num->value() == static_cast<const ExprNumNode*>(b)->value();
+    if (const ExprStrNode* str = dynamic_cast<const ExprStrNode*>(a))
+        return std::string(str->str()) == static_cast<const ExprStrNode*>(b)->str();
+    if (const ExprVarNode* var = dynamic_cast<const ExprVarNode*>(a))
+        return var->localVar() == static_cast<const ExprVarNode*>(b)->localVar() &&
+               var->var() == static_cast<const ExprVarNode*>(b)->var();
+    if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(a))
+        return func->func() == static_cast<const ExprFuncNode*>(b)->func();
+    return nodeAttributeHash(a) == nodeAttributeHash(b);
+}
+
+bool sameTree(const ExprNode* a, const ExprNode* b) {
+    a = resolveShared(a);
+    b = resolveShared(b);
+    if (a == b) return true;
+    if (typeid(*a) != typeid(*b) || !(a->type() == b->type()) || a->numChildren() != b->numChildren() ||
+        !sameAttributes(a, b))
+        return false;
+    for (int c = 0; c < a->numChildren(); c++)
+        if (!sameTree(a->child(c), b->child(c))) return false;
+    return true;
+}
+
+/// True if child c of node is only evaluated on some paths through node
+bool isConditionalChild(const ExprNode* node, int c) {
+    if (dynamic_cast<const ExprCondNode*>(node) || dynamic_cast<const ExprIfThenElseNode*>(node)) return c > 0;
+    if (const ExprCompareNode* compare = dynamic_cast<const ExprCompareNode*>(node))
+        return c > 0 && (compare->_op == '&' || compare->_op == '|');
+    return false;
+}
+
+/// Value numbering over the tree in evaluation order, with the subtrees computed so far on every path to the
+/// current node available for reuse
+class CommonSubexpressions {
+  public:
+    CommonSubexpressions() : _replaced(0) {}
+
+    void eliminate(ExprNode* parent, int c) {
+        ExprNode* node = parent->child(c);
+        if (isFunctionDefinition(node) || dynamic_cast<ExprUniformNode*>(node)) return;
+
+        bool candidate = node->type().isFP() && node->numChildren() > 0 && isPureTree(node);
+        size_t hash = candidate ? structuralHash(node) : 0;
+        if (candidate) {
+            typedef std::unordered_multimap<size_t, ExprNode*>::iterator Iterator;
+            std::pair<Iterator, Iterator> range = _available.equal_range(hash);
+            for (Iterator it = range.first; it != range.second; ++it) {
+                if (sameTree(it->second, node)) {
+                    ExprNode* reuse = new ExprReuseNode(node->expr(), share(it->second));
+                    reuse->setPosition(node->startPos(), node->endPos());
+                    delete parent->replaceChild(c, reuse);
+                    _replaced++;
+                    return;
+                }
+            }
+        }
+
+        for (int k = 0; k < node->numChildren(); k++) {
+            size_t scope = _scope.size();
+            eliminate(node, k);
+            // subtrees in a branch are unavailable outside of it
+            if (isConditionalChild(node, k)) {
+                for (size_t i = scope; i < _scope.size(); i++) {
+                    std::pair<std::unordered_multimap<size_t, ExprNode*>::iterator,
+                              std::unordered_multimap<size_t, ExprNode*>::iterator> range =
+                        _available.equal_range(_scope[i].first);
+                    for (; range.first != range.second; ++range.first)
+                        if (range.first->second == _scope[i].second) {
+                            _available.erase(range.first);
+                            break;
+                        }
+                }
+                _scope.resize(scope);
+            }
+        }
+        if (candidate) {
+            _available.insert(std::make_pair(hash, node));
+            _scope.push_back(std::make_pair(hash, node));
+        }
+    }
+
+    int replaced() const { return _replaced; }
+
+  private:
+    /// The node that holds the value of subtree, wrapping subtree in one if needed
+    ExprSharedNode* share(ExprNode* subtree) {
+        ExprNode* parent = const_cast<ExprNode*>(subtree->parent());
+        if (ExprSharedNode* shared = dynamic_cast<ExprSharedNode*>(parent)) return shared;
+        ExprSharedNode* shared = new ExprSharedNode(subtree->expr(), subtree);
+        for (int c = 0; c < parent->numChildren(); c++)
+            if (parent->child(c) == subtree) {
+                parent->replaceChild(c, shared);
+                break;
+            }
+        return shared;
+    }
+
+    std::unordered_multimap<size_t, ExprNode*> _available;
+    /// Everything in _available in the order it was added
+    std::vector<std::pair<size_t, ExprNode*> > _scope;
+    int _replaced;
+};
+}
+
+void foldConstants(ExprNode* root, ExprVarEnvBuilder& envBuilder) {
+    for (int c = 0; c < root->numChildren(); c++) {
+        ExprNode* node = root->child(c);
+        if (isFunctionDefinition(node)) continue;
+        const ExprType& type = node->type();
+        if (type.isFP() && type.isLifetimeConstant() && !isLiteral(node) && isInvariant(node, false)) {
+            delete root->replaceChild(c, evaluateToLiteral(node, envBuilder));
+        } else {
+            foldConstants(node, envBuilder);
+        }
+    }
+}
+
+void hoistUniforms(ExprNode* root) {
+    for (int c = 0; c < root->numChildren(); c++) {
+        ExprNode* node = root->child(c);
+        if (isFunctionDefinition(node) || dynamic_cast<ExprUniformNode*>(node)) continue;
+        const ExprType& type = node->type();
+        if (type.isFP() && type.isLifetimeUniform() && node->numChildren() > 0 && isInvariant(node, true)) {
+            ExprNode* uniform = new ExprUniformNode(node->expr(), node);
+            root->replaceChild(c, uniform);
+        } else {
+            hoistUniforms(node);
+        }
+    }
+}
+
+int eliminateCommonSubexpressions(ExprNode* root) {
+    CommonSubexpressions cse;
+    for (int c = 0; c < root->numChildren(); c++) cse.eliminate(root, c);
+    return cse.replaced();
+}
+}
@@ -0,0 +1,39 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#ifndef ExprOptimize_h
+#define ExprOptimize_h
+
+namespace SeExpr2 {
+class ExprNode;
+class ExprVarEnvBuilder;
+
+/// Replace every constant FP subtree that only calls pure functions with an equivalent literal.
+/// Must be called after a successful prep of root.
+void foldConstants(ExprNode* root, ExprVarEnvBuilder& envBuilder);
+
+/// Wrap every maximal uniform FP subtree (one that only reads external variables and calls pure functions)
+/// in an ExprUniformNode so it is evaluated once instead of once per point. Call after foldConstants.
+void hoistUniforms(ExprNode* root);
+
+/// Find FP subtrees that only call pure functions and compute the same value as a subtree evaluated before them
+/// on every path (same node kinds, operators, functions, variables and types, not in a branch the earlier one
+/// isn't in), wrap the earlier subtree in an ExprSharedNode and replace the later ones with ExprReuseNodes.
+/// Call after hoistUniforms. Returns the number of subtrees replaced.
+int eliminateCommonSubexpressions(ExprNode* root);
+}
+
+#endif
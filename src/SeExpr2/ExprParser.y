@@ -21,59 +21,73 @@
 #include <vector>
 #include <string>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <iostream>
 #endif
+#include "Platform.h"
 #include "ExprType.h"
 #include "ExprNode.h"
 #include "ExprParser.h"
 #include "Expression.h"
-#include "Mutex.h"
-
-/******************
- lexer declarations
- ******************/
-
-// declarations of functions and data in ExprParser.l
-int yylex();
-int yypos();
-extern int yy_start;
-extern char* yytext;
-struct yy_buffer_state;
-yy_buffer_state* yy_scan_string(const char *str);
-void yy_delete_buffer(yy_buffer_state*);
-
-/*******************
- parser declarations
- *******************/
-
-// forward declaration
-static void yyerror(const char* msg);
-
-// local data
-static const char* ParseStr;    // string being parsed
-static std::string ParseError;  // error (set from yyerror)
-static SeExpr2::ExprNode* ParseResult; // must set result here since yyparse can't return it
-static const SeExpr2::Expression* Expr;// used for parenting created SeExprOp's
-
-/* The list of nodes being built is remembered locally here.
-   Eventually (if there are no syntax errors) ownership of the nodes
-   will belong solely to the parse tree and the parent expression.
-   However, if there is a syntax error, we must loop through this list
-   and free any nodes that were allocated before the error to avoid a
-   memory leak. */
-static std::vector<SeExpr2::ExprNode*> ParseNodes;
-inline SeExpr2::ExprNode* Remember(SeExpr2::ExprNode* n,const int startPos,const int endPos)
-    { ParseNodes.push_back(n); n->setPosition(startPos,endPos); return n; }
-inline void Forget(SeExpr2::ExprNode* n)
-    { ParseNodes.erase(std::find(ParseNodes.begin(), ParseNodes.end(), n)); }
-/* These are handy node constructors for 0-3 arguments */
-#define NODE(startPos,endPos,name) Remember(new SeExpr2::Expr##name(Expr),startPos,endPos)
-#define NODE1(startPos,endPos,name,a) Remember(new SeExpr2::Expr##name(Expr,a),startPos,endPos)
-#define NODE2(startPos,endPos,name,a,b) Remember(new SeExpr2::Expr##name(Expr,a,b),startPos,endPos)
-#define NODE3(startPos,endPos,name,a,b,c) Remember(new SeExpr2::Expr##name(Expr,a,b,c),startPos,endPos)
-#define NODE4(startPos,endPos,name,a,b,c,t) Remember(new SeExpr2::Expr##name(Expr,a,b,c,t),startPos,endPos)
 %}
 
+%code requires {
+namespace SeExpr2 {
+struct ExprParseState;
+}
+}
+
+%code {
+namespace SeExpr2 {
+/* All state of one parse lives here rather than in globals so that any
+   number of expressions may be parsed concurrently. */
+struct ExprParseState {
+    ExprParseState(const Expression* expr, const char* str, std::vector<std::pair<int, int> >& comments)
+        : str(str), expr(expr), comments(comments), pos(0), tokenStart(0), tokenLength(0), errorStart(0), errorEnd(0),
+          result(0) {}
+
+    const char* str;                               // string being parsed
+    const Expression* expr;                        // used for parenting created SeExprOp's
+    std::vector<std::pair<int, int> >& comments;   // comment ranges found by the lexer
+    int pos;                                       // lexer position in str
+    int tokenStart, tokenLength;                   // last token matched by the lexer (for error reporting)
+    std::string error;                             // error (set from yyerror)
+    int errorStart, errorEnd;                      // location of the error (set from yyerror)
+    ExprNode* result;                              // must set result here since yyparse can't return it
+
+    /* The list of nodes being built is remembered locally here.
+       Eventually (if there are no syntax errors) ownership of the nodes
+       will belong solely to the parse tree and the parent expression.
+       However, if there is a syntax error, we must loop through this list
+       and free any nodes that were allocated before the error to avoid a
+       memory leak. */
+    std::vector<ExprNode*> nodes;
+};
+}
+
+static int yylex(YYSTYPE* value, YYLTYPE* location, SeExpr2::ExprParseState* parseState);
+static void yyerror(YYLTYPE* location, SeExpr2::ExprParseState* parseState, const char* msg);
+
+inline SeExpr2::ExprNode* Remember(SeExpr2::ExprParseState* parseState, SeExpr2::ExprNode* n,const int startPos,const int endPos)
+    { parseState->nodes.push_back(n); n->setPosition(startPos,endPos); return n; }
+inline void Forget(SeExpr2::ExprParseState* parseState, SeExpr2::ExprNode* n)
+    { parseState->nodes.erase(std::find(parseState->nodes.begin(), parseState->nodes.end(), n)); }
+/* These are handy node constructors for 0-3 arguments */
+#define NODE(startPos,endPos,name) Remember(parseState,new SeExpr2::Expr##name(parseState->expr),startPos,endPos)
+#define NODE1(startPos,endPos,name,a) Remember(parseState,new SeExpr2::Expr##name(parseState->expr,a),startPos,endPos)
+#define NODE2(startPos,endPos,name,a,b) Remember(parseState,new SeExpr2::Expr##name(parseState->expr,a,b),startPos,endPos)
+#define NODE3(startPos,endPos,name,a,b,c) Remember(parseState,new SeExpr2::Expr##name(parseState->expr,a,b,c),startPos,endPos)
+#define NODE4(startPos,endPos,name,a,b,c,t) Remember(parseState,new SeExpr2::Expr##name(parseState->expr,a,b,c,t),startPos,endPos)
+}
+
+%define api.pure full
+%locations
+%parse-param {SeExpr2::ExprParseState* parseState}
+%lex-param {SeExpr2::ExprParseState* parseState}
+%initial-action { @$.first_line = @$.last_line = 0; @$.first_column = @$.last_column = 0; }
+
 %union {
     SeExpr2::ExprNode* n; /* a node is returned for all non-terminals to
 		      build the parse tree from the leaves up. */
@@ -129,10 +143,10 @@ inline void Forget(SeExpr2::ExprNode* n)
 
 /* The root expression rule */
 module:
-      declarationList block     { ParseResult = $1; ParseResult->setPosition(@$.first_column, @$.last_column);
-                                  ParseResult->addChild($2); }
-    | block                     { ParseResult = NODE(@$.first_column, @$.last_column, ModuleNode);
-                                  ParseResult->addChild($1); }
+      declarationList block     { parseState->result = $1; parseState->result->setPosition(@$.first_column, @$.last_column);
+                                  parseState->result->addChild($2); }
+    | block                     { parseState->result = NODE(@$.first_column, @$.last_column, ModuleNode);
+                                  parseState->result->addChild($1); }
     ;
 
 declarationList:
@@ -148,7 +162,7 @@ declaration:
                                     SeExpr2::ExprPrototypeNode * prototype =
                                         (SeExpr2::ExprPrototypeNode*)NODE2(@$.first_column, @$.last_column, PrototypeNode, $3, type);
                                   prototype->addArgTypes($5);
-                                  Forget($5);
+                                  Forget(parseState, $5);
                                   $$ = prototype;
                                   free($3); }
     | DEF    typeDeclare NAME '(' formalTypeListOptional ')' '{' block '}'
@@ -156,14 +170,14 @@ declaration:
                                   SeExpr2::ExprPrototypeNode * prototype =
                                       (SeExpr2::ExprPrototypeNode*)NODE2(@$.first_column, @6.last_column, PrototypeNode, $3, type);
                                   prototype->addArgs($5);
-                                  Forget($5);
+                                  Forget(parseState, $5);
                                   $$ = NODE2(@$.first_column, @$.last_column, LocalFunctionNode, prototype, $8);
                                   free($3); }
     | DEF                NAME '(' formalTypeListOptional ')' '{' block '}'
                                 { SeExpr2::ExprPrototypeNode * prototype =
                                         (SeExpr2::ExprPrototypeNode*)NODE1(@$.first_column, @5.last_column, PrototypeNode, $2);
                                   prototype->addArgs($4);
-                                  Forget($4);
+                                  Forget(parseState, $4);
                                   $$ = NODE2(@$.first_column, @$.last_column, LocalFunctionNode, prototype, $7);
                                   free($2); }
     ;
@@ -297,7 +311,7 @@ optelse:
 /* An expression or sub-expression */
 e:
       '(' e ')'			{ $$ = $2; }
-    | '[' exprlist ']'          { SeExpr2::ExprNode* newNode = NODE(@$.first_column,@$.last_column,VecNode); newNode->addChildren($2); Forget($2); $$=newNode;}
+    | '[' exprlist ']'          { SeExpr2::ExprNode* newNode = NODE(@$.first_column,@$.last_column,VecNode); newNode->addChildren($2); Forget(parseState, $2); $$=newNode;}
     | e '[' e ']'               { $$ = NODE2(@$.first_column,@$.last_column,SubscriptNode, $1, $3); }
     | e '?' e ':' e		{ $$ = NODE3(@$.first_column,@$.last_column,CondNode, $1, $3, $5); }
     | e OR e			{ $$ = NODE3(@$.first_column,@$.last_column,CompareNode, $1, $3, '|'); }
@@ -321,13 +335,13 @@ e:
     | NAME '(' optargs ')'	{ $$ = NODE1(@$.first_column,@$.last_column,FuncNode, $1);
 				  free($1); // free name string
 				  // add args directly and discard arg list node
-				  $$->addChildren($3); Forget($3); }
+				  $$->addChildren($3); Forget(parseState, $3); }
     | e ARROW NAME '(' optargs ')'
     				{ $$ = NODE1(@$.first_column,@$.last_column,FuncNode, $3);
 				  free($3); // free name string
 				  $$->addChild($1);
 				  // add args directly and discard arg list node
-				  $$->addChildren($5); Forget($5); }
+				  $$->addChildren($5); Forget(parseState, $5); }
     | VAR			{ $$ = NODE1(@$.first_column,@$.last_column,VarNode, $1); free($1); /* free name string */ }
     | NAME			{ $$ = NODE1(@$.first_column,@$.last_column,VarNode, $1); free($1); /* free name string */ }
     | NUMBER			{ $$ = NODE1(@$.first_column,@$.last_column,NumNode, $1); /*printf("line %d",@$.last_column);*/}
@@ -358,14 +372,194 @@ arg:
 
 %%
 
-      /* yyerror - Report an error.  This is called by the parser.
-	 (Note: the "msg" param is useless as it is usually just "parse error".
-	 so it's ignored.)
-      */
-static void yyerror(const char* /*msg*/)
+/*****
+ lexer
+ *****/
+
+namespace {
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+inline bool isIdentStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+inline bool isIdentChar(char c) { return isIdentStart(c) || isDigit(c) || c == '.'; }
+
+// Length of the identifier [a-zA-Z_][a-zA-Z0-9_.]* at s (0 if none)
+int matchIdent(const char* s) {
+    if (!isIdentStart(s[0])) return 0;
+    int len = 1;
+    while (isIdentChar(s[len])) len++;
+    return len;
+}
+
+// Length of the longest number {D}+({E})?|{D}*"."{D}+({E})?|{D}+"."{D}*({E})? at s, where {E} is [Ee][+-]?{D}+
+int matchReal(const char* s) {
+    int len = 0, digits = 0;
+    while (isDigit(s[digits])) digits++;
+    len = digits;
+    if (s[digits] == '.') {
+        int fraction = digits + 1;
+        while (isDigit(s[fraction])) fraction++;
+        if (digits > 0 || fraction > digits + 1) len = fraction;
+    }
+    if (len == 0 || (s[len] != 'e' && s[len] != 'E')) return len;
+    int exponent = len + 1;
+    if (s[exponent] == '+' || s[exponent] == '-') exponent++;
+    if (!isDigit(s[exponent])) return len;
+    while (isDigit(s[exponent])) exponent++;
+    return exponent;
+}
+
+// Length of the longest quoted string \"(\\\"|[^"\n])*\" (or the same with ') at s (0 if none)
+int matchString(const char* s) {
+    const char quote = s[0];
+    int len = 0;
+    for (int i = 1; s[i] && s[i] != '\n'; i++) {
+        if (s[i] != quote) continue;
+        len = i + 1;
+        // the quote may only be part of the string if it is escaped
+        if (s[i - 1] != '\\' || i == 1) break;
+    }
+    return len;
+}
+
+// Length of the comment #([^\\\n]|\\[^n\n])* at s
+int matchComment(const char* s) {
+    int len = 1;
+    while (s[len] && s[len] != '\n') {
+        if (s[len] != '\\')
+            len++;
+        else if (s[len + 1] && s[len + 1] != 'n' && s[len + 1] != '\n')
+            len += 2;
+        else
+            break;
+    }
+    return len;
+}
+
+struct Keyword {
+    const char* name;
+    int token;
+    double value;
+};
+const Keyword keywords[] = {{"extern", EXTERN, 0},
+                            {"def", DEF, 0},
+                            {"FLOAT", FLOATPOINT, 0},
+                            {"STRING", STRING, 0},
+                            {"CONSTANT", LIFETIME_CONSTANT, 0},
+                            {"UNIFORM", LIFETIME_UNIFORM, 0},
+                            {"VARYING", LIFETIME_VARYING, 0},
+                            {"ERROR", LIFETIME_ERROR, 0},
+                            {"if", IF, 0},
+                            {"else", ELSE, 0},
+                            {"PI", NUMBER, M_PI},
+                            {"E", NUMBER, M_E},
+                            {"linear", NUMBER, 0},
+                            {"smooth", NUMBER, 1},
+                            {"gaussian", NUMBER, 2},
+                            {"box", NUMBER, 3}};
+
+struct Operator {
+    char first, second;
+    int token;
+};
+const Operator operators[] = {{'|', '|', OR},      {'&', '&', AND},     {'=', '=', EQ},     {'!', '=', NE},
+                              {'<', '=', SEEXPR_LE}, {'>', '=', SEEXPR_GE}, {'-', '>', ARROW},  {'+', '=', AddEq},
+                              {'-', '=', SubEq},   {'*', '=', MultEq},  {'/', '=', DivEq},  {'%', '=', ModEq},
+                              {'^', '=', ExpEq}};
+
+char* copyString(const char* s, int len) {
+    char* result = (char*)malloc(len + 1);
+    memcpy(result, s, len);
+    result[len] = '\0';
+    return result;
+}
+}
+
+/* yylex - Return the next token of parseState->str.  This is a reentrant
+   hand written scanner that matches the longest token at the current
+   position; whitespace, quoted newlines/tabs and comments are skipped.
+   The location of every match (skipped or not) is stored in location
+   as a buffer position.
+*/
+static int yylex(YYSTYPE* value, YYLTYPE* location, SeExpr2::ExprParseState* parseState)
 {
+    const char* str = parseState->str;
+    for (;;) {
+        int start = parseState->pos, len = 1, token = 0;
+        const char* s = str + start;
+        bool skip = false;
+
+        if (!s[0]) {
+            // end of input, errors are reported at the last character
+            parseState->tokenStart = start - 1;
+            parseState->tokenLength = 0;
+            return 0;
+        } else if (int identLen = matchIdent(s)) {
+            len = identLen;
+            token = NAME;
+            for (const Keyword& keyword : keywords)
+                if (strlen(keyword.name) == size_t(len) && !strncmp(keyword.name, s, len)) {
+                    token = keyword.token;
+                    value->d = keyword.value;
+                    break;
+                }
+            if (token == NAME) value->s = copyString(s, len);
+        } else if (int realLen = matchReal(s)) {
+            len = realLen;
+            token = NUMBER;
+            value->d = atof(std::string(s, len).c_str());
+        } else if (s[0] == '$' && matchIdent(s + 1)) {
+            len = 1 + matchIdent(s + 1);
+            if (s[len] == ':' && s[len + 1] == ':' && matchIdent(s + len + 2)) len += 2 + matchIdent(s + len + 2);
+            token = VAR;
+            value->s = copyString(s + 1, len - 1);
+        } else if ((s[0] == '"' || s[0] == '\'') && matchString(s)) {
+            len = matchString(s);
+            token = STR;
+            value->s = copyString(s + 1, len - 2);
+        } else if (s[0] == '#') {
+            len = matchComment(s);
+            skip = true;
+            parseState->comments.push_back(std::pair<int, int>(start, start + len));
+        } else if (s[0] == '\\' && (s[1] == 'n' || s[1] == 't')) {
+            // ignore quoted newline/tab
+            len = 2;
+            skip = true;
+        } else if (s[0] == ' ' || s[0] == '\t' || s[0] == '\n') {
+            skip = true;
+        } else {
+            token = s[0];
+            for (const Operator& op : operators)
+                if (s[0] == op.first && s[1] == op.second) {
+                    len = 2;
+                    token = op.token;
+                    break;
+                }
+        }
+
+        parseState->pos = start + len;
+        parseState->tokenStart = start;
+        parseState->tokenLength = len;
+        location->first_line = location->last_line = 0;
+        location->first_column = start;
+        location->last_column = start + len;
+        if (!skip) return token;
+    }
+}
+
+/* yyerror - Report an error.  This is called by the parser.
+   (Note: the "msg" param is useless as it is usually just "parse error".
+   so it's ignored.)
+*/
+static void yyerror(YYLTYPE* location, SeExpr2::ExprParseState* parseState, const char* /*msg*/)
+{
+    const char* ParseStr = parseState->str;
+    std::string& ParseError = parseState->error;
+    // text of the offending token (empty at the end of input)
+    const std::string text = parseState->tokenLength
+                                 ? std::string(ParseStr + parseState->tokenStart, parseState->tokenLength)
+                                 : std::string();
+
     // find start of line containing error
-    int pos = yypos(), lineno = 1, start = 0, end = strlen(ParseStr);
+    int pos = parseState->tokenStart, lineno = 1, start = 0, end = strlen(ParseStr);
     bool multiline = 0;
     for (int i = start; i < pos; i++)
 	if (ParseStr[i] == '\n') { start = i + 1; lineno++; multiline=1; }
@@ -374,15 +568,15 @@ static void yyerror(const char* /*msg*/)
     for (int i = end; i > pos; i--)
 	if (ParseStr[i] == '\n') { end = i - 1; multiline=1; }
 
-    ParseError = yytext[0] ? "Syntax error" : "Unexpected end of expression";
+    ParseError = text.size() ? "Syntax error" : "Unexpected end of expression";
     if (multiline) {
 	char buff[30];
 	snprintf(buff, 30, " at line %d", lineno);
 	ParseError += buff;
     }
-    if (yytext[0]) {
+    if (text.size()) {
 	ParseError += " near '";
-	ParseError += yytext;
+	ParseError += text;
     }
     ParseError += "':\n    ";
 
@@ -392,6 +586,9 @@ static void yyerror(const char* /*msg*/)
     if (s != start) ParseError += "...";
     ParseError += std::string(ParseStr, s, e-s+1);
     if (e != end) ParseError += "...";
+
+    parseState->errorStart = location->first_column;
+    parseState->errorEnd = location->last_column;
 }
 
 
@@ -401,48 +598,35 @@ static void yyerror(const char* /*msg*/)
    along.
  */
 
-extern void SeExprLexerResetState(std::vector<std::pair<int,int> >& comments);
-
-static SeExprInternal2::Mutex mutex;
-
 namespace SeExpr2 {
 bool ExprParse(SeExpr2::ExprNode*& parseTree,
     std::string& error, int& errorStart, int& errorEnd,
     std::vector<std::pair<int,int> >& comments,
     const SeExpr2::Expression* expr, const char* str, bool wantVec)
 {
-    SeExprInternal2::AutoMutex locker(mutex);
-
-    // glue around crippled C interface - ugh!
-    Expr = expr;
-    ParseStr = str;
-    SeExprLexerResetState(comments);
-    yy_buffer_state* buffer = yy_scan_string(str);
-    ParseResult = 0;
-    int resultCode = yyparse();
-    yy_delete_buffer(buffer);
+    ExprParseState parseState(expr, str, comments);
+    int resultCode = yyparse(&parseState);
 
     if (resultCode == 0) {
 	// success
 	error = "";
-	parseTree = ParseResult;
+	parseTree = parseState.result;
     }
     else {
 	// failure
-	error = ParseError;
-        errorStart=yylloc.first_column;
-        errorEnd=yylloc.last_column;
+	error = parseState.error;
+        errorStart=parseState.errorStart;
+        errorEnd=parseState.errorEnd;
 	parseTree = 0;
 	// gather list of nodes with no parent
 	std::vector<SeExpr2::ExprNode*> delnodes;
 	std::vector<SeExpr2::ExprNode*>::iterator iter;
-	for (iter = ParseNodes.begin(); iter != ParseNodes.end(); iter++)
+	for (iter = parseState.nodes.begin(); iter != parseState.nodes.end(); iter++)
 	    if (!(*iter)->parent()) { delnodes.push_back(*iter); }
 	// now delete them (they will delete their own children)
 	for (iter = delnodes.begin(); iter != delnodes.end(); iter++)
 	    delete *iter;
     }
-    ParseNodes.clear();
 
     return parseTree != 0;
 }
@@ -0,0 +1,71 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#include <map>
+
+#include "ExprProgramCache.h"
+#include "ExprNode.h"
+#include "Evaluator.h"
+#include "Mutex.h"
+
+namespace SeExpr2 {
+
+ExprProgram::~ExprProgram() {
+    delete interpreter;
+    delete llvmEvaluator;
+    delete parseTree;
+}
+
+namespace {
+typedef std::map<std::string, std::weak_ptr<ExprProgram> > ProgramMap;
+ProgramMap programs;
+SeExprInternal2::Mutex programsMutex;
+/// Number of entries left by the last sweep for expired entries
+size_t sweptSize = 0;
+
+void removeExpired() {
+    for (ProgramMap::iterator it = programs.begin(); it != programs.end();) {
+        if (it->second.expired())
+            programs.erase(it++);
+        else
+            ++it;
+    }
+    sweptSize = programs.size();
+}
+}
+
+std::shared_ptr<ExprProgram> ExprProgramCache::find(const std::string& key) {
+    SeExprInternal2::AutoMutex locker(programsMutex);
+    ProgramMap::iterator it = programs.find(key);
+    if (it == programs.end()) return std::shared_ptr<ExprProgram>();
+    return it->second.lock();
+}
+
+void ExprProgramCache::insert(const std::string& key, const std::shared_ptr<ExprProgram>& program) {
+    SeExprInternal2::AutoMutex locker(programsMutex);
+    // sweep once the table has doubled since the last sweep, which keeps it within twice the live programs
+    // (plus a few) at an amortized constant cost per insert
+    if (programs.size() >= 2 * sweptSize + 16) removeExpired();
+    std::weak_ptr<ExprProgram>& entry = programs[key];
+    if (entry.expired()) entry = program;
+}
+
+size_t ExprProgramCache::size() {
+    SeExprInternal2::AutoMutex locker(programsMutex);
+    removeExpired();
+    return programs.size();
+}
+}
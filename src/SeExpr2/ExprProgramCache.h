@@ -0,0 +1,59 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#ifndef ExprProgramCache_h
+#define ExprProgramCache_h
+
+#include <memory>
+#include <string>
+
+namespace SeExpr2 {
+class ExprNode;
+class Interpreter;
+class LLVMEvaluator;
+
+/// A compiled expression (interpreter program or JIT function) that can be shared by every Expression
+/// with the same cache key. Owns the parse tree the program was built from, because the program refers
+/// to data held by its nodes (string constants, function data).
+struct ExprProgram {
+    ExprProgram(ExprNode* parseTree, Interpreter* interpreter, LLVMEvaluator* llvmEvaluator, int returnSlot)
+        : parseTree(parseTree), interpreter(interpreter), llvmEvaluator(llvmEvaluator), returnSlot(returnSlot) {}
+    ~ExprProgram();
+
+    ExprNode* const parseTree;
+    Interpreter* const interpreter;
+    LLVMEvaluator* const llvmEvaluator;
+    const int returnSlot;
+
+  private:
+    ExprProgram(const ExprProgram&);
+    ExprProgram& operator=(const ExprProgram&);
+};
+
+/// Process-wide table of compiled expressions. Entries are weak, so a program is freed as soon as the last
+/// Expression using it is reset or destroyed.
+class ExprProgramCache {
+  public:
+    /// Return the live program stored under key, or null
+    static std::shared_ptr<ExprProgram> find(const std::string& key);
+    /// Store program under key, replacing any expired entry
+    static void insert(const std::string& key, const std::shared_ptr<ExprProgram>& program);
+    /// Number of live programs in the cache
+    static size_t size();
+};
+}
+
+#endif
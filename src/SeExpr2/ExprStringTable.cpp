@@ -0,0 +1,76 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include "ExprStringTable.h"
+
+namespace SeExpr2 {
+
+const char* ExprStringTable::intern(const char* str) {
+    static std::mutex mutex;
+    static std::unordered_set<std::string> strings;
+    std::lock_guard<std::mutex> lock(mutex);
+    // elements of a node based container never move, so their characters stay put
+    return strings.insert(str).first->c_str();
+}
+
+char* ExprStringArena::allocate(size_t size) {
+    while (_block < _blocks.size() && _used + size > _blocks[_block].size) {
+        _block++;
+        _used = 0;
+    }
+    if (_block == _blocks.size()) {
+        size_t blockSize = std::max(size, _blocks.empty() ? size_t(4096) : 2 * _blocks.back().size);
+        _blocks.push_back(Block{std::unique_ptr<char[]>(new char[blockSize]), blockSize});
+        _used = 0;
+    }
+    char* result = _blocks[_block].data.get() + _used;
+    _used += size;
+    return result;
+}
+
+char* ExprStringArena::concatenate(const char* a, const char* b) {
+    size_t lengthA = strlen(a), lengthB = strlen(b);
+    char* result = allocate(lengthA + lengthB + 1);
+    memcpy(result, a, lengthA);
+    memcpy(result + lengthA, b, lengthB + 1);
+    return result;
+}
+
+size_t ExprStringArena::sizeInBytes() const {
+    size_t size = _blocks.capacity() * sizeof(Block);
+    for (size_t i = 0; i < _blocks.size(); i++) size += _blocks[i].size;
+    return size;
+}
+
+void ExprStringArena::reset() {
+    if (_blocks.size() > 1 && _block > 0) {
+        // the last evaluation needed several blocks, so replace them by one that holds them all
+        size_t total = 0;
+        for (size_t i = 0; i < _blocks.size(); i++) total += _blocks[i].size;
+        _blocks.clear();
+        _blocks.push_back(Block{std::unique_ptr<char[]>(new char[total]), total});
+    }
+    _block = 0;
+    _used = 0;
+}
+}
@@ -0,0 +1,62 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#ifndef ExprStringTable_h
+#define ExprStringTable_h
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace SeExpr2 {
+
+/// Process-wide table of interned strings. Equal strings intern to the same pointer, so strings known to be
+/// interned compare by address. Interned strings are never freed, so only intern strings that come from
+/// expression text (string literals), never ones computed per point.
+class ExprStringTable {
+  public:
+    /// The interned copy of str, valid for the life of the process
+    static const char* intern(const char* str);
+};
+
+/// Bump allocator for the strings an evaluation computes (e.g. by concatenation). reset() takes back every string
+/// at once without freeing memory, so once the arena has grown to the size one evaluation needs, computing
+/// strings costs no allocator calls.
+class ExprStringArena {
+  public:
+    ExprStringArena() : _block(0), _used(0) {}
+
+    /// Uninitialized storage for size chars, valid until the next reset()
+    char* allocate(size_t size);
+    /// a followed by b, valid until the next reset()
+    char* concatenate(const char* a, const char* b);
+    /// Take back every string handed out since the last reset
+    void reset();
+    /// Memory held by the arena
+    size_t sizeInBytes() const;
+
+  private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> _blocks;
+    /// Block being allocated from and the number of its chars already handed out
+    size_t _block, _used;
+};
+}
+
+#endif
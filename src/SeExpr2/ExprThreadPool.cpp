@@ -0,0 +1,175 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <exception>
+
+#include "ExprThreadPool.h"
+#include "Mutex.h"
+
+namespace SeExpr2 {
+
+/// One parallelFor in flight: the body and each thread's remaining range
+struct ExprThreadPool::Loop {
+    struct Range {
+        SeExprInternal2::SpinLock lock;
+        size_t begin, end;
+        char padding[64];  // keep ranges of different threads off the same cache line
+    };
+
+    Loop(size_t begin, size_t end, size_t chunkSize, int numThreads, const Body& body)
+        : chunkSize(chunkSize), numThreads(numThreads), ranges(numThreads), body(body), failed(false) {
+        size_t count = end - begin;
+        for (int t = 0; t < numThreads; t++) {
+            ranges[t].begin = begin + count * t / numThreads;
+            ranges[t].end = begin + count * (t + 1) / numThreads;
+        }
+    }
+
+    /// Take the next chunk from the front of thread t's own range
+    bool take(int t, size_t& begin, size_t& end) {
+        if (failed.load(std::memory_order_relaxed)) return false;
+        Range& range = ranges[t];
+        SeExprInternal2::AutoSpin locker(range.lock);
+        if (range.begin >= range.end) return false;
+        begin = range.begin;
+        end = std::min(range.end, begin + chunkSize);
+        range.begin = end;
+        return true;
+    }
+
+    /// Move the back half of some other thread's remaining range into thread t's range
+    bool steal(int t) {
+        for (int k = 1; k < numThreads; k++) {
+            Range& victim = ranges[(t + k) % numThreads];
+            size_t begin, end;
+            {
+                SeExprInternal2::AutoSpin locker(victim.lock);
+                if (victim.begin >= victim.end) continue;
+                size_t remaining = victim.end - victim.begin;
+                begin = remaining <= chunkSize ? victim.begin : victim.begin + remaining / 2;
+                end = victim.end;
+                victim.end = begin;
+            }
+            Range& range = ranges[t];
+            SeExprInternal2::AutoSpin locker(range.lock);
+            range.begin = begin;
+            range.end = end;
+            return true;
+        }
+        return false;
+    }
+
+    /// Run chunks until the loop is done. The first exception thrown by the body stops every thread from taking
+    /// more work and is kept for parallelFor to rethrow on the calling thread.
+    void run(int t) {
+        try {
+            size_t begin, end;
+            do {
+                while (take(t, begin, end)) body(t, begin, end);
+            } while (steal(t));
+        } catch (...) {
+            SeExprInternal2::AutoSpin locker(errorLock);
+            if (!error) error = std::current_exception();
+            failed.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    size_t chunkSize;
+    int numThreads;
+    std::vector<Range> ranges;
+    const Body& body;
+    std::atomic<bool> failed;
+    SeExprInternal2::SpinLock errorLock;
+    std::exception_ptr error;
+};
+
+ExprThreadPool& ExprThreadPool::instance() {
+    static ExprThreadPool pool([]() {
+        int threads = static_cast<int>(std::thread::hardware_concurrency());
+        if (const char* env = getenv("SE_EXPR_NUM_THREADS")) threads = atoi(env);
+        return std::max(1, threads) - 1;
+    }());
+    return pool;
+}
+
+ExprThreadPool::ExprThreadPool(int numWorkers) : _loop(0), _loopId(0), _loopThreads(0), _pending(0), _stop(false) {
+    for (int w = 0; w < numWorkers; w++) _workers.push_back(std::thread(&ExprThreadPool::workerMain, this, w + 1));
+}
+
+ExprThreadPool::~ExprThreadPool() {
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (size_t w = 0; w < _workers.size(); w++) _workers[w].join();
+}
+
+void ExprThreadPool::workerMain(int thread) {
+    unsigned int seenLoopId = 0;
+    std::unique_lock<std::mutex> locker(_mutex);
+    while (true) {
+        _wake.wait(locker, [&]() { return _stop || _loopId != seenLoopId; });
+        if (_stop) return;
+        seenLoopId = _loopId;
+        // Only workers counted in _pending may touch the loop; the others can wake after it has finished
+        if (thread >= _loopThreads) continue;
+        Loop* loop = _loop;
+
+        locker.unlock();
+        loop->run(thread);
+        locker.lock();
+        if (--_pending == 0) _done.notify_all();
+    }
+}
+
+void ExprThreadPool::parallelFor(size_t begin, size_t end, size_t chunkSize, int maxThreads, const Body& body) {
+    if (begin >= end) return;
+    chunkSize = std::max(chunkSize, size_t(1));
+    size_t numChunks = (end - begin + chunkSize - 1) / chunkSize;
+    int threads = numThreads();
+    if (maxThreads > 0) threads = std::min(threads, maxThreads);
+    threads = static_cast<int>(std::min(static_cast<size_t>(threads), numChunks));
+
+    std::unique_lock<std::mutex> busy(_busy, std::try_to_lock);
+    if (threads <= 1 || !busy.owns_lock()) {
+        for (size_t chunk = begin; chunk < end; chunk += chunkSize) body(0, chunk, std::min(end, chunk + chunkSize));
+        return;
+    }
+
+    Loop loop(begin, end, chunkSize, threads, body);
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _loop = &loop;
+        _loopId++;
+        _loopThreads = threads;
+        _pending = threads - 1;
+    }
+    _wake.notify_all();
+    loop.run(0);
+
+    std::unique_lock<std::mutex> locker(_mutex);
+    _done.wait(locker, [&]() { return _pending == 0; });
+    _loop = 0;
+    _loopThreads = 0;
+    locker.unlock();
+    busy.unlock();
+    if (loop.error) std::rethrow_exception(loop.error);
+}
+}
@@ -0,0 +1,75 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+#ifndef ExprThreadPool_h
+#define ExprThreadPool_h
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SeExpr2 {
+
+/// Process-wide pool of worker threads for running parallel loops over index ranges. The range is split evenly
+/// between the participating threads; a thread that runs out of work steals the back half of another thread's
+/// remaining range, so uneven per-index costs still keep every core busy.
+class ExprThreadPool {
+  public:
+    /// Loop body, called with the participating thread's index in [0,numThreads) and a chunk [begin,end)
+    typedef std::function<void(int thread, size_t begin, size_t end)> Body;
+
+    /// The shared pool, with one worker per hardware thread besides the caller. The environment variable
+    /// SE_EXPR_NUM_THREADS overrides the total number of threads.
+    static ExprThreadPool& instance();
+
+    /// Make a pool with numWorkers threads of its own
+    explicit ExprThreadPool(int numWorkers);
+    ~ExprThreadPool();
+
+    /// Number of threads that take part in a parallelFor, including the calling thread
+    int numThreads() const { return static_cast<int>(_workers.size()) + 1; }
+
+    /// Run body over [begin,end) in chunks of at most chunkSize indices and return once every index is done.
+    /// At most maxThreads threads take part (all when 0). The calling thread takes part as thread 0; if the pool
+    /// is already running a loop (e.g. a nested or concurrent call) the whole range runs on the calling thread.
+    /// If the body throws, the remaining chunks are abandoned and the first exception is rethrown here.
+    void parallelFor(size_t begin, size_t end, size_t chunkSize, int maxThreads, const Body& body);
+
+  private:
+    ExprThreadPool(const ExprThreadPool&);
+    ExprThreadPool& operator=(const ExprThreadPool&);
+
+    struct Loop;
+    void workerMain(int thread);
+
+    std::vector<std::thread> _workers;
+    /// Held by the thread running a parallelFor
+    std::mutex _busy;
+    /// Protects the fields below
+    std::mutex _mutex;
+    std::condition_variable _wake, _done;
+    Loop* _loop;
+    unsigned int _loopId;
+    /// Number of threads taking part in the current loop, so idle workers never dereference _loop
+    int _loopThreads;
+    int _pending;
+    bool _stop;
+};
+}
+
+#endif
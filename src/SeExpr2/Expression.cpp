@@ -33,9 +33,17 @@
 
 #include "Evaluator.h"
 #include "ExprWalker.h"
+#include "ExprOptimize.h"
+#include "ExprProgramCache.h"
+#include "ExprThreadPool.h"
+#include "VarBlock.h"
 
+#include <cassert>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
 #include <typeinfo>
+#include <unordered_set>
 
 namespace SeExpr2 {
 
@@ -56,8 +64,8 @@ static Expression::EvaluationStrategy chooseDefaultEvaluationStrategy() {
 #ifdef SEEXPR_ENABLE_LLVM
     if (char* env = getenv("SE_EXPR_EVAL")) {
         if (Expression::debugging) std::cerr << "Overriding SeExpr Evaluation Default to be " << env << std::endl;
-        return !strcmp(env, "LLVM") ? Expression::UseLLVM : !strcmp(env, "INTERPRETER") ? Expression::UseInterpreter
-                                                                                        : Expression::UseInterpreter;
+        return !strcmp(env, "LLVM") ? Expression::UseLLVM : !strcmp(env, "TIERED") ? Expression::UseTiered
+                                                                                  : Expression::UseInterpreter;
     } else
         return Expression::UseLLVM;
 #else
@@ -65,6 +73,10 @@ static Expression::EvaluationStrategy chooseDefaultEvaluationStrategy() {
 #endif
 }
 Expression::EvaluationStrategy Expression::defaultEvaluationStrategy = chooseDefaultEvaluationStrategy();
+bool Expression::sharePrograms = getenv("SE_EXPR_SHARE_PROGRAMS") != 0;
+size_t Expression::tieredCompileThreshold =
+    getenv("SE_EXPR_TIERED_THRESHOLD") ? strtoul(getenv("SE_EXPR_TIERED_THRESHOLD"), nullptr, 10) : 10000;
+int Expression::llvmVectorWidth = getenv("SE_EXPR_LLVM_VECTOR_WIDTH") ? atoi(getenv("SE_EXPR_LLVM_VECTOR_WIDTH")) : 0;
 
 class TypePrintExaminer : public SeExpr2::Examiner<true> {
   public:
@@ -87,11 +99,91 @@ bool TypePrintExaminer::examine(const ExprNode* examinee) {
     return true;
 };
 
+namespace {
+/// Every live Expression, for allStatistics
+struct LiveExpressions {
+    std::mutex mutex;
+    std::unordered_set<const Expression*> expressions;
+};
+
+LiveExpressions& liveExpressions() {
+    // never destroyed, so that expressions with static storage can unregister at exit
+    static LiveExpressions* live = new LiveExpressions;
+    return *live;
+}
+
+/// The one thread that runs the background compiles of UseTiered expressions, one at a time in request order.
+/// Compiling one at a time bounds the threads and memory compiles take, and means that compiles of a tree shared
+/// by several expressions (see ExprProgramCache) never run at once.
+class TieredCompiler {
+  public:
+    static TieredCompiler& instance() {
+        // never destroyed (its thread is detached), so that expressions with static storage can cancel at exit
+        static TieredCompiler* compiler = new TieredCompiler;
+        return *compiler;
+    }
+
+    /// Run compile on the compiler thread, on behalf of owner
+    void enqueue(const Expression* owner, const std::function<void()>& compile) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_started) {
+            std::thread(&TieredCompiler::run, this).detach();
+            _started = true;
+        }
+        _queue.push_back(std::make_pair(owner, compile));
+        _changed.notify_all();
+    }
+
+    /// Drop the compiles owner queued, and wait for the one running for it (if any) to finish
+    void cancel(const Expression* owner) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (Queue::iterator it = _queue.begin(); it != _queue.end();) {
+            if (it->first == owner)
+                it = _queue.erase(it);
+            else
+                ++it;
+        }
+        _changed.wait(lock, [&]() { return _compiling != owner; });
+    }
+
+  private:
+    typedef std::deque<std::pair<const Expression*, std::function<void()> > > Queue;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _changed.wait(lock, [&]() { return !_queue.empty(); });
+            std::function<void()> compile = _queue.front().second;
+            _compiling = _queue.front().first;
+            _queue.pop_front();
+            lock.unlock();
+            compile();
+            lock.lock();
+            _compiling = 0;
+            _changed.notify_all();
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    Queue _queue;
+    const Expression* _compiling = 0;
+    bool _started = false;
+};
+
+void registerExpression(const Expression* expression) {
+    LiveExpressions& live = liveExpressions();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    live.expressions.insert(expression);
+}
+}
+
 Expression::Expression(Expression::EvaluationStrategy evaluationStrategy)
     : _wantVec(true), _expression(""), _evaluationStrategy(evaluationStrategy), _context(&Context::global()),
       _desiredReturnType(ExprType().FP(3).Varying()), _parseTree(0), _isValid(0), _parsed(0), _prepped(0),
-      _interpreter(0), _llvmEvaluator(new LLVMEvaluator()) {
+      _interpreter(0), _llvmEvaluator(0) {
     ExprFunc::init();
+    registerExpression(this);
 }
 
 Expression::Expression(const std::string& e,
@@ -100,11 +192,17 @@ Expression::Expression(const std::string& e,
                        const Context& context)
     : _wantVec(true), _expression(e), _evaluationStrategy(evaluationStrategy), _context(&context),
       _desiredReturnType(type), _parseTree(0), _isValid(0), _parsed(0), _prepped(0), _interpreter(0),
-      _llvmEvaluator(new LLVMEvaluator()) {
+      _llvmEvaluator(0) {
     ExprFunc::init();
+    registerExpression(this);
 }
 
 Expression::~Expression() {
+    {
+        LiveExpressions& live = liveExpressions();
+        std::lock_guard<std::mutex> lock(live.mutex);
+        live.expressions.erase(this);
+    }
     reset();
     delete _llvmEvaluator;
 }
@@ -113,10 +211,21 @@ void Expression::debugPrintInterpreter() const {
     if (_interpreter) {
         _interpreter->print();
         std::cerr << "return slot " << _returnSlot << std::endl;
+        std::cerr << "registers fp " << _interpreter->d.size() << " (" << _interpreter->uncompactedFPSize
+                  << " before reuse) str " << _interpreter->s.size() << " (" << _interpreter->uncompactedPtrSize
+                  << " before reuse)" << std::endl;
     }
 }
 
-void Expression::debugPrintLLVM() const { _llvmEvaluator->debugPrint(); }
+void Expression::debugPrintLLVM() const {
+    if (_llvmEvaluator) _llvmEvaluator->debugPrint();
+}
+
+bool Expression::isLLVMLoopVectorized() const {
+    prepIfNeeded();
+    bool compiled = _evaluationStrategy == UseTiered ? _tieredCompiled.load(std::memory_order_acquire) : true;
+    return compiled && _llvmEvaluator && _llvmEvaluator->loopVectorized();
+}
 
 void Expression::debugPrintParseTree() const {
     if (_parseTree) {
@@ -129,18 +238,116 @@ void Expression::debugPrintParseTree() const {
     }
 }
 
+namespace {
+/// Add the memory held by the nodes of tree and by their function data
+void addParseTreeSize(const ExprNode* node, size_t& treeBytes, size_t& dataBytes, std::set<const void*>* counted) {
+    treeBytes += node->sizeInBytes();
+    if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(node)) {
+        const ExprFuncNode::Data* data = func->getData();
+        if (data && (!counted || counted->insert(data).second)) dataBytes += data->sizeInBytes();
+    }
+    for (int i = 0; i < node->numChildren(); i++) addParseTreeSize(node->child(i), treeBytes, dataBytes, counted);
+}
+
+/// Estimated memory held by a std::set or std::map node besides its value
+const size_t treeNodeOverhead = 4 * sizeof(void*);
+}
+
+void Expression::addStatistics(Statistics& statistics, std::set<const void*>* counted) const {
+    std::lock_guard<std::recursive_mutex> lock(_prepMutex);
+    auto firstTime = [counted](const void* object) { return !counted || counted->insert(object).second; };
+
+    size_t expressionBytes = sizeof(Expression) + _expression.capacity() + _parseError.capacity() +
+                             _errors.capacity() * sizeof(Error) + _comments.capacity() * sizeof(_comments[0]) +
+                             _threadUnsafeFunctionCalls.capacity() * sizeof(std::string);
+    for (size_t i = 0; i < _errors.size(); i++) expressionBytes += _errors[i].error.capacity();
+    for (size_t i = 0; i < _threadUnsafeFunctionCalls.size(); i++)
+        expressionBytes += _threadUnsafeFunctionCalls[i].capacity();
+    for (const std::string& name : _vars) expressionBytes += sizeof(name) + treeNodeOverhead + name.capacity();
+    for (const std::string& name : _funcs) expressionBytes += sizeof(name) + treeNodeOverhead + name.capacity();
+    statistics["expression"] += expressionBytes;
+    statistics["varEnv"] += _envBuilder.sizeInBytes();
+
+    size_t treeBytes = 0, dataBytes = 0;
+    if (_parseTree) addParseTreeSize(_parseTree, treeBytes, dataBytes, counted);
+    // a shared program outliving the expression that compiled it holds that expression's tree
+    if (counted && _program && _program->parseTree && _program->parseTree != _parseTree &&
+        firstTime(_program->parseTree))
+        addParseTreeSize(_program->parseTree, treeBytes, dataBytes, counted);
+    statistics["parseTree"] += treeBytes;
+    statistics["funcData"] += dataBytes;
+
+    statistics["interpreter"] += _interpreter && firstTime(_interpreter) ? _interpreter->sizeInBytes() : 0;
+
+    // a UseTiered expression's evaluator is still being built until _tieredCompiled is set
+    bool compiled = _evaluationStrategy == UseTiered ? _tieredCompiled.load(std::memory_order_acquire) : true;
+    size_t moduleBytes = 0, codeBytes = 0;
+    if (compiled && _llvmEvaluator && firstTime(_llvmEvaluator)) {
+        moduleBytes = sizeof(LLVMEvaluator) + _llvmEvaluator->moduleSizeInBytes();
+        codeBytes = _llvmEvaluator->codeSizeInBytes();
+    }
+    statistics["llvmModule"] += moduleBytes;
+    statistics["llvmCode"] += codeBytes;
+}
+
+Statistics Expression::statistics() const {
+    Statistics statistics;
+    addStatistics(statistics, nullptr);
+    return statistics;
+}
+
+size_t Expression::sizeInBytes() const {
+    Statistics statistics = this->statistics();
+    size_t size = 0;
+    for (Statistics::const_iterator it = statistics.begin(); it != statistics.end(); ++it)
+        size += static_cast<size_t>(it->second);
+    return size;
+}
+
+Statistics Expression::allStatistics() {
+    LiveExpressions& live = liveExpressions();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    Statistics statistics;
+    std::set<const void*> counted;
+    for (const Expression* expression : live.expressions) expression->addStatistics(statistics, &counted);
+    statistics["expressions"] = static_cast<double>(live.expressions.size());
+    return statistics;
+}
+
+size_t Expression::allSizeInBytes() {
+    Statistics statistics = allStatistics();
+    size_t size = 0;
+    for (Statistics::const_iterator it = statistics.begin(); it != statistics.end(); ++it)
+        if (it->first != "expressions") size += static_cast<size_t>(it->second);
+    return size;
+}
+
 void Expression::reset() {
+    // the background compile uses the parse tree and the LLVM evaluator
+    if (_tieredCompiling) TieredCompiler::instance().cancel(this);
+    _tieredPoints = 0;
+    _tieredCompiling = false;
+    _tieredCompiled = false;
+    if (_program) {
+        // the shared program owns whichever of these it holds
+        if (_program->parseTree == _parseTree) _parseTree = 0;
+        if (_program->interpreter == _interpreter) _interpreter = 0;
+        if (_program->llvmEvaluator == _llvmEvaluator) _llvmEvaluator = 0;
+        _program.reset();
+    }
     delete _llvmEvaluator;
-    _llvmEvaluator = new LLVMEvaluator();
+    _llvmEvaluator = 0;
     delete _parseTree;
     _parseTree = 0;
-    if (_evaluationStrategy == UseInterpreter) {
+    if (_evaluationStrategy != UseLLVM) {
         delete _interpreter;
         _interpreter = 0;
     }
+    _scratch.reset();
     _isValid = 0;
     _parsed = 0;
     _prepped = 0;
+    _ready = false;
     _parseError = "";
     _vars.clear();
     _funcs.clear();
@@ -166,6 +373,11 @@ void Expression::setVarBlockCreator(const VarBlockCreator* creator) {
     _varBlockCreator = creator;
 }
 
+void Expression::setIOPrecision(IOPrecision precision) {
+    reset();
+    _ioPrecision = precision;
+}
+
 void Expression::setExpr(const std::string& e) {
     if (_expression != "") reset();
     _expression = e;
@@ -201,6 +413,47 @@ void Expression::parse() const {
     }
 }
 
+namespace {
+/// Appends the name and id of every external variable and function the tree is bound to
+void appendBindings(const ExprNode* node, std::ostringstream& key) {
+    if (const ExprVarNode* var = dynamic_cast<const ExprVarNode*>(node)) {
+        if (var->var()) key << ' ' << var->name() << '=' << var->var()->id();
+    } else if (const ExprFuncNode* func = dynamic_cast<const ExprFuncNode*>(node)) {
+        if (func->func()) key << ' ' << func->name() << '=' << func->func()->id();
+    }
+    for (int c = 0; c < node->numChildren(); c++) appendBindings(node->child(c), key);
+}
+}
+
+uint64_t ExprVarRef::nextId() {
+    static std::atomic<uint64_t> id(0);
+    return ++id;
+}
+
+std::string Expression::programKey() const {
+    std::ostringstream key;
+    key << _expression.size() << ':' << _expression << ' ' << _desiredReturnType.toString() << ' '
+        << _evaluationStrategy << ' ' << _ioPrecision << ' ' << _context->id() << ' ' << ExprFunc::generation();
+    appendBindings(_parseTree, key);
+    return key.str();
+}
+
+void Expression::prepOnce() const {
+    std::lock_guard<std::recursive_mutex> lock(_prepMutex);
+    // a prep that is under way on this thread (_prepped is set when it starts) publishes when it is done
+    if (_prepped) return;
+    prep();
+    _ready.store(true, std::memory_order_release);
+}
+
+std::future<bool> Expression::prepareAsync(const Executor& executor) const {
+    if (!executor) return std::async(std::launch::async, [this]() { return isValid(); });
+    auto task = std::make_shared<std::packaged_task<bool()> >([this]() { return isValid(); });
+    std::future<bool> result = task->get_future();
+    executor([task]() { (*task)(); });
+    return result;
+}
+
 void Expression::prep() const {
     if (_prepped) return;
 #ifdef SEEXPR_PERFORMANCE
@@ -224,8 +477,29 @@ void Expression::prep() const {
                              " incompatible with desired type " + _desiredReturnType.toString());
     } else {
         _isValid = true;
+        _scratch.reset(new InterpreterScratch);
+        _llvmResult.resize(_desiredReturnType.isFP() ? _desiredReturnType.dim() : 0);
+
+        foldConstants(_parseTree, _envBuilder);
+        hoistUniforms(_parseTree);
+        eliminateCommonSubexpressions(_parseTree);
+
+        std::string key;
+        if (sharePrograms) {
+            key = programKey();
+            _program = ExprProgramCache::find(key);
+        }
 
-        if (_evaluationStrategy == UseInterpreter) {
+        if (_program) {
+            // reuse the program compiled by another expression, keeping our own parse tree for introspection
+            _returnSlot = _program->returnSlot;
+            if (_evaluationStrategy != UseLLVM) {
+                _interpreter = _program->interpreter;
+            } else {
+                delete _llvmEvaluator;
+                _llvmEvaluator = _program->llvmEvaluator;
+            }
+        } else if (_evaluationStrategy != UseLLVM) {
             if (debugging) {
                 debugPrintParseTree();
                 std::cerr << "Eval strategy is interpreter" << std::endl;
@@ -237,25 +511,44 @@ void Expression::prep() const {
                 int dimWanted = _desiredReturnType.dim();
                 int dimHave = _parseTree->type().dim();
                 if (dimWanted > dimHave) {
-                    _interpreter->addOp(getTemplatizedOp<Promote>(dimWanted));
+                    _interpreter->addOp(getTemplatizedOp<Promote>(dimWanted),
+                                        getTemplatizedOp<PromoteBatch>(dimWanted));
                     int finalOp = _interpreter->allocFP(dimWanted);
-                    _interpreter->addOperand(_returnSlot);
-                    _interpreter->addOperand(finalOp);
+                    _interpreter->addOperand(_returnSlot, Interpreter::ReadFP);
+                    _interpreter->addOperand(finalOp, Interpreter::WriteFP);
                     _returnSlot = finalOp;
                     _interpreter->endOp();
                 }
             }
+            _interpreter->fuseOps(_returnSlot, !_parseTree->type().isString());
+            _returnSlot = _interpreter->compactRegisters(_returnSlot, !_parseTree->type().isString());
+            _interpreter->assemble();
             if (debugging) _interpreter->print();
         } else {  // useLLVM
             if (debugging) {
                 std::cerr << "Eval strategy is llvm" << std::endl;
                 debugPrintParseTree();
             }
+            // the custom function data is built by building an interpreter program (UseTiered expressions
+            // compile later on another thread and reuse the data of their interpreter)
+            {
+                Interpreter dataBuilder;
+                _parseTree->buildInterpreter(&dataBuilder);
+            }
+            _llvmEvaluator = new LLVMEvaluator();
             if (!_llvmEvaluator->prepLLVM(_parseTree, _desiredReturnType)) {
                 error = true;
             }
         }
 
+        if (sharePrograms && !_program && !error) {
+            // tiered expressions share the interpreter program, each compiles its own JIT function
+            bool llvm = _evaluationStrategy == UseLLVM;
+            _program = std::make_shared<ExprProgram>(
+                _parseTree, _interpreter, llvm ? _llvmEvaluator : nullptr, _returnSlot);
+            ExprProgramCache::insert(key, _program);
+        }
+
         // TODO: need promote
         _returnType = _parseTree->type();
     }
@@ -291,6 +584,31 @@ void Expression::prep() const {
     }
 }
 
+bool Expression::useLLVM(size_t points) const {
+    if (_evaluationStrategy != UseTiered) return _evaluationStrategy == UseLLVM;
+    if (_tieredCompiled.load(std::memory_order_acquire)) return true;
+#ifdef SEEXPR_ENABLE_LLVM
+    if (_tieredPoints.fetch_add(points, std::memory_order_relaxed) + points >= tieredCompileThreshold &&
+        !_tieredCompiling.exchange(true)) {
+        TieredCompiler::instance().enqueue(this, [this]() { compileTiered(); });
+    }
+#endif
+    return false;
+}
+
+void Expression::compileTiered() const {
+    if (debugging) std::cerr << "Compiling tiered expression with llvm" << std::endl;
+    // evaluations keep using the interpreter until the JIT function is ready (and for good if compiling fails).
+    // The tree the interpreter program was built from already holds the custom function data, so compiling only
+    // reads it and runs no evalConstant or variable evaluation alongside the interpreter. The tree stays alive
+    // until reset() has cancelled or waited for this compile, and no other compile of it runs meanwhile (see
+    // TieredCompiler).
+    ExprNode* parseTree = _program ? _program->parseTree : _parseTree;
+    _llvmEvaluator = new LLVMEvaluator();
+    if (_llvmEvaluator->prepLLVM(parseTree, _desiredReturnType))
+        _tieredCompiled.store(true, std::memory_order_release);
+}
+
 bool Expression::isVec() const {
     prepIfNeeded();
     return _isValid ? _parseTree->isVec() : _wantVec;
@@ -304,49 +622,110 @@ const ExprType& Expression::returnType() const {
 const double* Expression::evalFP(VarBlock* varBlock) const {
     prepIfNeeded();
     if (_isValid) {
-        if (_evaluationStrategy == UseInterpreter) {
-            _interpreter->eval(varBlock);
-            return (varBlock && varBlock->threadSafe) ? &(varBlock->d[_returnSlot]) : &_interpreter->d[_returnSlot];
+        if (!useLLVM(1)) {
+            _interpreter->eval(varBlock, *_scratch);
+            return _interpreter->scratch(varBlock, *_scratch).d.data() + _returnSlot;
         } else {  // useLLVM
-            return _llvmEvaluator->evalFP(varBlock);
+            _llvmEvaluator->evalFP(_llvmResult.data(), varBlock);
+            return _llvmResult.data();
         }
     }
     static double noCrash[16] = {};
     return noCrash;
 }
 
+void Expression::evalFP(double* result, VarBlock* varBlock) const {
+    prepIfNeeded();
+    int dim = _desiredReturnType.dim();
+    if (_isValid) {
+        if (!useLLVM(1)) {
+            _interpreter->eval(varBlock, *_scratch);
+            const double* f = _interpreter->scratch(varBlock, *_scratch).d.data() + _returnSlot;
+            for (int k = 0; k < dim; k++) result[k] = f[k];
+        } else {  // useLLVM
+            _llvmEvaluator->evalFP(result, varBlock);
+        }
+        return;
+    }
+    for (int k = 0; k < dim; k++) result[k] = 0;
+}
+
+void Expression::evalFP(float* result, VarBlock* varBlock) const {
+    // the interpreter's ops go up to 16 components (see getTemplatizedOp)
+    double value[16];
+    assert(_desiredReturnType.dim() <= 16);
+    evalFP(value, varBlock);
+    for (int k = 0; k < _desiredReturnType.dim(); k++) result[k] = static_cast<float>(value[k]);
+}
+
 void Expression::evalMultiple(VarBlock* varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) const {
     prepIfNeeded();
     if (_isValid) {
-        if (_evaluationStrategy == UseInterpreter) {
+        // the output attribute is laid out as registered with the var block creator (if it was)
+        int dim = _desiredReturnType.dim();
+        VarBinding output = (_varBlockCreator ? _varBlockCreator->binding(outputVarBlockOffset) : VarBinding())
+                                .resolved(_ioPrecision == FloatIO, dim);
+        if (!useLLVM(rangeEnd > rangeStart ? rangeEnd - rangeStart : 0)) {
             // TODO: need strings to work
-            int dim = _desiredReturnType.dim();
-            // double* iHack=reinterpret_cast<double**>(varBlock->data())[outputVarBlockOffset];
-            double* destBase = reinterpret_cast<double**>(varBlock->data())[outputVarBlockOffset];
-            for (size_t i = rangeStart; i < rangeEnd; i++) {
-                varBlock->indirectIndex = static_cast<int>(i);
-                const double* f = evalFP(varBlock);
-                for (int k = 0; k < dim; k++) {
-                    destBase[dim * i + k] = f[k];
-                }
-            }
+            _interpreter->evalMultiple(
+                varBlock, *_scratch, outputVarBlockOffset, _returnSlot, dim, rangeStart, rangeEnd, output);
         } else {  // useLLVM
-            _llvmEvaluator->evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+            _llvmEvaluator->evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd, output);
         }
     }
 }
 
+void Expression::evalMultipleParallel(VarBlock* varBlock,
+                                      int outputVarBlockOffset,
+                                      size_t rangeStart,
+                                      size_t rangeEnd,
+                                      size_t chunkSize) const {
+    // prep here since it is not safe to do from several threads at once
+    prepIfNeeded();
+    if (!_isValid || rangeStart >= rangeEnd) return;
+    ExprThreadPool& pool = ExprThreadPool::instance();
+    if (!isThreadSafe() || pool.numThreads() == 1) {
+        evalMultiple(varBlock, outputVarBlockOffset, rangeStart, rangeEnd);
+        return;
+    }
+
+    // enough chunks for load balancing, each big enough to amortize the per chunk setup
+    if (!chunkSize) chunkSize = std::max(size_t(256), (rangeEnd - rangeStart) / (pool.numThreads() * 16));
+
+    std::vector<VarBlock> blocks;
+    blocks.reserve(pool.numThreads());
+    for (int t = 0; t < pool.numThreads(); t++) blocks.push_back(varBlock->clone(true));
+    pool.parallelFor(rangeStart, rangeEnd, chunkSize, 0, [&](int thread, size_t begin, size_t end) {
+        evalMultiple(&blocks[thread], outputVarBlockOffset, begin, end);
+    });
+}
+
 const char* Expression::evalStr(VarBlock* varBlock) const {
     prepIfNeeded();
     if (_isValid) {
-        if (_evaluationStrategy == UseInterpreter) {
-            _interpreter->eval(varBlock);
-            return (varBlock && varBlock->threadSafe) ? varBlock->s[_returnSlot] : _interpreter->s[_returnSlot];
+        if (!useLLVM(1)) {
+            _interpreter->eval(varBlock, *_scratch);
+            return _interpreter->scratch(varBlock, *_scratch).s[_returnSlot];
         } else {  // useLLVM
-            return _llvmEvaluator->evalStr(varBlock);
+            char* result = 0;
+            _llvmEvaluator->evalStr(&result, varBlock);
+            return result;
         }
     }
     return 0;
 }
 
+void Expression::evalStr(const char** result, VarBlock* varBlock) const {
+    prepIfNeeded();
+    *result = 0;
+    if (_isValid) {
+        if (!useLLVM(1)) {
+            _interpreter->eval(varBlock, *_scratch);
+            *result = _interpreter->scratch(varBlock, *_scratch).s[_returnSlot];
+        } else {  // useLLVM
+            _llvmEvaluator->evalStr(const_cast<char**>(result), varBlock);
+        }
+    }
+}
+
 }  // end namespace SeExpr2/
@@ -21,7 +21,13 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <memory>
 #include <iomanip>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
 #include <stdint.h>
 #include "ExprConfig.h"
 #include "Vec.h"
@@ -40,6 +46,7 @@ class ExprVarNode;
 class ExprFunc;
 class Expression;
 class Interpreter;
+typedef std::map<std::string, double> Statistics;
 
 //! abstract class for implementing variable references
 class ExprVarRef {
@@ -60,17 +67,24 @@ class ExprVarRef {
         return _type;
     };
 
+    //! Number identifying this variable, never reused (unlike its address) once it is destroyed
+    uint64_t id() const { return _id; }
+
     //! returns this variable's value by setting result
     virtual void eval(double* result) = 0;
     virtual void eval(const char** resultStr) = 0;
 
   private:
     ExprType _type;
+    uint64_t _id = nextId();
+    static uint64_t nextId();
 };
 
 class LLVMEvaluator;
 class VarBlock;
 class VarBlockCreator;
+struct ExprProgram;
+struct InterpreterScratch;
 
 /// main expression class
 class Expression {
@@ -78,12 +92,34 @@ class Expression {
     //! Types of evaluation strategies that are available
     enum EvaluationStrategy {
         UseInterpreter,
-        UseLLVM
+        UseLLVM,
+        //! Start evaluating with the interpreter right away and switch to LLVM once tieredCompileThreshold points
+        //! have been evaluated and the JIT compile, queued on a background compiler thread, is done
+        UseTiered
     };
     //! What evaluation strategy to use by default
     static EvaluationStrategy defaultEvaluationStrategy;
+    //! Element type of the FP data exchanged through VarBlocks. This only changes the inputs and outputs:
+    //! evaluation itself (registers, noise kernels and JIT code) always works in double precision.
+    enum IOPrecision {
+        DoubleIO,
+        FloatIO
+    };
     //! Whether to debug expressions
     static bool debugging;
+    //! Whether expressions with the same text, desired type, variable and function bindings share one compiled
+    //! program (see ExprProgramCache). Only the program itself (ops, operands and constants) is shared: every
+    //! Expression evaluates in working registers of its own. Defaults to on when SE_EXPR_SHARE_PROGRAMS is set.
+    static bool sharePrograms;
+    //! Hint for the number of points the LLVM evalMultiple loop evaluates at once in SIMD lanes: 0 lets LLVM pick
+    //! from the host's vector width, 1 evaluates one point per iteration. The loop is only widened when LLVM's loop
+    //! vectorizer can handle the expression, which rules out most calls (e.g. of variable references that are not
+    //! VarBlock bound, or of builtins) and vector valued code; see isLLVMLoopVectorized(). Defaults to
+    //! SE_EXPR_LLVM_VECTOR_WIDTH.
+    static int llvmVectorWidth;
+    //! Number of points a UseTiered expression evaluates with the interpreter before it starts compiling with LLVM.
+    //! Defaults to SE_EXPR_TIERED_THRESHOLD or 10000.
+    static size_t tieredCompileThreshold;
 
     // typedef std::map<std::string, ExprLocalVarRef> LocalVarTable;
 
@@ -135,6 +171,15 @@ class Expression {
         return _isValid;
     }
 
+    //! Runs a task, e.g. by queueing it on a thread pool
+    typedef std::function<void(std::function<void()>)> Executor;
+
+    /** Parse, bind and compile the expression as a task run by executor, or on a new thread when executor is
+        empty, so that hosts can prepare many expressions in parallel. The future holds isValid(). Preparing is
+        done once however many threads (or first uses such as isValid or evalFP) ask for it at the same time;
+        the expression must not be changed or reset before the future is ready. */
+    std::future<bool> prepareAsync(const Executor& executor = Executor()) const;
+
     /** Get parse error (if any).  First call syntaxOK or isValid
         to parse (and optionally bind) the expression. */
     const std::string& parseError() const { return _parseError; }
@@ -184,6 +229,15 @@ class Expression {
     /// Evaluate multiple blocks
     void evalMultiple(VarBlock* varBlock, int outputVarBlockOffset, size_t rangeStart, size_t rangeEnd) const;
 
+    /// Evaluate multiple blocks on all cores. [rangeStart,rangeEnd) is split into chunks of chunkSize points (picked
+    /// automatically when 0) that are scheduled on the ExprThreadPool; each thread evaluates with its own thread safe
+    /// clone of varBlock and writes into the same output attribute. Runs serially if !isThreadSafe().
+    void evalMultipleParallel(VarBlock* varBlock,
+                              int outputVarBlockOffset,
+                              size_t rangeStart,
+                              size_t rangeEnd,
+                              size_t chunkSize = 0) const;
+
     // TODO: make this deprecated
     /** Evaluates and returns float (check returnType()!) */
     const double* evalFP(VarBlock* varBlock = nullptr) const;
@@ -192,6 +246,18 @@ class Expression {
     /** Evaluates and returns string (check returnType()!) */
     const char* evalStr(VarBlock* varBlock = nullptr) const;
 
+    /** Evaluates into caller owned storage for returnType().dim() doubles. With the LLVM backend, or with
+        the interpreter and a thread safe VarBlock, this may be called concurrently from many threads on one
+        Expression once it has been prepped (e.g. by isValid()). LLVM compiled expressions that concatenate
+        strings keep the result in their parse tree and so are not reentrant. */
+    void evalFP(double* result, VarBlock* varBlock) const;
+
+    /** evalFP(double*,VarBlock*) with the result narrowed to float */
+    void evalFP(float* result, VarBlock* varBlock) const;
+
+    /** Evaluates a string expression into caller owned storage, see evalFP(double*,VarBlock*) */
+    void evalStr(const char** result, VarBlock* varBlock) const;
+
     /** Reset expr - force reparse/rebind */
     void reset();
 
@@ -225,11 +291,40 @@ class Expression {
     /** Debug printout of LLVM evaluation  **/
     void debugPrintLLVM() const;
 
+    /** True if the expression is JIT compiled and its evalMultiple loop evaluates several points per iteration
+        (see llvmVectorWidth). False for code loaded from the object cache, which is not optimized again. **/
+    bool isLLVMLoopVectorized() const;
+
     /** Set variable block creator (lifetime of expression must be <= block) **/
     void setVarBlockCreator(const VarBlockCreator* varBlockCreator);
 
     const VarBlockCreator* varBlockCreator() const { return _varBlockCreator; }
 
+    EvaluationStrategy evaluationStrategy() const { return _evaluationStrategy; }
+
+    /** Set whether FP variables bound through the VarBlockCreator and the evalMultiple output attribute hold float
+        (FloatIO) or double data. Values are widened to double when read and narrowed when written. **/
+    void setIOPrecision(IOPrecision precision);
+
+    IOPrecision ioPrecision() const { return _ioPrecision; }
+
+    /** Estimated memory held by the expression in bytes, by component: "expression" (the object, its text and
+        what parsing recorded), "parseTree" (the nodes), "varEnv" (local variable scopes), "funcData" (the
+        ExprFuncNode::Data of function calls, e.g. curves), "interpreter" (the interpreter program), "llvmModule"
+        (the JIT compiled module's IR) and "llvmCode" (its machine code and data). Programs shared with other
+        expressions (see sharePrograms) are counted in full. **/
+    Statistics statistics() const;
+
+    /** Sum of statistics() **/
+    size_t sizeInBytes() const;
+
+    /** statistics() summed over every live expression, counting programs shared by several expressions once, plus
+        "expressions", the number of live expressions. Expressions must not be reset or changed meanwhile. **/
+    static Statistics allStatistics();
+
+    /** Sum of the memory entries of allStatistics() **/
+    static size_t allSizeInBytes();
+
   private:
     /** No definition by design. */
     Expression(const Expression& e);
@@ -240,13 +335,30 @@ class Expression {
 
     /** Parse, but only if not yet parsed */
     void parseIfNeeded() const {
-        if (!_parsed) parse();
+        if (!_ready.load(std::memory_order_acquire)) {
+            std::lock_guard<std::recursive_mutex> lock(_prepMutex);
+            if (!_parsed) parse();
+        }
     }
 
     /** Prepare expression (bind vars/functions, etc.)
     and remember error if any */
     void prep() const;
 
+    /** Key identifying the compiled program of this prepped expression in the ExprProgramCache */
+    std::string programKey() const;
+
+    /** Whether to evaluate the next points with LLVM rather than the interpreter. Counts the points evaluated
+        by a UseTiered expression and starts its background compile when they reach tieredCompileThreshold. */
+    bool useLLVM(size_t points) const;
+
+    /** Compile with LLVM on the background compiler thread and switch a UseTiered expression over to it */
+    void compileTiered() const;
+
+    /** Add the memory held by the expression to statistics. Objects already in counted are skipped and the
+        others added to it, unless counted is null. */
+    void addStatistics(Statistics& statistics, std::set<const void*>* counted) const;
+
     /** True if the expression wants a vector */
     bool _wantVec;
 
@@ -258,6 +370,9 @@ class Expression {
 
     EvaluationStrategy _evaluationStrategy;
 
+    /** Precision of VarBlock data */
+    IOPrecision _ioPrecision = DoubleIO;
+
     /** Context for out of band function parameters */
     const Context* _context;
 
@@ -270,16 +385,24 @@ class Expression {
     /** Parse tree (null if syntax is bad). */
     mutable ExprNode* _parseTree;
 
-    /** Prepare, but only if not yet prepped */
+    /** Prepare, but only if not yet prepped. Safe to call from several threads at once: one of them prepares
+        while the others wait for it. */
     void prepIfNeeded() const {
-        if (!_prepped) prep();
+        if (!_ready.load(std::memory_order_acquire)) prepOnce();
     }
 
+    /** Prepare under _prepMutex unless another thread already did, then publish the prepared state */
+    void prepOnce() const;
+
   private:
     /** Flag if we are valid or not */
     mutable bool _isValid;
     /** Flag set once expr is parsed/prepped (parsing is automatic and lazy) */
     mutable bool _parsed, _prepped;
+    /** Set, after prep is done, for threads that did not prep the expression themselves */
+    mutable std::atomic<bool> _ready{false};
+    /** Held while parsing or prepping (prep may parse) */
+    mutable std::recursive_mutex _prepMutex;
 
     /** Cached parse error (returned by isValid) */
     mutable std::string _parseError;
@@ -305,10 +428,21 @@ class Expression {
     /** Interpreter */
     mutable Interpreter* _interpreter;
     mutable int _returnSlot;
+    /** Working registers of evaluations without a thread safe VarBlock, ours even when the program is shared */
+    mutable std::unique_ptr<InterpreterScratch> _scratch;
+    /** Result of evalFP(VarBlock*) with the LLVM backend, whose evaluator may be shared too */
+    mutable std::vector<double> _llvmResult;
 
-    // LLVM evaluation layer
+    // LLVM evaluation layer (only made for expressions that are JIT compiled)
     mutable LLVMEvaluator* _llvmEvaluator;
 
+    /** UseTiered state: points evaluated so far, whether the compile was started and whether it succeeded */
+    mutable std::atomic<size_t> _tieredPoints{0};
+    mutable std::atomic<bool> _tieredCompiling{false}, _tieredCompiled{false};
+
+    /** Compiled program shared through the ExprProgramCache (owns whichever of the above it holds) */
+    mutable std::shared_ptr<ExprProgram> _program;
+
     // Var block creator
     const VarBlockCreator* _varBlockCreator = 0;
 
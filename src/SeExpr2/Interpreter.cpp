@@ -21,6 +21,9 @@
 #include <iostream>
 #include <cstdio>
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <map>
 #if !defined(WINDOWS)
 #include <dlfcn.h>
 #endif
@@ -28,44 +31,328 @@
 // TODO: optimize to write to location directly on a CondNode
 namespace SeExpr2 {
 
-void Interpreter::eval(VarBlock* block, bool debug) {
+namespace {
+//! Reads and writes VarBlock data stored as T (uint16_t holds half floats)
+template <class T>
+struct VarBlockElement {
+    static double read(const char* p) { return *reinterpret_cast<const T*>(p); }
+    static void write(char* p, double value) { *reinterpret_cast<T*>(p) = static_cast<T>(value); }
+};
+
+template <>
+struct VarBlockElement<uint16_t> {
+    static double read(const char* p) { return halfToFloat(*reinterpret_cast<const uint16_t*>(p)); }
+    static void write(char* p, double value) {
+        *reinterpret_cast<uint16_t*>(p) = floatToHalf(static_cast<float>(value));
+    }
+};
+
+//! Number of ints an OpF takes in the instruction stream, and where the length and operands of an op start
+const int opWords = sizeof(Interpreter::OpF) / sizeof(int);
+const int lengthWord = 2 * opWords, operandsWord = 2 * opWords + 1;
+static_assert(sizeof(Interpreter::OpF) % sizeof(int) == 0, "OpF must fill whole ints of the instruction stream");
+
+//! The scalar (which=0) or batched (which=1) OpF of the op at instruction
+inline Interpreter::OpF streamOp(const int* instruction, int which) {
+    Interpreter::OpF op;
+    memcpy(&op, instruction + which * opWords, sizeof(op));
+    return op;
+}
+
+//! Address of a component of a point of VarBlock data of type T laid out as described by a VarBinding
+template <class T>
+inline char* varBlockAddress(char** data, int offset, int byteStride, int soa, size_t index, int component) {
+    return soa ? data[offset + component] + byteStride * index
+               : data[offset] + byteStride * index + sizeof(T) * component;
+}
+}
+
+uint64_t Interpreter::nextId() {
+    static std::atomic<uint64_t> id(0);
+    return ++id;
+}
+
+InterpreterScratch& Interpreter::scratch(VarBlock* block, InterpreterScratch& own) {
+    InterpreterScratch& scratch = block && block->threadSafe ? block->scratch(_id, _alive) : own;
+    // constants are never written by ops, so they stay valid in the copy across evaluations
+    if (scratch.s.empty()) {
+        scratch.d = d;
+        scratch.s = s;
+    }
+    return scratch;
+}
+
+void Interpreter::eval(VarBlock* block, InterpreterScratch& own, bool debug, bool keepUniforms) {
     // get pointers to the working data
-    double* fp = d.data();
-    char** str = s.data();
+    InterpreterScratch& registers = scratch(block, own);
+    double* fp = registers.d.data();
+    char** str = registers.s.data();
 
-    // if we have a VarBlock instance, we need to update the working data
+    // if we have a VarBlock instance, set the variable evaluation data
     if (block) {
-        // if the VarBlock is flagged as thread safe, copy the interpreter's data to it.
-        if (block->threadSafe == true) {
-            // copy double data
-            block->d.resize(d.size());
-            fp = block->d.data();
-            memcpy(fp, d.data(), d.size() * sizeof(double));
-
-            // copy string data
-            block->s.resize(s.size());
-            str = block->s.data();
-            memcpy(str, s.data(), s.size() * sizeof(char*));
-        }
-
-        // set the variable evaluation data
         str[0] = reinterpret_cast<char*>(block->data());
         str[1] = reinterpret_cast<char*>(static_cast<size_t>(block->indirectIndex));
     }
+    str[2] = reinterpret_cast<char*>(&registers.strings);
+    registers.strings.reset();
+    if (!keepUniforms)
+        for (size_t i = 0; i < uniformFlags.size(); i++) fp[uniformFlags[i]] = 0;
 
+    if (_codeOffsets.size() != ops.size() + 1) assemble();
+    std::vector<int>& stack = registers.callStack;
     int pc = _pcStart;
     int end = static_cast<int>(ops.size());
+    int* code = _code.data();
+    int* instruction = code + _codeOffsets[pc];
     while (pc < end) {
         if (debug) {
             std::cerr << "Running op at " << pc << std::endl;
             print(pc);
         }
-        const std::pair<OpF, int>& op = ops[pc];
-        int* opCurr = &opData[0] + op.second;
-        pc += op.first(opCurr, fp, str, callStack);
+        int step = streamOp(instruction, 0)(instruction + operandsWord, fp, str, stack);
+        pc += step;
+        // falling through to the next op is the common case and needs no lookup
+        instruction = step == 1 ? instruction + instruction[lengthWord] : code + _codeOffsets[pc];
+    }
+}
+
+void Interpreter::assemble() {
+    _code.clear();
+    _codeOffsets.clear();
+    for (size_t pc = 0; pc < ops.size(); pc++) {
+        int begin = ops[pc].second;
+        int end = pc + 1 < ops.size() ? ops[pc + 1].second : static_cast<int>(opData.size());
+        int offset = static_cast<int>(_code.size());
+        _codeOffsets.push_back(offset);
+        _code.resize(offset + operandsWord + end - begin);
+        memcpy(&_code[offset], &ops[pc].first, sizeof(OpF));
+        memcpy(&_code[offset + opWords], &batchOps[pc], sizeof(OpF));
+        _code[offset + lengthWord] = operandsWord + end - begin;
+        std::copy(opData.begin() + begin, opData.begin() + end, _code.begin() + offset + operandsWord);
+    }
+    _codeOffsets.push_back(static_cast<int>(_code.size()));
+}
+
+bool Interpreter::batchable() const {
+    for (size_t pc = _pcStart; pc < batchOps.size(); pc++) {
+        if (batchOps[pc]) continue;
+        // ops without a batched variant run lane by lane, unless they jump, produce strings (lanes share the
+        // str registers) or have operands the interpreter knows nothing about
+        int end = pc + 1 < ops.size() ? ops[pc + 1].second : static_cast<int>(opData.size());
+        for (int i = ops[pc].second; i < end; i++) {
+            OperandKind kind = opDataKinds[i];
+            if (kind == UnknownOperand || kind == WritePtr || kind == JumpOffset || kind == ProgramCounter)
+                return false;
+        }
+    }
+    return true;
+}
+
+void Interpreter::evalMultiple(VarBlock* block,
+                               InterpreterScratch& own,
+                               int outputVarBlockOffset,
+                               int returnSlot,
+                               int dim,
+                               size_t rangeStart,
+                               size_t rangeEnd,
+                               const VarBinding& output) {
+    switch (output.elementType) {
+        case VarBinding::Float:
+            evalMultipleInto<float>(block, own, outputVarBlockOffset, returnSlot, dim, rangeStart, rangeEnd, output);
+            break;
+        case VarBinding::Int32:
+            evalMultipleInto<int32_t>(block, own, outputVarBlockOffset, returnSlot, dim, rangeStart, rangeEnd, output);
+            break;
+        case VarBinding::Half:
+            evalMultipleInto<uint16_t>(block, own, outputVarBlockOffset, returnSlot, dim, rangeStart, rangeEnd, output);
+            break;
+        default:
+            evalMultipleInto<double>(block, own, outputVarBlockOffset, returnSlot, dim, rangeStart, rangeEnd, output);
+            break;
+    }
+}
+
+template <class T>
+void Interpreter::evalMultipleInto(VarBlock* block,
+                                   InterpreterScratch& own,
+                                   int outputVarBlockOffset,
+                                   int returnSlot,
+                                   int dim,
+                                   size_t rangeStart,
+                                   size_t rangeEnd,
+                                   const VarBinding& output) {
+    char** data = block->data();
+    auto store = [&](size_t i, int k, double value) {
+        VarBlockElement<T>::write(
+            varBlockAddress<T>(data, outputVarBlockOffset, output.byteStride, output.soa, i, k), value);
+    };
+    if (_codeOffsets.size() != ops.size() + 1) assemble();
+
+    if (!batchable()) {
+        const double* scalarResult = scratch(block, own).d.data() + returnSlot;
+        for (size_t i = rangeStart; i < rangeEnd; i++) {
+            block->indirectIndex = static_cast<int>(i);
+            eval(block, own, false, i != rangeStart);
+            for (int k = 0; k < dim; k++) store(i, k, scalarResult[k]);
+        }
+        return;
+    }
+
+    const int W = batchWidth;
+    BatchRegisters registers = batchRegisters(block, own, dim);
+    double* fp = registers.d->data();
+    char** str = registers.s->data();
+    for (size_t i = 0; i < uniformFlags.size(); i++)
+        for (int l = 0; l < W; l++) fp[uniformFlags[i] * W + l] = 0;
+    size_t laneIndex[batchWidth];
+    str[0] = reinterpret_cast<char*>(block->data());
+    str[1] = reinterpret_cast<char*>(laneIndex);
+    // results are gathered past the registers, as lanes split on branches may finish on copies of them
+    double* result = fp + d.size() * W;
+
+    for (size_t blockStart = rangeStart; blockStart < rangeEnd; blockStart += W) {
+        size_t count = std::min(static_cast<size_t>(W), rangeEnd - blockStart);
+        // lanes past the end of the range replicate the last point so kernels always run full width
+        for (int l = 0; l < W; l++) laneIndex[l] = blockStart + std::min(static_cast<size_t>(l), count - 1);
+        runBatch(_pcStart, (1u << count) - 1, fp, str, returnSlot, dim, result, registers, 0);
+        for (size_t l = 0; l < count; l++)
+            for (int k = 0; k < dim; k++) store(blockStart + l, k, result[k * W + l]);
+    }
+}
+
+Interpreter::BatchRegisters Interpreter::batchRegisters(VarBlock* block, InterpreterScratch& own, int dim) {
+    InterpreterScratch& scratch = block && block->threadSafe ? block->scratch(_id, _alive) : own;
+    BatchRegisters registers{&scratch.batchD, &scratch.batchS, &scratch.batchSplitD, &scratch.batchSplitS};
+    // every register broadcast to all lanes; constants are never written by ops, so they stay valid across calls
+    const int W = batchWidth;
+    const size_t numFP = d.size();
+    if (registers.s->size() != s.size() || registers.d->size() < numFP * W) {
+        registers.d->resize(numFP * W);
+        for (size_t k = 0; k < numFP; k++)
+            for (int l = 0; l < W; l++) (*registers.d)[k * W + l] = d[k];
+        *registers.s = s;
+        // a split leaves at least one lane less in every group, so there are fewer than W nested splits
+        registers.splitD->resize(numFP + numFP * W * W);
+        registers.splitS->resize(s.size() * W);
+    }
+    if (registers.d->size() < (numFP + dim) * W) registers.d->resize((numFP + dim) * W);
+    return registers;
+}
+
+void Interpreter::runLanes(const int* instruction, unsigned lanes, double* fp, char** str, double* laneFP) {
+    // every lane in lanes runs the scalar op on its registers gathered from (and then scattered back to) the
+    // batch, so a function with side effects is called once per point. The other lanes copy the first one.
+    const int W = batchWidth;
+    const size_t numFP = d.size();
+    char* laneIndex = str[1];
+    int first = -1;
+    for (int l = 0; l < W; l++) {
+        if (!(lanes & (1u << l))) continue;
+        if (first < 0) first = l;
+        for (size_t k = 0; k < numFP; k++) laneFP[k] = fp[k * W + l];
+        str[1] = reinterpret_cast<char*>(reinterpret_cast<size_t*>(laneIndex)[l]);
+        streamOp(instruction, 0)(const_cast<int*>(instruction) + operandsWord, laneFP, str, callStack);
+        for (size_t k = 0; k < numFP; k++) fp[k * W + l] = laneFP[k];
+    }
+    str[1] = laneIndex;
+    for (int l = 0; l < W; l++)
+        if (!(lanes & (1u << l)))
+            for (size_t k = 0; k < numFP; k++) fp[k * W + l] = fp[k * W + first];
+}
+
+void Interpreter::runBatch(int pc,
+                           unsigned lanes,
+                           double* fp,
+                           char** str,
+                           int returnSlot,
+                           int dim,
+                           double* result,
+                           const BatchRegisters& registers,
+                           int depth) {
+    const int W = batchWidth;
+    const size_t numFP = d.size();
+    double* laneFP = registers.splitD->data();
+    int end = static_cast<int>(ops.size());
+    int* code = _code.data();
+    int* instruction = code + _codeOffsets[pc];
+    while (pc < end) {
+        OpF batchOp = streamOp(instruction, 1);
+        int step = 1;
+        if (batchOp)
+            step = batchOp(instruction + operandsWord, fp, str, callStack);
+        else
+            runLanes(instruction, lanes, fp, str, laneFP);
+        if (step == 0) break;
+        pc += step;
+        instruction = step == 1 ? instruction + instruction[lengthWord] : code + _codeOffsets[pc];
+    }
+    if (pc >= end) {
+        const double* value = fp + returnSlot * W;
+        for (int l = 0; l < W; l++)
+            if (lanes & (1u << l))
+                for (int k = 0; k < dim; k++) result[k * W + l] = value[k * W + l];
+        return;
+    }
+
+    // the lanes disagreed on a branch: the scalar op (jumps only read registers) tells where each lane goes
+    int laneStep[batchWidth];
+    for (int l = 0; l < W; l++) {
+        if (!(lanes & (1u << l))) continue;
+        for (size_t k = 0; k < numFP; k++) laneFP[k] = fp[k * W + l];
+        laneStep[l] = streamOp(instruction, 0)(instruction + operandsWord, laneFP, str, callStack);
+    }
+
+    // every group of lanes going the same way continues at full width, its other lanes replicating one of its
+    // lanes (registers and index) so they follow it. The last group keeps the registers, earlier ones work on
+    // the copy kept for this depth.
+    size_t* laneIndex = reinterpret_cast<size_t*>(str[1]);
+    double* copyD = laneFP + numFP + depth * numFP * W;
+    char** copyS = registers.splitS->data() + depth * s.size();
+    unsigned remaining = lanes;
+    while (remaining) {
+        int first = 0;
+        while (!(remaining & (1u << first))) first++;
+        unsigned group = 0;
+        for (int l = first; l < W; l++)
+            if ((remaining & (1u << l)) && laneStep[l] == laneStep[first]) group |= 1u << l;
+        remaining &= ~group;
+
+        size_t groupIndex[batchWidth];
+        double* groupFP = fp;
+        char** groupStr = str;
+        size_t* index = laneIndex;
+        if (remaining) {
+            std::copy(fp, fp + numFP * W, copyD);
+            std::copy(str, str + s.size(), copyS);
+            std::copy(laneIndex, laneIndex + W, groupIndex);
+            groupFP = copyD;
+            groupStr = copyS;
+            index = groupIndex;
+            groupStr[1] = reinterpret_cast<char*>(groupIndex);
+        }
+        for (int l = 0; l < W; l++) {
+            if (group & (1u << l)) continue;
+            index[l] = index[first];
+            for (size_t k = 0; k < numFP; k++) groupFP[k * W + l] = groupFP[k * W + first];
+        }
+        runBatch(pc + laneStep[first], group, groupFP, groupStr, returnSlot, dim, result, registers, depth + 1);
     }
 }
 
+size_t Interpreter::sizeInBytes() const {
+    // map nodes hold a key, a value and about three pointers of balancing data
+    const size_t mapNodeOverhead = 4 * sizeof(void*);
+    return sizeof(*this) + d.capacity() * sizeof(double) + s.capacity() * sizeof(char*) +
+           opData.capacity() * sizeof(int) + opDataKinds.capacity() * sizeof(OperandKind) +
+           varToLoc.size() * (sizeof(VarToLoc::value_type) + mapNodeOverhead) +
+           varRefToLoc.size() * (sizeof(VarRefToLoc::value_type) + mapNodeOverhead) +
+           sharedToLoc.size() * (sizeof(SharedToLoc::value_type) + mapNodeOverhead) +
+           ops.capacity() * sizeof(ops[0]) + batchOps.capacity() * sizeof(OpF) + callStack.capacity() * sizeof(int) +
+           uniformFlags.capacity() * sizeof(int) + strings.sizeInBytes() + _code.capacity() * sizeof(int) +
+           _codeOffsets.capacity() * sizeof(int) + (_fpAllocs.capacity() + _ptrAllocs.capacity()) * sizeof(_fpAllocs[0]) +
+           (_pinnedFP.capacity() + _pinnedPtr.capacity()) * sizeof(int);
+}
+
 void Interpreter::print(int pc) const {
     std::cerr << "---- ops     ----------------------" << std::endl;
     for (size_t i = 0; i < ops.size(); i++) {
@@ -94,13 +381,161 @@ void Interpreter::print(int pc) const {
     std::cerr << "---- str     ----------------------" << std::endl;
     std::cerr << "s[0] reserved for datablock = " << reinterpret_cast<size_t>(s[0]) << std::endl;
     std::cerr << "s[1] is indirectIndex = " << reinterpret_cast<size_t>(s[1]) << std::endl;
-    for (size_t k = 2; k < s.size(); k++) {
+    std::cerr << "s[2] reserved for string arena = 0x" << reinterpret_cast<void*>(s[2]) << std::endl;
+    for (size_t k = 3; k < s.size(); k++) {
         std::cerr << "s[" << k << "]= 0x" << s[k];
         if (s[k]) std::cerr << " '" << s[k][0] << s[k][1] << s[k][2] << s[k][3] << "...'";
         std::cerr << std::endl;
     }
 }
 
+namespace {
+//! Where an allocation of registers is used in the op list
+struct RegisterRange {
+    int first = -1, last = -1;
+    bool readFirst = false, pinned = false;
+};
+
+//! Index of the allocation in allocs (sorted by location) that holds loc, or -1
+int findAllocation(const std::vector<std::pair<int, int> >& allocs, int loc) {
+    auto it = std::upper_bound(allocs.begin(), allocs.end(), std::make_pair(loc, INT_MAX));
+    if (it == allocs.begin()) return -1;
+    --it;
+    return loc < it->first + it->second ? static_cast<int>(it - allocs.begin()) : -1;
+}
+
+//! Gives every used allocation a new location starting at base, pinned ones first. Equally sized temporaries whose
+//! ranges do not overlap share registers; unused ones get -1. Returns the size of the new register file.
+int assignRegisters(const std::vector<std::pair<int, int> >& allocs,
+                    const std::vector<RegisterRange>& ranges,
+                    int base,
+                    std::vector<int>& newLoc) {
+    int size = base;
+    newLoc.assign(allocs.size(), -1);
+    std::vector<int> temporaries;
+    for (size_t a = 0; a < allocs.size(); a++) {
+        if (ranges[a].pinned) {
+            newLoc[a] = size;
+            size += allocs[a].second;
+        } else if (ranges[a].first >= 0) {
+            temporaries.push_back(static_cast<int>(a));
+        }
+    }
+    std::stable_sort(temporaries.begin(), temporaries.end(), [&](int a, int b) {
+        return ranges[a].first < ranges[b].first;
+    });
+
+    std::multimap<int, int> active;          // last use -> allocation
+    std::map<int, std::vector<int> > free;  // allocation size -> released locations
+    for (int a : temporaries) {
+        // an op may write its output before it is done reading its inputs, so only ranges ended by an earlier op
+        // are released
+        while (!active.empty() && active.begin()->first < ranges[a].first) {
+            int released = active.begin()->second;
+            free[allocs[released].second].push_back(newLoc[released]);
+            active.erase(active.begin());
+        }
+        std::vector<int>& pool = free[allocs[a].second];
+        if (pool.empty()) {
+            newLoc[a] = size;
+            size += allocs[a].second;
+        } else {
+            newLoc[a] = pool.back();
+            pool.pop_back();
+        }
+        active.insert(std::make_pair(ranges[a].last, a));
+    }
+    return size;
+}
+}
+
+int Interpreter::compactRegisters(int returnSlot, bool returnIsFP) {
+    uncompactedFPSize = d.size();
+    uncompactedPtrSize = s.size();
+    if (_unknownOperands || _compacted) return returnSlot;
+    _compacted = true;
+
+    std::vector<RegisterRange> fpRanges(_fpAllocs.size()), ptrRanges(_ptrAllocs.size());
+    auto pin = [&](int loc, bool isFP) {
+        int a = findAllocation(isFP ? _fpAllocs : _ptrAllocs, loc);
+        if (a >= 0) (isFP ? fpRanges : ptrRanges)[a].pinned = true;
+    };
+    for (int loc : _pinnedFP) pin(loc, true);
+    for (int loc : _pinnedPtr) pin(loc, false);
+    for (int loc : uniformFlags) pin(loc, true);
+    for (auto& it : varToLoc) pin(it.second, !it.first->type().isString());
+    pin(returnSlot, returnIsFP);
+
+    // live ranges over the op list, counting the reads of an op before its writes
+    for (size_t pc = 0; pc < ops.size(); pc++) {
+        int begin = ops[pc].second;
+        int end = pc + 1 < ops.size() ? ops[pc + 1].second : static_cast<int>(opData.size());
+        for (int pass = 0; pass < 2; pass++) {
+            for (int k = begin; k < end; k++) {
+                OperandKind kind = opDataKinds[k];
+                bool read = kind == ReadFP || kind == ReadPtr;
+                if ((kind == ReadFP || kind == WriteFP || kind == ReadPtr || kind == WritePtr) && read == !pass) {
+                    bool isFP = kind == ReadFP || kind == WriteFP;
+                    int a = findAllocation(isFP ? _fpAllocs : _ptrAllocs, opData[k]);
+                    if (a < 0) continue;
+                    RegisterRange& range = (isFP ? fpRanges : ptrRanges)[a];
+                    if (range.first < 0) {
+                        range.first = static_cast<int>(pc);
+                        range.readFirst = read;
+                    }
+                    range.last = static_cast<int>(pc);
+                    // local function bodies come before the program start and are jumped into from anywhere
+                    if (static_cast<int>(pc) < _pcStart) range.pinned = true;
+                }
+            }
+        }
+    }
+    // values read before being written come from the build (constants) or an earlier evaluation
+    for (RegisterRange& range : fpRanges) range.pinned |= range.readFirst;
+    for (RegisterRange& range : ptrRanges) range.pinned |= range.readFirst;
+
+    std::vector<int> fpLoc, ptrLoc;
+    int fpSize = assignRegisters(_fpAllocs, fpRanges, 0, fpLoc);
+    int ptrSize = assignRegisters(_ptrAllocs, ptrRanges, 3, ptrLoc);  // s[0], s[1] and s[2] are reserved
+    auto relocate = [&](int loc, bool isFP) {
+        const std::vector<std::pair<int, int> >& allocs = isFP ? _fpAllocs : _ptrAllocs;
+        int a = findAllocation(allocs, loc);
+        if (a < 0) return loc;
+        const std::vector<int>& newLoc = isFP ? fpLoc : ptrLoc;
+        return newLoc[a] + loc - allocs[a].first;
+    };
+
+    // move the initial values (constants, function pointers, ...) to their new registers
+    std::vector<double> newD(fpSize, 0);
+    std::vector<char*> newS(ptrSize, nullptr);
+    newS[0] = s[0];
+    newS[1] = s[1];
+    newS[2] = s[2];
+    for (size_t a = 0; a < _fpAllocs.size(); a++)
+        if (fpRanges[a].pinned)
+            for (int k = 0; k < _fpAllocs[a].second; k++) newD[fpLoc[a] + k] = d[_fpAllocs[a].first + k];
+    for (size_t a = 0; a < _ptrAllocs.size(); a++)
+        if (ptrRanges[a].pinned) newS[ptrLoc[a]] = s[_ptrAllocs[a].first];
+
+    for (size_t k = 0; k < opData.size(); k++) {
+        OperandKind kind = opDataKinds[k];
+        if (kind == ReadFP || kind == WriteFP)
+            opData[k] = relocate(opData[k], true);
+        else if (kind == ReadPtr || kind == WritePtr)
+            opData[k] = relocate(opData[k], false);
+    }
+    for (int& loc : uniformFlags) loc = relocate(loc, true);
+    for (auto& it : varToLoc) it.second = relocate(it.second, !it.first->type().isString());
+    returnSlot = relocate(returnSlot, returnIsFP);
+
+    d.swap(newD);
+    s.swap(newS);
+    _fpAllocs.clear();
+    _ptrAllocs.clear();
+    _codeOffsets.clear();
+    return returnSlot;
+}
+
 // template Interpreter::OpF* getTemplatizedOp<Promote<1> >(int);
 // template Interpreter::OpF* getTemplatizedOp<Promote<2> >(int);
 // template Interpreter::OpF* getTemplatizedOp<Promote<3> >(int);
@@ -151,36 +586,11 @@ static Interpreter::OpF getTemplatizedOp2(int i) {
 
 namespace {
 
-//! Binary operator for strings. Currently only handle '+'
+//! Binary operator for strings. Currently only handle '+'. The result lives in the evaluation's string arena
 struct BinaryStringOp {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
-        // get the operand data
-        char*& out = *(char**)c[opData[0]];
-        char* in1 = c[opData[1]];
-        char* in2 = c[opData[2]];
-
-        // delete previous data and allocate a new buffer, only if needed
-        // NOTE: this is more efficient, but might consume more memory...
-        // Maybe make this behaviour configurable ?
-        int len1 = static_cast<int>(strlen(in1));
-        int len2 = static_cast<int>(strlen(in2));
-        if (out == 0 || len1 + len2 + 1 > strlen(out))
-        {
-            delete [] out;
-            out = new char [len1 + len2 + 1];
-        }
-
-        // clear previous evaluation content
-        memset(out, 0, len1 + len2 + 1);
-
-        // concatenate strings
-        strcat(out, in1);
-        strcat(out + len1, in2);
-        out[len1 + len2] = '\0';
-
-        // copy to the output
-        c[opData[3]] = out;
-
+        ExprStringArena* strings = reinterpret_cast<ExprStringArena*>(c[2]);
+        c[opData[2]] = strings->concatenate(c[opData[0]], c[opData[1]]);
         return 1;
     }
 };
@@ -193,53 +603,46 @@ struct BinaryOp {
         return a - floor(a / b) * b;
     }
 
+    static inline double apply(double a, double b) {
+        switch (op) {
+            case '+':
+                return a + b;
+            case '-':
+                return a - b;
+            case '*':
+                return a * b;
+            case '/':
+                return a / b;
+            case '%':
+                return niceMod(a, b);
+            case '^':
+                return pow(a, b);
+            // these only make sense with d==1
+            case '<':
+                return a < b;
+            case '>':
+                return a > b;
+            case 'l':
+                return a <= b;
+            case 'g':
+                return a >= b;
+            case '&':
+                return a && b;
+            case '|':
+                return a || b;
+            default:
+                assert(false);
+        }
+        return 0;
+    }
+
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         double* in1 = fp + opData[0];
         double* in2 = fp + opData[1];
         double* out = fp + opData[2];
 
         for (int k = 0; k < d; k++) {
-            switch (op) {
-                case '+':
-                    *out = (*in1) + (*in2);
-                    break;
-                case '-':
-                    *out = (*in1) - (*in2);
-                    break;
-                case '*':
-                    *out = (*in1) * (*in2);
-                    break;
-                case '/':
-                    *out = (*in1) / (*in2);
-                    break;
-                case '%':
-                    *out = niceMod(*in1, *in2);
-                    break;
-                case '^':
-                    *out = pow(*in1, *in2);
-                    break;
-                // these only make sense with d==1
-                case '<':
-                    *out = (*in1) < (*in2);
-                    break;
-                case '>':
-                    *out = (*in1) > (*in2);
-                    break;
-                case 'l':
-                    *out = (*in1) <= (*in2);
-                    break;
-                case 'g':
-                    *out = (*in1) >= (*in2);
-                    break;
-                case '&':
-                    *out = (*in1) && (*in2);
-                    break;
-                case '|':
-                    *out = (*in1) || (*in2);
-                    break;
-                default:
-                    assert(false);
-            }
+            *out = apply(*in1, *in2);
             in1++;
             in2++;
             out++;
@@ -248,26 +651,41 @@ struct BinaryOp {
     }
 };
 
+//! Batched BinaryOp. The d components of a register are adjacent lane blocks, so this is one flat loop
+template <char op, int d>
+struct BinaryOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* in1 = fp + opData[0] * W;
+        const double* in2 = fp + opData[1] * W;
+        double* out = fp + opData[2] * W;
+        for (int i = 0; i < d * W; i++) out[i] = BinaryOp<op, d>::apply(in1[i], in2[i]);
+        return 1;
+    }
+};
+
 /// Computes a unary op on a FP[d]
 template <char op, int d>
 struct UnaryOp {
+    static inline double apply(double a) {
+        switch (op) {
+            case '-':
+                return -a;
+            case '~':
+                return 1 - a;
+            case '!':
+                return !a;
+            default:
+                assert(false);
+        }
+        return 0;
+    }
+
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         double* in = fp + opData[0];
         double* out = fp + opData[1];
         for (int k = 0; k < d; k++) {
-            switch (op) {
-                case '-':
-                    *out = -(*in);
-                    break;
-                case '~':
-                    *out = 1 - (*in);
-                    break;
-                case '!':
-                    *out = !*in;
-                    break;
-                default:
-                    assert(false);
-            }
+            *out = apply(*in);
             in++;
             out++;
         }
@@ -275,6 +693,18 @@ struct UnaryOp {
     }
 };
 
+//! Batched UnaryOp
+template <char op, int d>
+struct UnaryOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* in = fp + opData[0] * W;
+        double* out = fp + opData[1] * W;
+        for (int i = 0; i < d * W; i++) out[i] = UnaryOp<op, d>::apply(in[i]);
+        return 1;
+    }
+};
+
 //! Subscripts
 template <int d>
 struct Subscript {
@@ -290,6 +720,22 @@ struct Subscript {
     }
 };
 
+//! Batched Subscript (the subscript may differ per lane)
+template <int d>
+struct SubscriptBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* tuple = fp + opData[0] * W;
+        const double* subscript = fp + opData[1] * W;
+        double* out = fp + opData[2] * W;
+        for (int l = 0; l < W; l++) {
+            int index = int(subscript[l]);
+            out[l] = (index >= d || index < 0) ? 0 : tuple[index * W + l];
+        }
+        return 1;
+    }
+};
+
 //! build a vector tuple from a bunch of numbers
 template <int d>
 struct Tuple {
@@ -302,6 +748,20 @@ struct Tuple {
     }
 };
 
+//! Batched Tuple
+template <int d>
+struct TupleBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        double* out = fp + opData[d] * W;
+        for (int k = 0; k < d; k++) {
+            const double* in = fp + opData[k] * W;
+            for (int l = 0; l < W; l++) out[k * W + l] = in[l];
+        }
+        return 1;
+    }
+};
+
 //! Assign a floating point to another (NOTE: if src and dest have different dimensions, use Promote)
 template <int d>
 struct AssignOp {
@@ -315,6 +775,18 @@ struct AssignOp {
     }
 };
 
+//! Batched AssignOp
+template <int d>
+struct AssignOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* in = fp + opData[0] * W;
+        double* out = fp + opData[1] * W;
+        for (int i = 0; i < d * W; i++) out[i] = in[i];
+        return 1;
+    }
+};
+
 //! Assigns a string from one position to another
 struct AssignStrOp {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
@@ -347,11 +819,49 @@ struct CondJmpRelativeIfTrue {
     }
 };
 
+//! Batched conditional jump. Only takes a branch when all lanes agree, otherwise returns 0 so that the
+//! caller falls back to evaluating the block one point at a time.
+template <bool jumpIf>
+struct CondJmpRelativeBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* cond = fp + opData[0] * W;
+        int taken = 0;
+        for (int l = 0; l < W; l++) taken += (bool)cond[l] == jumpIf;
+        if (taken == W)
+            return opData[1];
+        else if (taken == 0)
+            return 1;
+        return 0;
+    }
+};
+
 //! Jumps relative to current executing pc unconditionally
 struct JmpRelative {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) { return opData[0]; }
 };
 
+//! Skips a uniform subtree whose result is already in place, otherwise marks it computed and runs it
+struct UniformGuard {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        double& computed = fp[opData[0]];
+        if (computed != 0) return opData[1];
+        computed = 1;
+        return 1;
+    }
+};
+
+//! Batched UniformGuard. A uniform result is the same in every lane, so all lanes share the flag of lane 0.
+struct UniformGuardBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        double* computed = fp + opData[0] * W;
+        if (computed[0] != 0) return opData[1];
+        for (int l = 0; l < W; l++) computed[l] = 1;
+        return 1;
+    }
+};
+
 //! Evaluates an external variable
 struct EvalVar {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
@@ -378,28 +888,73 @@ struct EvalVarBlock {
     }
 };
 
-//! Evaluates an external variable using a variable block
-template <char uniform, int dim>
-struct EvalVarBlockIndirect {
+//! Evaluates an external variable using a variable block holding T data. opData holds the variable offset, the
+//! destination, the byte stride and whether the binding is soa
+template <class T, char uniform, int dim>
+struct EvalVarBlockIndirectT {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
         if (c[0]) {
-            int stride = opData[2];
-            int outputVarBlockOffset = opData[0];
-            int destIndex = opData[1];
-            size_t indirectIndex = reinterpret_cast<size_t>(c[1]);
-            double* basePointer =
-                reinterpret_cast<double**>(c[0])[outputVarBlockOffset] + (uniform ? 0 : (stride * indirectIndex));
-            double* destPointer = fp + destIndex;
-            for (int i = 0; i < dim; i++) destPointer[i] = basePointer[i];
+            char** data = reinterpret_cast<char**>(c[0]);
+            size_t indirectIndex = uniform ? 0 : reinterpret_cast<size_t>(c[1]);
+            double* destPointer = fp + opData[1];
+            for (int i = 0; i < dim; i++)
+                destPointer[i] = VarBlockElement<T>::read(
+                    varBlockAddress<T>(data, opData[0], opData[2], opData[3], indirectIndex, i));
         } else {
             // TODO: this happens in initial evaluation!
             // std::cerr<<"Did not get data block"<<std::endl;
             // assert(false && "Did not get data block");
+            // the destination may share its register with other temporaries, so do not leave their value in it
+            for (int i = 0; i < dim; i++) fp[opData[1] + i] = 0;
         }
         return 1;
     }
 };
 
+//! Batched EvalVarBlockIndirectT, c[1] holds the per lane indirect indices
+template <class T, char uniform, int dim>
+struct EvalVarBlockIndirectBatchT {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        char** data = reinterpret_cast<char**>(c[0]);
+        const size_t* laneIndex = reinterpret_cast<const size_t*>(c[1]);
+        double* destPointer = fp + opData[1] * W;
+        for (int l = 0; l < W; l++) {
+            size_t indirectIndex = uniform ? 0 : laneIndex[l];
+            for (int i = 0; i < dim; i++)
+                destPointer[i * W + l] = VarBlockElement<T>::read(
+                    varBlockAddress<T>(data, opData[0], opData[2], opData[3], indirectIndex, i));
+        }
+        return 1;
+    }
+};
+
+template <char uniform, int dim>
+using EvalVarBlockIndirect = EvalVarBlockIndirectT<double, uniform, dim>;
+template <char uniform, int dim>
+using EvalVarBlockIndirectBatch = EvalVarBlockIndirectBatchT<double, uniform, dim>;
+template <char uniform, int dim>
+using EvalFloatVarBlockIndirect = EvalVarBlockIndirectT<float, uniform, dim>;
+template <char uniform, int dim>
+using EvalFloatVarBlockIndirectBatch = EvalVarBlockIndirectBatchT<float, uniform, dim>;
+template <char uniform, int dim>
+using EvalInt32VarBlockIndirect = EvalVarBlockIndirectT<int32_t, uniform, dim>;
+template <char uniform, int dim>
+using EvalInt32VarBlockIndirectBatch = EvalVarBlockIndirectBatchT<int32_t, uniform, dim>;
+template <char uniform, int dim>
+using EvalHalfVarBlockIndirect = EvalVarBlockIndirectT<uint16_t, uniform, dim>;
+template <char uniform, int dim>
+using EvalHalfVarBlockIndirectBatch = EvalVarBlockIndirectBatchT<uint16_t, uniform, dim>;
+
+//! Adds the scalar and batched ops reading a VarBlock variable of the given element type
+template <template <char, int> class Op, template <char, int> class BatchOp>
+void addVarBlockOp(Interpreter* interpreter, bool uniform, int dim) {
+    if (uniform)
+        interpreter->addOp(getTemplatizedOp2<1, Op>(dim), getTemplatizedOp2<1, BatchOp>(dim));
+    else
+        interpreter->addOp(getTemplatizedOp2<0, Op>(dim), getTemplatizedOp2<0, BatchOp>(dim));
+}
+
 template <char op, int d>
 struct CompareEqOp {
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
@@ -437,21 +992,422 @@ struct CompareEqOp<op, 3> {
     }
 };
 
+//! Batched CompareEqOp
+template <char op, int d>
+struct CompareEqOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* in0 = fp + opData[0] * W;
+        const double* in1 = fp + opData[1] * W;
+        double* out = fp + opData[2] * W;
+        // matches CompareEqOp, including its FP[3] specialization of '!'
+        for (int l = 0; l < W; l++) {
+            bool result = true;
+            for (int k = 0; k < d; k++) {
+                if (op == '=' || d == 3)
+                    result &= in0[k * W + l] == in1[k * W + l];
+                else
+                    result &= in0[k * W + l] != in1[k * W + l];
+            }
+            out[l] = (op == '!' && d == 3) ? !result : result;
+        }
+        return 1;
+    }
+};
+
 template <char op, int d>
 struct StrCompareEqOp {
-    // TODO: this should rely on tokenization and not use strcmp
     static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
-        switch (op) {
-            case '=':
-                fp[opData[2]] = strcmp(c[opData[0]], c[opData[1]]) == 0;
-                break;
-            case '!':
-                fp[opData[2]] = strcmp(c[opData[0]], c[opData[1]]) != 0;
-                break;
+        const char* a = c[opData[0]];
+        const char* b = c[opData[1]];
+        bool equal = a == b || strcmp(a, b) == 0;
+        fp[opData[2]] = op == '=' ? equal : !equal;
+        return 1;
+    }
+};
+
+//! String comparison of two operands that are both interned (see ExprStringTable), so equal only if identical
+template <char op, int d>
+struct InternedStrCompareEqOp {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        bool equal = c[opData[0]] == c[opData[1]];
+        fp[opData[2]] = op == '=' ? equal : !equal;
+        return 1;
+    }
+};
+}
+
+namespace {
+//! Superinstruction for Promote<d> feeding the left operand of BinaryOp<op,d>. opData holds the scalar, the
+//! FP[d] right operand and the output
+template <char op, int d>
+struct ScalarLeftBinaryOp {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        double scalar = fp[opData[0]];
+        const double* in = fp + opData[1];
+        double* out = fp + opData[2];
+        for (int k = 0; k < d; k++) out[k] = BinaryOp<op, d>::apply(scalar, in[k]);
+        return 1;
+    }
+};
+
+//! Batched ScalarLeftBinaryOp
+template <char op, int d>
+struct ScalarLeftBinaryOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* scalar = fp + opData[0] * W;
+        const double* in = fp + opData[1] * W;
+        double* out = fp + opData[2] * W;
+        for (int k = 0; k < d; k++)
+            for (int l = 0; l < W; l++) out[k * W + l] = BinaryOp<op, d>::apply(scalar[l], in[k * W + l]);
+        return 1;
+    }
+};
+
+//! Superinstruction for Promote<d> feeding the right operand of BinaryOp<op,d>. opData holds the scalar, the
+//! FP[d] left operand and the output
+template <char op, int d>
+struct ScalarRightBinaryOp {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        double scalar = fp[opData[0]];
+        const double* in = fp + opData[1];
+        double* out = fp + opData[2];
+        for (int k = 0; k < d; k++) out[k] = BinaryOp<op, d>::apply(in[k], scalar);
+        return 1;
+    }
+};
+
+//! Batched ScalarRightBinaryOp
+template <char op, int d>
+struct ScalarRightBinaryOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* scalar = fp + opData[0] * W;
+        const double* in = fp + opData[1] * W;
+        double* out = fp + opData[2] * W;
+        for (int k = 0; k < d; k++)
+            for (int l = 0; l < W; l++) out[k * W + l] = BinaryOp<op, d>::apply(in[k * W + l], scalar[l]);
+        return 1;
+    }
+};
+
+//! Superinstruction for a product feeding a sum, out=a*b+c. opData holds a, b, c and the output. The product is
+//! rounded before the sum like with separate ops, which needs this file built without floating point
+//! contraction (-ffp-contract=off, see src/SeExpr2/CMakeLists.txt) so a*b+c is not turned into an fma.
+template <int d>
+struct MulAddOp {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const double* a = fp + opData[0];
+        const double* b = fp + opData[1];
+        const double* addend = fp + opData[2];
+        double* out = fp + opData[3];
+        for (int k = 0; k < d; k++) out[k] = a[k] * b[k] + addend[k];
+        return 1;
+    }
+};
+
+//! Batched MulAddOp
+template <int d>
+struct MulAddOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* a = fp + opData[0] * W;
+        const double* b = fp + opData[1] * W;
+        const double* addend = fp + opData[2] * W;
+        double* out = fp + opData[3] * W;
+        for (int i = 0; i < d * W; i++) out[i] = a[i] * b[i] + addend[i];
+        return 1;
+    }
+};
+
+//! Superinstruction for a comparison feeding CondJmpRelativeIfFalse. opData holds the two operands and the jump
+template <char op>
+struct CompareJmpRelativeIfFalse {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        return BinaryOp<op, 1>::apply(fp[opData[0]], fp[opData[1]]) ? 1 : opData[2];
+    }
+};
+
+//! Batched CompareJmpRelativeIfFalse, which like CondJmpRelativeBatch returns 0 when the lanes disagree
+template <char op>
+struct CompareJmpRelativeIfFalseBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* in1 = fp + opData[0] * W;
+        const double* in2 = fp + opData[1] * W;
+        int taken = 0;
+        for (int l = 0; l < W; l++) taken += !BinaryOp<op, 1>::apply(in1[l], in2[l]);
+        if (taken == W)
+            return opData[2];
+        else if (taken == 0)
+            return 1;
+        return 0;
+    }
+};
+
+//! Superinstruction for a VarBlock variable of T data feeding BinaryOp<op,d>. opData holds the variable offset,
+//! byte stride, soa and uniform flags, the other operand, the output and whether the variable is the left operand
+template <class T, char op, int d>
+struct VarBlockBinaryOp {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        char** data = reinterpret_cast<char**>(c[0]);
+        size_t indirectIndex = opData[3] ? 0 : reinterpret_cast<size_t>(c[1]);
+        const double* in = fp + opData[4];
+        double* out = fp + opData[5];
+        for (int k = 0; k < d; k++) {
+            double var =
+                data ? VarBlockElement<T>::read(varBlockAddress<T>(data, opData[0], opData[1], opData[2], indirectIndex, k))
+                     : 0;
+            out[k] = opData[6] ? BinaryOp<op, d>::apply(var, in[k]) : BinaryOp<op, d>::apply(in[k], var);
         }
         return 1;
     }
 };
+
+//! Batched VarBlockBinaryOp
+template <class T, char op, int d>
+struct VarBlockBinaryOpBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        char** data = reinterpret_cast<char**>(c[0]);
+        const size_t* laneIndex = reinterpret_cast<const size_t*>(c[1]);
+        const double* in = fp + opData[4] * W;
+        double* out = fp + opData[5] * W;
+        for (int l = 0; l < W; l++) {
+            size_t indirectIndex = opData[3] ? 0 : laneIndex[l];
+            for (int k = 0; k < d; k++) {
+                double var =
+                    VarBlockElement<T>::read(varBlockAddress<T>(data, opData[0], opData[1], opData[2], indirectIndex, k));
+                out[k * W + l] = opData[6] ? BinaryOp<op, d>::apply(var, in[k * W + l])
+                                           : BinaryOp<op, d>::apply(in[k * W + l], var);
+            }
+        }
+        return 1;
+    }
+};
+}
+
+namespace {
+//! The op char of f if it is BinaryOp<op,d> for one of + - * /, else 0
+char arithmeticOp(Interpreter::OpF f, int d) {
+    if (f == getTemplatizedOp2<'+', BinaryOp>(d)) return '+';
+    if (f == getTemplatizedOp2<'-', BinaryOp>(d)) return '-';
+    if (f == getTemplatizedOp2<'*', BinaryOp>(d)) return '*';
+    if (f == getTemplatizedOp2<'/', BinaryOp>(d)) return '/';
+    return 0;
+}
+
+//! The op char of f if it is a scalar comparison BinaryOp, else 0
+char compareOp(Interpreter::OpF f) {
+    if (f == BinaryOp<'<', 1>::f) return '<';
+    if (f == BinaryOp<'>', 1>::f) return '>';
+    if (f == BinaryOp<'l', 1>::f) return 'l';
+    if (f == BinaryOp<'g', 1>::f) return 'g';
+    return 0;
+}
+
+//! Whether f loads a VarBlock variable of T data and dimension d uniformly (1) or per point (0), -1 if it does not
+template <class T, int d>
+int varBlockLoad(Interpreter::OpF f) {
+    if (f == EvalVarBlockIndirectT<T, 0, d>::f) return 0;
+    if (f == EvalVarBlockIndirectT<T, 1, d>::f) return 1;
+    return -1;
+}
+
+//! Scalar and batched ops of the superinstruction Op<op,d> for one of + - * /
+template <template <char, int> class Op, template <char, int> class BatchOp>
+std::pair<Interpreter::OpF, Interpreter::OpF> arithmeticOps(char op, int d) {
+    switch (op) {
+        case '+':
+            return std::make_pair(getTemplatizedOp2<'+', Op>(d), getTemplatizedOp2<'+', BatchOp>(d));
+        case '-':
+            return std::make_pair(getTemplatizedOp2<'-', Op>(d), getTemplatizedOp2<'-', BatchOp>(d));
+        case '*':
+            return std::make_pair(getTemplatizedOp2<'*', Op>(d), getTemplatizedOp2<'*', BatchOp>(d));
+        default:
+            return std::make_pair(getTemplatizedOp2<'/', Op>(d), getTemplatizedOp2<'/', BatchOp>(d));
+    }
+}
+
+template <class T, int d>
+struct VarBlockBinaryOps {
+    template <char op>
+    using Op = VarBlockBinaryOp<T, op, d>;
+    template <char op>
+    using BatchOp = VarBlockBinaryOpBatch<T, op, d>;
+
+    static std::pair<Interpreter::OpF, Interpreter::OpF> get(char op) {
+        switch (op) {
+            case '+':
+                return std::make_pair(Op<'+'>::f, BatchOp<'+'>::f);
+            case '-':
+                return std::make_pair(Op<'-'>::f, BatchOp<'-'>::f);
+            case '*':
+                return std::make_pair(Op<'*'>::f, BatchOp<'*'>::f);
+            default:
+                return std::make_pair(Op<'/'>::f, BatchOp<'/'>::f);
+        }
+    }
+};
+
+std::pair<Interpreter::OpF, Interpreter::OpF> compareJmpOps(char op) {
+    switch (op) {
+        case '<':
+            return std::make_pair(CompareJmpRelativeIfFalse<'<'>::f, CompareJmpRelativeIfFalseBatch<'<'>::f);
+        case '>':
+            return std::make_pair(CompareJmpRelativeIfFalse<'>'>::f, CompareJmpRelativeIfFalseBatch<'>'>::f);
+        case 'l':
+            return std::make_pair(CompareJmpRelativeIfFalse<'l'>::f, CompareJmpRelativeIfFalseBatch<'l'>::f);
+        default:
+            return std::make_pair(CompareJmpRelativeIfFalse<'g'>::f, CompareJmpRelativeIfFalseBatch<'g'>::f);
+    }
+}
+}
+
+void Interpreter::fuseOps(int returnSlot, bool returnIsFP) {
+    if (_unknownOperands || _compacted || ops.empty()) return;
+
+    auto opEnd = [&](size_t pc) {
+        return pc + 1 < ops.size() ? ops[pc + 1].second : static_cast<int>(opData.size());
+    };
+
+    // FP allocations whose value is needed by anything but the op reading it
+    std::vector<bool> isProtected(_fpAllocs.size(), false);
+    std::vector<int> reads(_fpAllocs.size(), 0), writes(_fpAllocs.size(), 0);
+    auto protect = [&](int loc) {
+        int a = findAllocation(_fpAllocs, loc);
+        if (a >= 0) isProtected[a] = true;
+    };
+    for (int loc : _pinnedFP) protect(loc);
+    for (int loc : uniformFlags) protect(loc);
+    for (auto& it : varToLoc)
+        if (!it.first->type().isString()) protect(it.second);
+    if (returnIsFP) protect(returnSlot);
+
+    // ops something jumps to can not be merged into the op before them
+    std::vector<bool> isTarget(ops.size() + 1, false);
+    isTarget[_pcStart] = true;
+    for (size_t pc = 0; pc < ops.size(); pc++) {
+        for (int k = ops[pc].second; k < opEnd(pc); k++) {
+            OperandKind kind = opDataKinds[k];
+            int target = kind == JumpOffset ? static_cast<int>(pc) + opData[k] : opData[k];
+            if ((kind == JumpOffset || kind == ProgramCounter) && target >= 0 && target <= static_cast<int>(ops.size()))
+                isTarget[target] = true;
+            if (kind == ReadFP || kind == WriteFP) {
+                int a = findAllocation(_fpAllocs, opData[k]);
+                if (a >= 0) (kind == ReadFP ? reads : writes)[a]++;
+            }
+        }
+    }
+
+    // whether loc is a register written by one op and read once by the next one, and nothing else
+    auto intermediate = [&](int loc, int d) {
+        int a = findAllocation(_fpAllocs, loc);
+        return a >= 0 && _fpAllocs[a].first == loc && _fpAllocs[a].second == d && !isProtected[a] && reads[a] == 1 &&
+               writes[a] == 1;
+    };
+
+    std::vector<std::pair<OpF, int> > newOps;
+    std::vector<OpF> newBatchOps;
+    std::vector<int> newOpData, newIndex(ops.size() + 1);
+    std::vector<OperandKind> newKinds;
+    std::vector<int> owners;  // new op of every operand, jump offsets hold their absolute target until retargeted
+    auto emit = [&](std::pair<OpF, OpF> op, std::initializer_list<std::pair<int, OperandKind> > operands) {
+        newOps.push_back(std::make_pair(op.first, static_cast<int>(newOpData.size())));
+        newBatchOps.push_back(op.second);
+        for (const auto& operand : operands) {
+            newOpData.push_back(operand.first);
+            newKinds.push_back(operand.second);
+            owners.push_back(static_cast<int>(newOps.size()) - 1);
+        }
+    };
+
+    for (size_t pc = 0; pc < ops.size(); pc++) {
+        newIndex[pc] = static_cast<int>(newOps.size());
+        bool fused = false;
+        if (static_cast<int>(pc) >= _pcStart && pc + 1 < ops.size() && !isTarget[pc + 1]) {
+            const int* a = &opData[ops[pc].second];
+            const int* b = &opData[ops[pc + 1].second];
+            OpF first = ops[pc].first, second = ops[pc + 1].first;
+            if (second == CondJmpRelativeIfFalse::f && compareOp(first) && b[0] == a[2] && intermediate(a[2], 1)) {
+                // comparison feeding a conditional jump
+                emit(compareJmpOps(compareOp(first)),
+                     {{a[0], ReadFP}, {a[1], ReadFP}, {static_cast<int>(pc) + 1 + b[1], JumpOffset}});
+                fused = true;
+            }
+            for (int d = 1; d <= 16 && !fused; d++) {
+                char op = arithmeticOp(second, d);
+                if (!op) continue;
+                // which operand of the binary op reads loc (0 left, 1 right), -1 if neither or both do
+                auto side = [&](int loc) { return b[0] == b[1] ? -1 : b[0] == loc ? 0 : b[1] == loc ? 1 : -1; };
+                if (first == getTemplatizedOp<Promote>(d) && side(a[1]) >= 0 && intermediate(a[1], d)) {
+                    // scalar promoted to a vector for a binary op
+                    bool left = side(a[1]) == 0;
+                    emit(left ? arithmeticOps<ScalarLeftBinaryOp, ScalarLeftBinaryOpBatch>(op, d)
+                              : arithmeticOps<ScalarRightBinaryOp, ScalarRightBinaryOpBatch>(op, d),
+                         {{a[0], ReadFP}, {b[left ? 1 : 0], ReadFP}, {b[2], WriteFP}});
+                    fused = true;
+                } else if (op == '+' && first == getTemplatizedOp2<'*', BinaryOp>(d) && side(a[2]) >= 0 &&
+                           intermediate(a[2], d)) {
+                    // multiply-add
+                    emit(std::make_pair(getTemplatizedOp<MulAddOp>(d), getTemplatizedOp<MulAddOpBatch>(d)),
+                         {{a[0], ReadFP}, {a[1], ReadFP}, {b[side(a[2]) == 0 ? 1 : 0], ReadFP}, {b[2], WriteFP}});
+                    fused = true;
+                } else if ((d == 1 || d == 3) && side(a[1]) >= 0 && intermediate(a[1], d)) {
+                    // VarBlock variable feeding a binary op
+                    std::pair<OpF, OpF> fusedOp;
+                    int uniform = d == 1 ? varBlockLoad<double, 1>(first) : varBlockLoad<double, 3>(first);
+                    if (uniform >= 0) {
+                        fusedOp = d == 1 ? VarBlockBinaryOps<double, 1>::get(op) : VarBlockBinaryOps<double, 3>::get(op);
+                    } else {
+                        uniform = d == 1 ? varBlockLoad<float, 1>(first) : varBlockLoad<float, 3>(first);
+                        fusedOp = d == 1 ? VarBlockBinaryOps<float, 1>::get(op) : VarBlockBinaryOps<float, 3>::get(op);
+                    }
+                    if (uniform >= 0) {
+                        bool left = side(a[1]) == 0;
+                        emit(fusedOp,
+                             {{a[0], Immediate},
+                              {a[2], Immediate},
+                              {a[3], Immediate},
+                              {uniform, Immediate},
+                              {b[left ? 1 : 0], ReadFP},
+                              {b[2], WriteFP},
+                              {left, Immediate}});
+                        fused = true;
+                    }
+                }
+                break;
+            }
+        }
+        if (fused) {
+            pc++;
+            newIndex[pc] = newIndex[pc - 1];
+            continue;
+        }
+        newOps.push_back(std::make_pair(ops[pc].first, static_cast<int>(newOpData.size())));
+        newBatchOps.push_back(batchOps[pc]);
+        for (int k = ops[pc].second; k < opEnd(pc); k++) {
+            newOpData.push_back(opDataKinds[k] == JumpOffset ? static_cast<int>(pc) + opData[k] : opData[k]);
+            newKinds.push_back(opDataKinds[k]);
+            owners.push_back(static_cast<int>(newOps.size()) - 1);
+        }
+    }
+    newIndex[ops.size()] = static_cast<int>(newOps.size());
+    if (newOps.size() == ops.size()) return;
+
+    for (size_t k = 0; k < newOpData.size(); k++) {
+        if (newKinds[k] == ProgramCounter)
+            newOpData[k] = newIndex[newOpData[k]];
+        else if (newKinds[k] == JumpOffset)
+            newOpData[k] = newIndex[newOpData[k]] - owners[k];
+    }
+    _pcStart = newIndex[_pcStart];
+    ops.swap(newOps);
+    batchOps.swap(newBatchOps);
+    opData.swap(newOpData);
+    opDataKinds.swap(newKinds);
+    _codeOffsets.clear();
 }
 
 namespace {
@@ -477,7 +1433,7 @@ int ExprLocalFunctionNode::buildInterpreter(Interpreter* interpreter) const {
     ;
     interpreter->addOp(ProcedureReturn);
     // int endPC =
-    interpreter->addOperand(basePC);
+    interpreter->addOperand(basePC, Interpreter::ProgramCounter);
     interpreter->endOp(false);
     _returnedDataOp = lastOperand;
 
@@ -493,15 +1449,17 @@ int ExprLocalFunctionNode::buildInterpreterForCall(const ExprFuncNode* callerNod
         if (child->type().isFP()) {
             if (callerNode->promote(c) != 0) {
                 // promote the argument to the needed type
-                interpreter->addOp(getTemplatizedOp<Promote>(callerNode->promote(c)));
+                interpreter->addOp(getTemplatizedOp<Promote>(callerNode->promote(c)),
+                                   getTemplatizedOp<PromoteBatch>(callerNode->promote(c)));
                 // int promotedOperand=interpreter->allocFP(callerNode->promote(c));
-                interpreter->addOperand(operand);
-                interpreter->addOperand(prototype()->interpreterOps(c));
+                interpreter->addOperand(operand, Interpreter::ReadFP);
+                interpreter->addOperand(prototype()->interpreterOps(c), Interpreter::WriteFP);
                 interpreter->endOp();
             } else {
-                interpreter->addOp(getTemplatizedOp<AssignOp>(child->type().dim()));
-                interpreter->addOperand(operand);
-                interpreter->addOperand(prototype()->interpreterOps(c));
+                interpreter->addOp(getTemplatizedOp<AssignOp>(child->type().dim()),
+                                   getTemplatizedOp<AssignOpBatch>(child->type().dim()));
+                interpreter->addOperand(operand, Interpreter::ReadFP);
+                interpreter->addOperand(prototype()->interpreterOps(c), Interpreter::WriteFP);
                 interpreter->endOp();
             }
         } else {
@@ -520,16 +1478,17 @@ int ExprLocalFunctionNode::buildInterpreterForCall(const ExprFuncNode* callerNod
 
     int basePC = interpreter->nextPC();
     interpreter->addOp(ProcedureCall);
-    int returnAddress = interpreter->addOperand(0);
-    interpreter->addOperand(_procedurePC - basePC);
+    int returnAddress = interpreter->addOperand(0, Interpreter::ProgramCounter);
+    interpreter->addOperand(_procedurePC - basePC, Interpreter::JumpOffset);
     interpreter->endOp(false);
     // set return address
     interpreter->opData[returnAddress] = interpreter->nextPC();
 
     // TODO: copy result back and string
-    interpreter->addOp(getTemplatizedOp<AssignOp>(callerNode->type().dim()));
-    interpreter->addOperand(_returnedDataOp);
-    interpreter->addOperand(outoperand);
+    interpreter->addOp(getTemplatizedOp<AssignOp>(callerNode->type().dim()),
+                       getTemplatizedOp<AssignOpBatch>(callerNode->type().dim()));
+    interpreter->addOperand(_returnedDataOp, Interpreter::ReadFP);
+    interpreter->addOperand(outoperand, Interpreter::WriteFP);
     interpreter->endOp();
 
     return outoperand;
@@ -548,20 +1507,45 @@ int ExprNumNode::buildInterpreter(Interpreter* interpreter) const {
 
 int ExprStrNode::buildInterpreter(Interpreter* interpreter) const {
     int loc = interpreter->allocPtr();
-    interpreter->s[loc] = const_cast<char*>(_str.c_str());
+    interpreter->s[loc] = const_cast<char*>(ExprStringTable::intern(_str.c_str()));
     return loc;
 }
 
+int ExprUniformNode::buildInterpreter(Interpreter* interpreter) const {
+    int flag = interpreter->allocFP(1);
+    interpreter->uniformFlags.push_back(flag);
+    int basePC = interpreter->nextPC();
+    interpreter->addOp(UniformGuard::f, UniformGuardBatch::f);
+    interpreter->addOperand(flag, Interpreter::ReadFP);
+    int destEnd = interpreter->addOperand(0, Interpreter::JumpOffset);
+    interpreter->endOp(false);
+
+    int loc = child(0)->buildInterpreter(interpreter);
+    // later evaluations skip the subtree and read the result left by an earlier one
+    interpreter->pinRegister(loc, type().isFP());
+    interpreter->opData[destEnd] = interpreter->nextPC() - basePC;
+    return loc;
+}
+
+int ExprSharedNode::buildInterpreter(Interpreter* interpreter) const {
+    return interpreter->sharedToLoc[this] = child(0)->buildInterpreter(interpreter);
+}
+
+int ExprReuseNode::buildInterpreter(Interpreter* interpreter) const {
+    assert(interpreter->sharedToLoc.count(_shared) && "Reused a value before computing it");
+    return interpreter->sharedToLoc[_shared];
+}
+
 int ExprVecNode::buildInterpreter(Interpreter* interpreter) const {
     std::vector<int> locs;
     for (int k = 0; k < numChildren(); k++) {
         const ExprNode* c = child(k);
         locs.push_back(c->buildInterpreter(interpreter));
     }
-    interpreter->addOp(getTemplatizedOp<Tuple>(numChildren()));
-    for (int k = 0; k < numChildren(); k++) interpreter->addOperand(locs[k]);
+    interpreter->addOp(getTemplatizedOp<Tuple>(numChildren()), getTemplatizedOp<TupleBatch>(numChildren()));
+    for (int k = 0; k < numChildren(); k++) interpreter->addOperand(locs[k], Interpreter::ReadFP);
     int loc = interpreter->allocFP(numChildren());
-    interpreter->addOperand(loc);
+    interpreter->addOperand(loc, Interpreter::WriteFP);
     interpreter->endOp();
     return loc;
 }
@@ -573,18 +1557,18 @@ int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
     int op1 = child1->buildInterpreter(interpreter);
     if (dimout > 1) {
         if (dim0 != dimout) {
-            interpreter->addOp(getTemplatizedOp<Promote>(dimout));
+            interpreter->addOp(getTemplatizedOp<Promote>(dimout), getTemplatizedOp<PromoteBatch>(dimout));
             int promoteOp0 = interpreter->allocFP(dimout);
-            interpreter->addOperand(op0);
-            interpreter->addOperand(promoteOp0);
+            interpreter->addOperand(op0, Interpreter::ReadFP);
+            interpreter->addOperand(promoteOp0, Interpreter::WriteFP);
             op0 = promoteOp0;
             interpreter->endOp();
         }
         if (dim1 != dimout) {
-            interpreter->addOp(getTemplatizedOp<Promote>(dimout));
+            interpreter->addOp(getTemplatizedOp<Promote>(dimout), getTemplatizedOp<PromoteBatch>(dimout));
             int promoteOp1 = interpreter->allocFP(dimout);
-            interpreter->addOperand(op1);
-            interpreter->addOperand(promoteOp1);
+            interpreter->addOperand(op1, Interpreter::ReadFP);
+            interpreter->addOperand(promoteOp1, Interpreter::WriteFP);
             op1 = promoteOp1;
             interpreter->endOp();
         }
@@ -597,35 +1581,37 @@ int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
     if (isString == false) {
         switch (_op) {
             case '+':
-                interpreter->addOp(getTemplatizedOp2<'+', BinaryOp>(dimout));
+                interpreter->addOp(getTemplatizedOp2<'+', BinaryOp>(dimout),
+                                   getTemplatizedOp2<'+', BinaryOpBatch>(dimout));
                 break;
             case '-':
-                interpreter->addOp(getTemplatizedOp2<'-', BinaryOp>(dimout));
+                interpreter->addOp(getTemplatizedOp2<'-', BinaryOp>(dimout),
+                                   getTemplatizedOp2<'-', BinaryOpBatch>(dimout));
                 break;
             case '*':
-                interpreter->addOp(getTemplatizedOp2<'*', BinaryOp>(dimout));
+                interpreter->addOp(getTemplatizedOp2<'*', BinaryOp>(dimout),
+                                   getTemplatizedOp2<'*', BinaryOpBatch>(dimout));
                 break;
             case '/':
-                interpreter->addOp(getTemplatizedOp2<'/', BinaryOp>(dimout));
+                interpreter->addOp(getTemplatizedOp2<'/', BinaryOp>(dimout),
+                                   getTemplatizedOp2<'/', BinaryOpBatch>(dimout));
                 break;
             case '^':
-                interpreter->addOp(getTemplatizedOp2<'^', BinaryOp>(dimout));
+                interpreter->addOp(getTemplatizedOp2<'^', BinaryOp>(dimout),
+                                   getTemplatizedOp2<'^', BinaryOpBatch>(dimout));
                 break;
             case '%':
-                interpreter->addOp(getTemplatizedOp2<'%', BinaryOp>(dimout));
+                interpreter->addOp(getTemplatizedOp2<'%', BinaryOp>(dimout),
+                                   getTemplatizedOp2<'%', BinaryOpBatch>(dimout));
                 break;
             default:
                 assert(false);
         }
     } else {
         switch (_op) {
-            case '+': {
+            case '+':
                 interpreter->addOp(BinaryStringOp::f);
-                int intermediateOp = interpreter->allocPtr();
-                interpreter->s[intermediateOp] = (char*)(&_out);
-                interpreter->addOperand(intermediateOp);
                 break;
-            }
             default:
                 assert(false);
         }
@@ -639,9 +1625,10 @@ int ExprBinaryOpNode::buildInterpreter(Interpreter* interpreter) const {
         op2 = interpreter->allocPtr();
     }
 
-    interpreter->addOperand(op0);
-    interpreter->addOperand(op1);
-    interpreter->addOperand(op2);
+    Interpreter::OperandKind read = isString ? Interpreter::ReadPtr : Interpreter::ReadFP;
+    interpreter->addOperand(op0, read);
+    interpreter->addOperand(op1, read);
+    interpreter->addOperand(op2, isString ? Interpreter::WritePtr : Interpreter::WriteFP);
 
     // NOTE: one of the operand can be a function. If it's the case for
     // strings, since functions are not immediately executed (they have
@@ -662,20 +1649,20 @@ int ExprUnaryOpNode::buildInterpreter(Interpreter* interpreter) const {
 
     switch (_op) {
         case '-':
-            interpreter->addOp(getTemplatizedOp2<'-', UnaryOp>(dimout));
+            interpreter->addOp(getTemplatizedOp2<'-', UnaryOp>(dimout), getTemplatizedOp2<'-', UnaryOpBatch>(dimout));
             break;
         case '~':
-            interpreter->addOp(getTemplatizedOp2<'~', UnaryOp>(dimout));
+            interpreter->addOp(getTemplatizedOp2<'~', UnaryOp>(dimout), getTemplatizedOp2<'~', UnaryOpBatch>(dimout));
             break;
         case '!':
-            interpreter->addOp(getTemplatizedOp2<'!', UnaryOp>(dimout));
+            interpreter->addOp(getTemplatizedOp2<'!', UnaryOp>(dimout), getTemplatizedOp2<'!', UnaryOpBatch>(dimout));
             break;
         default:
             assert(false);
     }
     int op1 = interpreter->allocFP(dimout);
-    interpreter->addOperand(op0);
-    interpreter->addOperand(op1);
+    interpreter->addOperand(op0, Interpreter::ReadFP);
+    interpreter->addOperand(op1, Interpreter::WriteFP);
     interpreter->endOp();
 
     return op1;
@@ -688,10 +1675,10 @@ int ExprSubscriptNode::buildInterpreter(Interpreter* interpreter) const {
     int op1 = child1->buildInterpreter(interpreter);
     int op2 = interpreter->allocFP(1);
 
-    interpreter->addOp(getTemplatizedOp<Subscript>(dimin));
-    interpreter->addOperand(op0);
-    interpreter->addOperand(op1);
-    interpreter->addOperand(op2);
+    interpreter->addOp(getTemplatizedOp<Subscript>(dimin), getTemplatizedOp<SubscriptBatch>(dimin));
+    interpreter->addOperand(op0, Interpreter::ReadFP);
+    interpreter->addOperand(op1, Interpreter::ReadFP);
+    interpreter->addOperand(op2, Interpreter::WriteFP);
     interpreter->endOp();
     return op2;
 }
@@ -705,6 +1692,8 @@ int ExprVarNode::buildInterpreter(Interpreter* interpreter) const {
         else
             throw std::runtime_error("Unallocated variable encountered.");
     } else if (const ExprVarRef* var = _var) {
+        Interpreter::VarRefToLoc::iterator bound = interpreter->varRefToLoc.find(var);
+        if (bound != interpreter->varRefToLoc.end()) return bound->second;
         ExprType type = var->type();
         int destLoc = -1;
         if (type.isFP()) {
@@ -714,20 +1703,37 @@ int ExprVarNode::buildInterpreter(Interpreter* interpreter) const {
             destLoc = interpreter->allocPtr();
         if (const auto* blockVarRef = dynamic_cast<const VarBlockCreator::Ref*>(var)) {
             // TODO: handle strings
-            if (blockVarRef->type().isLifetimeUniform())
-                interpreter->addOp(getTemplatizedOp2<1, EvalVarBlockIndirect>(type.dim()));
-            else
-                interpreter->addOp(getTemplatizedOp2<0, EvalVarBlockIndirect>(type.dim()));
-            interpreter->addOperand(blockVarRef->offset());
-            interpreter->addOperand(destLoc);
-            interpreter->addOperand(blockVarRef->stride());
+            bool uniform = blockVarRef->type().isLifetimeUniform();
+            VarBinding binding = blockVarRef->binding().resolved(
+                _expr && _expr->ioPrecision() == Expression::FloatIO, type.dim());
+            switch (binding.elementType) {
+                case VarBinding::Float:
+                    addVarBlockOp<EvalFloatVarBlockIndirect, EvalFloatVarBlockIndirectBatch>(
+                        interpreter, uniform, type.dim());
+                    break;
+                case VarBinding::Int32:
+                    addVarBlockOp<EvalInt32VarBlockIndirect, EvalInt32VarBlockIndirectBatch>(
+                        interpreter, uniform, type.dim());
+                    break;
+                case VarBinding::Half:
+                    addVarBlockOp<EvalHalfVarBlockIndirect, EvalHalfVarBlockIndirectBatch>(
+                        interpreter, uniform, type.dim());
+                    break;
+                default:
+                    addVarBlockOp<EvalVarBlockIndirect, EvalVarBlockIndirectBatch>(interpreter, uniform, type.dim());
+                    break;
+            }
+            interpreter->addOperand(blockVarRef->offset(), Interpreter::Immediate);
+            interpreter->addOperand(destLoc, Interpreter::WriteFP);
+            interpreter->addOperand(binding.byteStride, Interpreter::Immediate);
+            interpreter->addOperand(binding.soa, Interpreter::Immediate);
             interpreter->endOp();
         } else {
             int varRefLoc = interpreter->allocPtr();
             interpreter->addOp(EvalVar::f);
             interpreter->s[varRefLoc] = const_cast<char*>(reinterpret_cast<const char*>(var));
-            interpreter->addOperand(varRefLoc);
-            interpreter->addOperand(destLoc);
+            interpreter->addOperand(varRefLoc, Interpreter::ReadPtr);
+            interpreter->addOperand(destLoc, type.isFP() ? Interpreter::WriteFP : Interpreter::WritePtr);
             interpreter->endOp();
         }
         return destLoc;
@@ -747,15 +1753,16 @@ int ExprAssignNode::buildInterpreter(Interpreter* interpreter) const {
     ExprType child0Type = child(0)->type();
     int op0 = child(0)->buildInterpreter(interpreter);
     if (child0Type.isFP()) {
-        interpreter->addOp(getTemplatizedOp<AssignOp>(child0Type.dim()));
+        interpreter->addOp(getTemplatizedOp<AssignOp>(child0Type.dim()),
+                           getTemplatizedOp<AssignOpBatch>(child0Type.dim()));
     } else if (child0Type.isString()) {
         interpreter->addOp(AssignStrOp::f);
     } else {
         assert(false && "Invalid desired assign type");
         return -1;
     }
-    interpreter->addOperand(op0);
-    interpreter->addOperand(loc);
+    interpreter->addOperand(op0, child0Type.isString() ? Interpreter::ReadPtr : Interpreter::ReadFP);
+    interpreter->addOperand(loc, child0Type.isString() ? Interpreter::WritePtr : Interpreter::WriteFP);
     interpreter->endOp(child0Type.isString() == false);
     return loc;
 }
@@ -765,17 +1772,17 @@ void copyVarToPromotedPosition(Interpreter* interpreter, ExprLocalVar* varSource
         int destDim = varDest->type().dim();
         if (destDim != varSource->type().dim()) {
             assert(varSource->type().dim() == 1);
-            interpreter->addOp(getTemplatizedOp<Promote>(destDim));
+            interpreter->addOp(getTemplatizedOp<Promote>(destDim), getTemplatizedOp<PromoteBatch>(destDim));
         } else {
-            interpreter->addOp(getTemplatizedOp<AssignOp>(destDim));
+            interpreter->addOp(getTemplatizedOp<AssignOp>(destDim), getTemplatizedOp<AssignOpBatch>(destDim));
         }
-        interpreter->addOperand(interpreter->varToLoc[varSource]);
-        interpreter->addOperand(interpreter->varToLoc[varDest]);
+        interpreter->addOperand(interpreter->varToLoc[varSource], Interpreter::ReadFP);
+        interpreter->addOperand(interpreter->varToLoc[varDest], Interpreter::WriteFP);
         interpreter->endOp();
     } else if (varDest->type().isString()) {
         interpreter->addOp(AssignStrOp::f);
-        interpreter->addOperand(interpreter->varToLoc[varSource]);
-        interpreter->addOperand(interpreter->varToLoc[varDest]);
+        interpreter->addOperand(interpreter->varToLoc[varSource], Interpreter::ReadPtr);
+        interpreter->addOperand(interpreter->varToLoc[varDest], Interpreter::WritePtr);
         interpreter->endOp();
     } else {
         assert(false && "failed to promote invalid type");
@@ -798,9 +1805,9 @@ int ExprIfThenElseNode::buildInterpreter(Interpreter* interpreter) const {
     }
 
     // Setup the conditional jump
-    interpreter->addOp(CondJmpRelativeIfFalse::f);
-    interpreter->addOperand(condop);
-    int destFalse = interpreter->addOperand(0);
+    interpreter->addOp(CondJmpRelativeIfFalse::f, CondJmpRelativeBatch<false>::f);
+    interpreter->addOperand(condop, Interpreter::ReadFP);
+    int destFalse = interpreter->addOperand(0, Interpreter::JumpOffset);
     interpreter->endOp();
 
     // Then block (build interpreter and copy variables out then jump to end)
@@ -811,8 +1818,8 @@ int ExprIfThenElseNode::buildInterpreter(Interpreter* interpreter) const {
             copyVarToPromotedPosition(interpreter, finalVar->_thenVar, finalVar);
         }
     }
-    interpreter->addOp(JmpRelative::f);
-    int destEnd = interpreter->addOperand(0);
+    interpreter->addOp(JmpRelative::f, JmpRelative::f);
+    int destEnd = interpreter->addOperand(0, Interpreter::JumpOffset);
     interpreter->endOp();
 
     // Else block (build interpreter, copy variables out and then we're at end)
@@ -845,27 +1852,33 @@ int ExprCompareNode::buildInterpreter(Interpreter* interpreter) const {
         int op0 = child0->buildInterpreter(interpreter);
         // conditional to check if that argument could continue
         int basePC = (interpreter->nextPC());
-        interpreter->addOp(_op == '&' ? CondJmpRelativeIfFalse::f : CondJmpRelativeIfTrue::f);
-        interpreter->addOperand(op0);
-        int destFalse = interpreter->addOperand(0);
+        if (_op == '&')
+            interpreter->addOp(CondJmpRelativeIfFalse::f, CondJmpRelativeBatch<false>::f);
+        else
+            interpreter->addOp(CondJmpRelativeIfTrue::f, CondJmpRelativeBatch<true>::f);
+        interpreter->addOperand(op0, Interpreter::ReadFP);
+        int destFalse = interpreter->addOperand(0, Interpreter::JumpOffset);
         interpreter->endOp();
         // this is the no-branch case (op1=true for & and op0=false for |), so eval op1
         int op1 = child1->buildInterpreter(interpreter);
         // combine with &
-        interpreter->addOp(_op == '&' ? getTemplatizedOp2<'&', BinaryOp>(1) : getTemplatizedOp2<'|', BinaryOp>(1));
-        interpreter->addOperand(op0);
-        interpreter->addOperand(op1);
-        interpreter->addOperand(op2);
+        if (_op == '&')
+            interpreter->addOp(getTemplatizedOp2<'&', BinaryOp>(1), getTemplatizedOp2<'&', BinaryOpBatch>(1));
+        else
+            interpreter->addOp(getTemplatizedOp2<'|', BinaryOp>(1), getTemplatizedOp2<'|', BinaryOpBatch>(1));
+        interpreter->addOperand(op0, Interpreter::ReadFP);
+        interpreter->addOperand(op1, Interpreter::ReadFP);
+        interpreter->addOperand(op2, Interpreter::WriteFP);
         interpreter->endOp();
-        interpreter->addOp(JmpRelative::f);
-        int destEnd = interpreter->addOperand(0);
+        interpreter->addOp(JmpRelative::f, JmpRelative::f);
+        int destEnd = interpreter->addOperand(0, Interpreter::JumpOffset);
         interpreter->endOp();
         // this is the branch case (op1=false for & and op0=true for |) so no eval of op1 required
         // just copy from the op0's value
         int falseConditionPC = interpreter->nextPC();
-        interpreter->addOp(AssignOp<1>::f);
-        interpreter->addOperand(op0);
-        interpreter->addOperand(op2);
+        interpreter->addOp(AssignOp<1>::f, AssignOpBatch<1>::f);
+        interpreter->addOperand(op0, Interpreter::ReadFP);
+        interpreter->addOperand(op2, Interpreter::WriteFP);
         interpreter->endOp();
 
         // fix PC relative jump addressses
@@ -880,16 +1893,16 @@ int ExprCompareNode::buildInterpreter(Interpreter* interpreter) const {
         int op1 = child1->buildInterpreter(interpreter);
         switch (_op) {
             case '<':
-                interpreter->addOp(getTemplatizedOp2<'<', BinaryOp>(1));
+                interpreter->addOp(getTemplatizedOp2<'<', BinaryOp>(1), getTemplatizedOp2<'<', BinaryOpBatch>(1));
                 break;
             case '>':
-                interpreter->addOp(getTemplatizedOp2<'>', BinaryOp>(1));
+                interpreter->addOp(getTemplatizedOp2<'>', BinaryOp>(1), getTemplatizedOp2<'>', BinaryOpBatch>(1));
                 break;
             case 'l':
-                interpreter->addOp(getTemplatizedOp2<'l', BinaryOp>(1));
+                interpreter->addOp(getTemplatizedOp2<'l', BinaryOp>(1), getTemplatizedOp2<'l', BinaryOpBatch>(1));
                 break;
             case 'g':
-                interpreter->addOp(getTemplatizedOp2<'g', BinaryOp>(1));
+                interpreter->addOp(getTemplatizedOp2<'g', BinaryOp>(1), getTemplatizedOp2<'g', BinaryOpBatch>(1));
                 break;
             case '&':
                 assert(false);  // interpreter->addOp(getTemplatizedOp2<'&',BinaryOp>(1));break;
@@ -899,9 +1912,9 @@ int ExprCompareNode::buildInterpreter(Interpreter* interpreter) const {
                 assert(false);
         }
         int op2 = interpreter->allocFP(1);
-        interpreter->addOperand(op0);
-        interpreter->addOperand(op1);
-        interpreter->addOperand(op2);
+        interpreter->addOperand(op0, Interpreter::ReadFP);
+        interpreter->addOperand(op1, Interpreter::ReadFP);
+        interpreter->addOperand(op2, Interpreter::WriteFP);
         interpreter->endOp();
         return op2;
     }
@@ -928,6 +1941,15 @@ int ExprPrototypeNode::buildInterpreter(Interpreter* interpreter) const {
     return 0;
 }
 
+namespace {
+//! Whether the string node always evaluates to an interned string (see ExprStringTable)
+bool isInternedString(const ExprNode* node) {
+    if (const ExprReuseNode* reuse = dynamic_cast<const ExprReuseNode*>(node)) node = reuse->shared();
+    if (dynamic_cast<const ExprSharedNode*>(node)) node = node->child(0);
+    return dynamic_cast<const ExprStrNode*>(node) != nullptr;
+}
+}
+
 int ExprCompareEqNode::buildInterpreter(Interpreter* interpreter) const {
     const ExprNode* child0 = child(0), *child1 = child(1);
     int op0 = child0->buildInterpreter(interpreter);
@@ -938,41 +1960,47 @@ int ExprCompareEqNode::buildInterpreter(Interpreter* interpreter) const {
         int dimCompare = std::max(dim0, dim1);
         if (dimCompare > 1) {
             if (dim0 == 1) {
-                interpreter->addOp(getTemplatizedOp<Promote>(dim1));
+                interpreter->addOp(getTemplatizedOp<Promote>(dim1), getTemplatizedOp<PromoteBatch>(dim1));
                 int promotedOp0 = interpreter->allocFP(dim1);
-                interpreter->addOperand(op0);
-                interpreter->addOperand(promotedOp0);
+                interpreter->addOperand(op0, Interpreter::ReadFP);
+                interpreter->addOperand(promotedOp0, Interpreter::WriteFP);
                 interpreter->endOp();
                 op0 = promotedOp0;
             }
             if (dim1 == 1) {
-                interpreter->addOp(getTemplatizedOp<Promote>(dim0));
+                interpreter->addOp(getTemplatizedOp<Promote>(dim0), getTemplatizedOp<PromoteBatch>(dim0));
                 int promotedOp1 = interpreter->allocFP(dim0);
-                interpreter->addOperand(op1);
-                interpreter->addOperand(promotedOp1);
+                interpreter->addOperand(op1, Interpreter::ReadFP);
+                interpreter->addOperand(promotedOp1, Interpreter::WriteFP);
                 interpreter->endOp();
                 op1 = promotedOp1;
             }
         }
         if (_op == '=')
-            interpreter->addOp(getTemplatizedOp2<'=', CompareEqOp>(dimCompare));
+            interpreter->addOp(getTemplatizedOp2<'=', CompareEqOp>(dimCompare),
+                               getTemplatizedOp2<'=', CompareEqOpBatch>(dimCompare));
         else if (_op == '!')
-            interpreter->addOp(getTemplatizedOp2<'!', CompareEqOp>(dimCompare));
+            interpreter->addOp(getTemplatizedOp2<'!', CompareEqOp>(dimCompare),
+                               getTemplatizedOp2<'!', CompareEqOpBatch>(dimCompare));
         else
             assert(false && "Invalid operation");
     } else if (child0->type().isString()) {
+        bool interned = isInternedString(child0) && isInternedString(child1);
         if (_op == '=')
-            interpreter->addOp(getTemplatizedOp2<'=', StrCompareEqOp>(1));
+            interpreter->addOp(interned ? getTemplatizedOp2<'=', InternedStrCompareEqOp>(1)
+                                        : getTemplatizedOp2<'=', StrCompareEqOp>(1));
         else if (_op == '!')
-            interpreter->addOp(getTemplatizedOp2<'!', StrCompareEqOp>(1));
+            interpreter->addOp(interned ? getTemplatizedOp2<'!', InternedStrCompareEqOp>(1)
+                                        : getTemplatizedOp2<'!', StrCompareEqOp>(1));
         else
             assert(false && "Invalid operation");
     } else
         assert(false && "Invalid type for comparison");
     int op2 = interpreter->allocFP(1);
-    interpreter->addOperand(op0);
-    interpreter->addOperand(op1);
-    interpreter->addOperand(op2);
+    Interpreter::OperandKind read = child0->type().isString() ? Interpreter::ReadPtr : Interpreter::ReadFP;
+    interpreter->addOperand(op0, read);
+    interpreter->addOperand(op1, read);
+    interpreter->addOperand(op2, Interpreter::WriteFP);
     interpreter->endOp(child0->type().isString() == false);
     return op2;
 }
@@ -985,26 +2013,28 @@ int ExprCondNode::buildInterpreter(Interpreter* interpreter) const {
     // conditional
     int condOp = child(0)->buildInterpreter(interpreter);
     int basePC = (interpreter->nextPC());
-    interpreter->addOp(CondJmpRelativeIfFalse::f);
-    interpreter->addOperand(condOp);
-    int destFalse = interpreter->addOperand(0);
+    interpreter->addOp(CondJmpRelativeIfFalse::f, CondJmpRelativeBatch<false>::f);
+    interpreter->addOperand(condOp, Interpreter::ReadFP);
+    int destFalse = interpreter->addOperand(0, Interpreter::JumpOffset);
     interpreter->endOp();
 
     // true way of working
     int op1 = child(1)->buildInterpreter(interpreter);
     if (type().isFP())
-        interpreter->addOp(getTemplatizedOp<AssignOp>(dimout));
+        interpreter->addOp(getTemplatizedOp<AssignOp>(dimout), getTemplatizedOp<AssignOpBatch>(dimout));
     else if (type().isString())
         interpreter->addOp(AssignStrOp::f);
     else
         assert(false);
-    interpreter->addOperand(op1);
-    int dataOutTrue = interpreter->addOperand(-1);
+    Interpreter::OperandKind read = type().isString() ? Interpreter::ReadPtr : Interpreter::ReadFP;
+    Interpreter::OperandKind write = type().isString() ? Interpreter::WritePtr : Interpreter::WriteFP;
+    interpreter->addOperand(op1, read);
+    int dataOutTrue = interpreter->addOperand(-1, write);
     interpreter->endOp(false);
 
     // jump past false way of working
-    interpreter->addOp(JmpRelative::f);
-    int destEnd = interpreter->addOperand(0);
+    interpreter->addOp(JmpRelative::f, JmpRelative::f);
+    int destEnd = interpreter->addOperand(0, Interpreter::JumpOffset);
     interpreter->endOp();
 
     // record start of false condition
@@ -1013,13 +2043,13 @@ int ExprCondNode::buildInterpreter(Interpreter* interpreter) const {
     // false way of working
     int op2 = child(2)->buildInterpreter(interpreter);
     if (type().isFP())
-        interpreter->addOp(getTemplatizedOp<AssignOp>(dimout));
+        interpreter->addOp(getTemplatizedOp<AssignOp>(dimout), getTemplatizedOp<AssignOpBatch>(dimout));
     else if (type().isString())
         interpreter->addOp(AssignStrOp::f);
     else
         assert(false);
-    interpreter->addOperand(op2);
-    int dataOutFalse = interpreter->addOperand(-1);
+    interpreter->addOperand(op2, read);
+    int dataOutFalse = interpreter->addOperand(-1, write);
     interpreter->endOp(false);
 
     // patch up relative jumps
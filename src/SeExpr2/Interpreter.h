@@ -19,9 +19,17 @@
 
 #include <vector>
 #include <stack>
+#include <memory>
+#include <stdint.h>
+
+#include "ExprStringTable.h"
 
 namespace SeExpr2 {
 class ExprLocalVar;
+class ExprNode;
+class ExprVarRef;
+class VarBlock;
+struct VarBinding;
 
 //! Promotes a FP[1] to FP[d]
 template <int d>
@@ -35,48 +43,152 @@ struct Promote {
     }
 };
 
+/// Working registers an interpreter program is evaluated in: an Expression's own, or those a thread safe VarBlock
+/// keeps for every program it evaluates. Initialized from the program's registers (its constants) on first use.
+struct InterpreterScratch {
+    /// expires when the program is destroyed (for scratch kept by a VarBlock)
+    std::weak_ptr<const void> alive;
+    /// double and str registers
+    std::vector<double> d;
+    std::vector<char*> s;
+    /// the same registers broadcast to every lane, and room for splitting lanes, for Interpreter::evalMultiple
+    std::vector<double> batchD, batchSplitD;
+    std::vector<char*> batchS, batchSplitS;
+    /// call stack for local functions
+    std::vector<int> callStack;
+    /// strings computed by the program, taken back at the start of every evaluation
+    ExprStringArena strings;
+};
+
 /// Non-LLVM manual interpreter. This is a simple computation machine. There are no dynamic activation records
 /// just fixed locations, because we have no recursion!
 class Interpreter {
   public:
-    /// Double data (constants and evaluated)
+    /// Double data: constants, and values computed while building. Evaluation only reads it, to initialize an
+    /// InterpreterScratch, so Expressions may share a program.
     std::vector<double> d;
-    /// constant and evaluated pointer data
+    /// constant pointer data, read only by evaluation like d
     std::vector<char*> s;
     /// Ooperands to op
     std::vector<int> opData;
 
+    /// What an operand refers to, for the register liveness analysis of compactRegisters()
+    enum OperandKind {
+        UnknownOperand,  ///< unspecified, compactRegisters() then leaves the program's registers alone
+        Immediate,       ///< not a register (VarBlock offset, count, ...)
+        JumpOffset,      ///< number of ops to jump, relative to the op
+        ProgramCounter,  ///< absolute op index
+        ReadFP,
+        WriteFP,
+        ReadPtr,
+        WritePtr
+    };
+    /// Kind of each entry in opData
+    std::vector<OperandKind> opDataKinds;
+
     /// Not needed for eval only building
     typedef std::map<const ExprLocalVar*, int> VarToLoc;
     VarToLoc varToLoc;
+    /// Registers holding variables computed earlier in the same program, read by ExprVarNode instead of calling
+    /// ExprVarRef::eval (used to fuse several expressions into one program)
+    typedef std::map<const ExprVarRef*, int> VarRefToLoc;
+    VarRefToLoc varRefToLoc;
+    /// Registers holding the value of every ExprSharedNode built so far, read by its ExprReuseNodes
+    typedef std::map<const ExprNode*, int> SharedToLoc;
+    SharedToLoc sharedToLoc;
 
     /// Op function pointer arguments are (int* currOpData,double* currD,char** c,std::stack<int>& callStackurrS)
     typedef int (*OpF)(int*, double*, char**, std::vector<int>&);
 
     std::vector<std::pair<OpF, int> > ops;
+    /// Batched (SoA) variant of each op in ops, or null if the op can only run one point at a time
+    std::vector<OpF> batchOps;
+    /// call stack of ops evaluated while building the program
     std::vector<int> callStack;
+    /// Locations in d of the "already computed" flag of every hoisted uniform subtree (see ExprUniformNode)
+    std::vector<int> uniformFlags;
+    /// Strings computed by ops evaluated while building the program (evaluations use their scratch's arena). Ops
+    /// find the arena in use at s[2].
+    ExprStringArena strings;
+    /// Sizes of d and s before compactRegisters() reused the registers of dead temporaries
+    size_t uncompactedFPSize = 0, uncompactedPtrSize = 0;
+
+    /// Number of points evaluated together by evalMultiple when every op has a batched variant.
+    /// In batch mode register k of lane l lives at fp[k*batchWidth+l] and c[1] points at a
+    /// size_t[batchWidth] array holding each lane's indirect index.
+    static const int batchWidth = 8;
 
   private:
     bool _startedOp;
     int _pcStart;
+    /// ops and opData laid out as one instruction stream used by eval: every op is its OpF, its batched OpF, its
+    /// length in ints and its operands (see assemble())
+    std::vector<int> _code;
+    /// Stream offset of every op (and of the end of the program), to follow jumps
+    std::vector<int> _codeOffsets;
+    /// Every allocFP() and allocPtr() allocation as (location, size), and those that may never share registers
+    std::vector<std::pair<int, int> > _fpAllocs, _ptrAllocs;
+    std::vector<int> _pinnedFP, _pinnedPtr;
+    bool _unknownOperands = false, _compacted = false;
+    /// Identifies this program's registers in thread safe VarBlocks, which drop them once _alive expires
+    uint64_t _id;
+    std::shared_ptr<const void> _alive;
+    /// Batched working registers (followed by room for dim results of every lane), and the room used when lanes
+    /// split: one lane's registers, then a copy of the registers and str registers for every nesting depth
+    struct BatchRegisters {
+        std::vector<double>* d;
+        std::vector<char*>* s;
+        std::vector<double>* splitD;
+        std::vector<char*>* splitS;
+    };
+    BatchRegisters batchRegisters(VarBlock* block, InterpreterScratch& own, int dim);
+
+    /// Run the batched ops from pc to the end of the program, then copy the returnSlot values of the lanes set in
+    /// lanes to result (SoA). Lanes that disagree on a branch are split into groups that continue separately, at
+    /// depth+1.
+    void runBatch(int pc,
+                  unsigned lanes,
+                  double* fp,
+                  char** str,
+                  int returnSlot,
+                  int dim,
+                  double* result,
+                  const BatchRegisters& registers,
+                  int depth);
+    /// Run the scalar op at instruction once for each of lanes, for ops without a batched variant
+    void runLanes(const int* instruction, unsigned lanes, double* fp, char** str, double* laneFP);
+
+    static uint64_t nextId();
+
+    template <class T>
+    void evalMultipleInto(VarBlock* varBlock,
+                          InterpreterScratch& own,
+                          int outputVarBlockOffset,
+                          int returnSlot,
+                          int dim,
+                          size_t rangeStart,
+                          size_t rangeEnd,
+                          const VarBinding& output);
 
   public:
-    Interpreter() : _startedOp(false) {
+    Interpreter() : _startedOp(false), _pcStart(0), _id(nextId()), _alive(std::make_shared<char>()) {
         s.push_back(nullptr);  // reserved for double** of variable block
         s.push_back(nullptr);  // reserved for double** of variable block
+        s.push_back(nullptr);  // reserved for the ExprStringArena of the evaluation
     }
 
     /// Return the position that the next instruction will be placed at
     int nextPC() { return static_cast<int>(ops.size()); }
 
     ///! adds an operator to the program (pointing to the data at the current location)
-    int addOp(OpF op) {
+    int addOp(OpF op, OpF batchOp = 0) {
         if (_startedOp) {
             assert(false && "addOp called within another addOp");
         }
         _startedOp = true;
         int pc = static_cast<int>(ops.size());
         ops.push_back(std::make_pair(op, static_cast<int>(opData.size())));
+        batchOps.push_back(batchOp);
         return pc;
     }
 
@@ -85,6 +197,7 @@ class Interpreter {
         if (execute) {
             double* fp = &d[0];
             char** str = &s[0];
+            str[2] = reinterpret_cast<char*>(&strings);
             int pc = static_cast<int>(ops.size()) - 1;
             const std::pair<OpF, int>& op = ops[pc];
             int* opCurr = &opData[0] + op.second;
@@ -93,10 +206,12 @@ class Interpreter {
     }
 
     ///! Adds an operand. Note this should be done after doing the addOp!
-    int addOperand(int param) {
+    int addOperand(int param, OperandKind kind = UnknownOperand) {
         assert(_startedOp);
         int ret = static_cast<int>(opData.size());
         opData.push_back(param);
+        opDataKinds.push_back(kind);
+        if (kind == UnknownOperand) _unknownOperands = true;
         return ret;
     }
 
@@ -104,6 +219,7 @@ class Interpreter {
     int allocFP(int n) {
         int ret = static_cast<int>(d.size());
         for (int k = 0; k < n; k++) d.push_back(0);
+        _fpAllocs.push_back(std::make_pair(ret, n));
         return ret;
     }
 
@@ -111,17 +227,78 @@ class Interpreter {
     int allocPtr() {
         int ret = static_cast<int>(s.size());
         s.push_back(0);
+        _ptrAllocs.push_back(std::make_pair(ret, 1));
         return ret;
     }
 
-    /// Evaluate program
-    void eval(VarBlock* varBlock, bool debug = false);
+    /// Keep the FP (or pointer) allocation holding loc out of register reuse, because its value must survive
+    /// between evaluations (e.g. the result of a hoisted uniform subtree)
+    void pinRegister(int loc, bool isFP) { (isFP ? _pinnedFP : _pinnedPtr).push_back(loc); }
+
+    /// Replace frequent pairs of adjacent ops whose intermediate register is read by nothing else by single
+    /// superinstructions (scalar-vector binary ops, multiply-add, VarBlock loads feeding binary ops and compares
+    /// feeding conditional jumps). Call before compactRegisters(). Does nothing if an operand was added with
+    /// UnknownOperand.
+    void fuseOps(int returnSlot, bool returnIsFP);
+
+    /// Reuse the registers of temporaries whose live ranges (over the op list, which only jumps forward outside
+    /// of local function bodies) do not overlap, shrinking d and s. Constants and other values read before being
+    /// written, locals in varToLoc, pinned allocations, registers used by local function bodies and the returned
+    /// register keep registers of their own. Returns the new location of returnSlot. Does nothing if an operand
+    /// was added with UnknownOperand (e.g. by a plugin's ExprFuncX).
+    int compactRegisters(int returnSlot, bool returnIsFP);
+
+    /// Lay out the ops and their operands as the contiguous instruction stream that eval runs. Done on demand by
+    /// eval, but must be called before evaluating from several threads. ops and opData must not be changed after,
+    /// except by adding more ops.
+    void assemble();
+
+    /// The registers evaluating with block uses: own, or, for a thread safe block, the scratch the block keeps for
+    /// this program. Either is initialized from d and s on first use, so only the first evaluation pays for it.
+    InterpreterScratch& scratch(VarBlock* block, InterpreterScratch& own);
+
+    /// Evaluate program in scratch(varBlock, own). Hoisted uniform subtrees are recomputed unless keepUniforms is
+    /// set, in which case the values left by the previous evaluation with the same uniform inputs are reused.
+    void eval(VarBlock* varBlock, InterpreterScratch& own, bool debug = false, bool keepUniforms = false);
+    /// Evaluate program for every index in [rangeStart,rangeEnd), writing FP[dim] results found at returnSlot
+    /// into the varBlock data at outputVarBlockOffset, laid out as described by the resolved output binding.
+    /// Runs batchWidth points per op when batchable(). Ops without a batched variant (e.g. calls of an
+    /// ExprFuncSimple or of a standard function without a batch kernel, external ExprVarRefs) then run point by
+    /// point inside the batch, copying every register of the lanes in and out, so a program mostly made of such
+    /// ops gains little. Programs with local functions, string results or ops with UnknownOperand operands are
+    /// evaluated one point at a time. Registers are taken as by eval.
+    void evalMultiple(VarBlock* varBlock,
+                      InterpreterScratch& own,
+                      int outputVarBlockOffset,
+                      int returnSlot,
+                      int dim,
+                      size_t rangeStart,
+                      size_t rangeEnd,
+                      const VarBinding& output);
+    /// True if every op reachable from the program start has a batched variant or can run lane by lane
+    bool batchable() const;
     /// Debug by printing program
     void print(int pc = -1) const;
 
+    /// Memory held by the program: registers, ops and their operands, and bookkeeping kept from building it
+    size_t sizeInBytes() const;
+
     void setPCStart(int pcStart) { _pcStart = pcStart; }
 };
 
+//! Batched version of Promote, operating on batchWidth lanes at once
+template <int d>
+struct PromoteBatch {
+    static int f(int* opData, double* fp, char** c, std::vector<int>& callStack) {
+        const int W = Interpreter::batchWidth;
+        const double* in = fp + opData[0] * W;
+        double* out = fp + opData[1] * W;
+        for (int k = 0; k < d; k++)
+            for (int l = 0; l < W; l++) out[k * W + l] = in[l];
+        return 1;
+    }
+};
+
 //! Return the function f encapsulated in class T for the dynamic i converted to a static d.
 template <template <int d> class T, class T_FUNCTYPE = Interpreter::OpF>
 T_FUNCTYPE getTemplatizedOp(int i) {
@@ -16,6 +16,7 @@
 */
 
 #include <iostream>
+#include <algorithm>
 #ifdef __SSE4_1__
 #include <smmintrin.h>
 #endif
@@ -145,6 +146,135 @@ T noiseHelper(const T* X, const int* period = 0) {
     // return reduced version
     return vals[0];
 }
+
+//! Number of points the batch kernels process together
+static const int noiseBlock = 8;
+
+//! Floors m values
+template <class T>
+inline void floorBlock(const T* in, T* out, int m) {
+    for (int l = 0; l < m; l++) out[l] = floorSSE(in[l]);
+}
+
+inline void floorBlock(const double* in, double* out, int m) {
+    int l = 0;
+#ifdef __SSE4_1__
+    for (; l + 2 <= m; l += 2) _mm_storeu_pd(out + l, _mm_floor_pd(_mm_loadu_pd(in + l)));
+#endif
+    for (; l < m; l++) out[l] = floorSSE(in[l]);
+}
+
+//! hashReduceChar of m lattice points at once, index[k][l] is coordinate k of point l
+template <int d>
+void hashReduceCharBlock(const int (*index)[noiseBlock], int* out, int m) {
+    int l = 0;
+#ifdef __SSE4_1__
+    const __m128i M = _mm_set1_epi32(1664525), C = _mm_set1_epi32(1013904223);
+    const __m128i mask0 = _mm_set1_epi32(int(0x9d2c5680U)), mask1 = _mm_set1_epi32(int(0xefc60000U));
+    for (; l + 4 <= m; l += 4) {
+        __m128i seed = _mm_setzero_si128();
+        for (int k = 0; k < d; k++)
+            seed = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(seed, M),
+                                               _mm_loadu_si128(reinterpret_cast<const __m128i*>(index[k] + l))),
+                                 C);
+        seed = _mm_xor_si128(seed, _mm_srli_epi32(seed, 11));
+        seed = _mm_xor_si128(seed, _mm_and_si128(_mm_slli_epi32(seed, 7), mask0));
+        seed = _mm_xor_si128(seed, _mm_and_si128(_mm_slli_epi32(seed, 15), mask1));
+        seed = _mm_xor_si128(seed, _mm_srli_epi32(seed, 18));
+        __m128i hash = _mm_add_epi32(_mm_srli_epi32(_mm_and_si128(seed, _mm_set1_epi32(0xff0000)), 4),
+                                     _mm_and_si128(seed, _mm_set1_epi32(0xff)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + l), _mm_and_si128(hash, _mm_set1_epi32(0xff)));
+    }
+#endif
+    for (; l < m; l++) {
+        int latticeIndex[d];
+        for (int k = 0; k < d; k++) latticeIndex[k] = index[k][l];
+        out[l] = hashReduceChar<d>(latticeIndex);
+    }
+}
+
+//! noiseHelper for m <= noiseBlock points, X[k][l] is coordinate k of point l. Each point goes through the
+//! same operations in the same order as noiseHelper, so the results match it exactly.
+template <int d, class T, bool periodic>
+void noiseHelperBlock(const T* const* X, int m, T* out, const int* period = 0) {
+    // find lattice index
+    T weights[2][d][noiseBlock];  // lower and upper weights
+    int index[d][noiseBlock];
+    for (int k = 0; k < d; k++) {
+        T f[noiseBlock];
+        floorBlock(X[k], f, m);
+        for (int l = 0; l < m; l++) {
+            index[k][l] = (int)f[l];
+            if (periodic) {
+                index[k][l] %= period[k];
+                if (index[k][l] < 0) index[k][l] += period[k];
+            }
+            weights[0][k][l] = X[k][l] - f[l];
+            weights[1][k][l] = weights[0][k][l] - 1;  // dist to cell with index one above
+        }
+    }
+    // compute function values propagated from zero from each node
+    const int num = 1 << d;
+    T vals[num][noiseBlock];
+    for (int dummy = 0; dummy < num; dummy++) {
+        int latticeIndex[d][noiseBlock];
+        int offset[d];
+        for (int k = 0; k < d; k++) {
+            offset[k] = ((dummy & (1 << k)) != 0);
+            for (int l = 0; l < m; l++) latticeIndex[k][l] = index[k][l] + offset[k];
+        }
+        // hash to get representative gradient vectors
+        int lookup[noiseBlock];
+        hashReduceCharBlock<d>(latticeIndex, lookup, m);
+        for (int l = 0; l < m; l++) {
+            T val = 0;
+            for (int k = 0; k < d; k++) {
+                double grad = NOISE_TABLES<d>::g[lookup[l]][k];
+                double weight = weights[offset[k]][k][l];
+                val += grad * weight;
+            }
+            vals[dummy][l] = val;
+        }
+    }
+    // compute linear interpolation coefficients
+    T alphas[d][noiseBlock];
+    for (int k = 0; k < d; k++)
+        for (int l = 0; l < m; l++) alphas[k][l] = s_curve(weights[0][k][l]);
+    // perform multilinear interpolation
+    for (int newd = d - 1; newd >= 0; newd--) {
+        int newnum = 1 << newd;
+        int k = (d - newd - 1);
+        for (int dummy = 0; dummy < newnum; dummy++) {
+            int index = dummy * (1 << (d - newd));
+            int otherIndex = index + (1 << k);
+            for (int l = 0; l < m; l++) {
+                T alpha = alphas[k][l];
+                T beta = T(1) - alphas[k][l];
+                vals[index][l] = beta * vals[index][l] + alpha * vals[otherIndex][l];
+            }
+        }
+    }
+    for (int l = 0; l < m; l++) out[l] = vals[0][l];
+}
+
+//! Noise for m <= noiseBlock points, in[k][l] is coordinate k of point l and out[i][l] receives component i
+template <int d_in, int d_out, class T>
+void noiseBlockOut(const T* const* in, int m, T* const* out) {
+    T P[d_in][noiseBlock];
+    const T* X[d_in];
+    for (int k = 0; k < d_in; k++) {
+        std::copy(in[k], in[k] + m, P[k]);
+        X[k] = P[k];
+    }
+
+    int i = 0;
+    while (1) {
+        noiseHelperBlock<d_in, T, false>(X, m, out[i]);
+        if (++i >= d_out) break;
+        for (int k = 0; k < d_out; k++)
+            for (int l = 0; l < m; l++) P[k][l] += (T)1000;
+    }
+}
 }
 
 namespace SeExpr2 {
@@ -216,6 +346,72 @@ void FBM(const T* in, T* out, int octaves, T lacunarity, T gain) {
     }
 }
 
+template <int d_in, int d_out, class T>
+void NoiseBatch(int n, const T* in, T* out) {
+    for (int l0 = 0; l0 < n; l0 += noiseBlock) {
+        int m = std::min(noiseBlock, n - l0);
+        const T* X[d_in];
+        T* Y[d_out];
+        for (int k = 0; k < d_in; k++) X[k] = in + k * n + l0;
+        for (int k = 0; k < d_out; k++) Y[k] = out + k * n + l0;
+        noiseBlockOut<d_in, d_out>(X, m, Y);
+    }
+}
+
+template <int d_in, int d_out, bool turbulence, class T>
+void FBMBatch(int n, const T* in, T* out, int octaves, T lacunarity, T gain) {
+    for (int l0 = 0; l0 < n; l0 += noiseBlock) {
+        int m = std::min(noiseBlock, n - l0);
+        T P[d_in][noiseBlock];
+        const T* X[d_in];
+        for (int k = 0; k < d_in; k++) {
+            std::copy(in + k * n + l0, in + k * n + l0 + m, P[k]);
+            X[k] = P[k];
+        }
+        T localResult[d_out][noiseBlock];
+        T* Y[d_out];
+        T* result[d_out];
+        for (int k = 0; k < d_out; k++) {
+            Y[k] = localResult[k];
+            result[k] = out + k * n + l0;
+            std::fill(result[k], result[k] + m, T(0));
+        }
+
+        T scale = 1;
+        int octave = 0;
+        while (1) {
+            noiseBlockOut<d_in, d_out>(X, m, Y);
+            for (int k = 0; k < d_out; k++)
+                for (int l = 0; l < m; l++)
+                    result[k][l] += (turbulence ? fabs(localResult[k][l]) : localResult[k][l]) * scale;
+            if (++octave >= octaves) break;
+            scale *= gain;
+            for (int k = 0; k < d_in; k++)
+                for (int l = 0; l < m; l++) {
+                    P[k][l] *= lacunarity;
+                    P[k][l] += (T)1234;
+                }
+        }
+    }
+}
+
+template <int d_in, int d_out, class T>
+void CellNoiseBatch(int n, const T* in, T* out) {
+    for (int l0 = 0; l0 < n; l0 += noiseBlock) {
+        int m = std::min(noiseBlock, n - l0);
+        T f[d_in][noiseBlock];
+        for (int k = 0; k < d_in; k++) floorBlock(in + k * n + l0, f[k], m);
+        for (int l = 0; l < m; l++) {
+            uint32_t index[d_in];
+            for (int k = 0; k < d_in; k++) index[k] = uint32_t(f[k][l]);
+            for (int dim = 0; dim < d_out; dim++) {
+                out[dim * n + l0 + l] = hashReduce<d_in>(index) * (1.0 / 0xffffffffu);
+                for (int k = 0; k < d_in; k++) index[k] += 1000;
+            }
+        }
+    }
+}
+
 // Explicit instantiations
 template void CellNoise<3, 1, double>(const double*, double*);
 template void CellNoise<3, 3, double>(const double*, double*);
@@ -232,6 +428,14 @@ template void FBM<3, 3, false, double>(const double*, double*, int, double, doub
 template void FBM<3, 3, true, double>(const double*, double*, int, double, double);
 template void FBM<4, 1, false, double>(const double*, double*, int, double, double);
 template void FBM<4, 3, false, double>(const double*, double*, int, double, double);
+template void CellNoiseBatch<3, 1, double>(int, const double*, double*);
+template void CellNoiseBatch<3, 3, double>(int, const double*, double*);
+template void NoiseBatch<3, 1, double>(int, const double*, double*);
+template void NoiseBatch<3, 3, double>(int, const double*, double*);
+template void FBMBatch<3, 1, false, double>(int, const double*, double*, int, double, double);
+template void FBMBatch<3, 1, true, double>(int, const double*, double*, int, double, double);
+template void FBMBatch<3, 3, false, double>(int, const double*, double*, int, double, double);
+template void FBMBatch<3, 3, true, double>(int, const double*, double*, int, double, double);
 }
 
 #ifdef MAINTEST
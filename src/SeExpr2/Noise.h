@@ -34,5 +34,16 @@ void FBM(const T* in, T* out, int octaves, T lacunarity, T gain);
 //! Cellular noise with input and output dimensionality
 template <int d_in, int d_out, class T>
 void CellNoise(const T* in, T* out);
+
+//! Batch versions of the above evaluating n points per call. Inputs and outputs are structure of arrays, i.e.
+//! component k of point l is in[k*n+l] (likewise for out). Results are identical to the single point versions.
+template <int d_in, int d_out, class T>
+void NoiseBatch(int n, const T* in, T* out);
+
+template <int d_in, int d_out, bool turbulence, class T>
+void FBMBatch(int n, const T* in, T* out, int octaves, T lacunarity, T gain);
+
+template <int d_in, int d_out, class T>
+void CellNoiseBatch(int n, const T* in, T* out);
 }
 #endif
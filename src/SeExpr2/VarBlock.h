@@ -17,8 +17,12 @@
 #ifndef VarBlock_h
 #define VarBlock_h
 
+#include <string.h>
+#include <map>
+#include <memory>
 #include "Expression.h"
 #include "ExprType.h"
+#include "Interpreter.h"
 #include "Vec.h"
 
 namespace SeExpr2 {
@@ -29,6 +33,90 @@ class ExprFunc;
 
 class VarBlockCreator;
 
+/// Memory layout of the data bound to a VarBlock variable (or evalMultiple output).
+/** Component k of point i of a variable bound to pointer p is read from p + i*byteStride + k*elementSize, or,
+    for an soa binding that has one pointer p_k per component (see VarBlock::bindComponent), from
+    p_k + i*byteStride. Uniform variables only have point 0. Data is converted to and from double as needed. */
+struct VarBinding {
+    enum ElementType {
+        Default,  ///< double, or float when the expression uses Expression::FloatIO
+        Double,
+        Float,
+        Int32,  ///< converted like a C cast when written
+        Half    ///< IEEE half precision stored as uint16_t (see halfToFloat and floatToHalf)
+    };
+
+    ElementType elementType;
+    uint32_t byteStride;  ///< distance between consecutive points in bytes, 0 for tightly packed data
+    bool soa;             ///< true if every component has its own pointer
+
+    VarBinding(ElementType elementType = Default, uint32_t byteStride = 0, bool soa = false)
+        : elementType(elementType), byteStride(byteStride), soa(soa) {}
+
+    static size_t elementSize(ElementType elementType) {
+        switch (elementType) {
+            case Float:
+            case Int32:
+                return 4;
+            case Half:
+                return 2;
+            default:
+                return 8;
+        }
+    }
+
+    /// This binding for data of dimension dim, with Default element types and strides made explicit
+    VarBinding resolved(bool floatIO, int dim) const {
+        VarBinding result(*this);
+        if (result.elementType == Default) result.elementType = floatIO ? Float : Double;
+        if (!result.byteStride)
+            result.byteStride = static_cast<uint32_t>(elementSize(result.elementType) * (soa ? 1 : dim));
+        return result;
+    }
+};
+
+/// Convert IEEE half precision bits to float
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f, mantissa = half & 0x3ff, bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);  // infinity or nan
+    } else if (exponent) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (!mantissa) {
+        bits = sign;
+    } else {
+        // renormalize denormals
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/// Convert float to IEEE half precision bits, rounding to nearest even
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000, magnitude = bits & 0x7fffffff;
+    if (magnitude >= 0x7f800000) return static_cast<uint16_t>(sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0));
+    if (magnitude >= 0x477ff000) return static_cast<uint16_t>(sign | 0x7c00);  // overflows to infinity
+    if (magnitude < 0x38800000) {
+        // denormal or zero
+        if (magnitude < 0x33000000) return static_cast<uint16_t>(sign);
+        uint32_t shift = 126 - (magnitude >> 23), mantissa = (magnitude & 0x7fffff) | 0x800000;
+        uint32_t result = mantissa >> shift, remainder = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (result & 1))) result++;
+        return static_cast<uint16_t>(sign | result);
+    }
+    return static_cast<uint16_t>(sign | ((magnitude + 0xfff + ((magnitude >> 13) & 1) - 0x38000000) >> 13));
+}
+
 /// A thread local evaluation context. Just allocate and fill in with data.
 class VarBlock {
   private:
@@ -41,8 +129,11 @@ class VarBlock {
     /// Move semantics is the only allowed way to change the structure
     VarBlock(VarBlock&& other) {
         threadSafe = other.threadSafe;
-        d = std::move(other.d);
-        s = std::move(other.s);
+        _scratch = std::move(other._scratch);
+        _sweptScratch = other._sweptScratch;
+        _lastScratchId = other._lastScratchId;
+        _lastScratch = other._lastScratch;
+        other._lastScratch = nullptr;
         _dataPtrs = std::move(other._dataPtrs);
         indirectIndex = other.indirectIndex;
     }
@@ -56,25 +147,74 @@ class VarBlock {
     /// Get a reference to the data block pointer which can be modified
     double*& Pointer(uint32_t variableOffset) { return reinterpret_cast<double*&>(_dataPtrs[variableOffset]); }
     char**& CharPointer(uint32_t variableOffset) { return reinterpret_cast<char**&>(_dataPtrs[variableOffset]); }
+    /// Float data block pointer, for expressions evaluated with Expression::FloatIO
+    float*& FloatPointer(uint32_t variableOffset) { return reinterpret_cast<float*&>(_dataPtrs[variableOffset]); }
+    /// Bind data laid out as described by the variable's VarBinding
+    void bind(uint32_t variableOffset, void* data) { _dataPtrs[variableOffset] = static_cast<char*>(data); }
+    /// Bind one component of a variable registered with an soa VarBinding
+    void bindComponent(uint32_t variableOffset, int component, void* data) {
+        _dataPtrs[variableOffset + component] = static_cast<char*>(data);
+    }
 
     /// indirect index to add to pointer based data
     // i.e.  _dataPtrs[someAttributeOffset][indirectIndex]
     int indirectIndex;
 
-    /// if true, interpreter's data will be copied to this instance before evaluation.
+    /// if true, the interpreter evaluates into working registers owned by this instance instead of its own.
     bool threadSafe;
 
-    /// copy of Interpreter's double data
-    std::vector<double> d;
+    /// Interpreter working registers of one program, kept by a thread safe VarBlock
+    typedef InterpreterScratch Scratch;
 
-    /// copy of Interpreter's str data
-    std::vector<char*> s;
+    /// The working registers of interpreter program programId (empty when this block has not evaluated it yet).
+    /// Every program has its own, kept (with the strings its last evaluation computed) until alive expires.
+    Scratch& scratch(uint64_t programId, const std::shared_ptr<const void>& alive) {
+        if (_lastScratch && _lastScratchId == programId) return *_lastScratch;
+        std::map<uint64_t, Scratch>::iterator it = _scratch.find(programId);
+        if (it == _scratch.end()) {
+            // sweep once the table has doubled since the last sweep, as ExprProgramCache does
+            if (_scratch.size() >= 2 * _sweptScratch + 16) removeExpiredScratch();
+            it = _scratch.insert(std::make_pair(programId, Scratch())).first;
+            it->second.alive = alive;
+        }
+        _lastScratchId = programId;
+        _lastScratch = &it->second;
+        return it->second;
+    }
+
+    /// Make another evaluation context bound to the same variable data (e.g. one for each thread)
+    VarBlock clone(bool makeThreadSafe) const {
+        VarBlock block(static_cast<int>(_dataPtrs.size()), makeThreadSafe);
+        block._dataPtrs = _dataPtrs;
+        block.indirectIndex = indirectIndex;
+        return block;
+    }
 
     /// Raw data of the data block pointer (used by compiler)
     char** data() { return _dataPtrs.data(); }
 
   private:
-    /// This stores double* or char** ptrs to variables
+    /// Drop the working registers of programs that were destroyed
+    void removeExpiredScratch() {
+        for (std::map<uint64_t, Scratch>::iterator it = _scratch.begin(); it != _scratch.end();) {
+            if (it->second.alive.expired())
+                _scratch.erase(it++);
+            else
+                ++it;
+        }
+        _sweptScratch = _scratch.size();
+        _lastScratch = nullptr;
+    }
+
+    /// Working registers of the programs evaluated with this block (when thread safe), by program id
+    std::map<uint64_t, Scratch> _scratch;
+    /// Number of entries left by the last sweep for expired entries
+    size_t _sweptScratch = 0;
+    /// The entry found by the last lookup, as a block usually evaluates the same program over and over
+    uint64_t _lastScratchId = 0;
+    Scratch* _lastScratch = nullptr;
+
+    /// This stores the data pointers of variables (one per component for soa bindings) or char** for strings
     std::vector<char*> _dataPtrs;
 };
 
@@ -86,29 +226,40 @@ class VarBlockCreator {
     /// Internally implemented var ref used by SeExpr
     class Ref : public ExprVarRef {
         uint32_t _offset;
-        uint32_t _stride;
+        VarBinding _binding;
 
       public:
         uint32_t offset() const { return _offset; }
-        uint32_t stride() const { return _stride; }
-        Ref(const ExprType& type, uint32_t offset, uint32_t stride)
-            : ExprVarRef(type), _offset(offset), _stride(stride) {}
+        const VarBinding& binding() const { return _binding; }
+        Ref(const ExprType& type, uint32_t offset, const VarBinding& binding)
+            : ExprVarRef(type), _offset(offset), _binding(binding) {}
         void eval(double*) override { assert(false); }
         void eval(const char**) override { assert(false); }
     };
 
-    /// Register a variable and return a handle
-    int registerVariable(const std::string& name, const ExprType type) {
+    /// Register a variable and return a handle. By default its data is dim packed doubles (floats for
+    /// Expression::FloatIO) per point; binding describes any other layout. An soa binding reserves
+    /// one data pointer per component.
+    int registerVariable(const std::string& name, const ExprType type, const VarBinding& binding = VarBinding()) {
         if (_vars.find(name) != _vars.end()) {
             throw std::runtime_error("Already registered a variable named " + name);
+        } else if (!type.isFP() && (binding.elementType != VarBinding::Default || binding.byteStride || binding.soa)) {
+            throw std::runtime_error("Only FP variables may have a binding, not " + name);
         } else {
             int offset = _nextOffset;
-            _nextOffset += 1;
-            _vars.insert(std::make_pair(name, Ref(type, offset, type.dim())));
+            _nextOffset += binding.soa ? type.dim() : 1;
+            _vars.insert(std::make_pair(name, Ref(type, offset, binding)));
+            _bindings.resize(_nextOffset);
+            _bindings[offset] = binding;
             return offset;
         }
     }
 
+    /// The binding of the variable registered at variableOffset (the default one for unknown offsets)
+    VarBinding binding(uint32_t variableOffset) const {
+        return variableOffset < _bindings.size() ? _bindings[variableOffset] : VarBinding();
+    }
+
     /// Get an evaluation handle (one needed per thread)
     /// \param makeThreadSafe
     ///     If true, right before evaluating the expression, all data used
@@ -132,6 +283,7 @@ class VarBlockCreator {
   private:
     int _nextOffset = 0;
     std::map<std::string, Ref> _vars;
+    std::vector<VarBinding> _bindings;
 };
 
 }  // namespace
@@ -20,6 +20,19 @@
 #include <SeExpr2/Expression.h>
 #include <SeExpr2/ExprFunc.h>
 #include <SeExpr2/Vec.h>
+#include <SeExpr2/VarBlock.h>
+#include <SeExpr2/ExprProgramCache.h>
+#include <SeExpr2/ExprThreadPool.h>
+#include <SeExpr2/ExprMultiExpr.h>
+#include <SeExpr2/ExprLLVMObjectCache.h>
+#include <SeExpr2/Noise.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#ifdef SEEXPR_ENABLE_LLVM
+#include <llvm/Support/FileSystem.h>
+#endif
 using namespace SeExpr2;
 
 static int invocations = 0;
@@ -54,6 +67,17 @@ struct Func : public ExprFuncSimple {
 } testFuncSimple;
 ExprFunc testFunc(testFuncSimple, 4, 4);
 
+//! countInvocations as an ExprFuncSimple, whose calls have no batched interpreter op
+struct CountFuncX : public ExprFuncSimple {
+    CountFuncX() : ExprFuncSimple(true) {}
+    ExprType prep(ExprFuncNode* node, bool scalarWanted, ExprVarEnvBuilder& envBuilder) const {
+        return node->checkArg(0, ExprType().FP(1).Varying(), envBuilder) ? ExprType().FP(1).Varying()
+                                                                          : ExprType().Error();
+    }
+    ExprFuncNode::Data* evalConstant(const ExprFuncNode* node, ArgHandle args) const { return nullptr; }
+    void eval(ArgHandle args) { args.outFp = countInvocations(args.inFp<1>(0)[0]); }
+} countFuncX;
+
 struct SimpleExpression : public Expression {
     // Define simple scalar variable type that just stores the value it returns
     struct Var : public ExprVarRef {
@@ -171,6 +195,42 @@ TEST(BasicTests, LogicalShortCircuiting) {
     testExpr("countInvocations(0)||countInvocations(0)||countInvocations(0)", 0, 3);
 }
 
+TEST(BasicTests, CommonSubexpressionElimination) {
+    // a repeated pure subtree is computed once where an earlier copy is evaluated on every path to it
+    struct CSEExpression : public SimpleExpression {
+        mutable ExprFunc pureCountFunc;
+        CSEExpression(const std::string& str) : SimpleExpression(str), pureCountFunc(countInvocations) {
+            pureCountFunc.pure();
+        }
+        ExprFunc* resolveFunc(const std::string& name) const {
+            if (name == "pureCount") return &pureCountFunc;
+            return SimpleExpression::resolveFunc(name);
+        }
+    };
+    auto testExpr = [&](const char* expr, double expectedOutput, int invocationsExpected) {
+        CSEExpression expr1(expr);
+        expr1.x.value = 2;
+        ASSERT_TRUE(expr1.isValid()) << expr1.parseError();
+        invocations = 0;
+        EXPECT_EQ(expr1.evalFP()[0], expectedOutput) << expr;
+        EXPECT_EQ(invocations, invocationsExpected) << expr;
+    };
+    testExpr("pureCount(x*3)+pureCount(x*3)", 12, 1);
+    testExpr("a=pureCount(x*3)+1; b=pureCount(x*3)*2; a+b", 19, 1);
+    testExpr("countInvocations(x*3)+countInvocations(x*3)", 12, 2);
+    testExpr("x>1 ? pureCount(x) : pureCount(x)+1", 2, 1);
+    testExpr("pureCount(x)>1 ? pureCount(x) : 0", 2, 1);
+    testExpr("(x>1 ? pureCount(x+1) : 0) + pureCount(x+1)", 6, 2);
+    testExpr("a=pureCount(x); a=a+1; pureCount(x)+a", 5, 1);
+    testExpr("a=x; a=a+1; pureCount(a)+pureCount(x)", 5, 2);
+
+    // marking one ExprFunc pure leaves another one sharing its ExprFuncX alone
+    ExprFunc pureShared(countFuncX, 1, 1), shared(countFuncX, 1, 1);
+    pureShared.pure();
+    EXPECT_TRUE(pureShared.isPure());
+    EXPECT_FALSE(shared.isPure());
+}
+
 TEST(BasicTests, IfThenElse) {
     auto doTest = [](
         const std::string& eStr, ExprType desiredType, bool shouldBeValid, std::function<void(const double*)> check) {
@@ -286,3 +346,1105 @@ TEST(BasicTests, Modulo) {
     EXPECT_TRUE(expr.isConstant());
     EXPECT_EQ(val[0], 1.7);
 }
+
+TEST(BasicTests, BatchedEvalMultiple) {
+    // evalMultiple runs blocks of points through the batched interpreter ops, check it against evalFP per point
+    const int numPoints = 21;  // not a multiple of the batch width so the tail block is exercised
+    VarBlockCreator creator;
+    int offP = creator.registerVariable("P", ExprType().FP(3).Varying());
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offK = creator.registerVariable("k", ExprType().FP(1).Uniform());
+    int offOut = creator.registerVariable("out", ExprType().FP(3).Varying());
+    std::vector<double> P(numPoints * 3), u(numPoints), out(numPoints * 3);
+    double k = 0.25;
+    for (int i = 0; i < numPoints * 3; i++) P[i] = 0.37 * i - 4;
+    for (int i = 0; i < numPoints; i++) u[i] = i;
+
+    auto check = [&](const std::string& exprStr) {
+        Expression e(exprStr, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+        e.setVarBlockCreator(&creator);
+        ASSERT_TRUE(e.isValid()) << e.parseError();
+        // evaluate twice with each kind of block, as the batch registers are kept from one call to the next
+        for (int pass = 0; pass < 4; pass++) {
+            VarBlock block = creator.create(pass >= 2);
+            block.Pointer(offP) = P.data();
+            block.Pointer(offU) = u.data();
+            block.Pointer(offK) = &k;
+            block.Pointer(offOut) = out.data();
+            std::fill(out.begin(), out.end(), -1);
+            e.evalMultiple(&block, offOut, 0, numPoints);
+            for (int i = 0; i < numPoints; i++) {
+                block.indirectIndex = i;
+                Vec<const double, 3, true> val(e.evalFP(&block));
+                Vec<const double, 3, true> batched(&out[3 * i]);
+                EXPECT_EQ(val, batched) << exprStr << " at index " << i << " pass " << pass;
+            }
+        }
+    };
+    check("P*k+u");
+    check("a=P-[1,2,3];b=-a%2;[a[1],b[2],length(a)]");
+    check("u>10 ? P : [u,u^2,-u]");
+    check("if(u<5){c=P;}else{c=noise(P);} c+(u==3)");
+    check("sin(P)+clamp(u,2,5)+(P!=[1,1,1])");
+    check("P*(k*2+sin(k))+[cos(k),u,k>0?-k:k]");
+    // lanes of one batch taking different ways, including nested branches and uniforms hoisted inside them
+    check("u%3==0 ? P : (u%3==1 ? -P : [u,u,u])");
+    check("if(u%2){c=P*2;}else{if(u%4==0){c=-P;}else{c=P+u;}} c*(u>7 && u<13 ? 2 : 1)");
+    check("u%2 ? P*(k*3+cos(k)) : [sin(k)*2,u,k]");
+    // noise functions with batch kernels, including a varying octave count that falls back to per lane calls
+    check("[fbm(P),turbulence(P*k,4,2.1,.6),cellnoise(P)]");
+    check("vfbm(P,u)+cturbulence(P,3)+ccellnoise(P*.3)");
+    check("cfbm(P*u,5,1.9,k)-vturbulence(P)");
+    // ops without a batched variant run lane by lane inside the batch, once per point
+    ExprFunc::define("countLanes", ExprFunc(countFuncX, 1, 1));
+    check("voronoi(P*.3)+[u,1,2]*vnoise(P)");
+    invocations = 0;
+    check("u%3==0 ? [countLanes(u),k,1] : P*countLanes(-u)");
+    EXPECT_EQ(invocations, 4 * 2 * numPoints);  // evalMultiple and evalFP for each of the four passes
+    for (int octaves = 1; octaves <= 8; octaves++) {
+        std::string o = std::to_string(octaves);
+        check("fbm(P," + o + ",2.1,.6)+cturbulence(P*k," + o + ",1.9,.45)+ccellnoise(P*" + o + ")");
+    }
+}
+
+TEST(BasicTests, NoiseBatchKernels) {
+    // the batch kernels give the single point results lane by lane, including the lanes of a partial block
+    for (int n : {1, 5, 8, 13, 21}) {
+        std::vector<double> in(3 * n), out(3 * n);
+        for (int i = 0; i < 3 * n; i++) in[i] = 0.731 * i - 5.2;  // SoA, component k of point l at k*n+l
+        auto point = [&](int l) {
+            Vec3d P;
+            for (int k = 0; k < 3; k++) P[k] = in[k * n + l];
+            return P;
+        };
+
+        CellNoiseBatch<3, 1>(n, in.data(), out.data());
+        for (int l = 0; l < n; l++) {
+            double expected;
+            CellNoise<3, 1>(&point(l)[0], &expected);
+            EXPECT_EQ(out[l], expected) << "cellnoise n " << n << " lane " << l;
+        }
+        CellNoiseBatch<3, 3>(n, in.data(), out.data());
+        for (int l = 0; l < n; l++) {
+            Vec3d expected;
+            CellNoise<3, 3>(&point(l)[0], &expected[0]);
+            for (int k = 0; k < 3; k++) EXPECT_EQ(out[k * n + l], expected[k]) << "ccellnoise n " << n << " lane " << l;
+        }
+        NoiseBatch<3, 3>(n, in.data(), out.data());
+        for (int l = 0; l < n; l++) {
+            Vec3d expected;
+            Noise<3, 3>(&point(l)[0], &expected[0]);
+            for (int k = 0; k < 3; k++) EXPECT_EQ(out[k * n + l], expected[k]) << "vnoise n " << n << " lane " << l;
+        }
+
+        for (int octaves = 1; octaves <= 8; octaves++) {
+            FBMBatch<3, 1, false>(n, in.data(), out.data(), octaves, 2.1, 0.6);
+            for (int l = 0; l < n; l++) {
+                double expected;
+                FBM<3, 1, false>(&point(l)[0], &expected, octaves, 2.1, 0.6);
+                EXPECT_EQ(out[l], expected) << "fbm octaves " << octaves << " n " << n << " lane " << l;
+            }
+            FBMBatch<3, 3, true>(n, in.data(), out.data(), octaves, 1.9, 0.45);
+            for (int l = 0; l < n; l++) {
+                Vec3d expected;
+                FBM<3, 3, true>(&point(l)[0], &expected[0], octaves, 1.9, 0.45);
+                for (int k = 0; k < 3; k++)
+                    EXPECT_EQ(out[k * n + l], expected[k]) << "vturbulence octaves " << octaves << " n " << n
+                                                           << " lane " << l;
+            }
+        }
+    }
+}
+
+#ifdef SEEXPR_ENABLE_LLVM
+TEST(BasicTests, LLVMLoopVectorization) {
+    // scalar VarBlock expressions widen at width 4 and give the results of one point per iteration
+    const int numPoints = 103;  // not a multiple of the width so the scalar tail loop is exercised
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offOut = creator.registerVariable("out", ExprType().FP(1).Varying());
+    std::vector<double> u(numPoints);
+    for (int i = 0; i < numPoints; i++) u[i] = 0.173 * i - 3;
+
+    int oldWidth = Expression::llvmVectorWidth;
+    auto run = [&](const std::string& exprStr, int width, bool& vectorized) {
+        Expression::llvmVectorWidth = width;
+        Expression e(exprStr, ExprType().FP(1).Varying(), Expression::UseLLVM);
+        e.setVarBlockCreator(&creator);
+        std::vector<double> out(numPoints, -1);
+        EXPECT_TRUE(e.isValid()) << e.parseError();
+        VarBlock block = creator.create();
+        block.Pointer(offU) = u.data();
+        block.Pointer(offOut) = out.data();
+        e.evalMultiple(&block, offOut, 0, numPoints);
+        vectorized = e.isLLVMLoopVectorized();
+        return out;
+    };
+    for (const char* exprStr : {"u*u+3*u-1", "u>0.5 ? u*2 : 1-u", "a=u*u;a>1 ? a : -a"}) {
+        bool narrow = true, wide = false;
+        std::vector<double> expected = run(exprStr, 1, narrow);
+        EXPECT_EQ(run(exprStr, 4, wide), expected) << exprStr;
+        EXPECT_FALSE(narrow) << exprStr;
+        EXPECT_TRUE(wide) << exprStr;
+    }
+    Expression::llvmVectorWidth = oldWidth;
+}
+
+TEST(BasicTests, LLVMObjectCache) {
+    // the second compile of an expression loads the object the first one stored, and gives the same results
+    std::string directory = ::testing::TempDir() + "seexpr2-object-cache-" +
+                            std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    ASSERT_TRUE(ExprLLVMObjectCache::setDirectory(directory));
+    ExprLLVMObjectCache* cache = ExprLLVMObjectCache::instance();
+    ASSERT_TRUE(cache != nullptr);
+    bool sharePrograms = Expression::sharePrograms;
+    Expression::sharePrograms = false;  // so the second expression compiles a program of its own
+
+    const int numPoints = 37;
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offOut = creator.registerVariable("out", ExprType().FP(1).Varying());
+    std::vector<double> u(numPoints);
+    for (int i = 0; i < numPoints; i++) u[i] = 0.173 * i - 3;
+    auto run = [&]() {
+        Expression e("a=sin(u*3)+u*u;a>1 ? a : cos(a)*u", ExprType().FP(1).Varying(), Expression::UseLLVM);
+        e.setVarBlockCreator(&creator);
+        std::vector<double> out(numPoints, -1);
+        EXPECT_TRUE(e.isValid()) << e.parseError();
+        VarBlock block = creator.create();
+        block.Pointer(offU) = u.data();
+        block.Pointer(offOut) = out.data();
+        e.evalMultiple(&block, offOut, 0, numPoints);
+        return out;
+    };
+    size_t hits = cache->hits(), stores = cache->stores();
+    std::vector<double> first = run();
+    EXPECT_EQ(cache->stores(), stores + 1);
+    EXPECT_EQ(cache->hits(), hits);
+    std::vector<double> second = run();
+    EXPECT_EQ(cache->stores(), stores + 1);
+    EXPECT_EQ(cache->hits(), hits + 1);
+    EXPECT_EQ(first, second);
+
+    // so do expressions calling custom functions and reading external variables, which live at other addresses
+    // in every expression
+    struct BoundExpression : public Expression {
+        struct Var : public ExprVarRef {
+            double value = 0.5;
+            Var() : ExprVarRef(ExprType().FP(1).Varying()) {}
+            void eval(double* result) { result[0] = value; }
+            void eval(const char**) {}
+        };
+        mutable Var x;
+        mutable ExprFunc count;
+        BoundExpression()
+            : Expression("countFuncX(x)*2+x", ExprType().FP(1).Varying(), Expression::UseLLVM),
+              count(countFuncX, 1, 1) {}
+        ExprVarRef* resolveVar(const std::string& name) const { return name == "x" ? &x : 0; }
+        ExprFunc* resolveFunc(const std::string& name) const { return name == "countFuncX" ? &count : 0; }
+    };
+    BoundExpression firstBound;
+    ASSERT_TRUE(firstBound.isValid()) << firstBound.parseError();
+    EXPECT_EQ(cache->stores(), stores + 2);
+    BoundExpression secondBound;
+    ASSERT_TRUE(secondBound.isValid()) << secondBound.parseError();
+    EXPECT_EQ(cache->stores(), stores + 2);
+    EXPECT_EQ(cache->hits(), hits + 2);
+    int invocationsBefore = invocations;
+    secondBound.x.value = 2;
+    EXPECT_EQ(firstBound.evalFP()[0], 1.5);
+    EXPECT_EQ(secondBound.evalFP()[0], 6);
+    EXPECT_EQ(invocations, invocationsBefore + 2);
+
+    Expression::sharePrograms = sharePrograms;
+    ExprLLVMObjectCache::setDirectory("");
+    llvm::sys::fs::remove_directories(directory);
+}
+#endif
+
+TEST(BasicTests, FloatIOVarBlocks) {
+    // float attributes are widened on input and results narrowed on output, matching a double evaluation
+    const int numPoints = 13;
+    VarBlockCreator creator;
+    int offP = creator.registerVariable("P", ExprType().FP(3).Varying());
+    int offK = creator.registerVariable("k", ExprType().FP(1).Uniform());
+    int offOut = creator.registerVariable("out", ExprType().FP(3).Varying());
+    std::vector<float> P(numPoints * 3), out(numPoints * 3);
+    std::vector<double> Pd(numPoints * 3), outd(numPoints * 3);
+    float k = 0.3f;
+    double kd = k;
+    for (int i = 0; i < numPoints * 3; i++) Pd[i] = P[i] = 0.37f * i - 4;
+
+    for (const char* exprStr : {"P*k+noise(P)", "if(P[0]>0){c=P;}else{c=-P;} c*k"}) {
+        Expression single(exprStr, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+        single.setVarBlockCreator(&creator);
+        single.setIOPrecision(Expression::FloatIO);
+        ASSERT_TRUE(single.isValid()) << single.parseError();
+        VarBlock block = creator.create();
+        block.FloatPointer(offP) = P.data();
+        block.FloatPointer(offK) = &k;
+        block.FloatPointer(offOut) = out.data();
+        single.evalMultiple(&block, offOut, 0, numPoints);
+
+        Expression reference(exprStr, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+        reference.setVarBlockCreator(&creator);
+        ASSERT_TRUE(reference.isValid()) << reference.parseError();
+        VarBlock blockd = creator.create();
+        blockd.Pointer(offP) = Pd.data();
+        blockd.Pointer(offK) = &kd;
+        blockd.Pointer(offOut) = outd.data();
+        reference.evalMultiple(&blockd, offOut, 0, numPoints);
+
+        for (int i = 0; i < numPoints * 3; i++) EXPECT_EQ(out[i], static_cast<float>(outd[i])) << exprStr;
+        block.indirectIndex = 5;
+        float value[3];
+        single.evalFP(value, &block);
+        for (int c = 0; c < 3; c++) EXPECT_EQ(value[c], out[15 + c]) << exprStr;
+    }
+}
+
+TEST(BasicTests, TypedVarBlockBindings) {
+    // float, int and half attributes of interleaved structs and soa channels are read and written in place
+    struct Vertex {
+        float P[3];
+        int32_t id;
+        uint16_t weight;
+        uint16_t pad;
+    };
+    const int numPoints = 21;
+    std::vector<Vertex> vertices(numPoints);
+    std::vector<double> X(numPoints), Y(numPoints), Z(numPoints);
+    std::vector<float> outX(numPoints), outY(numPoints), outZ(numPoints);
+    std::vector<int32_t> outIds(numPoints * 2);
+    std::vector<uint16_t> outHalf(numPoints);
+    for (int i = 0; i < numPoints; i++) {
+        for (int c = 0; c < 3; c++) vertices[i].P[c] = 0.5f * i - c;
+        vertices[i].id = i - 7;
+        vertices[i].weight = floatToHalf(0.25f * i);
+        X[i] = i;
+        Y[i] = -i;
+        Z[i] = 0.125 * i;
+    }
+    EXPECT_EQ(halfToFloat(vertices[9].weight), 2.25f);
+    EXPECT_EQ(halfToFloat(floatToHalf(1e-6f)), 1.013278961181640625e-06f);  // nearest denormal
+
+    VarBlockCreator creator;
+    int offP = creator.registerVariable("P", ExprType().FP(3).Varying(), VarBinding(VarBinding::Float, sizeof(Vertex)));
+    int offId =
+        creator.registerVariable("id", ExprType().FP(1).Varying(), VarBinding(VarBinding::Int32, sizeof(Vertex)));
+    int offW = creator.registerVariable("w", ExprType().FP(1).Varying(), VarBinding(VarBinding::Half, sizeof(Vertex)));
+    int offQ = creator.registerVariable("Q", ExprType().FP(3).Varying(), VarBinding(VarBinding::Double, 0, true));
+    int offOut = creator.registerVariable("out", ExprType().FP(3).Varying(), VarBinding(VarBinding::Float, 0, true));
+    int offIds = creator.registerVariable("ids", ExprType().FP(1).Varying(), VarBinding(VarBinding::Int32, 8));
+    int offHalf = creator.registerVariable("half", ExprType().FP(1).Varying(), VarBinding(VarBinding::Half));
+    EXPECT_EQ(offQ + 3, offOut);  // soa bindings take one pointer per component
+    EXPECT_THROW(creator.registerVariable("s", ExprType().String(), VarBinding(VarBinding::Float)), std::runtime_error);
+
+    VarBlock block = creator.create();
+    block.bind(offP, &vertices[0].P[0]);
+    block.bind(offId, &vertices[0].id);
+    block.bind(offW, &vertices[0].weight);
+    block.bindComponent(offQ, 0, X.data());
+    block.bindComponent(offQ, 1, Y.data());
+    block.bindComponent(offQ, 2, Z.data());
+    block.bindComponent(offOut, 0, outX.data());
+    block.bindComponent(offOut, 1, outY.data());
+    block.bindComponent(offOut, 2, outZ.data());
+    block.bind(offIds, outIds.data());
+    block.bind(offHalf, outHalf.data());
+
+    for (const char* exprStr : {"P*id+Q*w", "if(id>0){c=P*id;}else{c=-P*id;} c+Q*w"}) {
+        Expression e(exprStr, ExprType().FP(3).Varying(), Expression::UseInterpreter);
+        e.setVarBlockCreator(&creator);
+        ASSERT_TRUE(e.isValid()) << e.parseError();
+        e.evalMultiple(&block, offOut, 0, numPoints);
+        bool negate = exprStr[0] == 'i';
+        for (int i = 0; i < numPoints; i++) {
+            double q[3] = {X[i], Y[i], Z[i]}, result[3];
+            float* out[3] = {&outX[i], &outY[i], &outZ[i]};
+            double w = 0.25 * i, id = i - 7;
+            for (int c = 0; c < 3; c++) {
+                double p = vertices[i].P[c] * id;
+                result[c] = (negate && id <= 0 ? -p : p) + q[c] * w;
+                EXPECT_EQ(*out[c], static_cast<float>(result[c])) << exprStr << " " << i;
+            }
+            block.indirectIndex = i;
+            double value[3];
+            e.evalFP(value, &block);
+            for (int c = 0; c < 3; c++) EXPECT_EQ(value[c], result[c]) << exprStr << " " << i;
+        }
+    }
+
+    Expression ids("floor(id*1.5)", ExprType().FP(1).Varying(), Expression::UseInterpreter);
+    ids.setVarBlockCreator(&creator);
+    ASSERT_TRUE(ids.isValid()) << ids.parseError();
+    ids.evalMultiple(&block, offIds, 0, numPoints);
+    Expression halves("w*2", ExprType().FP(1).Varying(), Expression::UseInterpreter);
+    halves.setVarBlockCreator(&creator);
+    ASSERT_TRUE(halves.isValid()) << halves.parseError();
+    halves.evalMultiple(&block, offHalf, 0, numPoints);
+    for (int i = 0; i < numPoints; i++) {
+        EXPECT_EQ(outIds[2 * i], static_cast<int32_t>(std::floor((i - 7) * 1.5)));
+        EXPECT_EQ(outIds[2 * i + 1], 0);  // the stride skips the other int
+        EXPECT_EQ(halfToFloat(outHalf[i]), 0.5f * i);
+    }
+}
+
+TEST(BasicTests, FoldConstantsAndHoistUniforms) {
+    Expression folded("x=[1,2,3]*2+sin(0.5);y=-x[1];x*y", ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    ASSERT_TRUE(folded.isValid()) << folded.parseError();
+    Vec<const double, 3, true> val(folded.evalFP());
+    double s = sin(0.5);
+    EXPECT_DOUBLE_EQ(val[0], (2 + s) * -(4 + s));
+    EXPECT_DOUBLE_EQ(val[1], (4 + s) * -(4 + s));
+    EXPECT_DOUBLE_EQ(val[2], (6 + s) * -(4 + s));
+
+    // a hoisted uniform subtree must be recomputed when its inputs change between evaluations
+    VarBlockCreator creator;
+    int offK = creator.registerVariable("k", ExprType().FP(1).Uniform());
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    double k = 1, u = 3;
+    VarBlock block = creator.create();
+    block.Pointer(offK) = &k;
+    block.Pointer(offU) = &u;
+    Expression uniform("u*(k*2+sqrt(k))", ExprType().FP(1).Varying(), Expression::UseInterpreter);
+    uniform.setVarBlockCreator(&creator);
+    ASSERT_TRUE(uniform.isValid()) << uniform.parseError();
+    EXPECT_DOUBLE_EQ(uniform.evalFP(&block)[0], 9);
+    k = 4;
+    EXPECT_DOUBLE_EQ(uniform.evalFP(&block)[0], 30);
+}
+
+TEST(BasicTests, RegisterReuse) {
+    VarBlockCreator creator;
+    int offK = creator.registerVariable("k", ExprType().FP(1).Uniform());
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    double k = 2, u = 0.25;
+    VarBlock block = creator.create();
+    block.Pointer(offK) = &k;
+    block.Pointer(offU) = &u;
+    Expression e("a=(u+1)*(u+2)*(u+3)*(u+4);\n"
+                 "b=u>0.5 ? [u,u*2,u*3]+1 : [u*4,u*5,u*6]-1;\n"
+                 "c=sqrt(k*k+1)*(u*u+1);\n"
+                 "(a+b*c)*(1+u*(2+u*(3+u*(4+u))))",
+                 ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+
+    // dead temporaries share registers
+    testing::internal::CaptureStderr();
+    e.debugPrintInterpreter();
+    std::string dump = testing::internal::GetCapturedStderr();
+    size_t at = dump.find("registers fp ");
+    ASSERT_NE(at, std::string::npos);
+    int fpSize = 0, fpSizeBefore = 0;
+    ASSERT_EQ(sscanf(dump.c_str() + at, "registers fp %d (%d", &fpSize, &fpSizeBefore), 2);
+    EXPECT_LT(fpSize, fpSizeBefore);
+
+    for (u = 0; u < 1; u += 0.125) {
+        for (k = 1; k < 3; k++) {
+            double a = (u + 1) * (u + 2) * (u + 3) * (u + 4);
+            Vec3d b = u > 0.5 ? Vec3d(u + 1, u * 2 + 1, u * 3 + 1) : Vec3d(u * 4 - 1, u * 5 - 1, u * 6 - 1);
+            double c = sqrt(k * k + 1) * (u * u + 1);
+            double scale = 1 + u * (2 + u * (3 + u * (4 + u)));
+            Vec<const double, 3, true> val(e.evalFP(&block));
+            for (int i = 0; i < 3; i++) EXPECT_DOUBLE_EQ(val[i], (a + b[i] * c) * scale) << "u " << u << " k " << k;
+        }
+    }
+}
+
+TEST(BasicTests, SuperinstructionFusion) {
+    // VarBlock loads, promoted scalars and products feeding binary ops and compares feeding branches are fused
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offP = creator.registerVariable("P", ExprType().FP(3).Varying());
+    int offOut = creator.registerVariable("out", ExprType().FP(3).Varying());
+    const int n = 20;
+    std::vector<double> u(n), P(3 * n), out(3 * n);
+    for (int i = 0; i < n; i++) {
+        u[i] = 0.05 * i;
+        for (int k = 0; k < 3; k++) P[3 * i + k] = i + k;
+    }
+    Expression e("a=u*2;\n"
+                 "c=(a+1)*(a+2)+a;\n"
+                 "b=P*c+[1,2,3];\n"
+                 "if(u<0.5){b=b*3;}else{b=2-b;}\n"
+                 "b+P",
+                 ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+    auto expected = [&](int i, int k) {
+        double a = u[i] * 2, c = (a + 1) * (a + 2) + a, b = P[3 * i + k] * c + k + 1;
+        return (u[i] < 0.5 ? b * 3 : 2 - b) + P[3 * i + k];
+    };
+
+    VarBlock block = creator.create();
+    block.Pointer(offU) = u.data();
+    block.Pointer(offP) = P.data();
+    block.Pointer(offOut) = out.data();
+    for (int i = 0; i < n; i++) {
+        block.indirectIndex = i;
+        const double* val = e.evalFP(&block);
+        for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(val[k], expected(i, k)) << "point " << i;
+    }
+    // batches on either side of u=0.5 take one branch, the one across it diverges
+    e.evalMultiple(&block, offOut, 0, n);
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++) EXPECT_DOUBLE_EQ(out[3 * i + k], expected(i, k)) << "point " << i;
+}
+
+TEST(BasicTests, MultiplyAddRounding) {
+    // the fused multiply-add op rounds the product like the separate ops do: 0.1*10 rounds to exactly 1, while a
+    // contracted fma(0.1,10,-1) would give 2^-54
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offK = creator.registerVariable("k", ExprType().FP(1).Varying());
+    int offOut = creator.registerVariable("out", ExprType().FP(1).Varying());
+    const int n = 11;
+    std::vector<double> u(n, 0.1), k(n, -1), out(n);
+    for (int i = 0; i < n; i++) u[i] += i * 1e-3;
+    Expression e("a=u;b=k;a*10+b", ExprType().FP(1).Varying(), Expression::UseInterpreter);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+
+    VarBlock block = creator.create();
+    block.Pointer(offU) = u.data();
+    block.Pointer(offK) = k.data();
+    block.Pointer(offOut) = out.data();
+    e.evalMultiple(&block, offOut, 0, n);
+    for (int i = 0; i < n; i++) {
+        volatile double product = u[i] * 10;
+        double expected = product + k[i];
+        block.indirectIndex = i;
+        EXPECT_EQ(e.evalFP(&block)[0], expected) << "point " << i;
+        EXPECT_EQ(out[i], expected) << "point " << i;
+    }
+    block.indirectIndex = 0;
+    EXPECT_EQ(e.evalFP(&block)[0], 0.);
+}
+
+TEST(BasicTests, ReentrantEvalFP) {
+    // one prepped Expression shared by several threads, each evaluating into its own buffer
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    std::vector<double> u(1000);
+    for (size_t i = 0; i < u.size(); i++) u[i] = 0.01 * i;
+    Expression e("[u,sin(u),u*u+1]", ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+
+    const int numThreads = 4;
+    std::vector<int> mismatches(numThreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            VarBlock block = creator.create(true);
+            block.Pointer(offU) = u.data();
+            for (size_t i = t; i < u.size(); i += numThreads) {
+                double result[3];
+                block.indirectIndex = static_cast<int>(i);
+                e.evalFP(result, &block);
+                if (result[0] != u[i] || result[1] != sin(u[i]) || result[2] != u[i] * u[i] + 1) mismatches[t]++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    for (int t = 0; t < numThreads; t++) EXPECT_EQ(mismatches[t], 0) << "thread " << t;
+}
+
+TEST(BasicTests, ThreadSafeScratchRegisters) {
+    // a thread safe block keeps working registers for each program it evaluates, across evaluations
+    VarBlockCreator creator;
+    int offK = creator.registerVariable("k", ExprType().FP(1).Uniform());
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    double k = 2;
+    std::vector<double> u = {1, 2, 3};
+    Expression a("x=k*k+1;u*x", ExprType().FP(1).Varying(), Expression::UseInterpreter);
+    Expression b("[u,k,3]", ExprType().FP(3).Varying(), Expression::UseInterpreter);
+    a.setVarBlockCreator(&creator);
+    b.setVarBlockCreator(&creator);
+    ASSERT_TRUE(a.isValid()) << a.parseError();
+    ASSERT_TRUE(b.isValid()) << b.parseError();
+
+    VarBlock block = creator.create(true);
+    block.Pointer(offK) = &k;
+    block.Pointer(offU) = u.data();
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < u.size(); i++) {
+            block.indirectIndex = static_cast<int>(i);
+            EXPECT_DOUBLE_EQ(a.evalFP(&block)[0], u[i] * (k * k + 1));
+            Vec<const double, 3, true> val(b.evalFP(&block));
+            EXPECT_EQ(val, Vec3d(u[i], k, 3));
+        }
+        // uniforms are recomputed for new inputs
+        k = 3;
+    }
+
+    // the interpreter's own registers are left alone
+    VarBlock unsafeBlock = creator.create();
+    unsafeBlock.Pointer(offK) = &k;
+    unsafeBlock.Pointer(offU) = u.data();
+    EXPECT_DOUBLE_EQ(a.evalFP(&unsafeBlock)[0], 10);
+    k = 1;
+    block.indirectIndex = 2;
+    EXPECT_DOUBLE_EQ(a.evalFP(&block)[0], 6);
+    EXPECT_DOUBLE_EQ(a.evalFP(&unsafeBlock)[0], 2);
+
+    // every program keeps its registers, and the strings it computed, however many others the block evaluates
+    struct NameExpression : public Expression {
+        struct Name : public ExprVarRef {
+            Name() : ExprVarRef(ExprType().String().Varying()) {}
+            void eval(double*) {}
+            void eval(const char** result) { result[0] = "name"; }
+        };
+        mutable Name name;
+        NameExpression(const std::string& e) : Expression(e, ExprType().String(), Expression::UseInterpreter) {}
+        ExprVarRef* resolveVar(const std::string& n) const { return n == "name" ? &name : 0; }
+    };
+    std::vector<std::unique_ptr<NameExpression> > many;
+    std::vector<const char*> names;
+    for (size_t i = 0; i < 40; i++) {
+        many.emplace_back(new NameExpression("name+\"_" + std::to_string(i) + "\""));
+        ASSERT_TRUE(many.back()->isValid()) << many.back()->parseError();
+        names.push_back(many.back()->evalStr(&block));
+    }
+    for (size_t i = 0; i < many.size(); i++) EXPECT_STREQ(names[i], ("name_" + std::to_string(i)).c_str());
+    // and drops them once the program is gone
+    many.clear();
+    for (size_t i = 0; i < 40; i++) {
+        NameExpression expr("name+\"!\"");
+        EXPECT_STREQ(expr.evalStr(&block), "name!");
+    }
+}
+
+TEST(BasicTests, SharedPrograms) {
+    bool oldSharePrograms = Expression::sharePrograms;
+    Expression::sharePrograms = true;
+    size_t programsBefore = ExprProgramCache::size();
+    {
+        VarBlockCreator creator;
+        int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+        double u = 2;
+        VarBlock block = creator.create();
+        block.Pointer(offU) = &u;
+
+        std::vector<std::unique_ptr<Expression> > exprs;
+        for (int i = 0; i < 3; i++) {
+            exprs.emplace_back(new Expression("k=1;u*[1,2,3]+k", ExprType().FP(3), Expression::UseInterpreter));
+            exprs.back()->setVarBlockCreator(&creator);
+            ASSERT_TRUE(exprs.back()->isValid()) << exprs.back()->parseError();
+        }
+        EXPECT_EQ(ExprProgramCache::size(), programsBefore + 1);
+
+        // a different desired type compiles a separate program
+        Expression scalar("k=1;u*[1,2,3]+k", ExprType().FP(1), Expression::UseInterpreter);
+        scalar.setVarBlockCreator(&creator);
+        ASSERT_TRUE(scalar.isValid());
+        EXPECT_EQ(ExprProgramCache::size(), programsBefore + 2);
+
+        // the creator of the shared program can go away while the others keep using it
+        exprs.erase(exprs.begin());
+        for (auto& e : exprs) {
+            Vec<const double, 3, true> val(e->evalFP(&block));
+            EXPECT_EQ(val, Vec3d(3, 5, 7));
+        }
+
+        // every expression evaluates in its own registers, so results of one are not overwritten by another
+        const double* first = exprs[0]->evalFP(&block);
+        u = 3;
+        Vec<const double, 3, true> second(exprs[1]->evalFP(&block));
+        EXPECT_EQ(second, Vec3d(4, 7, 10));
+        EXPECT_EQ(Vec3d::copy(first), Vec3d(3, 5, 7));
+
+        // programs are keyed by variable ids, not addresses that a new variable may reuse
+        for (int i = 0; i < 8; i++) {
+            std::unique_ptr<VarBlockCreator> other(new VarBlockCreator);
+            other->registerVariable("u", ExprType().FP(1).Varying(), VarBinding(VarBinding::Float));
+            Expression e("k=1;u*[1,2,3]+k", ExprType().FP(3), Expression::UseInterpreter);
+            e.setVarBlockCreator(other.get());
+            ASSERT_TRUE(e.isValid());
+            float floatU = 1;
+            VarBlock otherBlock = other->create();
+            otherBlock.bind(0, &floatU);
+            Vec<const double, 3, true> val(e.evalFP(&otherBlock));
+            EXPECT_EQ(val, Vec3d(2, 3, 4));
+        }
+    }
+    EXPECT_EQ(ExprProgramCache::size(), programsBefore);
+    Expression::sharePrograms = oldSharePrograms;
+}
+
+TEST(BasicTests, TieredEvaluation) {
+    // evaluation starts in the interpreter and keeps giving the same results once the JIT function takes over
+    size_t oldThreshold = Expression::tieredCompileThreshold;
+    Expression::tieredCompileThreshold = 8;
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offOut = creator.registerVariable("out", ExprType().FP(3).Varying());
+    std::vector<double> u(64), out(3 * u.size());
+    for (size_t i = 0; i < u.size(); i++) u[i] = 0.125 * i;
+    VarBlock block = creator.create();
+    block.Pointer(offU) = u.data();
+    block.Pointer(offOut) = out.data();
+
+    Expression e("u<2 ? [u,u*u,1] : [2,u,u+1]", ExprType().FP(3).Varying(), Expression::UseTiered);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+    auto expected = [&](size_t i) { return u[i] < 2 ? Vec3d(u[i], u[i] * u[i], 1) : Vec3d(2, u[i], u[i] + 1); };
+    for (int pass = 0; pass < 4; pass++) {
+        for (size_t i = 0; i < u.size(); i++) {
+            block.indirectIndex = static_cast<int>(i);
+            Vec<const double, 3, true> val(e.evalFP(&block));
+            EXPECT_EQ(val, expected(i)) << "point " << i;
+        }
+        e.evalMultiple(&block, offOut, 0, u.size());
+        for (size_t i = 0; i < u.size(); i++) EXPECT_EQ(Vec3d::copy(&out[3 * i]), expected(i)) << "point " << i;
+    }
+    // changing the expression waits for a compile that is still running
+    e.setExpr("u*2");
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+    block.indirectIndex = 3;
+    EXPECT_EQ(e.evalFP(&block)[0], 0.75);
+    Expression::tieredCompileThreshold = oldThreshold;
+}
+
+TEST(BasicTests, EvalMultipleParallel) {
+    const size_t numPoints = 10007;
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+    int offOut = creator.registerVariable("out", ExprType().FP(3).Varying());
+    std::vector<double> u(numPoints), serial(numPoints * 3), parallel(numPoints * 3, -1);
+    for (size_t i = 0; i < numPoints; i++) u[i] = 0.001 * i;
+
+    Expression e("a=noise(u*5);u<3 ? [a,u,sin(u)] : [u,a,cos(u)]", ExprType().FP(3), Expression::UseInterpreter);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+
+    VarBlock block = creator.create();
+    block.Pointer(offU) = u.data();
+    block.Pointer(offOut) = serial.data();
+    e.evalMultiple(&block, offOut, 0, numPoints);
+    block.Pointer(offOut) = parallel.data();
+    e.evalMultipleParallel(&block, offOut, 0, numPoints, 100);
+    EXPECT_TRUE(serial == parallel);
+}
+
+TEST(BasicTests, ThreadPoolParallelFor) {
+    // a pool with its own workers, so stealing is exercised regardless of the machine's core count
+    ExprThreadPool pool(3);
+    const size_t count = 100000;
+    std::vector<int> visits(count, 0);
+    std::atomic<size_t> chunks(0);
+    pool.parallelFor(0, count, 7, 0, [&](int thread, size_t begin, size_t end) {
+        EXPECT_LT(thread, 4);
+        EXPECT_LE(end - begin, size_t(7));
+        // make some chunks expensive so threads finish their own share at different times
+        if (begin % 3 == 0) std::this_thread::sleep_for(std::chrono::microseconds(1));
+        for (size_t i = begin; i < end; i++) visits[i]++;
+        chunks++;
+    });
+    EXPECT_GE(chunks, count / 7);
+    EXPECT_EQ(std::count(visits.begin(), visits.end(), 1), static_cast<long>(count));
+}
+
+TEST(BasicTests, ThreadPoolFewerParticipants) {
+    // workers left out of a loop may wake after it has finished and must not touch it
+    ExprThreadPool pool(8);
+    for (int iteration = 0; iteration < 20000; iteration++) {
+        std::atomic<int> sum(0);
+        pool.parallelFor(0, 4, 1, 2, [&](int thread, size_t begin, size_t end) {
+            EXPECT_LT(thread, 2);
+            for (size_t i = begin; i < end; i++) sum += static_cast<int>(i);
+        });
+        ASSERT_EQ(sum, 6);
+    }
+}
+
+TEST(BasicTests, ThreadPoolException) {
+    ExprThreadPool pool(3);
+    std::atomic<int> calls(0);
+    EXPECT_THROW(pool.parallelFor(0, 1000, 1, 0,
+                                  [&](int thread, size_t begin, size_t end) {
+                                      calls++;
+                                      if (begin == 500) throw std::runtime_error("body failed");
+                                  }),
+                 std::runtime_error);
+    EXPECT_LE(calls, 1000);
+    // the pool is usable after a failed loop
+    std::atomic<size_t> visited(0);
+    pool.parallelFor(0, 1000, 10, 0, [&](int thread, size_t begin, size_t end) { visited += end - begin; });
+    EXPECT_EQ(visited, size_t(1000));
+}
+
+TEST(BasicTests, ScratchKeptWhileNodeLives) {
+    // a thread's scratch for a live node survives many other nodes coming and going, and theirs is freed
+    static int scratchCreated = 0;
+    struct ScratchFuncX : public ExprFuncSimple {
+        ScratchFuncX() : ExprFuncSimple(true) {}
+        ExprType prep(ExprFuncNode* node, bool scalarWanted, ExprVarEnvBuilder& envBuilder) const {
+            return node->checkArg(0, ExprType().FP(1).Varying(), envBuilder) ? ExprType().FP(1).Varying()
+                                                                              : ExprType().Error();
+        }
+        ExprFuncNode::Data* evalConstant(const ExprFuncNode* node, ArgHandle args) const {
+            return new ExprFuncNode::Data(true);
+        }
+        ExprFuncNode::Data* evalScratch(const ExprFuncNode::Data* data) const {
+            scratchCreated++;
+            return new ExprFuncNode::Data;
+        }
+        void eval(ArgHandle args) {
+            scratch(args);
+            args.outFp = args.inFp<1>(0)[0];
+        }
+    } scratchFuncX;
+    ExprFunc::define("scratchFunc", ExprFunc(scratchFuncX, 1, 1));
+
+    Expression kept("scratchFunc(1)", ExprType().FP(1));
+    ASSERT_TRUE(kept.isValid()) << kept.parseError();
+    scratchCreated = 0;
+    kept.evalFP();
+    EXPECT_EQ(scratchCreated, 1);
+    for (int i = 0; i < 5000; i++) {
+        Expression other("scratchFunc(" + std::to_string(i + 2) + ")", ExprType().FP(1));
+        ASSERT_TRUE(other.isValid()) << other.parseError();
+        EXPECT_EQ(other.evalFP()[0], i + 2);
+    }
+    EXPECT_EQ(scratchCreated, 5001);
+    kept.evalFP();
+    EXPECT_EQ(scratchCreated, 5001);
+}
+
+TEST(BasicTests, VoronoiScratchPerThread) {
+    // voronoi keeps a neighbor cache; threads evaluating the same expression must not see each other's cache
+    const int numPoints = 2000;
+    VarBlockCreator creator;
+    int offP = creator.registerVariable("P", ExprType().FP(3).Varying());
+    std::vector<double> P(numPoints * 3);
+    for (int i = 0; i < numPoints * 3; i++) P[i] = 0.173 * i;
+    Expression e("voronoi(P,1,.8)+cvoronoi(P*2)", ExprType().FP(3), Expression::UseInterpreter);
+    e.setVarBlockCreator(&creator);
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+
+    std::vector<double> expected(numPoints * 3);
+    VarBlock serialBlock = creator.create(true);
+    serialBlock.Pointer(offP) = P.data();
+    for (int i = 0; i < numPoints; i++) {
+        serialBlock.indirectIndex = i;
+        e.evalFP(&expected[3 * i], &serialBlock);
+    }
+
+    const int numThreads = 4;
+    std::vector<double> results(numPoints * 3);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            VarBlock block = serialBlock.clone(true);
+            for (int i = t; i < numPoints; i += numThreads) {
+                block.indirectIndex = i;
+                e.evalFP(&results[3 * i], &block);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_TRUE(results == expected);
+}
+
+TEST(BasicTests, ConcurrentParse) {
+    // parsing has no global state, so many expressions may be parsed at once with identical results
+    const char* sources[] = {"a=1;\nb=[a,2,3];\nb*2 # comment",
+                             "def f(x){x*2}\nf($u)+'str'->foo()",
+                             "if($v>0){x=PI;}else{x=E;} x+1.5e2",
+                             "1+",
+                             "a=1;\nb=(2",
+                             "x = \"s\\\"t\"; 3 @ 4"};
+    const int numSources = sizeof(sources) / sizeof(sources[0]);
+    auto describe = [](const Expression& e) {
+        std::string result = e.parseError();
+        for (auto& error : e.getErrors())
+            result += " " + std::to_string(error.startPos) + "," + std::to_string(error.endPos);
+        for (auto& comment : e.getComments())
+            result += " #" + std::to_string(comment.first) + "," + std::to_string(comment.second);
+        return result;
+    };
+    std::vector<std::string> expected;
+    for (int i = 0; i < numSources; i++) {
+        Expression e(sources[i]);
+        e.syntaxOK();
+        expected.push_back(describe(e));
+    }
+    EXPECT_NE(expected[3].find("Unexpected end of expression"), std::string::npos);
+    EXPECT_NE(expected[4].find("at line 2"), std::string::npos);
+    EXPECT_NE(expected[5].find("near '@'"), std::string::npos);
+
+    const int numThreads = 4;
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 200; i++) {
+                int source = (i + t) % numSources;
+                Expression e(sources[source]);
+                e.syntaxOK();
+                if (describe(e) != expected[source]) mismatches++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(mismatches, 0);
+}
+
+TEST(BasicTests, PrepareAsync) {
+    VarBlockCreator creator;
+    int offU = creator.registerVariable("u", ExprType().FP(1).Uniform());
+    double u = 3;
+    VarBlock block = creator.create(true);
+    block.Pointer(offU) = &u;
+    const int numExprs = 16;
+    std::vector<std::unique_ptr<Expression> > exprs;
+    for (int i = 0; i < numExprs; i++) {
+        std::string source = i == numExprs - 1 ? "u+" : "a=u*" + std::to_string(i) + ";[a,a+1,a+2]";
+        exprs.emplace_back(new Expression(source, ExprType().FP(3), Expression::UseInterpreter));
+        exprs.back()->setVarBlockCreator(&creator);
+    }
+
+    // half of them prepared on threads of their own, the others as tasks run by a custom executor
+    std::vector<std::thread> executorThreads;
+    Expression::Executor executor = [&](std::function<void()> task) { executorThreads.emplace_back(task); };
+    std::vector<std::future<bool> > ready;
+    for (int i = 0; i < numExprs; i++) ready.push_back(exprs[i]->prepareAsync(i % 2 ? executor : nullptr));
+    for (int i = 0; i < numExprs; i++) EXPECT_EQ(ready[i].get(), i != numExprs - 1) << "expression " << i;
+    for (auto& thread : executorThreads) thread.join();
+    for (int i = 0; i < numExprs - 1; i++) {
+        Vec<const double, 3, true> val(exprs[i]->evalFP(&block));
+        EXPECT_EQ(val, Vec3d(3 * i, 3 * i + 1, 3 * i + 2));
+    }
+    EXPECT_FALSE(exprs.back()->parseError().empty());
+
+    // threads racing into the first use of an expression prepare it once
+    const int numThreads = 4;
+    for (int round = 0; round < 20; round++) {
+        Expression e("a=u*2;[a,a,a]+1", ExprType().FP(3), Expression::UseInterpreter);
+        e.setVarBlockCreator(&creator);
+        std::atomic<int> mismatches(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; t++) {
+            threads.emplace_back([&]() {
+                VarBlock threadBlock = block.clone(true);
+                double result[3];
+                e.evalFP(result, &threadBlock);
+                if (Vec3d::copy(result) != Vec3d(7, 7, 7)) mismatches++;
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        EXPECT_EQ(mismatches, 0);
+    }
+}
+
+TEST(BasicTests, ExpressionsGraph) {
+    // a leveled graph only recomputes what changed, evaluating wide levels in parallel
+    Expressions ee;
+    ee.parallelLevelSize = 2;
+    VariableHandle x = ee.addExternalVariable("x", ExprType().FP(1).Varying());
+    VariableHandle t = ee.addExternalVariable("t", ExprType().FP(1).Varying());
+    ExprHandle a = ee.addExpression("a", ExprType().FP(1).Varying(), "x*2");
+    ee.addExpression("b", ExprType().FP(1).Varying(), "t+a");
+    ee.addExpression("c", ExprType().FP(1).Varying(), "t*a");
+    ExprHandle d = ee.addExpression("d", ExprType().FP(1).Varying(), "b+c");
+    std::vector<ExprHandle> leaves;
+    for (int i = 0; i < 20; i++)
+        leaves.push_back(ee.addExpression(
+            "e" + std::to_string(i), ExprType().FP(1).Varying(), "d+" + std::to_string(i)));
+    ExprHandle sum = ee.addExpression("sum", ExprType().FP(1).Varying(), "e0+e19+x");
+    ASSERT_TRUE(ee.isValid());
+    EXPECT_EQ((*a)->level, 0);
+    EXPECT_EQ((*d)->level, 2);
+    EXPECT_EQ((*leaves[7])->level, 3);
+    EXPECT_EQ((*sum)->level, 4);
+
+    VariableSetHandle tLoop = ee.getLoopVarSetHandle(t);
+    EXPECT_FALSE((*a)->loopVariant);
+    EXPECT_TRUE((*sum)->loopVariant);
+    ExprEvalHandle sumEval = ee.getExprEvalHandle(sum);
+    ExprEvalHandle leafEval = ee.getExprEvalHandle(leaves[7]);
+    EXPECT_EQ(sumEval.second.size(), size_t(6));
+    EXPECT_EQ(leafEval.second.size(), size_t(4));
+
+    ee.setVariable(x, 3);
+    for (int i = 0; i < 5; i++) {
+        ee.setLoopVariable(tLoop, i);
+        double dValue = (i + 6) + i * 6;
+        EXPECT_EQ(ee.evalFP(sumEval)[0], 2 * dValue + 19 + 3);
+        // leaves that the handle doesn't use stay dirty
+        EXPECT_TRUE((*leaves[7])->dirty);
+        EXPECT_EQ(ee.evalFP(leafEval)[0], dValue + 7);
+        EXPECT_FALSE((*leaves[7])->dirty);
+        EXPECT_TRUE((*leaves[8])->dirty);
+    }
+    ee.setVariable(x, 1);
+    EXPECT_TRUE((*a)->dirty);
+    EXPECT_EQ(ee.evalFP(leafEval)[0], (4 + 2) + 4 * 2 + 7);
+    EXPECT_FALSE((*a)->dirty);
+}
+
+/// Thread unsafe function that records whether two threads ever ran it at once
+struct UnsafeOverlapFunc : public ExprFuncSimple {
+    UnsafeOverlapFunc() : ExprFuncSimple(false), active(0), overlaps(0) {}
+
+    virtual ExprType prep(ExprFuncNode* node, bool scalarWanted, ExprVarEnvBuilder& envBuilder) const {
+        return node->checkArg(0, ExprType().FP(1).Varying(), envBuilder) ? ExprType().FP(1).Varying()
+                                                                          : ExprType().Error();
+    }
+    virtual ExprFuncNode::Data* evalConstant(const ExprFuncNode* node, ArgHandle args) const { return nullptr; }
+    virtual void eval(ArgHandle args) {
+        if (++active > 1) overlaps++;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        args.outFp = args.inFp<1>(0)[0];
+        active--;
+    }
+
+    std::atomic<int> active, overlaps;
+} unsafeOverlapFunc;
+
+TEST(BasicTests, ExpressionsGraphThreadUnsafeLevel) {
+    // a wide level calling a thread unsafe function is evaluated on one thread
+    ExprFunc::define("unsafeOverlap", ExprFunc(unsafeOverlapFunc, 1, 1));
+    Expressions ee;
+    ee.parallelLevelSize = 2;
+    VariableHandle x = ee.addExternalVariable("x", ExprType().FP(1).Varying());
+    std::vector<ExprHandle> wide;
+    for (int i = 0; i < 32; i++)
+        wide.push_back(ee.addExpression(
+            "w" + std::to_string(i), ExprType().FP(1).Varying(), "unsafeOverlap(x+" + std::to_string(i) + ")"));
+    ASSERT_TRUE(ee.isValid());
+    EXPECT_FALSE((*wide[0])->isThreadSafe());
+
+    // the expressions are loop invariant, so the first evalFP after setting x recomputes the whole level
+    std::vector<ExprEvalHandle> handles;
+    for (ExprHandle handle : wide) handles.push_back(ee.getExprEvalHandle(handle));
+    for (int i = 0; i < 3; i++) {
+        ee.setVariable(x, i);
+        for (int w = 0; w < 32; w++) EXPECT_EQ(ee.evalFP(handles[w])[0], i + w);
+    }
+    EXPECT_EQ(unsafeOverlapFunc.overlaps, 0);
+}
+
+TEST(BasicTests, ExpressionsFusion) {
+    // a fused handle gives the same results while only writing its own expression
+    Expression::EvaluationStrategy oldStrategy = Expression::defaultEvaluationStrategy;
+    Expression::defaultEvaluationStrategy = Expression::UseInterpreter;
+    Expressions fused, separate;
+    fused.fuseHandles = true;
+    ExprEvalHandle handles[2];
+    VariableSetHandle loops[2];
+    ExprHandle intermediates[2];
+    Expressions* graphs[2] = {&fused, &separate};
+    for (int g = 0; g < 2; g++) {
+        Expressions& ee = *graphs[g];
+        VariableHandle x = ee.addExternalVariable("x", ExprType().FP(1).Varying());
+        VariableHandle t = ee.addExternalVariable("t", ExprType().FP(1).Varying());
+        ee.addExpression("a", ExprType().FP(3).Varying(), "x*2");
+        intermediates[g] = ee.addExpression("b", ExprType().FP(3).Varying(), "s=t+1;[s,a[1],s*s]");
+        ee.addExpression("c", ExprType().FP(1).Varying(), "b[0] > 2 ? sin(b[2]) : a[0]");
+        ExprHandle out = ee.addExpression("out", ExprType().FP(3).Varying(), "b*c+a");
+        ASSERT_TRUE(ee.isValid());
+        loops[g] = ee.getLoopVarSetHandle(t);
+        handles[g] = ee.getExprEvalHandle(out);
+        ee.setVariable(x, 1.5);
+    }
+    EXPECT_TRUE(fused.fuse(handles[0]));
+    for (int i = 0; i < 6; i++) {
+        fused.setLoopVariable(loops[0], i * 0.5);
+        separate.setLoopVariable(loops[1], i * 0.5);
+        std::vector<double> expected = separate.evalFP(handles[1]);
+        EXPECT_EQ(fused.evalFP(handles[0]), expected);
+        EXPECT_FALSE((*handles[0].first)->dirty);
+        EXPECT_TRUE((*intermediates[0])->dirty);
+        EXPECT_EQ(fused.evalFP(handles[0]), expected);
+    }
+
+    // expressions that may be JIT compiled are not fused into an interpreter program
+    Expression::defaultEvaluationStrategy = Expression::UseTiered;
+    Expressions tiered;
+    tiered.fuseHandles = true;
+    VariableHandle t = tiered.addExternalVariable("t", ExprType().FP(1).Varying());
+    tiered.addExpression("a", ExprType().FP(1).Varying(), "t*2");
+    ExprHandle out = tiered.addExpression("out", ExprType().FP(1).Varying(), "a+1");
+    VariableSetHandle loop = tiered.getLoopVarSetHandle(t);
+    ExprEvalHandle handle = tiered.getExprEvalHandle(out);
+    Expression::defaultEvaluationStrategy = oldStrategy;
+    EXPECT_FALSE(tiered.fuse(handle));
+    tiered.setLoopVariable(loop, 3);
+    EXPECT_EQ(tiered.evalFP(handle)[0], 7);
+}
+
+static double registryTestFunc(double x) { return 2 * x; }
+
+TEST(BasicTests, FunctionRegistrySnapshots) {
+    // lookups read immutable snapshots, so they may race with define() and keep their results afterwards
+    const ExprFunc* sinFunc = ExprFunc::lookup("sin");
+    ASSERT_TRUE(sinFunc != nullptr);
+    unsigned int generation = ExprFunc::generation();
+
+    std::atomic<bool> done(false);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                if (ExprFunc::lookup("sin") != sinFunc) failures++;
+                if (ExprFunc::getDocString("sin").empty()) failures++;
+            }
+        });
+    }
+    for (int i = 0; i < 50; i++) {
+        std::string name = "registryTest" + std::to_string(i);
+        ExprFunc::define(name.c_str(), ExprFunc(registryTestFunc), "doc");
+    }
+    const ExprFunc* first = ExprFunc::lookup("registryTest0");
+    ExprFunc::define("registryTest0", ExprFunc(registryTestFunc), "redefined");
+    done = true;
+    for (auto& reader : readers) reader.join();
+
+    EXPECT_EQ(failures, 0);
+    EXPECT_EQ(ExprFunc::generation(), generation + 51);
+    EXPECT_EQ(ExprFunc::getDocString("registryTest0"), "redefined");
+    EXPECT_NE(ExprFunc::lookup("registryTest0"), first);
+    EXPECT_EQ(first->minArgs(), 1);  // superseded entries stay alive until cleanup
+
+    Expression e("registryTest49(2)", ExprType().FP(1));
+    ASSERT_TRUE(e.isValid()) << e.parseError();
+    EXPECT_EQ(e.evalFP()[0], 4);
+}
+
+TEST(BasicTests, MemoryStatistics) {
+    SimpleExpression small("1");
+    ASSERT_TRUE(small.isValid()) << small.parseError();
+    SimpleExpression large("a = curve(x, 0, 0, 4, 0.5, 1, 4, 1, 0, 4);\nb = [a, a * 2, a * 3] + y;\nb * b");
+    ASSERT_TRUE(large.isValid()) << large.parseError();
+
+    Statistics statistics = large.statistics();
+    double sum = 0;
+    for (const char* key : {"expression", "parseTree", "varEnv", "funcData", "interpreter", "llvmModule", "llvmCode"}) {
+        ASSERT_EQ(statistics.count(key), 1u) << key;
+        sum += statistics[key];
+    }
+    EXPECT_EQ(statistics.size(), 7u);
+    EXPECT_GT(statistics["parseTree"], 0);
+    EXPECT_GT(statistics["varEnv"], 0);
+    EXPECT_GT(statistics["funcData"], 0);
+    EXPECT_GT(statistics["interpreter"], 0);
+    EXPECT_EQ(large.sizeInBytes(), static_cast<size_t>(sum));
+    EXPECT_GT(large.sizeInBytes(), small.sizeInBytes());
+
+    // the aggregate counts every live expression
+    double expressions = Expression::allStatistics()["expressions"];
+    size_t total = Expression::allSizeInBytes();
+    {
+        SimpleExpression extra("x + y");
+        ASSERT_TRUE(extra.isValid());
+        EXPECT_EQ(Expression::allStatistics()["expressions"], expressions + 1);
+        EXPECT_EQ(Expression::allSizeInBytes(), total + extra.sizeInBytes());
+    }
+    EXPECT_EQ(Expression::allStatistics()["expressions"], expressions);
+    EXPECT_EQ(Expression::allSizeInBytes(), total);
+}
@@ -0,0 +1,334 @@
+/*
+ Copyright Disney Enterprises, Inc.  All rights reserved.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License
+ and the following modification to it: Section 6 Trademarks.
+ deleted and replaced with:
+
+ 6. Trademarks. This License does not grant permission to use the
+ trade names, trademarks, service marks, or product names of the
+ Licensor and its affiliates, except as required for reproducing
+ the content of the NOTICE file.
+
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+*/
+
+// Benchmark driver: runs a corpus of expressions through parse, prep (including JIT compilation), single point
+// evalFP and evalMultiple with each backend and reports median/percentile timings as text, csv or json.
+//
+// usage: exprbench [--repetitions N] [--points N] [--format text|csv|json] [--backend interpreter|llvm|all]
+//                  [file.se ...]
+// Files holding lines of the form "expr" dim (like llvmtest.se) contribute one case per line, any other file is
+// a single expression (like the imageSynth examples). Without files a small built-in corpus is used.
+
+#include <SeExpr2/Expression.h>
+#include <SeExpr2/VarBlock.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace SeExpr2;
+
+namespace {
+
+struct Case {
+    std::string name;
+    std::string expr;
+    int dim;
+};
+
+struct Options {
+    int repetitions = 11;
+    size_t points = 16384;
+    std::string format = "text";
+    std::vector<Expression::EvaluationStrategy> backends;
+    std::vector<std::string> files;
+};
+
+//! Order statistics of one phase, all times in seconds (per point for the eval phases)
+struct Stats {
+    std::string caseName, backend, phase;
+    size_t samples;
+    double median, p10, p90, min;
+    bool perPoint;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::time_point begin, Clock::time_point end) {
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+//! Nearest rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+Stats summarize(const Case& c, const char* backend, const char* phase, std::vector<double> samples, bool perPoint) {
+    std::sort(samples.begin(), samples.end());
+    Stats stats;
+    stats.caseName = c.name;
+    stats.backend = backend;
+    stats.phase = phase;
+    stats.samples = samples.size();
+    stats.median = percentile(samples, .5);
+    stats.p10 = percentile(samples, .1);
+    stats.p90 = percentile(samples, .9);
+    stats.min = samples.front();
+    stats.perPoint = perPoint;
+    return stats;
+}
+
+//! Lines of the form "expr" dim, ignoring blank lines and ; or # comments
+bool readLineCorpus(const std::string& file, const std::string& text, std::vector<Case>& cases) {
+    std::vector<Case> found;
+    std::istringstream lines(text);
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(lines, line)) {
+        lineNumber++;
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == ';' || line[first] == '#') continue;
+        size_t end = line.find_last_of('"');
+        if (line[first] != '"' || end == first) return false;
+        std::istringstream dimStream(line.substr(end + 1));
+        int dim = 0;
+        if (!(dimStream >> dim) || dim < 1) return false;
+        found.push_back(Case{file + ":" + std::to_string(lineNumber), line.substr(first + 1, end - first - 1), dim});
+    }
+    if (found.empty()) return false;
+    cases.insert(cases.end(), found.begin(), found.end());
+    return true;
+}
+
+std::vector<Case> loadCorpus(const Options& options) {
+    std::vector<Case> cases;
+    for (const std::string& file : options.files) {
+        std::ifstream in(file);
+        if (!in) {
+            std::cerr << "exprbench: cannot read " << file << std::endl;
+            continue;
+        }
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!readLineCorpus(file, text, cases)) cases.push_back(Case{file, text, 3});
+    }
+    if (options.files.empty()) {
+        cases.push_back(Case{"arith", "P*u+[v,u*v,1]/(1+u)", 3});
+        cases.push_back(Case{"trig", "sin(P*10)*cos(u*20)+atan2(v,u)", 3});
+        cases.push_back(Case{"noise", "noise(P*4)+snoise(P*8)*.5", 3});
+        cases.push_back(Case{"fbm", "fbm([10*u,10*v,.5])", 3});
+        cases.push_back(Case{"branch", "if(u<.5){c=P;}else{c=vnoise(P);} c*v", 3});
+        cases.push_back(Case{"ccurve", "ccurve(u,0,[1,0,0],4,1,[0,0,1],4)", 3});
+    }
+    return cases;
+}
+
+//! Variables available to the corpus, bound to a grid of points
+class Inputs {
+  public:
+    explicit Inputs(size_t points) : _P(3 * points), _u(points), _v(points), _out(16 * points) {
+        offP = creator.registerVariable("P", ExprType().FP(3).Varying());
+        offU = creator.registerVariable("u", ExprType().FP(1).Varying());
+        offV = creator.registerVariable("v", ExprType().FP(1).Varying());
+        offW = creator.registerVariable("w", ExprType().FP(1).Uniform());
+        offH = creator.registerVariable("h", ExprType().FP(1).Uniform());
+        offOut = creator.registerVariable("__out", ExprType().FP(16).Varying());
+        size_t side = static_cast<size_t>(std::ceil(std::sqrt(double(points))));
+        _w = _h = double(side);
+        for (size_t i = 0; i < points; i++) {
+            _u[i] = (i % side + .5) / side;
+            _v[i] = (i / side + .5) / side;
+            _P[3 * i] = _u[i];
+            _P[3 * i + 1] = _v[i];
+            _P[3 * i + 2] = .5;
+        }
+    }
+
+    VarBlock block() {
+        VarBlock block = creator.create();
+        block.Pointer(offP) = _P.data();
+        block.Pointer(offU) = _u.data();
+        block.Pointer(offV) = _v.data();
+        block.Pointer(offW) = &_w;
+        block.Pointer(offH) = &_h;
+        block.Pointer(offOut) = _out.data();
+        return block;
+    }
+
+    VarBlockCreator creator;
+    int offP, offU, offV, offW, offH, offOut;
+
+  private:
+    std::vector<double> _P, _u, _v, _out;
+    double _w, _h;
+};
+
+const char* backendName(Expression::EvaluationStrategy backend) {
+    return backend == Expression::UseInterpreter ? "interpreter" : "llvm";
+}
+
+//! Runs all phases of one case with one backend, returns false if the expression is not valid
+bool runCase(const Case& c,
+             Expression::EvaluationStrategy backend,
+             const Options& options,
+             Inputs& inputs,
+             std::vector<Stats>& results,
+             double& checksum) {
+    const char* name = backendName(backend);
+    ExprType type = ExprType().FP(c.dim);
+    std::vector<double> parse, prep, evalFP, evalMultiple;
+    for (int r = 0; r < options.repetitions; r++) {
+        Expression e(c.expr, type, backend);
+        e.setVarBlockCreator(&inputs.creator);
+        Clock::time_point t0 = Clock::now();
+        e.syntaxOK();  // parses only, validity is known after prep
+        Clock::time_point t1 = Clock::now();
+        bool valid = e.isValid();
+        Clock::time_point t2 = Clock::now();
+        if (!valid) {
+            std::cerr << "exprbench: skipping " << c.name << " (" << name << "): " << e.parseError() << std::endl;
+            return false;
+        }
+        parse.push_back(seconds(t0, t1));
+        prep.push_back(seconds(t1, t2));
+    }
+
+    Expression e(c.expr, type, backend);
+    e.setVarBlockCreator(&inputs.creator);
+    e.isValid();
+    VarBlock block = inputs.block();
+    std::vector<double> result(c.dim);
+    double points = double(options.points);
+    for (int r = 0; r < options.repetitions; r++) {
+        Clock::time_point t0 = Clock::now();
+        for (size_t i = 0; i < options.points; i++) {
+            block.indirectIndex = static_cast<int>(i);
+            e.evalFP(result.data(), &block);
+            checksum += result[0];
+        }
+        Clock::time_point t1 = Clock::now();
+        e.evalMultiple(&block, inputs.offOut, 0, options.points);
+        Clock::time_point t2 = Clock::now();
+        checksum += block.Pointer(inputs.offOut)[0];
+        evalFP.push_back(seconds(t0, t1) / points);
+        evalMultiple.push_back(seconds(t1, t2) / points);
+    }
+
+    results.push_back(summarize(c, name, "parse", parse, false));
+    results.push_back(summarize(c, name, "prep", prep, false));
+    results.push_back(summarize(c, name, "evalFP", evalFP, true));
+    results.push_back(summarize(c, name, "evalMultiple", evalMultiple, true));
+    return true;
+}
+
+std::string jsonEscape(const std::string& s) {
+    std::ostringstream out;
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\')
+            out << '\\' << ch;
+        else if (static_cast<unsigned char>(ch) < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(ch) << std::dec;
+        else
+            out << ch;
+    }
+    return out.str();
+}
+
+void report(const std::vector<Stats>& results, const Options& options) {
+    std::cout << std::setprecision(6);
+    if (options.format == "csv") {
+        std::cout << "case,backend,phase,samples,median_s,p10_s,p90_s,min_s,points_per_s\n";
+        for (const Stats& s : results)
+            std::cout << '"' << s.caseName << "\"," << s.backend << ',' << s.phase << ',' << s.samples << ','
+                      << s.median << ',' << s.p10 << ',' << s.p90 << ',' << s.min << ','
+                      << (s.perPoint ? 1 / s.median : 0) << '\n';
+    } else if (options.format == "json") {
+        std::cout << "[\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Stats& s = results[i];
+            std::cout << "  {\"case\": \"" << jsonEscape(s.caseName) << "\", \"backend\": \"" << s.backend
+                      << "\", \"phase\": \"" << s.phase << "\", \"samples\": " << s.samples
+                      << ", \"median_s\": " << s.median << ", \"p10_s\": " << s.p10 << ", \"p90_s\": " << s.p90
+                      << ", \"min_s\": " << s.min;
+            if (s.perPoint) std::cout << ", \"points_per_s\": " << 1 / s.median;
+            std::cout << (i + 1 < results.size() ? "},\n" : "}\n");
+        }
+        std::cout << "]\n";
+    } else {
+        std::cout << std::left << std::setw(32) << "case" << std::setw(13) << "backend" << std::setw(14) << "phase"
+                  << std::right << std::setw(12) << "median" << std::setw(12) << "p10" << std::setw(12) << "p90"
+                  << std::setw(14) << "Mpoints/s" << '\n';
+        for (const Stats& s : results) {
+            double scale = s.perPoint ? 1e9 : 1e6;  // ns per point or us per call
+            std::cout << std::left << std::setw(32) << s.caseName.substr(0, 31) << std::setw(13) << s.backend
+                      << std::setw(14) << s.phase << std::right << std::fixed << std::setprecision(3)
+                      << std::setw(10) << s.median * scale << (s.perPoint ? "ns" : "us") << std::setw(10)
+                      << s.p10 * scale << (s.perPoint ? "ns" : "us") << std::setw(10) << s.p90 * scale
+                      << (s.perPoint ? "ns" : "us");
+            if (s.perPoint) std::cout << std::setw(14) << 1e-6 / s.median;
+            std::cout << '\n' << std::defaultfloat;
+        }
+    }
+}
+
+int usage() {
+    std::cerr << "usage: exprbench [--repetitions N] [--points N] [--format text|csv|json]"
+                 " [--backend interpreter|llvm|all] [file.se ...]"
+              << std::endl;
+    return 1;
+}
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    std::string backend = "all";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--repetitions" && hasValue)
+            options.repetitions = std::max(1, atoi(argv[++i]));
+        else if (arg == "--points" && hasValue)
+            options.points = std::max(1, atoi(argv[++i]));
+        else if (arg == "--format" && hasValue)
+            options.format = argv[++i];
+        else if (arg == "--backend" && hasValue)
+            backend = argv[++i];
+        else if (arg.compare(0, 2, "--") == 0)
+            return usage();
+        else
+            options.files.push_back(arg);
+    }
+    if (options.format != "text" && options.format != "csv" && options.format != "json") return usage();
+    if (backend == "interpreter" || backend == "all") options.backends.push_back(Expression::UseInterpreter);
+#ifdef SEEXPR_ENABLE_LLVM
+    if (backend == "llvm" || backend == "all") options.backends.push_back(Expression::UseLLVM);
+#else
+    if (backend == "llvm") std::cerr << "exprbench: LLVM is not enabled in this build" << std::endl;
+#endif
+    if (options.backends.empty()) return usage();
+
+    std::vector<Case> cases = loadCorpus(options);
+    Inputs inputs(options.points);
+    std::vector<Stats> results;
+    double checksum = 0;
+    int skipped = 0;
+    for (const Case& c : cases)
+        for (Expression::EvaluationStrategy strategy : options.backends)
+            if (!runCase(c, strategy, options, inputs, results, checksum)) skipped++;
+    report(results, options);
+    if (skipped) std::cerr << "exprbench: skipped " << skipped << " invalid case(s)" << std::endl;
+    if (std::isnan(checksum)) std::cerr << "exprbench: checksum is nan" << std::endl;
+    return results.empty() ? 1 : 0;
+}
@@ -19,6 +19,7 @@
 
 #include <SeExpr2/Expression.h>
 #include <SeExpr2/ExprFunc.h>
+#include <SeExpr2/ExprStringTable.h>
 
 using namespace SeExpr2;
 
@@ -178,3 +179,27 @@ TEST(StringTests, BinaryOp) {
     EXPECT_TRUE(expr6.isConstant() == true);
     EXPECT_STREQ(expr6.evalStr(), "ok");
 }
+
+TEST(StringTests, InternedAndArenaStrings) {
+    std::string copy("texture");
+    EXPECT_EQ(ExprStringTable::intern("texture"), ExprStringTable::intern(copy.c_str()));
+    EXPECT_NE(ExprStringTable::intern("texture"), ExprStringTable::intern("textures"));
+
+    StringExpression equal("v = 'no';\nif ('a' == 'a' && 'a' != 'b' && stringVar + 'b' == 'ab') {\n    v = 'yes';\n}\nv");
+    equal.stringVar = "a";
+    EXPECT_TRUE(equal.isValid());
+    EXPECT_STREQ(equal.evalStr(), "yes");
+
+    // once the arena has grown to fit an evaluation, concatenations reuse the memory of the previous one
+    StringExpression path("stringVar + '/tex_' + stringVar + '.tx'");
+    EXPECT_TRUE(path.isValid());
+    for (size_t length : {1, 2, 5000, 3}) {
+        path.stringVar = std::string(length, 'x').c_str();
+        path.evalStr();
+        const char* first = path.evalStr();
+        std::string expected = path.stringVar.value + "/tex_" + path.stringVar.value + ".tx";
+        EXPECT_EQ(first, expected);
+        EXPECT_EQ(path.evalStr(), first);
+        EXPECT_EQ(std::string(path.evalStr()), expected);
+    }
+}